@@ -282,7 +282,7 @@ static int read_packet_sec_TCP(const Logger *logger, struct sec_TCP_con *con, ui
     return rlen;
 }
 
-static void test_some(void)
+static void test_some(uint16_t num_workers)
 {
     Mono_Time *mono_time = mono_time_new();
     Logger *logger = logger_new();
@@ -294,6 +294,14 @@ static void test_some(void)
     ck_assert_msg(tcp_s != nullptr, "Failed to create TCP relay server");
     ck_assert_msg(tcp_server_listen_count(tcp_s) == NUM_PORTS, "Failed to bind to all ports.");
 
+    if (num_workers > 0 && !tcp_server_start_workers(tcp_s, mono_time, num_workers)) {
+        printf("TCP server workers are not supported on this platform, skipping\n");
+        kill_TCP_server(tcp_s);
+        logger_kill(logger);
+        mono_time_free(mono_time);
+        return;
+    }
+
     struct sec_TCP_con *con1 = new_TCP_con(logger, tcp_s, mono_time);
     struct sec_TCP_con *con2 = new_TCP_con(logger, tcp_s, mono_time);
     struct sec_TCP_con *con3 = new_TCP_con(logger, tcp_s, mono_time);
@@ -389,6 +397,287 @@ static void test_some(void)
     mono_time_free(mono_time);
 }
 
+/** More routes than fit inline in the server's connection state, so that the
+ * route table has to grow while other routes are in use.
+ */
+static void test_many_routes(uint16_t num_workers)
+{
+    Mono_Time *mono_time = mono_time_new();
+    Logger *logger = logger_new();
+
+    uint8_t self_public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t self_secret_key[CRYPTO_SECRET_KEY_SIZE];
+    crypto_new_keypair(self_public_key, self_secret_key);
+    TCP_Server *tcp_s = new_TCP_server(logger, USE_IPV6, NUM_PORTS, ports, self_secret_key, nullptr);
+    ck_assert_msg(tcp_s != nullptr, "Failed to create TCP relay server");
+
+    if (num_workers > 0 && !tcp_server_start_workers(tcp_s, mono_time, num_workers)) {
+        kill_TCP_server(tcp_s);
+        logger_kill(logger);
+        mono_time_free(mono_time);
+        return;
+    }
+
+    struct sec_TCP_con *con1 = new_TCP_con(logger, tcp_s, mono_time);
+    struct sec_TCP_con *con2 = new_TCP_con(logger, tcp_s, mono_time);
+
+    uint8_t requ_p[1 + CRYPTO_PUBLIC_KEY_SIZE];
+    requ_p[0] = TCP_PACKET_ROUTING_REQUEST;
+    uint8_t data[2048];
+    const uint8_t num_offline = 6;
+
+    for (uint8_t i = 0; i <= num_offline; ++i) {
+        if (i < num_offline) {
+            random_bytes(requ_p + 1, CRYPTO_PUBLIC_KEY_SIZE);
+        } else {
+            memcpy(requ_p + 1, con2->public_key, CRYPTO_PUBLIC_KEY_SIZE);
+        }
+
+        write_packet_TCP_test_connection(logger, con1, requ_p, sizeof(requ_p));
+        do_TCP_server_delay(tcp_s, mono_time, 50);
+
+        const int len = read_packet_sec_TCP(logger, con1, data, 2 + 1 + 1 + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_MAC_SIZE);
+        ck_assert_msg(len == 1 + 1 + CRYPTO_PUBLIC_KEY_SIZE, "Wrong response packet length of %d.", len);
+        ck_assert_msg(data[0] == TCP_PACKET_ROUTING_RESPONSE, "Wrong response packet id of %d.", data[0]);
+        ck_assert_msg(data[1] == NUM_RESERVED_PORTS + i, "Wrong connection id %u for route %u.", data[1], i);
+    }
+
+    memcpy(requ_p + 1, con1->public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    write_packet_TCP_test_connection(logger, con2, requ_p, sizeof(requ_p));
+    do_TCP_server_delay(tcp_s, mono_time, 50);
+
+    int len = read_packet_sec_TCP(logger, con2, data, 2 + 1 + 1 + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_MAC_SIZE);
+    ck_assert_msg(len == 1 + 1 + CRYPTO_PUBLIC_KEY_SIZE, "Wrong response packet length of %d.", len);
+    ck_assert_msg(data[1] == NUM_RESERVED_PORTS, "Wrong connection id %u.", data[1]);
+    len = read_packet_sec_TCP(logger, con2, data, 2 + 2 + CRYPTO_MAC_SIZE);
+    ck_assert_msg(len == 2 && data[0] == TCP_PACKET_CONNECTION_NOTIFICATION, "Expected a connection notification.");
+    ck_assert_msg(data[1] == NUM_RESERVED_PORTS, "wrong peer id %u", data[1]);
+    len = read_packet_sec_TCP(logger, con1, data, 2 + 2 + CRYPTO_MAC_SIZE);
+    ck_assert_msg(len == 2 && data[0] == TCP_PACKET_CONNECTION_NOTIFICATION, "Expected a connection notification.");
+    ck_assert_msg(data[1] == NUM_RESERVED_PORTS + num_offline, "wrong peer id %u", data[1]);
+
+    uint8_t test_packet[100] = {NUM_RESERVED_PORTS, 1, 2, 3};
+    write_packet_TCP_test_connection(logger, con2, test_packet, sizeof(test_packet));
+    do_TCP_server_delay(tcp_s, mono_time, 50);
+
+    len = read_packet_sec_TCP(logger, con1, data, 2 + sizeof(test_packet) + CRYPTO_MAC_SIZE);
+    ck_assert_msg(len == sizeof(test_packet), "wrong len %d", len);
+    ck_assert_msg(data[0] == NUM_RESERVED_PORTS + num_offline, "wrong peer id %u", data[0]);
+    ck_assert_msg(memcmp(data + 1, test_packet + 1, sizeof(test_packet) - 1) == 0, "packet is wrong");
+
+    kill_TCP_server(tcp_s);
+    kill_TCP_con(con1);
+    kill_TCP_con(con2);
+
+    logger_kill(logger);
+    mono_time_free(mono_time);
+}
+
+/** Handshakes done on the handshake threads, with room for a single pending
+ * connection in each queue.
+ */
+/** Wait until the connection has length bytes to read, or fail after a few seconds. */
+static void wait_for_data(TCP_Server *tcp_s, Mono_Time *mono_time, const struct sec_TCP_con *con, uint16_t length)
+{
+    for (uint32_t i = 0; i < 100 && net_socket_data_recv_buffer(con->sock) < length; ++i) {
+        do_TCP_server_delay(tcp_s, mono_time, 25);
+    }
+
+    ck_assert_msg(net_socket_data_recv_buffer(con->sock) >= length, "only %u of %u bytes arrived",
+                  net_socket_data_recv_buffer(con->sock), length);
+}
+
+/** Many clients routed to each other in pairs, each sending a burst of data
+ * packets. With worker threads most pairs are on different shards.
+ */
+static void test_many_clients(uint16_t num_workers)
+{
+#define NUM_PAIRS 16
+#define NUM_PACKETS 32
+#define PACKET_SIZE 1000
+    Mono_Time *mono_time = mono_time_new();
+    Logger *logger = logger_new();
+
+    uint8_t self_public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t self_secret_key[CRYPTO_SECRET_KEY_SIZE];
+    crypto_new_keypair(self_public_key, self_secret_key);
+    TCP_Server *tcp_s = new_TCP_server(logger, USE_IPV6, NUM_PORTS, ports, self_secret_key, nullptr);
+    ck_assert_msg(tcp_s != nullptr, "Failed to create TCP relay server");
+
+    if (num_workers > 0 && !tcp_server_start_workers(tcp_s, mono_time, num_workers)) {
+        kill_TCP_server(tcp_s);
+        logger_kill(logger);
+        mono_time_free(mono_time);
+        return;
+    }
+
+    struct sec_TCP_con *cons[NUM_PAIRS * 2];
+
+    for (uint32_t i = 0; i < NUM_PAIRS * 2; ++i) {
+        cons[i] = new_TCP_con(logger, tcp_s, mono_time);
+    }
+
+    uint8_t requ_p[1 + CRYPTO_PUBLIC_KEY_SIZE];
+    requ_p[0] = TCP_PACKET_ROUTING_REQUEST;
+
+    for (uint32_t i = 0; i < NUM_PAIRS * 2; ++i) {
+        memcpy(requ_p + 1, cons[i ^ 1]->public_key, CRYPTO_PUBLIC_KEY_SIZE);
+        write_packet_TCP_test_connection(logger, cons[i], requ_p, sizeof(requ_p));
+    }
+
+    uint8_t data[2048];
+
+    for (uint32_t i = 0; i < NUM_PAIRS * 2; ++i) {
+        const uint16_t response_size = 2 + 1 + 1 + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_MAC_SIZE;
+        const uint16_t notification_size = 2 + 2 + CRYPTO_MAC_SIZE;
+        wait_for_data(tcp_s, mono_time, cons[i], response_size + notification_size);
+
+        int len = read_packet_sec_TCP(logger, cons[i], data, response_size);
+        ck_assert_msg(len == 1 + 1 + CRYPTO_PUBLIC_KEY_SIZE && data[0] == TCP_PACKET_ROUTING_RESPONSE,
+                      "client %u: expected a routing response", i);
+        ck_assert_msg(data[1] == NUM_RESERVED_PORTS, "client %u: wrong connection id %u", i, data[1]);
+        len = read_packet_sec_TCP(logger, cons[i], data, notification_size);
+        ck_assert_msg(len == 2 && data[0] == TCP_PACKET_CONNECTION_NOTIFICATION,
+                      "client %u: expected a connection notification", i);
+    }
+
+    uint8_t packet[PACKET_SIZE];
+
+    for (uint32_t k = 0; k < NUM_PACKETS; ++k) {
+        for (uint32_t i = 0; i < NUM_PAIRS * 2; ++i) {
+            memset(packet, i, sizeof(packet));
+            packet[0] = NUM_RESERVED_PORTS;
+            packet[1] = k;
+            write_packet_TCP_test_connection(logger, cons[i], packet, sizeof(packet));
+        }
+    }
+
+    for (uint32_t i = 0; i < NUM_PAIRS * 2; ++i) {
+        wait_for_data(tcp_s, mono_time, cons[i], NUM_PACKETS * (2 + PACKET_SIZE + CRYPTO_MAC_SIZE));
+
+        for (uint32_t k = 0; k < NUM_PACKETS; ++k) {
+            const int len = read_packet_sec_TCP(logger, cons[i], data, 2 + PACKET_SIZE + CRYPTO_MAC_SIZE);
+            ck_assert_msg(len == PACKET_SIZE, "client %u: wrong length %d", i, len);
+            ck_assert_msg(data[1] == k, "client %u: packet %u arrived as packet %u", i, data[1], k);
+            ck_assert_msg(data[2] == (uint8_t)(i ^ 1), "client %u: packet %u is from the wrong client", i, k);
+        }
+    }
+
+    kill_TCP_server(tcp_s);
+
+    for (uint32_t i = 0; i < NUM_PAIRS * 2; ++i) {
+        kill_TCP_con(cons[i]);
+    }
+
+    logger_kill(logger);
+    mono_time_free(mono_time);
+#undef PACKET_SIZE
+#undef NUM_PACKETS
+#undef NUM_PAIRS
+}
+
+static void test_handshake_threads(void)
+{
+    Mono_Time *mono_time = mono_time_new();
+    Logger *logger = logger_new();
+
+    uint8_t self_public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t self_secret_key[CRYPTO_SECRET_KEY_SIZE];
+    crypto_new_keypair(self_public_key, self_secret_key);
+    TCP_Server *tcp_s = new_TCP_server(logger, USE_IPV6, NUM_PORTS, ports, self_secret_key, nullptr);
+    ck_assert_msg(tcp_s != nullptr, "Failed to create TCP relay server");
+    ck_assert_msg(!tcp_server_set_max_pending_connections(tcp_s, 0), "0 pending connections should be refused");
+    ck_assert_msg(tcp_server_set_max_pending_connections(tcp_s, 1), "Failed to set max pending connections");
+    ck_assert_msg(tcp_server_set_handshake_threads(tcp_s, 3), "Failed to start handshake threads");
+
+    struct sec_TCP_con *cons[4];
+    uint8_t ping_packet[1 + sizeof(uint64_t)] = {TCP_PACKET_PING, 8, 6, 9, 67};
+    uint8_t data[2048];
+
+    // Each connection sends its first packet before the next one takes its
+    // place in the unconfirmed queue.
+    for (uint32_t i = 0; i < 4; ++i) {
+        cons[i] = new_TCP_con(logger, tcp_s, mono_time);
+        write_packet_TCP_test_connection(logger, cons[i], ping_packet, sizeof(ping_packet));
+        do_TCP_server_delay(tcp_s, mono_time, 50);
+
+        const int len = read_packet_sec_TCP(logger, cons[i], data, 2 + sizeof(ping_packet) + CRYPTO_MAC_SIZE);
+        ck_assert_msg(len == sizeof(ping_packet), "wrong len %d", len);
+        ck_assert_msg(data[0] == TCP_PACKET_PONG, "wrong packet id %u", data[0]);
+    }
+
+    kill_TCP_server(tcp_s);
+
+    for (uint32_t i = 0; i < 4; ++i) {
+        kill_TCP_con(cons[i]);
+    }
+
+    logger_kill(logger);
+    mono_time_free(mono_time);
+}
+
+/** Data over the rate limit of the sender is dropped, other traffic passes. */
+static void test_rate_limit(void)
+{
+    Mono_Time *mono_time = mono_time_new();
+    Logger *logger = logger_new();
+
+    uint8_t self_public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t self_secret_key[CRYPTO_SECRET_KEY_SIZE];
+    crypto_new_keypair(self_public_key, self_secret_key);
+    TCP_Server *tcp_s = new_TCP_server(logger, USE_IPV6, NUM_PORTS, ports, self_secret_key, nullptr);
+    ck_assert_msg(tcp_s != nullptr, "Failed to create TCP relay server");
+
+    // The burst is raised to MAX_PACKET_SIZE, enough for two packets of 1000 bytes.
+    tcp_server_set_rate_limit(tcp_s, TCP_TRAFFIC_DATA, 1, 0);
+
+    struct sec_TCP_con *con1 = new_TCP_con(logger, tcp_s, mono_time);
+    struct sec_TCP_con *con2 = new_TCP_con(logger, tcp_s, mono_time);
+
+    uint8_t requ_p[1 + CRYPTO_PUBLIC_KEY_SIZE];
+    requ_p[0] = TCP_PACKET_ROUTING_REQUEST;
+    memcpy(requ_p + 1, con2->public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    write_packet_TCP_test_connection(logger, con1, requ_p, sizeof(requ_p));
+    memcpy(requ_p + 1, con1->public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    write_packet_TCP_test_connection(logger, con2, requ_p, sizeof(requ_p));
+    do_TCP_server_delay(tcp_s, mono_time, 50);
+
+    uint8_t data[2048];
+    read_packet_sec_TCP(logger, con1, data, 2 + 1 + 1 + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_MAC_SIZE);
+    read_packet_sec_TCP(logger, con2, data, 2 + 1 + 1 + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_MAC_SIZE);
+    int len = read_packet_sec_TCP(logger, con1, data, 2 + 2 + CRYPTO_MAC_SIZE);
+    ck_assert_msg(len == 2 && data[0] == TCP_PACKET_CONNECTION_NOTIFICATION, "Expected a connection notification.");
+    len = read_packet_sec_TCP(logger, con2, data, 2 + 2 + CRYPTO_MAC_SIZE);
+    ck_assert_msg(len == 2 && data[0] == TCP_PACKET_CONNECTION_NOTIFICATION, "Expected a connection notification.");
+
+    uint8_t test_packet[1000] = {NUM_RESERVED_PORTS};
+
+    for (uint32_t i = 0; i < 5; ++i) {
+        write_packet_TCP_test_connection(logger, con1, test_packet, sizeof(test_packet));
+    }
+
+    uint8_t ping_packet[1 + sizeof(uint64_t)] = {TCP_PACKET_PING, 8, 6, 9, 67};
+    write_packet_TCP_test_connection(logger, con1, ping_packet, sizeof(ping_packet));
+    do_TCP_server_delay(tcp_s, mono_time, 50);
+
+    for (uint32_t i = 0; i < 2; ++i) {
+        len = read_packet_sec_TCP(logger, con2, data, 2 + sizeof(test_packet) + CRYPTO_MAC_SIZE);
+        ck_assert_msg(len == sizeof(test_packet), "wrong len %d", len);
+    }
+
+    ck_assert_msg(net_socket_data_recv_buffer(con2->sock) == 0, "packets over the rate limit were relayed");
+
+    len = read_packet_sec_TCP(logger, con1, data, 2 + sizeof(ping_packet) + CRYPTO_MAC_SIZE);
+    ck_assert_msg(len == sizeof(ping_packet) && data[0] == TCP_PACKET_PONG, "ping was not answered");
+
+    kill_TCP_server(tcp_s);
+    kill_TCP_con(con1);
+    kill_TCP_con(con2);
+
+    logger_kill(logger);
+    mono_time_free(mono_time);
+}
+
 static int response_callback_good;
 static uint8_t response_callback_connection_id;
 static uint8_t response_callback_public_key[CRYPTO_PUBLIC_KEY_SIZE];
@@ -511,6 +800,7 @@ static void test_client(void)
         // The status of the connection should continue to be TCP_CLIENT_CONFIRMED after multiple subsequent do_TCP_connection() calls.
         ck_assert_msg(tcp_con_status(conn) == TCP_CLIENT_CONFIRMED, "Wrong connection status. Expected: %d, is: %d",
                       TCP_CLIENT_CONFIRMED, tcp_con_status(conn));
+        ck_assert_msg(tcp_con_rtt(conn) > 0, "Handshake did not measure the round trip time.");
 
         c_sleep(i == LOOP_SIZE - 1 ? 0 : 500); // Sleep for 500ms on all except third loop.
     }
@@ -747,6 +1037,9 @@ static void test_tcp_connection(void)
     ck_assert_msg(send_packet_tcp_connection(tc_1, 0, (const uint8_t *)"Gentoo", 6) == -1, "could send packet.");
     ck_assert_msg(kill_tcp_connection_to(tc_2, 0) == 0, "could not kill connection to\n");
 
+    ck_assert_msg(kill_tcp_relay_connection(tc_1, 0) == 0, "could not kill relay connection\n");
+    ck_assert_msg(tcp_connections_count(tc_1) == 0, "relay connection was not removed\n");
+
     kill_TCP_server(tcp_s);
     kill_tcp_connections(tc_1);
     kill_tcp_connections(tc_2);
@@ -856,14 +1149,77 @@ static void test_tcp_connection2(void)
     mono_time_free(mono_time);
 }
 
+/** A relay that does not answer over IPv4 is reached over IPv6 instead. */
+static void test_tcp_connection_race(void)
+{
+#if USE_IPV6
+    Mono_Time *mono_time = mono_time_new();
+    Logger *logger = logger_new();
+
+    uint8_t self_public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t self_secret_key[CRYPTO_SECRET_KEY_SIZE];
+    crypto_new_keypair(self_public_key, self_secret_key);
+    TCP_Server *tcp_s = new_TCP_server(logger, USE_IPV6, NUM_PORTS, ports, self_secret_key, nullptr);
+    ck_assert_msg(tcp_s != nullptr, "Failed to create TCP relay server");
+
+    // Accepts connections but never answers the handshake.
+    const uint16_t stalled_port = 13216;
+    Socket stalled = net_socket(net_family_ipv4, TOX_SOCK_STREAM, TOX_PROTO_TCP);
+    ck_assert_msg(sock_valid(stalled), "Failed to create socket");
+    ck_assert_msg(bind_to_port(stalled, net_family_ipv4, stalled_port), "Failed to bind socket");
+    ck_assert_msg(net_listen(stalled, 8) == 0, "Failed to listen on socket");
+
+    TCP_Proxy_Info proxy_info;
+    proxy_info.proxy_type = TCP_PROXY_NONE;
+    crypto_new_keypair(self_public_key, self_secret_key);
+    TCP_Connections *tc_1 = new_tcp_connections(logger, mono_time, self_secret_key, &proxy_info);
+
+    IP_Port ip_port_stalled;
+    ip_port_stalled.ip.family = net_family_ipv4;
+    ip_port_stalled.ip.ip.v4 = get_ip4_loopback();
+    ip_port_stalled.port = net_htons(stalled_port);
+
+    IP_Port ip_port_tcp_s;
+    ip_port_tcp_s.ip = get_loopback();
+    ip_port_tcp_s.port = net_htons(ports[random_u32() % NUM_PORTS]);
+
+    ck_assert_msg(add_tcp_relay_global(tc_1, &ip_port_stalled, tcp_server_public_key(tcp_s)) == 0,
+                  "Could not add global relay");
+    ck_assert_msg(add_tcp_relay_global(tc_1, &ip_port_tcp_s, tcp_server_public_key(tcp_s)) == -1,
+                  "Added the same relay twice");
+
+    for (uint32_t i = 0; i < 20 && tcp_connected_relays_count(tc_1) == 0; ++i) {
+        do_TCP_server_delay(tcp_s, mono_time, 50);
+        do_tcp_connections(logger, tc_1, nullptr);
+    }
+
+    ck_assert_msg(tcp_connected_relays_count(tc_1) == 1, "Relay was not reached over its other address");
+
+    kill_TCP_server(tcp_s);
+    kill_tcp_connections(tc_1);
+    kill_sock(stalled);
+
+    logger_kill(logger);
+    mono_time_free(mono_time);
+#endif
+}
+
 static void TCP_suite(void)
 {
     test_basic();
-    test_some();
+    test_some(0);
+    test_some(4);
+    test_many_routes(0);
+    test_many_routes(4);
+    test_many_clients(0);
+    test_many_clients(4);
+    test_handshake_threads();
+    test_rate_limit();
     test_client();
     test_client_invalid();
     test_tcp_connection();
     test_tcp_connection2();
+    test_tcp_connection_race();
 }
 
 int main(void)
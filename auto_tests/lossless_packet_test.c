@@ -14,11 +14,13 @@
 
 typedef struct State {
     bool custom_packet_received;
+    uint32_t small_packets_received;
 } State;
 
 #include "auto_test_support.h"
 
 #define LOSSLESS_PACKET_FILLER 160
+#define SMALL_PACKET_COUNT 50
 
 static void handle_lossless_packet(Tox *tox, uint32_t friend_number, const uint8_t *data, size_t length,
                                    void *user_data)
@@ -49,6 +51,51 @@ static void test_lossless_packet(AutoTox *autotoxes)
     do {
         iterate_all_wait(autotoxes, 2, ITERATION_INTERVAL);
     } while (!((State *)autotoxes[1].state)->custom_packet_received);
+
+    Tox_Err_Friend_Query err;
+    ck_assert_msg(tox_friend_get_connection_status(autotoxes[0].tox, 0, nullptr) != TOX_CONNECTION_NONE,
+                  "friend should be connected");
+    ck_assert(tox_friend_get_transport_stats_packets_sent(autotoxes[0].tox, 0, &err) > 0);
+    ck_assert(err == TOX_ERR_FRIEND_QUERY_OK);
+    const uint64_t bytes_sent = tox_friend_get_transport_stats_bytes_sent(autotoxes[0].tox, 0, &err);
+    ck_assert(err == TOX_ERR_FRIEND_QUERY_OK);
+    ck_assert_msg(bytes_sent >= TOX_MAX_CUSTOM_PACKET_SIZE, "sent bytes not counted: %lu", (unsigned long)bytes_sent);
+
+    ck_assert(tox_friend_get_transport_stats_rtt(autotoxes[0].tox, 1, &err) == 0);
+    ck_assert(err == TOX_ERR_FRIEND_QUERY_FRIEND_NOT_FOUND);
+}
+
+static void handle_small_lossless_packet(Tox *tox, uint32_t friend_number, const uint8_t *data, size_t length,
+        void *user_data)
+{
+    const AutoTox *autotox = (AutoTox *)user_data;
+    State *state = (State *)autotox->state;
+
+    ck_assert_msg(length == 2, "unexpected small packet length %u", (unsigned)length);
+    ck_assert_msg(data[0] == LOSSLESS_PACKET_FILLER, "unexpected small packet id %u", data[0]);
+    ck_assert_msg(data[1] == state->small_packets_received,
+                  "small packets out of order: got %u, expected %u", data[1], state->small_packets_received);
+    ++state->small_packets_received;
+}
+
+static void test_small_lossless_packets(AutoTox *autotoxes)
+{
+    tox_callback_friend_lossless_packet(autotoxes[1].tox, &handle_small_lossless_packet);
+
+    // Give the peers time to exchange their capabilities.
+    for (uint32_t i = 0; i < 20; ++i) {
+        iterate_all_wait(autotoxes, 2, ITERATION_INTERVAL);
+    }
+
+    for (uint8_t i = 0; i < SMALL_PACKET_COUNT; ++i) {
+        const uint8_t packet[2] = {LOSSLESS_PACKET_FILLER, i};
+        const bool ret = tox_friend_send_lossless_packet(autotoxes[0].tox, 0, packet, sizeof(packet), nullptr);
+        ck_assert_msg(ret == true, "tox_friend_send_lossless_packet fail %i", ret);
+    }
+
+    do {
+        iterate_all_wait(autotoxes, 2, ITERATION_INTERVAL);
+    } while (((State *)autotoxes[1].state)->small_packets_received < SMALL_PACKET_COUNT);
 }
 
 int main(void)
@@ -60,5 +107,18 @@ int main(void)
 
     run_auto_test(nullptr, 2, test_lossless_packet, sizeof(State), &options);
 
+    struct Tox_Options *tox_options = tox_options_new(nullptr);
+    ck_assert(tox_options != nullptr);
+    tox_options_set_experimental_lossless_coalescing(tox_options, true);
+
+    run_auto_test(tox_options, 2, test_small_lossless_packets, sizeof(State), &options);
+
+    tox_options_set_experimental_lossless_coalescing(tox_options, false);
+    tox_options_set_experimental_crypto_threads(tox_options, 2);
+
+    run_auto_test(tox_options, 2, test_small_lossless_packets, sizeof(State), &options);
+
+    tox_options_free(tox_options);
+
     return 0;
 }
@@ -163,7 +163,7 @@ static int handle_test_4(void *object, const IP_Port *source, const uint8_t *pac
     return 0;
 }
 
-static void test_basic(void)
+static void test_basic(bool relay_thread)
 {
     uint32_t index[] = { 1, 2, 3 };
     Logger *log1 = logger_new();
@@ -180,6 +180,12 @@ static void test_basic(void)
     ck_assert_msg((onion1 != nullptr) && (onion2 != nullptr), "Onion failed initializing.");
     networking_registerhandler(onion2->net, NET_PACKET_ANNOUNCE_REQUEST, &handle_test_1, onion2);
 
+    if (relay_thread) {
+        ck_assert_msg(onion_start_relay_thread(onion1) && onion_start_relay_thread(onion2),
+                      "Failed to start onion relay threads.");
+        ck_assert_msg(!onion_start_relay_thread(onion1), "Started a second onion relay thread.");
+    }
+
     IP_Port on1 = {ip, net_port(onion1->net)};
     Node_format n1;
     memcpy(n1.public_key, dht_get_self_public_key(onion1->dht), CRYPTO_PUBLIC_KEY_SIZE);
@@ -246,8 +252,9 @@ static void test_basic(void)
 
     random_bytes(sb_data, sizeof(sb_data));
     memcpy(&s, sb_data, sizeof(uint64_t));
-    memcpy(onion_announce_entry_public_key(onion2_a, 1), dht_get_self_public_key(onion2->dht), CRYPTO_PUBLIC_KEY_SIZE);
-    onion_announce_entry_set_time(onion2_a, 1, mono_time_get(mono_time2));
+    const uint8_t zero_ret[ONION_RETURN_3] = {0};
+    ck_assert_msg(onion_announce_add_entry(onion2_a, dht_get_self_public_key(onion2->dht), &on2, zeroes, zero_ret),
+                  "Failed to add announcement.");
     networking_registerhandler(onion1->net, NET_PACKET_ONION_DATA_RESPONSE, &handle_test_4, onion1);
     send_announce_request(onion1->net, &path, nodes[3],
                           dht_get_self_public_key(onion1->dht),
@@ -260,9 +267,9 @@ static void test_basic(void)
         do_onion(onion1);
         do_onion(onion2);
         c_sleep(50);
-    } while (memcmp(onion_announce_entry_public_key(onion2_a, ONION_ANNOUNCE_MAX_ENTRIES - 2),
-                    dht_get_self_public_key(onion1->dht),
-                    CRYPTO_PUBLIC_KEY_SIZE) != 0);
+    } while (!onion_announce_has_entry(onion2_a, dht_get_self_public_key(onion1->dht)));
+
+    ck_assert_msg(onion_announce_num_entries(onion2_a) == 2, "Wrong number of announcements.");
 
     c_sleep(1000);
     Logger *log3 = logger_new();
@@ -552,12 +559,32 @@ static void test_announce(void)
     memcpy(first_dht_pk, dht_get_self_public_key(onions[NUM_FIRST]->onion->dht), CRYPTO_PUBLIC_KEY_SIZE);
     memcpy(last_dht_pk, dht_get_self_public_key(onions[NUM_LAST]->onion->dht), CRYPTO_PUBLIC_KEY_SIZE);
 
+    // Friends that never come online must not crowd out the one that does.
+    onion_set_friend_search_rate(onions[NUM_FIRST]->onion_c, 20);
+
+    for (i = 0; i < 200; ++i) {
+        uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
+        uint8_t secret_key[CRYPTO_SECRET_KEY_SIZE];
+        crypto_new_keypair(public_key, secret_key);
+        const int friend_num = onion_addfriend(onions[NUM_FIRST]->onion_c, public_key);
+        ck_assert_msg(friend_num == (int)i, "Failed to add offline friend %u", i);
+    }
+
+    for (i = 0; i < 200; i += 2) {
+        ck_assert(onion_delfriend(onions[NUM_FIRST]->onion_c, i) == (int)i);
+    }
+
     printf("adding friend\n");
     int frnum_f = onion_addfriend(onions[NUM_FIRST]->onion_c,
                                   nc_get_self_public_key(onion_get_net_crypto(onions[NUM_LAST]->onion_c)));
     int frnum = onion_addfriend(onions[NUM_LAST]->onion_c,
                                 nc_get_self_public_key(onion_get_net_crypto(onions[NUM_FIRST]->onion_c)));
 
+    // Sending our DHT key to one friend a second is enough to be found.
+    onion_set_dhtpk_rate(onions[NUM_LAST]->onion_c, 1);
+    ck_assert(onion_set_friend_last_online(onions[NUM_LAST]->onion_c, frnum, 0) == 0);
+    ck_assert(onion_set_friend_last_online(onions[NUM_LAST]->onion_c, frnum + 1, 0) == -1);
+
     onion_dht_pk_callback(onions[NUM_FIRST]->onion_c, frnum_f, &dht_pk_callback, onions[NUM_FIRST], NUM_FIRST);
     onion_dht_pk_callback(onions[NUM_LAST]->onion_c, frnum, &dht_pk_callback, onions[NUM_LAST], NUM_LAST);
 
@@ -589,12 +616,95 @@ static void test_announce(void)
     }
 }
 
+static uint64_t get_test_time(Mono_Time *mono_time, void *user_data)
+{
+    return *(uint64_t *)user_data;
+}
+
+static const uint8_t *store_test_base_key;
+
+static int cmp_distance(const void *a, const void *b)
+{
+    const int closest = id_closest(store_test_base_key, (const uint8_t *)a, (const uint8_t *)b);
+    return closest == 1 ? -1 : closest == 2 ? 1 : 0;
+}
+
+#define STORE_TEST_KEYS 20000
+#define STORE_TEST_MAX_ENTRIES 1000
+
+/** The announce store keeps the announcements closest to our key and drops ones that timed out. */
+static void test_announce_store(void)
+{
+    Logger *log = logger_new();
+    Mono_Time *mono_time = mono_time_new();
+    uint64_t cur_time = current_time_monotonic(mono_time);
+    mono_time_set_current_time_callback(mono_time, get_test_time, &cur_time);
+    mono_time_update(mono_time);
+
+    IP ip = get_loopback();
+    Networking_Core *net = new_networking(log, &ip, 36570);
+    DHT *dht = new_dht(log, mono_time, net, true);
+    Onion_Announce *onion_a = new_onion_announce(log, mono_time, dht);
+    ck_assert_msg(onion_a != nullptr, "Onion_Announce failed initializing.");
+
+    ck_assert_msg(!onion_announce_set_max_entries(onion_a, 0), "Accepted a capacity of 0.");
+    ck_assert_msg(onion_announce_set_max_entries(onion_a, STORE_TEST_MAX_ENTRIES), "Failed to set capacity.");
+
+    uint8_t(*keys)[CRYPTO_PUBLIC_KEY_SIZE] = (uint8_t(*)[CRYPTO_PUBLIC_KEY_SIZE])calloc(STORE_TEST_KEYS,
+            CRYPTO_PUBLIC_KEY_SIZE);
+    ck_assert(keys != nullptr);
+
+    const IP_Port ret_ip_port = {ip, net_port(net)};
+    const uint8_t ret[ONION_RETURN_3] = {0};
+
+    for (uint32_t i = 0; i < STORE_TEST_KEYS; ++i) {
+        random_bytes(keys[i], CRYPTO_PUBLIC_KEY_SIZE);
+        const bool added = onion_announce_add_entry(onion_a, keys[i], &ret_ip_port, keys[i], ret);
+        ck_assert_msg(added || i >= STORE_TEST_MAX_ENTRIES, "Failed to add announcement %u.", i);
+    }
+
+    ck_assert_msg(onion_announce_num_entries(onion_a) == STORE_TEST_MAX_ENTRIES, "Wrong number of announcements.");
+
+    store_test_base_key = dht_get_self_public_key(dht);
+    qsort(keys, STORE_TEST_KEYS, CRYPTO_PUBLIC_KEY_SIZE, cmp_distance);
+
+    for (uint32_t i = 0; i < STORE_TEST_KEYS; ++i) {
+        ck_assert_msg(onion_announce_has_entry(onion_a, keys[i]) == (i < STORE_TEST_MAX_ENTRIES),
+                      "Announcement %u by distance is%s stored.", i, i < STORE_TEST_MAX_ENTRIES ? " not" : "");
+    }
+
+    // Lowering the capacity drops the farthest announcements.
+    ck_assert(onion_announce_set_max_entries(onion_a, STORE_TEST_MAX_ENTRIES / 2));
+    ck_assert(onion_announce_has_entry(onion_a, keys[STORE_TEST_MAX_ENTRIES / 2 - 1]));
+    ck_assert(!onion_announce_has_entry(onion_a, keys[STORE_TEST_MAX_ENTRIES / 2]));
+
+    // Refreshed announcements outlive the others.
+    cur_time += ONION_ANNOUNCE_TIMEOUT / 2 * 1000;
+    mono_time_update(mono_time);
+    ck_assert(onion_announce_add_entry(onion_a, keys[0], &ret_ip_port, keys[0], ret));
+    cur_time += (ONION_ANNOUNCE_TIMEOUT / 2 + 1) * 1000;
+    mono_time_update(mono_time);
+    ck_assert(onion_announce_has_entry(onion_a, keys[0]));
+    ck_assert(!onion_announce_has_entry(onion_a, keys[1]));
+    ck_assert(onion_announce_add_entry(onion_a, keys[STORE_TEST_KEYS - 1], &ret_ip_port, keys[0], ret));
+    ck_assert_msg(onion_announce_num_entries(onion_a) == 2, "Timed out announcements were not removed.");
+
+    free(keys);
+    kill_onion_announce(onion_a);
+    kill_dht(dht);
+    kill_networking(net);
+    mono_time_free(mono_time);
+    logger_kill(log);
+}
+
 int main(void)
 {
     setvbuf(stdout, nullptr, _IONBF, 0);
 
-    test_basic();
+    test_basic(false);
+    test_basic(true);
     test_announce();
+    test_announce_store();
 
     return 0;
 }
@@ -125,7 +125,9 @@ static void parse_tcp_relay_ports_config(config_t *cfg, uint16_t **tcp_relay_por
 
 int get_general_config(const char *cfg_file_path, char **pid_file_path, char **keys_file_path, int *port,
                        int *enable_ipv6, int *enable_ipv4_fallback, int *enable_lan_discovery, int *enable_tcp_relay,
-                       uint16_t **tcp_relay_ports, int *tcp_relay_port_count, int *enable_motd, char **motd)
+                       uint16_t **tcp_relay_ports, int *tcp_relay_port_count, int *tcp_relay_threads,
+                       int *tcp_handshake_threads, int *tcp_max_pending_connections, int *onion_announce_max_entries,
+                       int *enable_onion_relay_thread, int *enable_motd, char **motd)
 {
     config_t cfg;
 
@@ -136,6 +138,11 @@ int get_general_config(const char *cfg_file_path, char **pid_file_path, char **k
     const char *NAME_ENABLE_IPV4_FALLBACK = "enable_ipv4_fallback";
     const char *NAME_ENABLE_LAN_DISCOVERY = "enable_lan_discovery";
     const char *NAME_ENABLE_TCP_RELAY     = "enable_tcp_relay";
+    const char *NAME_TCP_RELAY_THREADS    = "tcp_relay_threads";
+    const char *NAME_TCP_HANDSHAKE_THREADS = "tcp_handshake_threads";
+    const char *NAME_TCP_MAX_PENDING_CONNECTIONS = "tcp_max_pending_connections";
+    const char *NAME_ONION_ANNOUNCE_MAX_ENTRIES = "onion_announce_max_entries";
+    const char *NAME_ENABLE_ONION_RELAY_THREAD = "enable_onion_relay_thread";
     const char *NAME_ENABLE_MOTD          = "enable_motd";
     const char *NAME_MOTD                 = "motd";
 
@@ -218,6 +225,55 @@ int get_general_config(const char *cfg_file_path, char **pid_file_path, char **k
         *tcp_relay_port_count = 0;
     }
 
+    // Get TCP relay threads
+    if (config_lookup_int(&cfg, NAME_TCP_RELAY_THREADS, tcp_relay_threads) == CONFIG_FALSE) {
+        *tcp_relay_threads = DEFAULT_TCP_RELAY_THREADS;
+    }
+
+    if (*tcp_relay_threads < 0 || *tcp_relay_threads > MAX_TCP_RELAY_THREADS) {
+        log_write(LOG_LEVEL_WARNING, "'%s' should be in [0, %d], using default: %d\n", NAME_TCP_RELAY_THREADS,
+                  MAX_TCP_RELAY_THREADS, DEFAULT_TCP_RELAY_THREADS);
+        *tcp_relay_threads = DEFAULT_TCP_RELAY_THREADS;
+    }
+
+    // Get TCP handshake threads
+    if (config_lookup_int(&cfg, NAME_TCP_HANDSHAKE_THREADS, tcp_handshake_threads) == CONFIG_FALSE) {
+        *tcp_handshake_threads = DEFAULT_TCP_HANDSHAKE_THREADS;
+    }
+
+    if (*tcp_handshake_threads < 0 || *tcp_handshake_threads > MAX_TCP_HANDSHAKE_THREADS) {
+        log_write(LOG_LEVEL_WARNING, "'%s' should be in [0, %d], using default: %d\n", NAME_TCP_HANDSHAKE_THREADS,
+                  MAX_TCP_HANDSHAKE_THREADS, DEFAULT_TCP_HANDSHAKE_THREADS);
+        *tcp_handshake_threads = DEFAULT_TCP_HANDSHAKE_THREADS;
+    }
+
+    // Get TCP max pending connections
+    if (config_lookup_int(&cfg, NAME_TCP_MAX_PENDING_CONNECTIONS, tcp_max_pending_connections) == CONFIG_FALSE) {
+        *tcp_max_pending_connections = DEFAULT_TCP_MAX_PENDING_CONNECTIONS;
+    }
+
+    if (*tcp_max_pending_connections < 1 || *tcp_max_pending_connections > MAX_TCP_MAX_PENDING_CONNECTIONS) {
+        log_write(LOG_LEVEL_WARNING, "'%s' should be in [1, %d], using default: %d\n", NAME_TCP_MAX_PENDING_CONNECTIONS,
+                  MAX_TCP_MAX_PENDING_CONNECTIONS, DEFAULT_TCP_MAX_PENDING_CONNECTIONS);
+        *tcp_max_pending_connections = DEFAULT_TCP_MAX_PENDING_CONNECTIONS;
+    }
+
+    // Get onion announce max entries
+    if (config_lookup_int(&cfg, NAME_ONION_ANNOUNCE_MAX_ENTRIES, onion_announce_max_entries) == CONFIG_FALSE) {
+        *onion_announce_max_entries = DEFAULT_ONION_ANNOUNCE_MAX_ENTRIES;
+    }
+
+    if (*onion_announce_max_entries < 1 || *onion_announce_max_entries > MAX_ONION_ANNOUNCE_MAX_ENTRIES) {
+        log_write(LOG_LEVEL_WARNING, "'%s' should be in [1, %d], using default: %d\n", NAME_ONION_ANNOUNCE_MAX_ENTRIES,
+                  MAX_ONION_ANNOUNCE_MAX_ENTRIES, DEFAULT_ONION_ANNOUNCE_MAX_ENTRIES);
+        *onion_announce_max_entries = DEFAULT_ONION_ANNOUNCE_MAX_ENTRIES;
+    }
+
+    // Get onion relay thread option
+    if (config_lookup_bool(&cfg, NAME_ENABLE_ONION_RELAY_THREAD, enable_onion_relay_thread) == CONFIG_FALSE) {
+        *enable_onion_relay_thread = DEFAULT_ENABLE_ONION_RELAY_THREAD;
+    }
+
     // Get MOTD option
     if (config_lookup_bool(&cfg, NAME_ENABLE_MOTD, enable_motd) == CONFIG_FALSE) {
         log_write(LOG_LEVEL_WARNING, "No '%s' setting in configuration file.\n", NAME_ENABLE_MOTD);
@@ -265,8 +321,16 @@ int get_general_config(const char *cfg_file_path, char **pid_file_path, char **k
                 log_write(LOG_LEVEL_INFO, "Port #%d: %u\n", i, (*tcp_relay_ports)[i]);
             }
         }
+
+        log_write(LOG_LEVEL_INFO, "'%s': %d\n", NAME_TCP_RELAY_THREADS, *tcp_relay_threads);
+        log_write(LOG_LEVEL_INFO, "'%s': %d\n", NAME_TCP_HANDSHAKE_THREADS, *tcp_handshake_threads);
+        log_write(LOG_LEVEL_INFO, "'%s': %d\n", NAME_TCP_MAX_PENDING_CONNECTIONS, *tcp_max_pending_connections);
     }
 
+    log_write(LOG_LEVEL_INFO, "'%s': %d\n", NAME_ONION_ANNOUNCE_MAX_ENTRIES, *onion_announce_max_entries);
+    log_write(LOG_LEVEL_INFO, "'%s': %s\n", NAME_ENABLE_ONION_RELAY_THREAD,
+              *enable_onion_relay_thread ? "true" : "false");
+
     log_write(LOG_LEVEL_INFO, "'%s': %s\n", NAME_ENABLE_MOTD,          *enable_motd          ? "true" : "false");
 
     if (*enable_motd) {
@@ -305,6 +369,56 @@ static uint8_t *bootstrap_hex_string_to_bin(const char *hex_string)
     return ret;
 }
 
+int get_tcp_relay_rate_limits(const char *cfg_file_path, uint32_t rates[TCP_TRAFFIC_NUM],
+                              uint32_t bursts[TCP_TRAFFIC_NUM])
+{
+    const char *NAME_TCP_RELAY_RATE_LIMITS = "tcp_relay_rate_limits";
+
+    // Indexed by TCP_Traffic.
+    const char *const NAME_RATE[TCP_TRAFFIC_NUM]  = {"data_rate", "onion_rate", "oob_rate"};
+    const char *const NAME_BURST[TCP_TRAFFIC_NUM] = {"data_burst", "onion_burst", "oob_burst"};
+
+    config_t cfg;
+
+    config_init(&cfg);
+
+    if (config_read_file(&cfg, cfg_file_path) == CONFIG_FALSE) {
+        log_write(LOG_LEVEL_ERROR, "%s:%d - %s\n", config_error_file(&cfg), config_error_line(&cfg), config_error_text(&cfg));
+        config_destroy(&cfg);
+        return 0;
+    }
+
+    const config_setting_t *limits = config_lookup(&cfg, NAME_TCP_RELAY_RATE_LIMITS);
+
+    for (int i = 0; i < TCP_TRAFFIC_NUM; ++i) {
+        int rate = 0;
+        int burst = 0;
+
+        if (limits != nullptr) {
+            config_setting_lookup_int(limits, NAME_RATE[i], &rate);
+            config_setting_lookup_int(limits, NAME_BURST[i], &burst);
+        }
+
+        if (rate < 0 || burst < 0) {
+            log_write(LOG_LEVEL_WARNING, "'%s.%s' and '%s.%s' should not be negative, not limiting them\n",
+                      NAME_TCP_RELAY_RATE_LIMITS, NAME_RATE[i], NAME_TCP_RELAY_RATE_LIMITS, NAME_BURST[i]);
+            rate = 0;
+            burst = 0;
+        }
+
+        rates[i] = rate;
+        bursts[i] = burst;
+
+        if (rate > 0) {
+            log_write(LOG_LEVEL_INFO, "'%s.%s': %d\n", NAME_TCP_RELAY_RATE_LIMITS, NAME_RATE[i], rate);
+            log_write(LOG_LEVEL_INFO, "'%s.%s': %d\n", NAME_TCP_RELAY_RATE_LIMITS, NAME_BURST[i], burst);
+        }
+    }
+
+    config_destroy(&cfg);
+    return 1;
+}
+
 int bootstrap_from_config(const char *cfg_file_path, DHT *dht, int enable_ipv6)
 {
     const char *NAME_BOOTSTRAP_NODES = "bootstrap_nodes";
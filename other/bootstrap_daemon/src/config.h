@@ -11,6 +11,7 @@
 #define C_TOXCORE_OTHER_BOOTSTRAP_DAEMON_SRC_CONFIG_H
 
 #include "../../../toxcore/DHT.h"
+#include "../../../toxcore/TCP_server.h"
 
 /**
  * Gets general config options from the config file.
@@ -24,7 +25,19 @@
  */
 int get_general_config(const char *cfg_file_path, char **pid_file_path, char **keys_file_path, int *port,
                        int *enable_ipv6, int *enable_ipv4_fallback, int *enable_lan_discovery, int *enable_tcp_relay,
-                       uint16_t **tcp_relay_ports, int *tcp_relay_port_count, int *enable_motd, char **motd);
+                       uint16_t **tcp_relay_ports, int *tcp_relay_port_count, int *tcp_relay_threads,
+                       int *tcp_handshake_threads, int *tcp_max_pending_connections, int *onion_announce_max_entries,
+                       int *enable_onion_relay_thread, int *enable_motd, char **motd);
+
+/**
+ * Gets the per-client TCP relay rate limits from the config file, indexed by
+ * TCP_Traffic. A limit that is not set is 0, meaning unlimited.
+ *
+ * @return 1 on success,
+ *         0 on failure, doesn't modify any data pointed by arguments.
+ */
+int get_tcp_relay_rate_limits(const char *cfg_file_path, uint32_t rates[TCP_TRAFFIC_NUM],
+                              uint32_t bursts[TCP_TRAFFIC_NUM]);
 
 /**
  * Bootstraps off nodes listed in the config file.
@@ -21,6 +21,15 @@
 #define DEFAULT_ENABLE_TCP_RELAY      1 // 1 - true, 0 - false
 #define DEFAULT_TCP_RELAY_PORTS       443, 3389, 33445 // comma-separated list of ports. make sure to adjust DEFAULT_TCP_RELAY_PORTS_COUNT accordingly
 #define DEFAULT_TCP_RELAY_PORTS_COUNT 3
+#define DEFAULT_TCP_RELAY_THREADS     0 // 0 - serve all TCP relay connections from the main thread
+#define MAX_TCP_RELAY_THREADS         64
+#define DEFAULT_TCP_HANDSHAKE_THREADS 0 // 0 - do TCP relay handshakes on the main thread
+#define MAX_TCP_HANDSHAKE_THREADS     64
+#define DEFAULT_TCP_MAX_PENDING_CONNECTIONS 256
+#define MAX_TCP_MAX_PENDING_CONNECTIONS     1048576 // TCP_MAX_PENDING_CONNECTIONS
+#define DEFAULT_ONION_ANNOUNCE_MAX_ENTRIES  160 // ONION_ANNOUNCE_MAX_ENTRIES
+#define MAX_ONION_ANNOUNCE_MAX_ENTRIES      16777216 // ONION_ANNOUNCE_MAX_ENTRIES_LIMIT
+#define DEFAULT_ENABLE_ONION_RELAY_THREAD   0 // 1 - true, 0 - false
 #define DEFAULT_ENABLE_MOTD           1 // 1 - true, 0 - false
 #define DEFAULT_MOTD                  DAEMON_NAME
 
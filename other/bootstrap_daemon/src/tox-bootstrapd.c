@@ -241,11 +241,18 @@ int main(int argc, char *argv[])
     int enable_tcp_relay;
     uint16_t *tcp_relay_ports = nullptr;
     int tcp_relay_port_count;
+    int tcp_relay_threads;
+    int tcp_handshake_threads;
+    int tcp_max_pending_connections;
+    int onion_announce_max_entries;
+    int enable_onion_relay_thread;
     int enable_motd;
     char *motd = nullptr;
 
     if (get_general_config(cfg_file_path, &pid_file_path, &keys_file_path, &port, &enable_ipv6, &enable_ipv4_fallback,
-                           &enable_lan_discovery, &enable_tcp_relay, &tcp_relay_ports, &tcp_relay_port_count, &enable_motd, &motd)) {
+                           &enable_lan_discovery, &enable_tcp_relay, &tcp_relay_ports, &tcp_relay_port_count, &tcp_relay_threads,
+                           &tcp_handshake_threads, &tcp_max_pending_connections, &onion_announce_max_entries,
+                           &enable_onion_relay_thread, &enable_motd, &motd)) {
         log_write(LOG_LEVEL_INFO, "General config read successfully\n");
     } else {
         log_write(LOG_LEVEL_ERROR, "Couldn't read config file: %s. Exiting.\n", cfg_file_path);
@@ -360,6 +367,12 @@ int main(int argc, char *argv[])
         return 1;
     }
 
+    onion_announce_set_max_entries(onion_a, onion_announce_max_entries);
+
+    if (enable_onion_relay_thread && !onion_start_relay_thread(onion)) {
+        log_write(LOG_LEVEL_WARNING, "Couldn't start the onion relay thread. Relaying onion packets on the main thread.\n");
+    }
+
     if (enable_motd) {
         if (bootstrap_set_callbacks(dht_get_net(dht), DAEMON_VERSION_NUMBER, (uint8_t *)motd, strlen(motd) + 1) == 0) {
             log_write(LOG_LEVEL_INFO, "Set MOTD successfully.\n");
@@ -418,6 +431,33 @@ int main(int argc, char *argv[])
         if (tcp_server != nullptr) {
             log_write(LOG_LEVEL_INFO, "Initialized Tox TCP server successfully.\n");
 
+            tcp_server_set_max_pending_connections(tcp_server, tcp_max_pending_connections);
+
+            uint32_t rates[TCP_TRAFFIC_NUM];
+            uint32_t bursts[TCP_TRAFFIC_NUM];
+
+            if (get_tcp_relay_rate_limits(cfg_file_path, rates, bursts)) {
+                for (int i = 0; i < TCP_TRAFFIC_NUM; ++i) {
+                    tcp_server_set_rate_limit(tcp_server, (TCP_Traffic)i, rates[i], bursts[i]);
+                }
+            }
+
+            if (tcp_handshake_threads > 0 && !tcp_server_set_handshake_threads(tcp_server, tcp_handshake_threads)) {
+                log_write(LOG_LEVEL_WARNING,
+                          "Couldn't start %d TCP handshake threads. Doing handshakes on the main thread.\n",
+                          tcp_handshake_threads);
+            }
+
+            if (tcp_relay_threads > 0) {
+                if (tcp_server_start_workers(tcp_server, mono_time, tcp_relay_threads)) {
+                    log_write(LOG_LEVEL_INFO, "Serving TCP relay connections from %d threads.\n", tcp_relay_threads);
+                } else {
+                    log_write(LOG_LEVEL_WARNING,
+                              "Couldn't start %d TCP relay threads. Serving TCP relay connections from the main thread.\n",
+                              tcp_relay_threads);
+                }
+            }
+
             struct rlimit limit;
 
             const rlim_t rlim_suggested = 32768;
@@ -42,6 +42,8 @@
 /** Number of get node requests to send to quickly find close nodes. */
 #define MAX_BOOTSTRAP_TIMES 5
 
+static_assert(sizeof(Node_format) <= PING_ARRAY_MAX_DATA_SIZE, "get nodes ping data does not fit in a ping array entry");
+
 typedef struct DHT_Friend_Callback {
     dht_ip_cb *ip_callback;
     void *data;
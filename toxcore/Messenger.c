@@ -57,20 +57,21 @@ static int realloc_friendlist(Messenger *m, uint32_t num)
     return 0;
 }
 
+/** Have do_friends() look at the friend on its next run, because something it
+ * does for the friend changed.
+ */
+non_null()
+static void wake_friend(Messenger *m, uint32_t friendnumber)
+{
+    run_queue_wake(&m->friend_queue, friendnumber, mono_time_get(m->mono_time));
+}
+
 /** return the friend number associated to that public key.
  *  return -1 if no such friend.
  */
 int32_t getfriend_id(const Messenger *m, const uint8_t *real_pk)
 {
-    for (uint32_t i = 0; i < m->numfriends; ++i) {
-        if (m->friendlist[i].status > 0) {
-            if (id_equal(real_pk, m->friendlist[i].real_pk)) {
-                return i;
-            }
-        }
-    }
-
-    return -1;
+    return hash_index_find(&m->friend_key_index, real_pk);
 }
 
 /** Copies the public key associated to that friend id into real_pk buffer.
@@ -173,6 +174,10 @@ static int32_t init_new_friend(Messenger *m, const uint8_t *real_pk, uint8_t sta
         return FAERR_NOMEM;
     }
 
+    if (!run_queue_reserve(&m->friend_queue, m->numfriends + 1)) {
+        return FAERR_NOMEM;
+    }
+
     memset(&m->friendlist[m->numfriends], 0, sizeof(Friend));
 
     int friendcon_id = new_friend_connection(m->fr_c, real_pk);
@@ -183,6 +188,11 @@ static int32_t init_new_friend(Messenger *m, const uint8_t *real_pk, uint8_t sta
 
     for (uint32_t i = 0; i <= m->numfriends; ++i) {
         if (m->friendlist[i].status == NOFRIEND) {
+            if (!hash_index_add(&m->friend_key_index, real_pk, i)) {
+                kill_friend_connection(m->fr_c, friendcon_id);
+                return FAERR_NOMEM;
+            }
+
             m->friendlist[i].status = status;
             m->friendlist[i].friendcon_id = friendcon_id;
             m->friendlist[i].friendrequest_lastsent = 0;
@@ -193,6 +203,7 @@ static int32_t init_new_friend(Messenger *m, const uint8_t *real_pk, uint8_t sta
             m->friendlist[i].message_id = 0;
             friend_connection_callbacks(m->fr_c, friendcon_id, MESSENGER_CALLBACK_INDEX, &m_handle_status, &m_handle_packet,
                                         &m_handle_lossy_packet, m, i);
+            wake_friend(m, i);
 
             if (m->numfriends == i) {
                 ++m->numfriends;
@@ -352,6 +363,7 @@ static int add_receipt(Messenger *m, int32_t friendnumber, uint32_t packet_num,
 
     m->friendlist[friendnumber].receipts_end = new_receipts;
     new_receipts->next = nullptr;
+    wake_friend(m, friendnumber);
     return 0;
 }
 /**
@@ -428,6 +440,8 @@ int m_delfriend(Messenger *m, int32_t friendnumber)
     }
 
     kill_friend_connection(m->fr_c, m->friendlist[friendnumber].friendcon_id);
+    run_queue_unschedule(&m->friend_queue, friendnumber);
+    hash_index_remove(&m->friend_key_index, m->friendlist[friendnumber].real_pk, friendnumber);
     memset(&m->friendlist[friendnumber], 0, sizeof(Friend));
 
     uint32_t i;
@@ -480,6 +494,25 @@ int m_get_friend_connectionstatus(const Messenger *m, int32_t friendnumber)
     return m->friendlist[friendnumber].last_connection_udp_tcp;
 }
 
+int m_get_friend_transport_stats(const Messenger *m, int32_t friendnumber, Crypto_Conn_Stats *stats)
+{
+    if (!friend_is_valid(m, friendnumber)) {
+        return -1;
+    }
+
+    if (m->friendlist[friendnumber].status != FRIEND_ONLINE) {
+        return -2;
+    }
+
+    const int crypt_conn_id = friend_connection_crypt_connection_id(m->fr_c, m->friendlist[friendnumber].friendcon_id);
+
+    if (!crypto_connection_stats(m->net_crypto, crypt_conn_id, stats)) {
+        return -2;
+    }
+
+    return 0;
+}
+
 int m_friend_exists(const Messenger *m, int32_t friendnumber)
 {
     if (!friend_is_valid(m, friendnumber)) {
@@ -523,15 +556,11 @@ int m_send_message_generic(Messenger *m, int32_t friendnumber, uint8_t type, con
         return -3;
     }
 
-    VLA(uint8_t, packet, length + 1);
-    packet[0] = PACKET_ID_MESSAGE + type;
+    const uint8_t packet_id = PACKET_ID_MESSAGE + type;
+    const Crypto_Packet_Fragment packet[2] = {{&packet_id, sizeof(packet_id)}, {message, (uint16_t)length}};
 
-    if (length != 0) {
-        memcpy(packet + 1, message, length);
-    }
-
-    int64_t packet_num = write_cryptpacket(m->net_crypto, friend_connection_crypt_connection_id(m->fr_c,
-                                           m->friendlist[friendnumber].friendcon_id), packet, length + 1, 0);
+    int64_t packet_num = write_cryptpacket_v(m->net_crypto, friend_connection_crypt_connection_id(m->fr_c,
+                         m->friendlist[friendnumber].friendcon_id), packet, 2, 0);
 
     if (packet_num == -1) {
         LOGGER_WARNING(m->log, "Failed to write crypto packet for message of length %d to friend %d",
@@ -562,15 +591,10 @@ static int write_cryptpacket_id(const Messenger *m, int32_t friendnumber, uint8_
         return 0;
     }
 
-    VLA(uint8_t, packet, length + 1);
-    packet[0] = packet_id;
-
-    if (length != 0) {
-        memcpy(packet + 1, data, length);
-    }
+    const Crypto_Packet_Fragment packet[2] = {{&packet_id, sizeof(packet_id)}, {data, (uint16_t)length}};
 
-    return write_cryptpacket(m->net_crypto, friend_connection_crypt_connection_id(m->fr_c,
-                             m->friendlist[friendnumber].friendcon_id), packet, length + 1, congestion_control) != -1;
+    return write_cryptpacket_v(m->net_crypto, friend_connection_crypt_connection_id(m->fr_c,
+                               m->friendlist[friendnumber].friendcon_id), packet, 2, congestion_control) != -1;
 }
 
 /** Send a name packet to friendnumber.
@@ -635,6 +659,10 @@ int setname(Messenger *m, const uint8_t *name, uint16_t length)
 
     for (uint32_t i = 0; i < m->numfriends; ++i) {
         m->friendlist[i].name_sent = 0;
+
+        if (m->friendlist[i].status == FRIEND_ONLINE) {
+            wake_friend(m, i);
+        }
     }
 
     return 0;
@@ -707,6 +735,10 @@ int m_set_statusmessage(Messenger *m, const uint8_t *status, uint16_t length)
 
     for (uint32_t i = 0; i < m->numfriends; ++i) {
         m->friendlist[i].statusmessage_sent = 0;
+
+        if (m->friendlist[i].status == FRIEND_ONLINE) {
+            wake_friend(m, i);
+        }
     }
 
     return 0;
@@ -726,6 +758,10 @@ int m_set_userstatus(Messenger *m, uint8_t status)
 
     for (uint32_t i = 0; i < m->numfriends; ++i) {
         m->friendlist[i].userstatus_sent = 0;
+
+        if (m->friendlist[i].status == FRIEND_ONLINE) {
+            wake_friend(m, i);
+        }
     }
 
     return 0;
@@ -827,6 +863,7 @@ int m_set_usertyping(Messenger *m, int32_t friendnumber, uint8_t is_typing)
 
     m->friendlist[friendnumber].user_istyping = is_typing;
     m->friendlist[friendnumber].user_istyping_sent = 0;
+    wake_friend(m, friendnumber);
 
     return 0;
 }
@@ -1007,6 +1044,7 @@ static void set_friend_status(Messenger *m, int32_t friendnumber, uint8_t status
 {
     check_friend_connectionstatus(m, friendnumber, status, userdata);
     m->friendlist[friendnumber].status = status;
+    wake_friend(m, friendnumber);
 }
 
 /*** CONFERENCES */
@@ -1400,16 +1438,11 @@ static int64_t send_file_data_packet(const Messenger *m, int32_t friendnumber, u
         return -1;
     }
 
-    VLA(uint8_t, packet, 2 + length);
-    packet[0] = PACKET_ID_FILE_DATA;
-    packet[1] = filenumber;
-
-    if (length) {
-        memcpy(packet + 2, data, length);
-    }
+    const uint8_t header[2] = {PACKET_ID_FILE_DATA, filenumber};
+    const Crypto_Packet_Fragment packet[2] = {{header, sizeof(header)}, {data, length}};
 
-    return write_cryptpacket(m->net_crypto, friend_connection_crypt_connection_id(m->fr_c,
-                             m->friendlist[friendnumber].friendcon_id), packet, SIZEOF_VLA(packet), 1);
+    return write_cryptpacket_v(m->net_crypto, friend_connection_crypt_connection_id(m->fr_c,
+                               m->friendlist[friendnumber].friendcon_id), packet, 2, 1);
 }
 
 #define MAX_FILE_DATA_SIZE (MAX_CRYPTO_DATA_SIZE - 2)
@@ -1676,6 +1709,7 @@ static int handle_filecontrol(Messenger *m, int32_t friendnumber, uint8_t receiv
             if (receive_send && ft->status == FILESTATUS_NOT_ACCEPTED) {
                 ft->status = FILESTATUS_TRANSFERRING;
                 ++m->friendlist[friendnumber].num_sending_files;
+                wake_friend(m, friendnumber);
             } else {
                 if (ft->paused & FILE_PAUSE_OTHER) {
                     ft->paused ^= FILE_PAUSE_OTHER;
@@ -2284,63 +2318,112 @@ static int m_handle_packet(void *object, int i, const uint8_t *temp, uint16_t le
     return 0;
 }
 
-non_null(1) nullable(2)
-static void do_friends(Messenger *m, void *userdata)
+/** Do what is due for a friend. Online friends are looked at every second, and
+ * on every run while they have something to send.
+ *
+ * return the time at which something is due next.
+ * return 0 if nothing is until the friend is woken.
+ */
+non_null(1) nullable(5)
+static uint64_t do_friend(Messenger *m, uint32_t i, uint64_t temp_time, uint64_t unix_time, void *userdata)
 {
-    uint64_t temp_time = mono_time_get(m->mono_time);
+    if (m->friendlist[i].status == FRIEND_ADDED) {
+        int fr = send_friend_request_packet(m->fr_c, m->friendlist[i].friendcon_id, m->friendlist[i].friendrequest_nospam,
+                                            m->friendlist[i].info,
+                                            m->friendlist[i].info_size);
 
-    for (uint32_t i = 0; i < m->numfriends; ++i) {
-        if (m->friendlist[i].status == FRIEND_ADDED) {
-            int fr = send_friend_request_packet(m->fr_c, m->friendlist[i].friendcon_id, m->friendlist[i].friendrequest_nospam,
-                                                m->friendlist[i].info,
-                                                m->friendlist[i].info_size);
+        if (fr < 0) {
+            // Try again on the next run.
+            return temp_time;
+        }
 
-            if (fr >= 0) {
-                set_friend_status(m, i, FRIEND_REQUESTED, userdata);
-                m->friendlist[i].friendrequest_lastsent = temp_time;
-            }
+        set_friend_status(m, i, FRIEND_REQUESTED, userdata);
+        m->friendlist[i].friendrequest_lastsent = temp_time;
+    }
+
+    if (m->friendlist[i].status == FRIEND_REQUESTED) {
+        /* If we didn't connect to friend after successfully sending him a friend request the request is deemed
+         * unsuccessful so we set the status back to FRIEND_ADDED and try again.
+         */
+        check_friend_request_timed_out(m, i, temp_time, userdata);
+
+        if (m->friendlist[i].status == FRIEND_REQUESTED) {
+            return m->friendlist[i].friendrequest_lastsent + m->friendlist[i].friendrequest_timeout + 1;
         }
 
-        if (m->friendlist[i].status == FRIEND_REQUESTED
-                || m->friendlist[i].status == FRIEND_CONFIRMED) { /* friend is not online. */
-            if (m->friendlist[i].status == FRIEND_REQUESTED) {
-                /* If we didn't connect to friend after successfully sending him a friend request the request is deemed
-                 * unsuccessful so we set the status back to FRIEND_ADDED and try again.
-                 */
-                check_friend_request_timed_out(m, i, temp_time, userdata);
+        return temp_time;
+    }
+
+    if (m->friendlist[i].status == FRIEND_ONLINE) { /* friend is online. */
+        if (m->friendlist[i].name_sent == 0) {
+            if (m_sendname(m, i, m->name, m->name_length)) {
+                m->friendlist[i].name_sent = 1;
             }
         }
 
-        if (m->friendlist[i].status == FRIEND_ONLINE) { /* friend is online. */
-            if (m->friendlist[i].name_sent == 0) {
-                if (m_sendname(m, i, m->name, m->name_length)) {
-                    m->friendlist[i].name_sent = 1;
-                }
+        if (m->friendlist[i].statusmessage_sent == 0) {
+            if (send_statusmessage(m, i, m->statusmessage, m->statusmessage_length)) {
+                m->friendlist[i].statusmessage_sent = 1;
             }
+        }
 
-            if (m->friendlist[i].statusmessage_sent == 0) {
-                if (send_statusmessage(m, i, m->statusmessage, m->statusmessage_length)) {
-                    m->friendlist[i].statusmessage_sent = 1;
-                }
+        if (m->friendlist[i].userstatus_sent == 0) {
+            if (send_userstatus(m, i, m->userstatus)) {
+                m->friendlist[i].userstatus_sent = 1;
             }
+        }
 
-            if (m->friendlist[i].userstatus_sent == 0) {
-                if (send_userstatus(m, i, m->userstatus)) {
-                    m->friendlist[i].userstatus_sent = 1;
-                }
+        if (m->friendlist[i].user_istyping_sent == 0) {
+            if (send_user_istyping(m, i, m->friendlist[i].user_istyping)) {
+                m->friendlist[i].user_istyping_sent = 1;
             }
+        }
 
-            if (m->friendlist[i].user_istyping_sent == 0) {
-                if (send_user_istyping(m, i, m->friendlist[i].user_istyping)) {
-                    m->friendlist[i].user_istyping_sent = 1;
-                }
-            }
+        check_friend_tcp_udp(m, i, userdata);
+        do_receipts(m, i, userdata);
+        do_reqchunk_filecb(m, i, userdata);
+
+        m->friendlist[i].last_seen_time = unix_time;
 
-            check_friend_tcp_udp(m, i, userdata);
-            do_receipts(m, i, userdata);
-            do_reqchunk_filecb(m, i, userdata);
+        const Friend *const f = &m->friendlist[i];
 
-            m->friendlist[i].last_seen_time = (uint64_t) time(nullptr);
+        if (f->name_sent == 0 || f->statusmessage_sent == 0 || f->userstatus_sent == 0 || f->user_istyping_sent == 0
+                || f->receipts_start != nullptr || f->num_sending_files != 0) {
+            // Try the sends that failed again, and keep waiting for receipts
+            // and sending file chunks, on the next run.
+            return temp_time;
+        }
+
+        // Poll the connection type once a second.
+        return temp_time + 1;
+    }
+
+    return 0;
+}
+
+non_null(1) nullable(2)
+static void do_friends(Messenger *m, void *userdata)
+{
+    const uint64_t temp_time = mono_time_get(m->mono_time);
+    const uint32_t num_due = run_queue_take_due(&m->friend_queue, temp_time);
+
+    if (num_due == 0) {
+        return;
+    }
+
+    const uint64_t unix_time = (uint64_t)time(nullptr);
+
+    for (uint32_t j = 0; j < num_due; ++j) {
+        const uint32_t i = m->friend_queue.due[j];
+
+        if (!friend_is_valid(m, i)) {
+            continue;
+        }
+
+        const uint64_t next_run = do_friend(m, i, temp_time, unix_time, userdata);
+
+        if (next_run != 0 && friend_is_valid(m, i)) {
+            run_queue_wake(&m->friend_queue, i, max_u64(next_run, temp_time));
         }
     }
 }
@@ -2438,7 +2521,9 @@ void do_messenger(Messenger *m, void *userdata)
     do_friends(m, userdata);
     connection_status_callback(m, userdata);
 
-    if (mono_time_get(m->mono_time) > m->lastdump + DUMPING_CLIENTS_FRIENDS_EVERY_N_SECONDS) {
+    // The dump matches every friend against every DHT friend, so only do it when it is logged.
+    if (MIN_LOGGER_LEVEL <= LOGGER_LEVEL_TRACE
+            && mono_time_get(m->mono_time) > m->lastdump + DUMPING_CLIENTS_FRIENDS_EVERY_N_SECONDS) {
         m->lastdump = mono_time_get(m->mono_time);
         uint32_t last_pinged;
 
@@ -2890,6 +2975,13 @@ static State_Load_Status friends_list_load(Messenger *m, const uint8_t *data, ui
             set_friend_statusmessage(m, fnum, temp.statusmessage, net_ntohs(temp.statusmessage_length));
             set_friend_userstatus(m, fnum, temp.userstatus);
             net_unpack_u64(temp.last_seen_time, &m->friendlist[fnum].last_seen_time);
+
+            const uint64_t now = (uint64_t)time(nullptr);
+
+            if (m->friendlist[fnum].last_seen_time != 0 && m->friendlist[fnum].last_seen_time <= now) {
+                friend_connection_set_last_online(m->fr_c, m->friendlist[fnum].friendcon_id,
+                                                  now - m->friendlist[fnum].last_seen_time);
+            }
         } else if (temp.status != 0) {
             /* TODO(irungentoo): This is not a good way to do this. */
             uint8_t address[FRIEND_ADDRESS_SIZE];
@@ -3180,6 +3272,8 @@ Messenger *new_messenger(Mono_Time *mono_time, Messenger_Options *options, unsig
     }
 
     m->mono_time = mono_time;
+    run_queue_init(&m->friend_queue);
+    hash_index_init(&m->friend_key_index, CRYPTO_PUBLIC_KEY_SIZE);
 
     m->fr = friendreq_new();
 
@@ -3247,6 +3341,13 @@ Messenger *new_messenger(Mono_Time *mono_time, Messenger_Options *options, unsig
         return nullptr;
     }
 
+    nc_set_lossless_coalescing(m->net_crypto, options->lossless_coalescing);
+
+    if (!nc_set_crypto_threads(m->net_crypto, options->crypto_threads)) {
+        LOGGER_WARNING(m->log, "failed to start %u crypto threads, encrypting on the main thread",
+                       options->crypto_threads);
+    }
+
     m->onion = new_onion(m->log, m->mono_time, m->dht);
     m->onion_a = new_onion_announce(m->log, m->mono_time, m->dht);
     m->onion_c =  new_onion_client(m->log, m->mono_time, m->net_crypto);
@@ -3333,6 +3434,8 @@ void kill_messenger(Messenger *m)
 
     logger_kill(m->log);
     free(m->friendlist);
+    run_queue_free(&m->friend_queue);
+    hash_index_free(&m->friend_key_index);
     friendreq_kill(m->fr);
 
     free(m->options.state_plugins);
@@ -13,8 +13,10 @@
 #include "TCP_server.h"
 #include "friend_connection.h"
 #include "friend_requests.h"
+#include "hash_index.h"
 #include "logger.h"
 #include "net_crypto.h"
+#include "run_queue.h"
 #include "state.h"
 
 #define MAX_NAME_LENGTH 128
@@ -60,6 +62,8 @@ typedef struct Messenger_Options {
 
     bool hole_punching_enabled;
     bool local_discovery_enabled;
+    bool lossless_coalescing;
+    uint32_t crypto_threads;
 
     logger_cb *log_callback;
     void *log_context;
@@ -257,6 +261,8 @@ struct Messenger {
 
     Friend *friendlist;
     uint32_t numfriends;
+    Hash_Index friend_key_index; // Friends by real public key.
+    Run_Queue friend_queue; // Friends by when do_friends() next has something to do for them.
 
     time_t lastdump;
 
@@ -376,6 +382,15 @@ int m_delfriend(Messenger *m, int32_t friendnumber);
 non_null()
 int m_get_friend_connectionstatus(const Messenger *m, int32_t friendnumber);
 
+/** Get the transport statistics of the connection to a friend.
+ *
+ *  return 0 on success.
+ *  return -1 if friend not valid.
+ *  return -2 if friend not online.
+ */
+non_null()
+int m_get_friend_transport_stats(const Messenger *m, int32_t friendnumber, Crypto_Conn_Stats *stats);
+
 /** Checks if there exists a friend with given friendnumber.
  *
  *  return 1 if friend exists.
@@ -31,7 +31,6 @@ struct TCP_Client_Connection {
     IP_Port ip_port; /* The ip and port of the server */
     TCP_Proxy_Info proxy_info;
     uint8_t recv_nonce[CRYPTO_NONCE_SIZE]; /* Nonce of received packets. */
-    uint16_t next_packet_length;
 
     uint8_t temp_secret_key[CRYPTO_SECRET_KEY_SIZE];
 
@@ -40,6 +39,9 @@ struct TCP_Client_Connection {
     uint64_t last_pinged;
     uint64_t ping_id;
 
+    uint64_t rtt_start_ms; /* When the handshake or the outstanding ping was sent. */
+    uint32_t rtt; /* Smoothed round trip time in milliseconds, 0 until measured. */
+
     uint64_t ping_response_id;
     uint64_t ping_request_id;
 
@@ -71,6 +73,31 @@ IP_Port tcp_con_ip_port(const TCP_Client_Connection *con)
     return con->ip_port;
 }
 
+Socket tcp_con_sock(const TCP_Client_Connection *con)
+{
+    return con->con.sock;
+}
+
+uint32_t tcp_con_rtt(const TCP_Client_Connection *con)
+{
+    return con->rtt;
+}
+
+/** Fold a round trip that started at rtt_start_ms into the smoothed round trip time. */
+non_null()
+static void tcp_add_rtt_sample(TCP_Client_Connection *conn, const Mono_Time *mono_time)
+{
+    const uint64_t now = mono_time_get_ms(mono_time);
+    const uint64_t elapsed = now > conn->rtt_start_ms ? now - conn->rtt_start_ms : 0;
+    const uint32_t sample = (uint32_t)max_u64(1, min_u64(elapsed, UINT32_MAX));
+
+    if (conn->rtt == 0) {
+        conn->rtt = sample;
+    } else {
+        conn->rtt = (uint32_t)(((uint64_t)conn->rtt * 7 + sample) / 8);
+    }
+}
+
 TCP_Client_Status tcp_con_status(const TCP_Client_Connection *con)
 {
     return con->status;
@@ -127,17 +154,14 @@ static int proxy_http_generate_connection_request(TCP_Client_Connection *tcp_con
     }
 
     const uint16_t port = net_ntohs(tcp_conn->ip_port.port);
-    const int written = snprintf((char *)tcp_conn->con.last_packet, MAX_PACKET_SIZE, "%s%s:%hu%s%s:%hu%s", one, ip, port,
-                                 two, ip, port, three);
+    char request[MAX_PACKET_SIZE + 1];
+    const int written = snprintf(request, sizeof(request), "%s%s:%hu%s%s:%hu%s", one, ip, port, two, ip, port, three);
 
     if (written < 0 || MAX_PACKET_SIZE < written) {
         return 0;
     }
 
-    tcp_conn->con.last_packet_length = written;
-    tcp_conn->con.last_packet_sent = 0;
-
-    return 1;
+    return add_priority(&tcp_conn->con, (const uint8_t *)request, written, 0);
 }
 
 /** return 1 on success.
@@ -182,15 +206,19 @@ static int proxy_http_read_connection_response(const Logger *logger, const TCP_C
 #define TCP_SOCKS5_PROXY_HS_ADDR_TYPE_IPV4 0x01
 #define TCP_SOCKS5_PROXY_HS_ADDR_TYPE_IPV6 0x04
 
+/** return 1 on success.
+ * return 0 on failure.
+ */
 non_null()
-static void proxy_socks5_generate_greetings(TCP_Client_Connection *tcp_conn)
+static int proxy_socks5_generate_greetings(TCP_Client_Connection *tcp_conn)
 {
-    tcp_conn->con.last_packet[0] = TCP_SOCKS5_PROXY_HS_VERSION_SOCKS5;
-    tcp_conn->con.last_packet[1] = TCP_SOCKS5_PROXY_HS_AUTH_METHODS_SUPPORTED;
-    tcp_conn->con.last_packet[2] = TCP_SOCKS5_PROXY_HS_NO_AUTH;
+    const uint8_t greetings[3] = {
+        TCP_SOCKS5_PROXY_HS_VERSION_SOCKS5,
+        TCP_SOCKS5_PROXY_HS_AUTH_METHODS_SUPPORTED,
+        TCP_SOCKS5_PROXY_HS_NO_AUTH,
+    };
 
-    tcp_conn->con.last_packet_length = 3;
-    tcp_conn->con.last_packet_sent = 0;
+    return add_priority(&tcp_conn->con, greetings, sizeof(greetings), 0);
 }
 
 /** return 1 on success.
@@ -214,31 +242,34 @@ static int socks5_read_handshake_response(const Logger *logger, const TCP_Client
     return -1;
 }
 
+/** return 1 on success.
+ * return 0 on failure.
+ */
 non_null()
-static void proxy_socks5_generate_connection_request(TCP_Client_Connection *tcp_conn)
+static int proxy_socks5_generate_connection_request(TCP_Client_Connection *tcp_conn)
 {
-    tcp_conn->con.last_packet[0] = TCP_SOCKS5_PROXY_HS_VERSION_SOCKS5;
-    tcp_conn->con.last_packet[1] = TCP_SOCKS5_PROXY_HS_COMM_ESTABLISH_REQUEST;
-    tcp_conn->con.last_packet[2] = TCP_SOCKS5_PROXY_HS_RESERVED;
+    uint8_t request[4 + sizeof(IP6) + sizeof(uint16_t)];
+    request[0] = TCP_SOCKS5_PROXY_HS_VERSION_SOCKS5;
+    request[1] = TCP_SOCKS5_PROXY_HS_COMM_ESTABLISH_REQUEST;
+    request[2] = TCP_SOCKS5_PROXY_HS_RESERVED;
     uint16_t length = 3;
 
     if (net_family_is_ipv4(tcp_conn->ip_port.ip.family)) {
-        tcp_conn->con.last_packet[3] = TCP_SOCKS5_PROXY_HS_ADDR_TYPE_IPV4;
+        request[3] = TCP_SOCKS5_PROXY_HS_ADDR_TYPE_IPV4;
         ++length;
-        memcpy(tcp_conn->con.last_packet + length, tcp_conn->ip_port.ip.ip.v4.uint8, sizeof(IP4));
+        memcpy(request + length, tcp_conn->ip_port.ip.ip.v4.uint8, sizeof(IP4));
         length += sizeof(IP4);
     } else {
-        tcp_conn->con.last_packet[3] = TCP_SOCKS5_PROXY_HS_ADDR_TYPE_IPV6;
+        request[3] = TCP_SOCKS5_PROXY_HS_ADDR_TYPE_IPV6;
         ++length;
-        memcpy(tcp_conn->con.last_packet + length, tcp_conn->ip_port.ip.ip.v6.uint8, sizeof(IP6));
+        memcpy(request + length, tcp_conn->ip_port.ip.ip.v6.uint8, sizeof(IP6));
         length += sizeof(IP6);
     }
 
-    memcpy(tcp_conn->con.last_packet + length, &tcp_conn->ip_port.port, sizeof(uint16_t));
+    memcpy(request + length, &tcp_conn->ip_port.port, sizeof(uint16_t));
     length += sizeof(uint16_t);
 
-    tcp_conn->con.last_packet_length = length;
-    tcp_conn->con.last_packet_sent = 0;
+    return add_priority(&tcp_conn->con, request, length, 0);
 }
 
 /** return 1 on success.
@@ -285,17 +316,20 @@ static int generate_handshake(TCP_Client_Connection *tcp_conn)
     crypto_new_keypair(plain, tcp_conn->temp_secret_key);
     random_nonce(tcp_conn->con.sent_nonce);
     memcpy(plain + CRYPTO_PUBLIC_KEY_SIZE, tcp_conn->con.sent_nonce, CRYPTO_NONCE_SIZE);
-    memcpy(tcp_conn->con.last_packet, tcp_conn->self_public_key, CRYPTO_PUBLIC_KEY_SIZE);
-    random_nonce(tcp_conn->con.last_packet + CRYPTO_PUBLIC_KEY_SIZE);
-    int len = encrypt_data_symmetric(tcp_conn->con.shared_key, tcp_conn->con.last_packet + CRYPTO_PUBLIC_KEY_SIZE, plain,
-                                     sizeof(plain), tcp_conn->con.last_packet + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_NONCE_SIZE);
+    uint8_t handshake[TCP_CLIENT_HANDSHAKE_SIZE];
+    memcpy(handshake, tcp_conn->self_public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    random_nonce(handshake + CRYPTO_PUBLIC_KEY_SIZE);
+    int len = encrypt_data_symmetric(tcp_conn->con.shared_key, handshake + CRYPTO_PUBLIC_KEY_SIZE, plain,
+                                     sizeof(plain), handshake + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_NONCE_SIZE);
 
     if (len != sizeof(plain) + CRYPTO_MAC_SIZE) {
         return -1;
     }
 
-    tcp_conn->con.last_packet_length = CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_NONCE_SIZE + sizeof(plain) + CRYPTO_MAC_SIZE;
-    tcp_conn->con.last_packet_sent = 0;
+    if (!add_priority(&tcp_conn->con, handshake, sizeof(handshake), 0)) {
+        return -1;
+    }
+
     return 0;
 }
 
@@ -574,13 +608,25 @@ TCP_Client_Connection *new_TCP_connection(const Logger *logger, const Mono_Time
     switch (proxy_info->proxy_type) {
         case TCP_PROXY_HTTP: {
             temp->status = TCP_CLIENT_PROXY_HTTP_CONNECTING;
-            proxy_http_generate_connection_request(temp);
+
+            if (proxy_http_generate_connection_request(temp) == 0) {
+                kill_sock(sock);
+                free(temp);
+                return nullptr;
+            }
+
             break;
         }
 
         case TCP_PROXY_SOCKS5: {
             temp->status = TCP_CLIENT_PROXY_SOCKS5_CONNECTING;
-            proxy_socks5_generate_greetings(temp);
+
+            if (proxy_socks5_generate_greetings(temp) == 0) {
+                kill_sock(sock);
+                free(temp);
+                return nullptr;
+            }
+
             break;
         }
 
@@ -605,9 +651,9 @@ TCP_Client_Connection *new_TCP_connection(const Logger *logger, const Mono_Time
 /** return 0 on success
  * return -1 on failure
  */
-non_null(1, 2, 3) nullable(5)
-static int handle_TCP_client_packet(const Logger *logger, TCP_Client_Connection *conn, const uint8_t *data,
-                                    uint16_t length, void *userdata)
+non_null(1, 2, 3, 4) nullable(6)
+static int handle_TCP_client_packet(const Logger *logger, TCP_Client_Connection *conn, const Mono_Time *mono_time,
+                                    const uint8_t *data, uint16_t length, void *userdata)
 {
     if (length <= 1) {
         return -1;
@@ -717,6 +763,7 @@ static int handle_TCP_client_packet(const Logger *logger, TCP_Client_Connection
             if (ping_id) {
                 if (ping_id == conn->ping_id) {
                     conn->ping_id = 0;
+                    tcp_add_rtt_sample(conn, mono_time);
                 }
 
                 return 0;
@@ -761,11 +808,11 @@ static int handle_TCP_client_packet(const Logger *logger, TCP_Client_Connection
 }
 
 non_null(1, 2) nullable(3)
-static bool tcp_process_packet(const Logger *logger, TCP_Client_Connection *conn, void *userdata)
+static bool tcp_process_packet(const Logger *logger, TCP_Client_Connection *conn, const Mono_Time *mono_time,
+                               void *userdata)
 {
     uint8_t packet[MAX_PACKET_SIZE];
-    const int len = read_packet_TCP_secure_connection(logger, conn->con.sock, &conn->next_packet_length,
-                    conn->con.shared_key, conn->recv_nonce, packet, sizeof(packet), &conn->ip_port);
+    const int len = read_packet_TCP_secure_connection(logger, &conn->con, conn->recv_nonce, packet, sizeof(packet));
 
     if (len == 0) {
         return false;
@@ -776,7 +823,7 @@ static bool tcp_process_packet(const Logger *logger, TCP_Client_Connection *conn
         return false;
     }
 
-    if (handle_TCP_client_packet(logger, conn, packet, len, userdata) == -1) {
+    if (handle_TCP_client_packet(logger, conn, mono_time, packet, len, userdata) == -1) {
         conn->status = TCP_CLIENT_DISCONNECTED;
         return false;
     }
@@ -784,15 +831,17 @@ static bool tcp_process_packet(const Logger *logger, TCP_Client_Connection *conn
     return true;
 }
 
-non_null(1, 2, 3) nullable(4)
+non_null(1, 2, 3) nullable(5)
 static int do_confirmed_TCP(const Logger *logger, TCP_Client_Connection *conn, const Mono_Time *mono_time,
-                            void *userdata)
+                            bool readable, void *userdata)
 {
     send_pending_data(logger, &conn->con);
     tcp_send_ping_response(logger, conn);
     tcp_send_ping_request(logger, conn);
 
     if (mono_time_is_timeout(mono_time, conn->last_pinged, TCP_PING_FREQUENCY)) {
+        release_idle_buffers(&conn->con);
+
         uint64_t ping_id = random_u64();
 
         if (!ping_id) {
@@ -803,6 +852,7 @@ static int do_confirmed_TCP(const Logger *logger, TCP_Client_Connection *conn, c
         conn->ping_id = ping_id;
         tcp_send_ping_request(logger, conn);
         conn->last_pinged = mono_time_get(mono_time);
+        conn->rtt_start_ms = mono_time_get_ms(mono_time);
     }
 
     if (conn->ping_id && mono_time_is_timeout(mono_time, conn->last_pinged, TCP_PING_TIMEOUT)) {
@@ -810,7 +860,11 @@ static int do_confirmed_TCP(const Logger *logger, TCP_Client_Connection *conn, c
         return 0;
     }
 
-    while (tcp_process_packet(logger, conn, userdata)) {
+    if (!readable) {
+        return 0;
+    }
+
+    while (tcp_process_packet(logger, conn, mono_time, userdata)) {
         // Keep reading until error or out of data.
         continue;
     }
@@ -822,13 +876,19 @@ static int do_confirmed_TCP(const Logger *logger, TCP_Client_Connection *conn, c
  */
 void do_TCP_connection(const Logger *logger, const Mono_Time *mono_time,
                        TCP_Client_Connection *tcp_connection, void *userdata)
+{
+    do_TCP_connection_ready(logger, mono_time, tcp_connection, true, userdata);
+}
+
+void do_TCP_connection_ready(const Logger *logger, const Mono_Time *mono_time,
+                             TCP_Client_Connection *tcp_connection, bool readable, void *userdata)
 {
     if (tcp_connection->status == TCP_CLIENT_DISCONNECTED) {
         return;
     }
 
     if (tcp_connection->status == TCP_CLIENT_PROXY_HTTP_CONNECTING) {
-        if (send_pending_data(logger, &tcp_connection->con) == 0) {
+        if (send_pending_data(logger, &tcp_connection->con) == 0 && readable) {
             int ret = proxy_http_read_connection_response(logger, tcp_connection);
 
             if (ret == -1) {
@@ -844,7 +904,7 @@ void do_TCP_connection(const Logger *logger, const Mono_Time *mono_time,
     }
 
     if (tcp_connection->status == TCP_CLIENT_PROXY_SOCKS5_CONNECTING) {
-        if (send_pending_data(logger, &tcp_connection->con) == 0) {
+        if (send_pending_data(logger, &tcp_connection->con) == 0 && readable) {
             int ret = socks5_read_handshake_response(logger, tcp_connection);
 
             if (ret == -1) {
@@ -860,7 +920,7 @@ void do_TCP_connection(const Logger *logger, const Mono_Time *mono_time,
     }
 
     if (tcp_connection->status == TCP_CLIENT_PROXY_SOCKS5_UNCONFIRMED) {
-        if (send_pending_data(logger, &tcp_connection->con) == 0) {
+        if (send_pending_data(logger, &tcp_connection->con) == 0 && readable) {
             int ret = proxy_socks5_read_connection_response(logger, tcp_connection);
 
             if (ret == -1) {
@@ -878,15 +938,17 @@ void do_TCP_connection(const Logger *logger, const Mono_Time *mono_time,
     if (tcp_connection->status == TCP_CLIENT_CONNECTING) {
         if (send_pending_data(logger, &tcp_connection->con) == 0) {
             tcp_connection->status = TCP_CLIENT_UNCONFIRMED;
+            tcp_connection->rtt_start_ms = mono_time_get_ms(mono_time);
         }
     }
 
-    if (tcp_connection->status == TCP_CLIENT_UNCONFIRMED) {
+    if (tcp_connection->status == TCP_CLIENT_UNCONFIRMED && readable) {
         uint8_t data[TCP_SERVER_HANDSHAKE_SIZE];
         int len = read_TCP_packet(logger, tcp_connection->con.sock, data, sizeof(data), &tcp_connection->con.ip_port);
 
         if (sizeof(data) == len) {
             if (handle_handshake(tcp_connection, data) == 0) {
+                tcp_add_rtt_sample(tcp_connection, mono_time);
                 tcp_connection->kill_at = -1;
                 tcp_connection->status = TCP_CLIENT_CONFIRMED;
             } else {
@@ -897,7 +959,7 @@ void do_TCP_connection(const Logger *logger, const Mono_Time *mono_time,
     }
 
     if (tcp_connection->status == TCP_CLIENT_CONFIRMED) {
-        do_confirmed_TCP(logger, tcp_connection, mono_time, userdata);
+        do_confirmed_TCP(logger, tcp_connection, mono_time, readable, userdata);
     }
 
     if (tcp_connection->kill_at <= mono_time_get(mono_time)) {
@@ -913,7 +975,7 @@ void kill_TCP_connection(TCP_Client_Connection *tcp_connection)
         return;
     }
 
-    wipe_priority_list(tcp_connection->con.priority_queue_start);
+    wipe_connection_buffers(&tcp_connection->con);
     kill_sock(tcp_connection->con.sock);
     crypto_memzero(tcp_connection, sizeof(TCP_Client_Connection));
     free(tcp_connection);
@@ -43,6 +43,13 @@ const uint8_t *tcp_con_public_key(const TCP_Client_Connection *con);
 non_null()
 IP_Port tcp_con_ip_port(const TCP_Client_Connection *con);
 non_null()
+Socket tcp_con_sock(const TCP_Client_Connection *con);
+/** Return the smoothed round trip time to the relay in milliseconds, measured
+ * from the handshake and the pings, or 0 if not known yet.
+ */
+non_null()
+uint32_t tcp_con_rtt(const TCP_Client_Connection *con);
+non_null()
 TCP_Client_Status tcp_con_status(const TCP_Client_Connection *con);
 
 non_null()
@@ -67,6 +74,15 @@ non_null(1, 2, 3) nullable(4)
 void do_TCP_connection(const Logger *logger, const Mono_Time *mono_time,
                        TCP_Client_Connection *tcp_connection, void *userdata);
 
+/** Run the TCP connection like do_TCP_connection(), but only read from its
+ * socket if readable is true. Pings, timeouts and queued data are handled
+ * either way, so a caller that knows the socket has nothing to read can skip
+ * the recv calls.
+ */
+non_null(1, 2, 3) nullable(5)
+void do_TCP_connection_ready(const Logger *logger, const Mono_Time *mono_time,
+                             TCP_Client_Connection *tcp_connection, bool readable, void *userdata);
+
 /** Kill the TCP connection
  */
 nullable(1)
@@ -8,113 +8,144 @@
 #include <stdlib.h>
 #include <string.h>
 
-void wipe_priority_list(TCP_Priority_List *p)
+#include "util.h"
+
+/** A send queue that grew larger than this for a burst is freed once it
+ * drains, smaller ones are kept for the next frame.
+ */
+#define TCP_SEND_QUEUE_KEEP_SIZE (8 * (sizeof(uint16_t) + MAX_PACKET_SIZE))
+
+non_null()
+static void wipe_send_queue(TCP_Connection *con)
+{
+    free(con->send_queue);
+    con->send_queue = nullptr;
+    con->send_queue_size = 0;
+    con->send_queue_start = 0;
+    con->send_queue_length = 0;
+}
+
+non_null()
+static void wipe_recv_buffer(TCP_Connection *con)
+{
+    free(con->recv_buffer);
+    con->recv_buffer = nullptr;
+    con->recv_start = 0;
+    con->recv_end = 0;
+}
+
+void wipe_connection_buffers(TCP_Connection *con)
+{
+    wipe_send_queue(con);
+    wipe_recv_buffer(con);
+}
+
+void release_idle_buffers(TCP_Connection *con)
 {
-    while (p != nullptr) {
-        TCP_Priority_List *pp = p;
-        p = p->next;
-        free(pp->data);
-        free(pp);
+    if (con->buffers_used) {
+        con->buffers_used = false;
+        return;
+    }
+
+    if (con->send_queue_length == 0) {
+        wipe_send_queue(con);
+    }
+
+    if (con->recv_end == con->recv_start) {
+        wipe_recv_buffer(con);
     }
 }
 
 /** return 0 if pending data was sent completely
  * return -1 if it wasn't
  */
-int send_pending_data_nonpriority(const Logger *logger, TCP_Connection *con)
+int send_pending_data(const Logger *logger, TCP_Connection *con)
 {
-    if (con->last_packet_length == 0) {
+    if (con->send_queue_length == 0) {
         return 0;
     }
 
-    const uint16_t left = con->last_packet_length - con->last_packet_sent;
-    const int len = net_send(logger, con->sock, con->last_packet + con->last_packet_sent, left, &con->ip_port);
+    /* The queued bytes wrap around the end of the ring at most once. */
+    const uint32_t to_end = con->send_queue_size - con->send_queue_start;
+    const uint32_t first = min_u32(con->send_queue_length, to_end);
+    const int len = net_send_split(logger, con->sock, con->send_queue + con->send_queue_start, first,
+                                   con->send_queue, con->send_queue_length - first, &con->ip_port);
+
+    if (len > 0) {
+        con->send_queue_start = (con->send_queue_start + len) % con->send_queue_size;
+        con->send_queue_length -= len;
+    }
 
-    if (len <= 0) {
+    if (con->send_queue_length != 0) {
         return -1;
     }
 
-    if (len == left) {
-        con->last_packet_length = 0;
-        con->last_packet_sent = 0;
-        return 0;
+    con->send_queue_start = 0;
+
+    if (con->send_queue_size > TCP_SEND_QUEUE_KEEP_SIZE) {
+        wipe_send_queue(con);
     }
 
-    con->last_packet_sent += len;
-    return -1;
+    return 0;
 }
 
-/** return 0 if pending data was sent completely
- * return -1 if it wasn't
+/** Make room for `size` more bytes in the send queue, moving the queued bytes
+ * to the start of a bigger buffer if needed.
  */
-int send_pending_data(const Logger *logger, TCP_Connection *con)
+non_null()
+static bool reserve_send_queue(TCP_Connection *con, uint32_t size)
 {
-    /* finish sending current non-priority packet */
-    if (send_pending_data_nonpriority(logger, con) == -1) {
-        return -1;
+    if (con->send_queue_size - con->send_queue_length >= size) {
+        return true;
     }
 
-    TCP_Priority_List *p = con->priority_queue_start;
-
-    while (p) {
-        const uint16_t left = p->size - p->sent;
-        const int len = net_send(logger, con->sock, p->data + p->sent, left, &con->ip_port);
+    uint32_t new_size = max_u32(con->send_queue_size, sizeof(uint16_t) + MAX_PACKET_SIZE);
 
-        if (len != left) {
-            if (len > 0) {
-                p->sent += len;
-            }
-
-            break;
+    while (new_size - con->send_queue_length < size) {
+        if (new_size > UINT32_MAX / 2) {
+            return false;
         }
 
-        TCP_Priority_List *pp = p;
-        p = p->next;
-        free(pp->data);
-        free(pp);
+        new_size *= 2;
     }
 
-    con->priority_queue_start = p;
+    uint8_t *new_queue = (uint8_t *)malloc(new_size);
 
-    if (!p) {
-        con->priority_queue_end = nullptr;
-        return 0;
+    if (new_queue == nullptr) {
+        return false;
     }
 
-    return -1;
+    if (con->send_queue_length > 0) {
+        const uint32_t first = min_u32(con->send_queue_length, con->send_queue_size - con->send_queue_start);
+        memcpy(new_queue, con->send_queue + con->send_queue_start, first);
+        memcpy(new_queue + first, con->send_queue, con->send_queue_length - first);
+    }
+
+    free(con->send_queue);
+    con->send_queue = new_queue;
+    con->send_queue_size = new_size;
+    con->send_queue_start = 0;
+    return true;
 }
 
-/** return 0 on failure (only if calloc fails)
+/** return 0 on failure (only if malloc fails)
  * return 1 on success
  */
 bool add_priority(TCP_Connection *con, const uint8_t *packet, uint16_t size, uint16_t sent)
 {
-    TCP_Priority_List *p = con->priority_queue_end;
-    TCP_Priority_List *new_list = (TCP_Priority_List *)calloc(1, sizeof(TCP_Priority_List));
+    const uint16_t left = size - sent;
 
-    if (new_list == nullptr) {
+    if (!reserve_send_queue(con, left)) {
         return false;
     }
 
-    new_list->next = nullptr;
-    new_list->size = size;
-    new_list->sent = sent;
-    new_list->data = (uint8_t *)malloc(size);
+    con->buffers_used = true;
 
-    if (new_list->data == nullptr) {
-        free(new_list);
-        return false;
-    }
-
-    memcpy(new_list->data, packet, size);
-
-    if (p) {
-        p->next = new_list;
-    } else {
-        con->priority_queue_start = new_list;
-    }
-
-    con->priority_queue_end = new_list;
+    const uint32_t end = (con->send_queue_start + con->send_queue_length) % con->send_queue_size;
+    const uint32_t first = min_u32(left, con->send_queue_size - end);
+    memcpy(con->send_queue + end, packet + sent, first);
+    memcpy(con->send_queue, packet + sent + first, left - first);
+    con->send_queue_length += left;
     return true;
 }
 
@@ -155,20 +186,12 @@ int write_packet_TCP_secure_connection(const Logger *logger, TCP_Connection *con
         if (len <= 0) {
             len = 0;
         }
+    } else {
+        len = net_send(logger, con->sock, packet, SIZEOF_VLA(packet), &con->ip_port);
 
-        increment_nonce(con->sent_nonce);
-
-        if ((unsigned int)len == SIZEOF_VLA(packet)) {
-            return 1;
+        if (len <= 0) {
+            return 0;
         }
-
-        return add_priority(con, packet, SIZEOF_VLA(packet), len);
-    }
-
-    len = net_send(logger, con->sock, packet, SIZEOF_VLA(packet), &con->ip_port);
-
-    if (len <= 0) {
-        return 0;
     }
 
     increment_nonce(con->sent_nonce);
@@ -177,9 +200,11 @@ int write_packet_TCP_secure_connection(const Logger *logger, TCP_Connection *con
         return 1;
     }
 
-    memcpy(con->last_packet, packet, SIZEOF_VLA(packet));
-    con->last_packet_length = SIZEOF_VLA(packet);
-    con->last_packet_sent = len;
+    /* The rest of the packet must follow on the stream, or the connection is broken. */
+    if (!add_priority(con, packet, SIZEOF_VLA(packet), len)) {
+        return -1;
+    }
+
     return 1;
 }
 
@@ -207,82 +232,112 @@ int read_TCP_packet(const Logger *logger, Socket sock, uint8_t *data, uint16_t l
     return len;
 }
 
-/** Read the next two bytes in TCP stream then convert them to
- * length (host byte order).
+/** Fill the free space of the receive buffer with one recv call.
  *
- * return length on success
- * return 0 if nothing has been read from socket.
- * return -1 on failure.
+ * The buffer is allocated on the first read and kept until
+ * release_idle_buffers() finds the connection idle.
+ *
+ * return number of bytes read.
+ * return 0 if the socket had no data.
+ * return -1 if the connection was closed by the other side or on allocation
+ *   failure.
  */
 non_null()
-static uint16_t read_TCP_length(const Logger *logger, Socket sock, const IP_Port *ip_port)
+static int fill_recv_buffer(const Logger *logger, TCP_Connection *con)
 {
-    const uint16_t count = net_socket_data_recv_buffer(sock);
-
-    if (count >= sizeof(uint16_t)) {
-        uint8_t length_buf[sizeof(uint16_t)];
-        const int len = net_recv(logger, sock, length_buf, sizeof(length_buf), ip_port);
+    if (con->recv_buffer == nullptr) {
+        con->recv_buffer = (uint8_t *)malloc(TCP_RECV_BUFFER_SIZE);
 
-        if (len != sizeof(uint16_t)) {
-            LOGGER_ERROR(logger, "FAIL recv packet");
-            return 0;
+        if (con->recv_buffer == nullptr) {
+            return -1;
         }
+    } else if (con->recv_start != 0) {
+        memmove(con->recv_buffer, con->recv_buffer + con->recv_start, con->recv_end - con->recv_start);
+        con->recv_end -= con->recv_start;
+        con->recv_start = 0;
+    }
 
-        uint16_t length;
-        net_unpack_u16(length_buf, &length);
+    const int len = net_recv(logger, con->sock, con->recv_buffer + con->recv_end, TCP_RECV_BUFFER_SIZE - con->recv_end,
+                             &con->ip_port);
 
-        if (length > MAX_PACKET_SIZE) {
-            LOGGER_WARNING(logger, "TCP packet too large: %d > %d", length, MAX_PACKET_SIZE);
-            return -1;
-        }
+    if (len == 0) {
+        LOGGER_TRACE(logger, "connection closed by peer");
+        return -1;
+    }
 
-        return length;
+    if (len < 0) {
+        return 0;
     }
 
-    return 0;
+    con->buffers_used = true;
+    con->recv_end += len;
+    return len;
+}
+
+/** return length of the next frame if the receive buffer holds all of it.
+ * return 0 if it doesn't.
+ * return -1 if the frame is too large.
+ */
+non_null()
+static int buffered_frame_length(const Logger *logger, const TCP_Connection *con)
+{
+    const uint16_t buffered = con->recv_end - con->recv_start;
+
+    if (buffered < sizeof(uint16_t)) {
+        /* Also covers a connection without a receive buffer. */
+        return 0;
+    }
+
+    uint16_t length;
+    net_unpack_u16(con->recv_buffer + con->recv_start, &length);
+
+    if (length > MAX_PACKET_SIZE) {
+        LOGGER_WARNING(logger, "TCP packet too large: %d > %d", length, MAX_PACKET_SIZE);
+        return -1;
+    }
+
+    if (buffered < sizeof(uint16_t) + length) {
+        return 0;
+    }
+
+    return length;
 }
 
 /** return length of received packet on success.
  * return 0 if could not read any packet.
  * return -1 on failure (connection must be killed).
  */
-int read_packet_TCP_secure_connection(const Logger *logger, Socket sock, uint16_t *next_packet_length,
-                                      const uint8_t *shared_key, uint8_t *recv_nonce, uint8_t *data,
-                                      uint16_t max_len, const IP_Port *ip_port)
+int read_packet_TCP_secure_connection(const Logger *logger, TCP_Connection *con, uint8_t *recv_nonce, uint8_t *data,
+                                      uint16_t max_len)
 {
-    if (*next_packet_length == 0) {
-        const uint16_t len = read_TCP_length(logger, sock, ip_port);
+    int length = buffered_frame_length(logger, con);
 
-        if (len == (uint16_t) -1) {
-            return -1;
-        }
+    if (length == 0) {
+        const int ret = fill_recv_buffer(logger, con);
 
-        if (len == 0) {
-            return 0;
+        if (ret <= 0) {
+            return ret;
         }
 
-        *next_packet_length = len;
+        length = buffered_frame_length(logger, con);
     }
 
-    if (max_len + CRYPTO_MAC_SIZE < *next_packet_length) {
-        LOGGER_DEBUG(logger, "packet too large");
-        return -1;
+    if (length <= 0) {
+        return length;
     }
 
-    VLA(uint8_t, data_encrypted, *next_packet_length);
-    const int len_packet = read_TCP_packet(logger, sock, data_encrypted, *next_packet_length, ip_port);
-
-    if (len_packet != *next_packet_length) {
-        LOGGER_WARNING(logger, "invalid packet length: %d, expected %d", len_packet, *next_packet_length);
-        return 0;
+    if (max_len + CRYPTO_MAC_SIZE < length) {
+        LOGGER_DEBUG(logger, "packet too large");
+        return -1;
     }
 
-    *next_packet_length = 0;
+    const uint8_t *data_encrypted = con->recv_buffer + con->recv_start + sizeof(uint16_t);
+    con->recv_start += sizeof(uint16_t) + length;
 
-    const int len = decrypt_data_symmetric(shared_key, recv_nonce, data_encrypted, len_packet, data);
+    const int len = decrypt_data_symmetric(con->shared_key, recv_nonce, data_encrypted, length, data);
 
-    if (len + CRYPTO_MAC_SIZE != len_packet) {
-        LOGGER_WARNING(logger, "decrypted length %d does not match expected length %d", len + CRYPTO_MAC_SIZE, len_packet);
+    if (len + CRYPTO_MAC_SIZE != length) {
+        LOGGER_WARNING(logger, "decrypted length %d does not match expected length %d", len + CRYPTO_MAC_SIZE, length);
         return -1;
     }
 
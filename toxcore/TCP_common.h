@@ -9,16 +9,9 @@
 #include "crypto_core.h"
 #include "network.h"
 
-typedef struct TCP_Priority_List TCP_Priority_List;
-struct TCP_Priority_List {
-    TCP_Priority_List *next;
-    uint16_t size;
-    uint16_t sent;
-    uint8_t *data;
-};
-
-nullable(1)
-void wipe_priority_list(TCP_Priority_List *p);
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 #define NUM_RESERVED_PORTS 16
 #define NUM_CLIENT_CONNECTIONS (256 - NUM_RESERVED_PORTS)
@@ -45,24 +38,46 @@ void wipe_priority_list(TCP_Priority_List *p);
 
 #define MAX_PACKET_SIZE 2048
 
+/** Size of the receive buffer of a connection. It holds at least one whole
+ * frame (length and packet) so that a full buffer always has one to parse.
+ */
+#define TCP_RECV_BUFFER_SIZE (2 * (sizeof(uint16_t) + MAX_PACKET_SIZE))
+
 typedef struct TCP_Connection {
     Socket sock;
     IP_Port ip_port;  // for debugging.
     uint8_t sent_nonce[CRYPTO_NONCE_SIZE]; /* Nonce of sent packets. */
     uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
-    uint8_t last_packet[2 + MAX_PACKET_SIZE];
-    uint16_t last_packet_length;
-    uint16_t last_packet_sent;
 
-    TCP_Priority_List *priority_queue_start;
-    TCP_Priority_List *priority_queue_end;
+    /* Bytes waiting to be sent: send_queue_length bytes from send_queue_start
+     * in a ring of send_queue_size bytes. Allocated on the first frame that
+     * could not be sent right away. */
+    uint8_t *send_queue;
+    uint32_t send_queue_size;
+    uint32_t send_queue_start;
+    uint32_t send_queue_length;
+
+    /* Received bytes not parsed into packets yet are in [recv_start, recv_end)
+     * of a TCP_RECV_BUFFER_SIZE buffer. Allocated on the first read. */
+    uint8_t *recv_buffer;
+    uint16_t recv_start;
+    uint16_t recv_end;
+
+    /* Set when data went through the buffers since the last call of
+     * release_idle_buffers(). */
+    bool buffers_used;
 } TCP_Connection;
 
-/** return 0 if pending data was sent completely
- * return -1 if it wasn't
+/** Free the send queue and receive buffer of the connection. */
+non_null()
+void wipe_connection_buffers(TCP_Connection *con);
+
+/** Free the empty buffers of a connection that did not use them since the
+ * previous call. Called about once per ping interval, so a connection keeps
+ * its buffers while it is active and gives them up when it goes idle.
  */
 non_null()
-int send_pending_data_nonpriority(const Logger *logger, TCP_Connection *con);
+void release_idle_buffers(TCP_Connection *con);
 
 /** return 0 if pending data was sent completely
  * return -1 if it wasn't
@@ -70,7 +85,9 @@ int send_pending_data_nonpriority(const Logger *logger, TCP_Connection *con);
 non_null()
 int send_pending_data(const Logger *logger, TCP_Connection *con);
 
-/** return 0 on failure (only if calloc fails)
+/** Queue the unsent part of a packet behind the pending data.
+ *
+ * return 0 on failure (only if malloc fails)
  * return 1 on success
  */
 non_null()
@@ -92,13 +109,21 @@ int write_packet_TCP_secure_connection(const Logger *logger, TCP_Connection *con
 non_null()
 int read_TCP_packet(const Logger *logger, Socket sock, uint8_t *data, uint16_t length, const IP_Port *ip_port);
 
-/** return length of received packet on success.
+/** Read the next packet of the connection.
+ *
+ * Reads as much as the socket has into the receive buffer with a single recv
+ * call and returns the buffered packets one by one before reading again.
+ *
+ * return length of received packet on success.
  * return 0 if could not read any packet.
  * return -1 on failure (connection must be killed).
  */
 non_null()
-int read_packet_TCP_secure_connection(const Logger *logger, Socket sock, uint16_t *next_packet_length,
-                                      const uint8_t *shared_key, uint8_t *recv_nonce, uint8_t *data,
-                                      uint16_t max_len, const IP_Port *ip_port);
+int read_packet_TCP_secure_connection(const Logger *logger, TCP_Connection *con, uint8_t *recv_nonce, uint8_t *data,
+                                      uint16_t max_len);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
 
 #endif
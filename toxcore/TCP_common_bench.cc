@@ -0,0 +1,83 @@
+#include <benchmark/benchmark.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <array>
+#include <vector>
+
+#include "TCP_common.h"
+#include "logger.h"
+
+namespace {
+
+/** Reads frames of range(0) bytes that arrive range(1) at a time, as a relay
+ * sees them from a client sending a file.
+ */
+void BM_ReadPacketTCPSecureConnection(benchmark::State &state) {
+  const uint16_t length = state.range(0);
+  const uint32_t burst = state.range(1);
+
+  int fds[2];
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0 || fcntl(fds[0], F_SETFL, O_NONBLOCK) != 0) {
+    state.SkipWithError("socketpair failed");
+    return;
+  }
+
+  Logger *logger = logger_new();
+  TCP_Connection con{};
+  con.sock.socket = fds[0];
+  new_symmetric_key(con.shared_key);
+  std::array<uint8_t, CRYPTO_NONCE_SIZE> send_nonce;
+  random_nonce(send_nonce.data());
+  std::array<uint8_t, CRYPTO_NONCE_SIZE> recv_nonce = send_nonce;
+
+  // The same bytes are written every time, so the frames are encrypted once
+  // with consecutive nonces and the receiving nonce is reset each round.
+  const std::vector<uint8_t> plain(length, 1);
+  std::vector<uint8_t> stream;
+
+  for (uint32_t i = 0; i < burst; ++i) {
+    std::vector<uint8_t> frame(sizeof(uint16_t) + length + CRYPTO_MAC_SIZE);
+    net_pack_u16(frame.data(), length + CRYPTO_MAC_SIZE);
+    encrypt_data_symmetric(con.shared_key, send_nonce.data(), plain.data(), length, frame.data() + sizeof(uint16_t));
+    increment_nonce(send_nonce.data());
+    stream.insert(stream.end(), frame.begin(), frame.end());
+  }
+
+  std::array<uint8_t, MAX_PACKET_SIZE> packet;
+
+  for (auto _ : state) {
+    if (write(fds[1], stream.data(), stream.size()) != static_cast<ssize_t>(stream.size())) {
+      state.SkipWithError("write failed");
+      break;
+    }
+
+    std::array<uint8_t, CRYPTO_NONCE_SIZE> nonce = recv_nonce;
+    uint32_t received = 0;
+
+    while (received < burst &&
+           read_packet_TCP_secure_connection(logger, &con, nonce.data(), packet.data(), packet.size()) == length) {
+      ++received;
+    }
+
+    if (received != burst) {
+      state.SkipWithError("read failed");
+      break;
+    }
+  }
+
+  state.SetItemsProcessed(state.iterations() * burst);
+
+  wipe_connection_buffers(&con);
+  close(fds[0]);
+  close(fds[1]);
+  logger_kill(logger);
+}
+BENCHMARK(BM_ReadPacketTCPSecureConnection)->ArgsProduct({{100, 1024}, {1, 16}});
+
+}  // namespace
+#endif  // _WIN32
@@ -0,0 +1,208 @@
+#include "TCP_common.h"
+
+#include <gtest/gtest.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <array>
+#include <cstring>
+#include <vector>
+
+#include "logger.h"
+
+namespace {
+
+class TcpFraming : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds_), 0);
+    ASSERT_EQ(fcntl(fds_[0], F_SETFL, O_NONBLOCK), 0);
+
+    logger_ = logger_new();
+    con_.sock.socket = fds_[0];
+    new_symmetric_key(con_.shared_key);
+    random_nonce(send_nonce_.data());
+    recv_nonce_ = send_nonce_;
+  }
+
+  void TearDown() override {
+    wipe_connection_buffers(&writer_);
+    wipe_connection_buffers(&con_);
+    close(fds_[0]);
+
+    if (fds_[1] != -1) {
+      close(fds_[1]);
+    }
+
+    logger_kill(logger_);
+  }
+
+  /** Append an encrypted frame holding `length` bytes of `fill` to `stream`. */
+  void add_frame(std::vector<uint8_t> &stream, uint16_t length, uint8_t fill) {
+    std::vector<uint8_t> plain(length, fill);
+    std::vector<uint8_t> frame(sizeof(uint16_t) + length + CRYPTO_MAC_SIZE);
+    net_pack_u16(frame.data(), length + CRYPTO_MAC_SIZE);
+    ASSERT_EQ(encrypt_data_symmetric(con_.shared_key, send_nonce_.data(), plain.data(), length,
+                                     frame.data() + sizeof(uint16_t)),
+              length + CRYPTO_MAC_SIZE);
+    increment_nonce(send_nonce_.data());
+    stream.insert(stream.end(), frame.begin(), frame.end());
+  }
+
+  void send_bytes(const uint8_t *data, size_t length) {
+    ASSERT_EQ(write(fds_[1], data, length), static_cast<ssize_t>(length));
+  }
+
+  int read_packet() {
+    return read_packet_TCP_secure_connection(logger_, &con_, recv_nonce_.data(), packet_.data(),
+                                             packet_.size());
+  }
+
+  int fds_[2] = {-1, -1};
+  Logger *logger_ = nullptr;
+  TCP_Connection con_{};
+  TCP_Connection writer_{};
+  std::array<uint8_t, CRYPTO_NONCE_SIZE> send_nonce_;
+  std::array<uint8_t, CRYPTO_NONCE_SIZE> recv_nonce_;
+  std::array<uint8_t, MAX_PACKET_SIZE> packet_;
+};
+
+TEST_F(TcpFraming, ReturnsZeroWithoutData) { EXPECT_EQ(read_packet(), 0); }
+
+TEST_F(TcpFraming, ParsesManyFramesFromOneWrite) {
+  std::vector<uint8_t> stream;
+
+  for (uint8_t i = 1; i <= 20; ++i) {
+    add_frame(stream, 100 + i, i);
+  }
+
+  send_bytes(stream.data(), stream.size());
+
+  for (uint8_t i = 1; i <= 20; ++i) {
+    ASSERT_EQ(read_packet(), 100 + i);
+    EXPECT_EQ(packet_[0], i);
+    EXPECT_EQ(packet_[99 + i], i);
+  }
+
+  EXPECT_EQ(read_packet(), 0);
+}
+
+TEST_F(TcpFraming, KeepsBuffersUntilIdle) {
+  std::vector<uint8_t> first;
+  std::vector<uint8_t> second;
+  add_frame(first, 100, 1);
+  add_frame(second, 100, 2);
+  send_bytes(first.data(), first.size());
+
+  ASSERT_EQ(read_packet(), 100);
+  EXPECT_EQ(read_packet(), 0);
+  ASSERT_NE(con_.recv_buffer, nullptr);
+
+  // Data arrived since the last check, so the buffer stays.
+  release_idle_buffers(&con_);
+  EXPECT_NE(con_.recv_buffer, nullptr);
+
+  // Half a frame is buffered, so the buffer stays even when idle.
+  send_bytes(second.data(), 1);
+  EXPECT_EQ(read_packet(), 0);
+  release_idle_buffers(&con_);
+  release_idle_buffers(&con_);
+  EXPECT_NE(con_.recv_buffer, nullptr);
+
+  send_bytes(second.data() + 1, second.size() - 1);
+  ASSERT_EQ(read_packet(), 100);
+  EXPECT_EQ(packet_[99], 2);
+  release_idle_buffers(&con_);
+  release_idle_buffers(&con_);
+  EXPECT_EQ(con_.recv_buffer, nullptr);
+}
+
+TEST_F(TcpFraming, WaitsForTheRestOfASplitFrame) {
+  std::vector<uint8_t> stream;
+  add_frame(stream, 500, 7);
+  add_frame(stream, MAX_PACKET_SIZE - CRYPTO_MAC_SIZE, 8);
+
+  send_bytes(stream.data(), 1);
+  EXPECT_EQ(read_packet(), 0);
+  send_bytes(stream.data() + 1, 300);
+  EXPECT_EQ(read_packet(), 0);
+  send_bytes(stream.data() + 301, stream.size() - 302);
+  ASSERT_EQ(read_packet(), 500);
+  EXPECT_EQ(packet_[499], 7);
+  EXPECT_EQ(read_packet(), 0);
+  send_bytes(stream.data() + stream.size() - 1, 1);
+  ASSERT_EQ(read_packet(), MAX_PACKET_SIZE - CRYPTO_MAC_SIZE);
+  EXPECT_EQ(packet_[MAX_PACKET_SIZE - CRYPTO_MAC_SIZE - 1], 8);
+}
+
+TEST_F(TcpFraming, FailsOnOversizedFrame) {
+  uint8_t length[sizeof(uint16_t)];
+  net_pack_u16(length, MAX_PACKET_SIZE + 1);
+  send_bytes(length, sizeof(length));
+  EXPECT_EQ(read_packet(), -1);
+}
+
+TEST_F(TcpFraming, FailsOnBadMac) {
+  std::vector<uint8_t> stream;
+  add_frame(stream, 50, 1);
+  stream.back() ^= 1;
+  send_bytes(stream.data(), stream.size());
+  EXPECT_EQ(read_packet(), -1);
+}
+
+TEST_F(TcpFraming, FailsWhenPeerClosesConnection) {
+  std::vector<uint8_t> stream;
+  add_frame(stream, 50, 1);
+  send_bytes(stream.data(), stream.size());
+  close(fds_[1]);
+  fds_[1] = -1;
+
+  EXPECT_EQ(read_packet(), 50);
+  EXPECT_EQ(read_packet(), -1);
+}
+
+TEST_F(TcpFraming, QueuedPacketsArriveInOrder) {
+  ASSERT_EQ(fcntl(fds_[1], F_SETFL, O_NONBLOCK), 0);
+  writer_.sock.socket = fds_[1];
+  memcpy(writer_.shared_key, con_.shared_key, sizeof(writer_.shared_key));
+  memcpy(writer_.sent_nonce, send_nonce_.data(), send_nonce_.size());
+
+  constexpr uint16_t kNumPackets = 1000;
+  std::array<uint8_t, 1500> data{};
+
+  for (uint16_t i = 0; i < kNumPackets; ++i) {
+    data[0] = i & 0xff;
+    data[1] = i >> 8;
+    ASSERT_EQ(write_packet_TCP_secure_connection(logger_, &writer_, data.data(), data.size(), true), 1);
+  }
+
+  // The socket buffer can't hold all of it, so some went into the queue.
+  ASSERT_NE(writer_.send_queue_length, 0);
+  EXPECT_EQ(write_packet_TCP_secure_connection(logger_, &writer_, data.data(), data.size(), false), 0);
+
+  uint16_t received = 0;
+
+  while (received < kNumPackets) {
+    const int len = read_packet();
+
+    if (len == 0) {
+      send_pending_data(logger_, &writer_);
+      continue;
+    }
+
+    ASSERT_EQ(len, data.size());
+    EXPECT_EQ(packet_[0], received & 0xff);
+    EXPECT_EQ(packet_[1], received >> 8);
+    ++received;
+  }
+
+  EXPECT_EQ(send_pending_data(logger_, &writer_), 0);
+  EXPECT_EQ(writer_.send_queue_length, 0);
+  EXPECT_EQ(writer_.send_queue, nullptr);
+}
+
+}  // namespace
+#endif  // _WIN32
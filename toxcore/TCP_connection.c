@@ -12,6 +12,11 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef TCP_CONNECTION_USE_EPOLL
+#include <sys/epoll.h>
+#include <unistd.h>
+#endif
+
 #include "TCP_client.h"
 #include "mono_time.h"
 #include "util.h"
@@ -43,6 +48,11 @@ struct TCP_Connections {
 
     bool onion_status;
     uint16_t onion_num_conns;
+
+#ifdef TCP_CONNECTION_USE_EPOLL
+    int efd; /* Watches the sockets of all relay connections, tagged with their tcp_connections_number. */
+    uint32_t num_watched; /* Number of sockets in efd, up to two per relay connection. */
+#endif
 };
 
 
@@ -275,6 +285,111 @@ static TCP_con *get_tcp_connection(const TCP_Connections *tcp_c, int tcp_connect
     return &tcp_c->tcp_connections[tcp_connections_number];
 }
 
+/** Start watching the socket of a client connection of the relay connection for data.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+non_null()
+static int watch_tcp_client(TCP_Connections *tcp_c, int tcp_connections_number,
+                            const TCP_Client_Connection *client)
+{
+#ifdef TCP_CONNECTION_USE_EPOLL
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = (uint32_t)tcp_connections_number;
+
+    if (epoll_ctl(tcp_c->efd, EPOLL_CTL_ADD, tcp_con_sock(client).socket, &ev) == -1) {
+        LOGGER_ERROR(tcp_c->logger, "epoll_ctl failed to add TCP relay connection %d", tcp_connections_number);
+        return -1;
+    }
+
+    ++tcp_c->num_watched;
+#endif
+    return 0;
+}
+
+/** Stop watching the socket of the client connection and kill it. */
+non_null(1) nullable(2)
+static void unwatch_and_kill_tcp_client(TCP_Connections *tcp_c, TCP_Client_Connection *client)
+{
+#ifdef TCP_CONNECTION_USE_EPOLL
+
+    if (client != nullptr) {
+        struct epoll_event ev;
+        epoll_ctl(tcp_c->efd, EPOLL_CTL_DEL, tcp_con_sock(client).socket, &ev);
+        --tcp_c->num_watched;
+    }
+
+#endif
+    kill_TCP_connection(client);
+}
+
+/** Kill the client connections of the relay connection, if it has any. */
+non_null()
+static void kill_tcp_client(TCP_Connections *tcp_c, TCP_con *tcp_con)
+{
+    unwatch_and_kill_tcp_client(tcp_c, tcp_con->connection);
+    tcp_con->connection = nullptr;
+    unwatch_and_kill_tcp_client(tcp_c, tcp_con->alt_connection);
+    tcp_con->alt_connection = nullptr;
+}
+
+/** Open a client connection to the relay and start watching it.
+ *
+ * return the connection on success.
+ * return NULL on failure.
+ */
+non_null()
+static TCP_Client_Connection *connect_tcp_client(TCP_Connections *tcp_c, int tcp_connections_number,
+        const IP_Port *ip_port, const uint8_t *relay_pk)
+{
+    TCP_Client_Connection *client = new_TCP_connection(tcp_c->logger, tcp_c->mono_time, ip_port, relay_pk,
+                                    tcp_c->self_public_key, tcp_c->self_secret_key, &tcp_c->proxy_info);
+
+    if (client == nullptr) {
+        return nullptr;
+    }
+
+    if (watch_tcp_client(tcp_c, tcp_connections_number, client) == -1) {
+        kill_TCP_connection(client);
+        return nullptr;
+    }
+
+    return client;
+}
+
+/** Start connecting the relay connection to the relay.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+non_null()
+static int connect_tcp_relay(TCP_Connections *tcp_c, int tcp_connections_number, const IP_Port *ip_port,
+                             const uint8_t *relay_pk)
+{
+    TCP_con *tcp_con = &tcp_c->tcp_connections[tcp_connections_number];
+    tcp_con->connection = connect_tcp_client(tcp_c, tcp_connections_number, ip_port, relay_pk);
+
+    if (tcp_con->connection == nullptr) {
+        return -1;
+    }
+
+    tcp_con->connect_start = mono_time_get_ms(tcp_c->mono_time);
+    tcp_con->alt_tried = false;
+    return 0;
+}
+
+/** Return the round trip time of the relay connection for ordering relays,
+ * UINT32_MAX if it is unknown.
+ */
+non_null()
+static uint32_t tcp_con_rtt_order(const TCP_con *tcp_con)
+{
+    const uint32_t rtt = tcp_con_rtt(tcp_con->connection);
+    return rtt == 0 ? UINT32_MAX : rtt;
+}
+
 /** Returns the number of connected TCP relays */
 uint32_t tcp_connected_relays_count(const TCP_Connections *tcp_c)
 {
@@ -314,30 +429,46 @@ int send_packet_tcp_connection(const TCP_Connections *tcp_c, int connections_num
     int ret = -1;
 
     bool limit_reached = 0;
+    bool tried[MAX_FRIEND_TCP_CONNECTIONS] = {false};
 
-    for (unsigned int i = 0; i < MAX_FRIEND_TCP_CONNECTIONS; ++i) {
-        uint32_t tcp_con_num = con_to->connections[i].tcp_connection;
-        uint8_t status = con_to->connections[i].status;
-        uint8_t connection_id = con_to->connections[i].connection_id;
+    /* Try the online relays from the lowest round trip time up. */
+    while (true) {
+        const TCP_con *best_con = nullptr;
+        unsigned int best = 0;
 
-        if (tcp_con_num && status == TCP_CONNECTIONS_STATUS_ONLINE) {
-            tcp_con_num -= 1;
-            TCP_con *tcp_con = get_tcp_connection(tcp_c, tcp_con_num);
+        for (unsigned int i = 0; i < MAX_FRIEND_TCP_CONNECTIONS; ++i) {
+            const uint32_t tcp_con_num = con_to->connections[i].tcp_connection;
 
-            if (!tcp_con) {
+            if (tried[i] || !tcp_con_num || con_to->connections[i].status != TCP_CONNECTIONS_STATUS_ONLINE) {
                 continue;
             }
 
-            ret = send_data(tcp_c->logger, tcp_con->connection, connection_id, packet, length);
+            const TCP_con *tcp_con = get_tcp_connection(tcp_c, tcp_con_num - 1);
 
-            if (ret == 0) {
-                limit_reached = 1;
+            if (tcp_con == nullptr) {
+                continue;
             }
 
-            if (ret == 1) {
-                break;
+            if (best_con == nullptr || tcp_con_rtt_order(tcp_con) < tcp_con_rtt_order(best_con)) {
+                best_con = tcp_con;
+                best = i;
             }
         }
+
+        if (best_con == nullptr) {
+            break;
+        }
+
+        tried[best] = true;
+        ret = send_data(tcp_c->logger, best_con->connection, con_to->connections[best].connection_id, packet, length);
+
+        if (ret == 0) {
+            limit_reached = 1;
+        }
+
+        if (ret == 1) {
+            break;
+        }
     }
 
     if (ret == 1) {
@@ -376,7 +507,8 @@ int send_packet_tcp_connection(const TCP_Connections *tcp_c, int connections_num
     return -1;
 }
 
-/** Return a random TCP connection number for use in send_tcp_onion_request.
+/** Return the number of the connected onion TCP relay with the lowest round
+ * trip time for use in send_tcp_onion_request.
  *
  * TODO(irungentoo): This number is just the index of an array that the elements
  * can change without warning.
@@ -384,19 +516,25 @@ int send_packet_tcp_connection(const TCP_Connections *tcp_c, int connections_num
  * return TCP connection number on success.
  * return -1 on failure.
  */
-int get_random_tcp_onion_conn_number(const TCP_Connections *tcp_c)
+int get_fastest_tcp_onion_conn_number(const TCP_Connections *tcp_c)
 {
     const uint32_t r = random_u32();
+    int best = -1;
 
     for (uint32_t i = 0; i < tcp_c->tcp_connections_length; ++i) {
-        uint32_t index = (i + r) % tcp_c->tcp_connections_length;
+        const uint32_t index = (i + r) % tcp_c->tcp_connections_length;
+        const TCP_con *tcp_con = &tcp_c->tcp_connections[index];
+
+        if (!tcp_con->onion || tcp_con->status != TCP_CONN_CONNECTED) {
+            continue;
+        }
 
-        if (tcp_c->tcp_connections[index].onion && tcp_c->tcp_connections[index].status == TCP_CONN_CONNECTED) {
-            return index;
+        if (best == -1 || tcp_con_rtt_order(tcp_con) < tcp_con_rtt_order(&tcp_c->tcp_connections[best])) {
+            best = index;
         }
     }
 
-    return -1;
+    return best;
 }
 
 /** Send an onion packet via the TCP relay corresponding to tcp_connections_number.
@@ -795,7 +933,7 @@ int kill_tcp_relay_connection(TCP_Connections *tcp_c, int tcp_connections_number
         --tcp_c->onion_num_conns;
     }
 
-    kill_TCP_connection(tcp_con->connection);
+    kill_tcp_client(tcp_c, tcp_con);
 
     return wipe_tcp_connection(tcp_c, tcp_connections_number);
 }
@@ -816,11 +954,9 @@ static int reconnect_tcp_relay_connection(TCP_Connections *tcp_c, int tcp_connec
     IP_Port ip_port = tcp_con_ip_port(tcp_con->connection);
     uint8_t relay_pk[CRYPTO_PUBLIC_KEY_SIZE];
     memcpy(relay_pk, tcp_con_public_key(tcp_con->connection), CRYPTO_PUBLIC_KEY_SIZE);
-    kill_TCP_connection(tcp_con->connection);
-    tcp_con->connection = new_TCP_connection(tcp_c->logger, tcp_c->mono_time, &ip_port, relay_pk, tcp_c->self_public_key,
-                          tcp_c->self_secret_key, &tcp_c->proxy_info);
+    kill_tcp_client(tcp_c, tcp_con);
 
-    if (!tcp_con->connection) {
+    if (connect_tcp_relay(tcp_c, tcp_connections_number, &ip_port, relay_pk) == -1) {
         kill_tcp_relay_connection(tcp_c, tcp_connections_number);
         return -1;
     }
@@ -867,8 +1003,7 @@ static int sleep_tcp_relay_connection(TCP_Connections *tcp_c, int tcp_connection
     tcp_con->ip_port = tcp_con_ip_port(tcp_con->connection);
     memcpy(tcp_con->relay_pk, tcp_con_public_key(tcp_con->connection), CRYPTO_PUBLIC_KEY_SIZE);
 
-    kill_TCP_connection(tcp_con->connection);
-    tcp_con->connection = nullptr;
+    kill_tcp_client(tcp_c, tcp_con);
 
     for (unsigned int i = 0; i < tcp_c->connections_length; ++i) {
         TCP_Connection_to *con_to = get_connection(tcp_c, i);
@@ -905,10 +1040,7 @@ static int unsleep_tcp_relay_connection(TCP_Connections *tcp_c, int tcp_connecti
         return -1;
     }
 
-    tcp_con->connection = new_TCP_connection(tcp_c->logger, tcp_c->mono_time, &tcp_con->ip_port, tcp_con->relay_pk,
-                          tcp_c->self_public_key, tcp_c->self_secret_key, &tcp_c->proxy_info);
-
-    if (!tcp_con->connection) {
+    if (connect_tcp_relay(tcp_c, tcp_connections_number, &tcp_con->ip_port, tcp_con->relay_pk) == -1) {
         kill_tcp_relay_connection(tcp_c, tcp_connections_number);
         return -1;
     }
@@ -1165,18 +1297,28 @@ static int tcp_relay_on_online(TCP_Connections *tcp_c, int tcp_connections_numbe
     return 0;
 }
 
+/** Turn the TCP family of a relay address into the IP family.
+ *
+ * return true if the address is an IPv4 or IPv6 address.
+ */
+non_null()
+static bool relay_ip_port_to_ip(IP_Port *ip_port)
+{
+    if (net_family_is_tcp_ipv4(ip_port->ip.family)) {
+        ip_port->ip.family = net_family_ipv4;
+    } else if (net_family_is_tcp_ipv6(ip_port->ip.family)) {
+        ip_port->ip.family = net_family_ipv6;
+    }
+
+    return net_family_is_ipv4(ip_port->ip.family) || net_family_is_ipv6(ip_port->ip.family);
+}
+
 non_null()
 static int add_tcp_relay_instance(TCP_Connections *tcp_c, const IP_Port *ip_port, const uint8_t *relay_pk)
 {
     IP_Port ipp_copy = *ip_port;
 
-    if (net_family_is_tcp_ipv4(ipp_copy.ip.family)) {
-        ipp_copy.ip.family = net_family_ipv4;
-    } else if (net_family_is_tcp_ipv6(ipp_copy.ip.family)) {
-        ipp_copy.ip.family = net_family_ipv6;
-    }
-
-    if (!net_family_is_ipv4(ipp_copy.ip.family) && !net_family_is_ipv6(ipp_copy.ip.family)) {
+    if (!relay_ip_port_to_ip(&ipp_copy)) {
         return -1;
     }
 
@@ -1188,10 +1330,7 @@ static int add_tcp_relay_instance(TCP_Connections *tcp_c, const IP_Port *ip_port
 
     TCP_con *tcp_con = &tcp_c->tcp_connections[tcp_connections_number];
 
-    tcp_con->connection = new_TCP_connection(tcp_c->logger, tcp_c->mono_time, &ipp_copy, relay_pk, tcp_c->self_public_key,
-                          tcp_c->self_secret_key, &tcp_c->proxy_info);
-
-    if (!tcp_con->connection) {
+    if (connect_tcp_relay(tcp_c, tcp_connections_number, &ipp_copy, relay_pk) == -1) {
         return -1;
     }
 
@@ -1200,6 +1339,39 @@ static int add_tcp_relay_instance(TCP_Connections *tcp_c, const IP_Port *ip_port
     return tcp_connections_number;
 }
 
+/** Remember the address of a known relay if it is in the other IP family than
+ * the one we connect to, so that both can be tried.
+ */
+non_null()
+static void add_tcp_relay_alt_ip_port(TCP_Connections *tcp_c, int tcp_connections_number, const IP_Port *ip_port)
+{
+    TCP_con *tcp_con = get_tcp_connection(tcp_c, tcp_connections_number);
+
+    if (tcp_con == nullptr || tcp_c->proxy_info.proxy_type != TCP_PROXY_NONE) {
+        return;
+    }
+
+    if (!net_family_is_unspec(tcp_con->alt_ip_port.ip.family)) {
+        return;
+    }
+
+    IP_Port ipp_copy = *ip_port;
+
+    if (!relay_ip_port_to_ip(&ipp_copy)) {
+        return;
+    }
+
+    const IP_Port current = tcp_con->status == TCP_CONN_SLEEPING ? tcp_con->ip_port : tcp_con_ip_port(tcp_con->connection);
+
+    if (!net_family_is_ipv4(current.ip.family) && !net_family_is_ipv6(current.ip.family)) {
+        return;
+    }
+
+    if (net_family_is_ipv4(current.ip.family) != net_family_is_ipv4(ipp_copy.ip.family)) {
+        tcp_con->alt_ip_port = ipp_copy;
+    }
+}
+
 /** Add a TCP relay to the TCP_Connections instance.
  *
  * return 0 on success.
@@ -1210,6 +1382,7 @@ int add_tcp_relay_global(TCP_Connections *tcp_c, const IP_Port *ip_port, const u
     int tcp_connections_number = find_tcp_connection_relay(tcp_c, relay_pk);
 
     if (tcp_connections_number != -1) {
+        add_tcp_relay_alt_ip_port(tcp_c, tcp_connections_number, ip_port);
         return -1;
     }
 
@@ -1278,6 +1451,7 @@ int add_tcp_relay_connection(TCP_Connections *tcp_c, int connections_number, con
     int tcp_connections_number = find_tcp_connection_relay(tcp_c, relay_pk);
 
     if (tcp_connections_number != -1) {
+        add_tcp_relay_alt_ip_port(tcp_c, tcp_connections_number, ip_port);
         return add_tcp_number_relay_connection(tcp_c, connections_number, tcp_connections_number);
     }
 
@@ -1444,12 +1618,106 @@ TCP_Connections *new_tcp_connections(const Logger *logger, Mono_Time *mono_time,
     crypto_derive_public_key(temp->self_public_key, temp->self_secret_key);
     temp->proxy_info = *proxy_info;
 
+#ifdef TCP_CONNECTION_USE_EPOLL
+    temp->efd = epoll_create(8);
+
+    if (temp->efd == -1) {
+        LOGGER_ERROR(logger, "epoll initialisation failed");
+        crypto_memzero(temp->self_secret_key, sizeof(temp->self_secret_key));
+        free(temp);
+        return nullptr;
+    }
+
+#endif
+
     return temp;
 }
 
+/** Mark the relay connections whose sockets have data as readable.
+ *
+ * Without epoll every connection is marked, so that all of them are read.
+ */
+non_null()
+static void find_readable_tcp_conns(TCP_Connections *tcp_c)
+{
+#ifdef TCP_CONNECTION_USE_EPOLL
+
+    if (tcp_c->num_watched == 0) {
+        return;
+    }
+
+    VLA(struct epoll_event, events, tcp_c->num_watched);
+    const int nfds = epoll_wait(tcp_c->efd, events, tcp_c->num_watched, 0);
+
+    for (int n = 0; n < nfds; ++n) {
+        TCP_con *tcp_con = get_tcp_connection(tcp_c, (int)events[n].data.u64);
+
+        if (tcp_con != nullptr) {
+            tcp_con->readable = true;
+        }
+    }
+
+#else
+
+    for (uint32_t i = 0; i < tcp_c->tcp_connections_length; ++i) {
+        tcp_c->tcp_connections[i].readable = true;
+    }
+
+#endif
+}
+
+/** Race the connection to the other address of a relay that is still
+ * connecting against the first one, and keep whichever succeeds first.
+ */
+non_null(1, 2) nullable(5)
+static void do_tcp_relay_race(const Logger *logger, TCP_Connections *tcp_c, int tcp_connections_number,
+                              bool readable, void *userdata)
+{
+    TCP_con *tcp_con = &tcp_c->tcp_connections[tcp_connections_number];
+    const TCP_Client_Status status = tcp_con_status(tcp_con->connection);
+
+    if (status == TCP_CLIENT_CONFIRMED) {
+        unwatch_and_kill_tcp_client(tcp_c, tcp_con->alt_connection);
+        tcp_con->alt_connection = nullptr;
+        return;
+    }
+
+    if (tcp_con->alt_connection == nullptr) {
+        if (!tcp_con->alt_tried && status != TCP_CLIENT_DISCONNECTED
+                && !net_family_is_unspec(tcp_con->alt_ip_port.ip.family)
+                && tcp_con->connect_start + TCP_CONNECTION_ATTEMPT_DELAY <= mono_time_get_ms(tcp_c->mono_time)) {
+            tcp_con->alt_connection = connect_tcp_client(tcp_c, tcp_connections_number, &tcp_con->alt_ip_port,
+                                      tcp_con_public_key(tcp_con->connection));
+            tcp_con->alt_tried = true;
+        }
+
+        return;
+    }
+
+    do_TCP_connection_ready(logger, tcp_c->mono_time, tcp_con->alt_connection, readable, userdata);
+    const TCP_Client_Status alt_status = tcp_con_status(tcp_con->alt_connection);
+
+    if (alt_status == TCP_CLIENT_DISCONNECTED) {
+        unwatch_and_kill_tcp_client(tcp_c, tcp_con->alt_connection);
+        tcp_con->alt_connection = nullptr;
+        return;
+    }
+
+    if (alt_status == TCP_CLIENT_CONFIRMED || status == TCP_CLIENT_DISCONNECTED) {
+        /* Keep the other address for the next time we connect. */
+        const IP_Port old_ip_port = tcp_con_ip_port(tcp_con->connection);
+        unwatch_and_kill_tcp_client(tcp_c, tcp_con->connection);
+        tcp_con->connection = tcp_con->alt_connection;
+        tcp_con->alt_connection = nullptr;
+        tcp_con->alt_ip_port = old_ip_port;
+    }
+}
+
 non_null(1, 2) nullable(3)
 static void do_tcp_conns(const Logger *logger, TCP_Connections *tcp_c, void *userdata)
 {
+    find_readable_tcp_conns(tcp_c);
+
     for (uint32_t i = 0; i < tcp_c->tcp_connections_length; ++i) {
         TCP_con *tcp_con = get_tcp_connection(tcp_c, i);
 
@@ -1458,7 +1726,9 @@ static void do_tcp_conns(const Logger *logger, TCP_Connections *tcp_c, void *use
         }
 
         if (tcp_con->status != TCP_CONN_SLEEPING) {
-            do_TCP_connection(logger, tcp_c->mono_time, tcp_con->connection, userdata);
+            const bool readable = tcp_con->readable;
+            tcp_con->readable = false;
+            do_TCP_connection_ready(logger, tcp_c->mono_time, tcp_con->connection, readable, userdata);
 
             /* callbacks can change TCP connection address. */
             tcp_con = get_tcp_connection(tcp_c, i);
@@ -1466,6 +1736,10 @@ static void do_tcp_conns(const Logger *logger, TCP_Connections *tcp_c, void *use
             // Make sure the TCP connection wasn't dropped in any of the callbacks.
             assert(tcp_con != nullptr);
 
+            if (tcp_con->status == TCP_CONN_VALID) {
+                do_tcp_relay_race(logger, tcp_c, i, readable, userdata);
+            }
+
             if (tcp_con_status(tcp_con->connection) == TCP_CLIENT_DISCONNECTED) {
                 if (tcp_con->status == TCP_CONN_CONNECTED) {
                     reconnect_tcp_relay_connection(tcp_c, i);
@@ -1540,10 +1814,15 @@ void kill_tcp_connections(TCP_Connections *tcp_c)
 {
     for (uint32_t i = 0; i < tcp_c->tcp_connections_length; ++i) {
         kill_TCP_connection(tcp_c->tcp_connections[i].connection);
+        kill_TCP_connection(tcp_c->tcp_connections[i].alt_connection);
     }
 
     crypto_memzero(tcp_c->self_secret_key, sizeof(tcp_c->self_secret_key));
 
+#ifdef TCP_CONNECTION_USE_EPOLL
+    close(tcp_c->efd);
+#endif
+
     free(tcp_c->tcp_connections);
     free(tcp_c->connections);
     free(tcp_c);
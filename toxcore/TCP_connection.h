@@ -37,6 +37,11 @@
  * NOTE: Must be at most (MAX_FRIEND_TCP_CONNECTIONS / 2) */
 #define RECOMMENDED_FRIEND_TCP_CONNECTIONS (MAX_FRIEND_TCP_CONNECTIONS / 2)
 
+/** Milliseconds a relay gets to accept a connection before it is also tried
+ * over its address of the other IP family, if it has one.
+ */
+#define TCP_CONNECTION_ATTEMPT_DELAY 250
+
 /** Number of TCP connections used for onion purposes. */
 #define NUM_ONION_TCP_CONNECTIONS RECOMMENDED_FRIEND_TCP_CONNECTIONS
 
@@ -67,6 +72,16 @@ typedef struct TCP_con {
     IP_Port ip_port;
     uint8_t relay_pk[CRYPTO_PUBLIC_KEY_SIZE];
     bool unsleep; /* set to 1 to unsleep connection. */
+
+    bool readable; /* The socket has data to read, only used while running do_tcp_connections(). */
+
+    /* Address of the relay in the other IP family, or family unspec. Connecting
+     * to it starts TCP_CONNECTION_ATTEMPT_DELAY ms after connect_start if the
+     * first attempt has not succeeded, and the first one to succeed is kept. */
+    IP_Port alt_ip_port;
+    TCP_Client_Connection *alt_connection;
+    uint64_t connect_start; /* In milliseconds. */
+    bool alt_tried; /* The other address was tried since connect_start. */
 } TCP_con;
 
 typedef struct TCP_Connections TCP_Connections;
@@ -90,7 +105,9 @@ non_null()
 int send_packet_tcp_connection(const TCP_Connections *tcp_c, int connections_number, const uint8_t *packet,
                                uint16_t length);
 
-/** Return a random TCP connection number for use in send_tcp_onion_request.
+/** Return the number of the connected onion TCP relay with the lowest round
+ * trip time for use in send_tcp_onion_request. Relays that have no measured
+ * round trip time yet come last, ties are broken at random.
  *
  * TODO(irungentoo): This number is just the index of an array that the elements
  * can change without warning.
@@ -99,7 +116,7 @@ int send_packet_tcp_connection(const TCP_Connections *tcp_c, int connections_num
  * return -1 on failure.
  */
 non_null()
-int get_random_tcp_onion_conn_number(const TCP_Connections *tcp_c);
+int get_fastest_tcp_onion_conn_number(const TCP_Connections *tcp_c);
 
 /** Send an onion packet via the TCP relay corresponding to tcp_connections_number.
  *
@@ -8,6 +8,7 @@
  */
 #include "TCP_server.h"
 
+#include <assert.h>
 #include <stdlib.h>
 #include <string.h>
 #if !defined(_WIN32) && !defined(__WIN32__) && !defined (WIN32)
@@ -15,13 +16,16 @@
 #endif
 
 #ifdef TCP_SERVER_USE_EPOLL
+#include <pthread.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <unistd.h>
 #endif
 
 #include "TCP_common.h"
-#include "list.h"
+#include "hash_index.h"
 #include "mono_time.h"
+#include "thread_pool.h"
 #include "util.h"
 
 #ifdef TCP_SERVER_USE_EPOLL
@@ -29,57 +33,269 @@
 #define TCP_SOCKET_INCOMING 1
 #define TCP_SOCKET_UNCONFIRMED 2
 #define TCP_SOCKET_CONFIRMED 3
+#define TCP_SOCKET_MAILBOX 4
+
+/** How long a worker thread waits for events before checking for pings and timeouts, in milliseconds. */
+#define TCP_WORKER_POLL_TIMEOUT 100
 #endif
 
+/** Size a pending connection queue starts with when it is first needed. */
+#define TCP_PENDING_QUEUE_MIN_SIZE 16
+
+/** Most handshakes done in one go, possibly spread over the handshake threads. */
+#define TCP_HANDSHAKE_BATCH_SIZE 64
+
+/** Bytes a connection may read and forward per turn when several have packets to read. */
+#define TCP_RECV_QUANTUM MAX_PACKET_SIZE
+
+/** Bytes read and forwarded by one call of do_ready_connections(), so that
+ * timers, new connections and the mailbox get a turn during a flood.
+ */
+#define TCP_READY_BUDGET (64 * TCP_RECV_QUANTUM)
+
+/** Most times do_TCP_server() runs the ready connections before returning. */
+#define TCP_MAX_READY_ROUNDS 16
+
+/** Number of one-second slots in the ping timer wheel. Larger than any ping deadline. */
+#define TCP_TIMER_WHEEL_SIZE 64
+#define TCP_TIMER_NONE UINT32_MAX
+
 typedef struct TCP_Secure_Conn {
     uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
     uint32_t index;
     // TODO(iphydf): Add an enum for this (same as in TCP_client.c, probably).
     uint8_t status; /* 0 if not used, 1 if other is offline, 2 if other is online. */
     uint8_t other_id;
+    uint16_t shard; /* Shard of the other connection if it is online. */
+    uint8_t id; /* Connection id the client uses for this route. */
 } TCP_Secure_Conn;
 
+/** Routes kept inside the connection before it gets a full table. */
+#define TCP_INLINE_LINKS 4
+
 typedef struct TCP_Secure_Connection {
     TCP_Connection con;
 
     uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
     uint8_t recv_nonce[CRYPTO_NONCE_SIZE]; /* Nonce of received packets. */
-    uint16_t next_packet_length;
-    TCP_Secure_Conn connections[NUM_CLIENT_CONNECTIONS];
+
+    /* Routes of the client. Most clients only use a few, so they start in
+     * links and move to link_table, indexed by connection id, once there
+     * are more. */
+    TCP_Secure_Conn links[TCP_INLINE_LINKS];
+    TCP_Secure_Conn *link_table;
     uint8_t status;
 
     uint64_t identifier;
 
     uint64_t last_pinged;
     uint64_t ping_id;
+
+    /* When to next check the pings, 0 if not in the timer wheel. Connections
+     * due in the same wheel slot are linked by index. */
+    uint64_t timer_deadline;
+    uint32_t timer_next;
+    uint32_t timer_prev;
+
+    /* Next unused slot of the accepted connection array if this one is unused. */
+    uint32_t next_free;
+
+    /* Set while the connection is in the list of connections with packets to
+     * read, linked by index. deficit is how much it may still read and forward
+     * in its turn. */
+    bool ready;
+    uint32_t ready_next;
+    uint32_t ready_prev;
+    int32_t deficit;
+
+    /* Bytes the client may still send of each kind of traffic, refilled every
+     * second from the rate limits of the server. */
+    uint64_t tokens[TCP_TRAFFIC_NUM];
+    uint64_t tokens_refilled;
 } TCP_Secure_Connection;
 
 
+#ifdef TCP_SERVER_USE_EPOLL
+typedef enum Shard_Message_Type {
+    /* main -> shard: a connection that just sent its first packet. */
+    SHARD_MESSAGE_ADOPT,
+    /* shard -> shard: a client asked to be routed to a client of the receiving shard. */
+    SHARD_MESSAGE_ROUTE,
+    /* shard -> shard: reply to a route request that linked the two clients. */
+    SHARD_MESSAGE_LINK,
+    /* shard -> shard: a linked client disconnected from the other. */
+    SHARD_MESSAGE_UNLINK,
+    /* shard -> shard: data packet for a linked client. */
+    SHARD_MESSAGE_DATA,
+    /* shard -> shard: out of band packet for a client. */
+    SHARD_MESSAGE_OOB,
+    /* shard -> main: onion request to pass to the onion. */
+    SHARD_MESSAGE_ONION_REQUEST,
+    /* main -> shard: onion response for a client. */
+    SHARD_MESSAGE_ONION_RESPONSE,
+} Shard_Message_Type;
+
+typedef struct Shard_Message {
+    struct Shard_Message *next;
+    Shard_Message_Type type;
+
+    uint16_t shard; /* Shard of the sender. */
+    uint32_t index; /* Connection index in the receiving shard, or in the sender for ROUTE and ONION_REQUEST. */
+    uint8_t con_id; /* Connection slot of the connection at index. */
+    uint32_t other_index; /* Connection index in the sending shard. */
+    uint8_t other_id; /* Connection slot of the connection at other_index. */
+    uint64_t identifier; /* Identifier of the connection at index. */
+    uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t other_public_key[CRYPTO_PUBLIC_KEY_SIZE];
+
+    /* Connection of an ADOPT message. Its status is TCP_STATUS_NO_STATUS once
+     * the receiving shard took it. */
+    TCP_Secure_Connection con;
+
+    /* Pool to give the message back to, nullptr if it was allocated on its own. */
+    struct Shard_Message_Pool *pool;
+
+    uint8_t *data;
+    uint16_t length;
+} Shard_Message;
+
+/* Messages with more data than this are allocated on their own. */
+#define SHARD_MESSAGE_POOL_DATA_SIZE MAX_PACKET_SIZE
+
+/* Messages given back beyond this many are freed, so that a burst does not
+ * keep its memory forever. */
+#define SHARD_MESSAGE_POOL_MAX_FREE 256
+
+/** Messages of one thread, reused instead of allocating one for each packet.
+ *
+ * Only the thread owning the pool takes messages out of it. The threads that
+ * receive them give them back on a lock-free stack, which the owner takes all
+ * at once when it runs out of free messages.
+ */
+typedef struct Shard_Message_Pool {
+    Shard_Message *free; /* Only used by the owner. */
+    Shard_Message *returned; /* Pushed to by any thread. */
+    uint32_t num_returned; /* About how many messages are in returned. */
+} Shard_Message_Pool;
+
+/** Lock-free queue with any number of producers and a single consumer.
+ *
+ * See http://www.1024cores.net/home/lock-free-algorithms/queues/intrusive-mpsc-node-based-queue
+ */
+typedef struct Shard_Mailbox {
+    Shard_Message *head; /* Last pushed message, updated by the producers. */
+    Shard_Message *tail; /* Next message to pop, only used by the consumer. */
+    Shard_Message stub;
+} Shard_Mailbox;
+#endif
+
+/** The accepted connections handled by one thread.
+ *
+ * Without worker threads, the server has a single shard run by do_TCP_server().
+ * With them, each shard has its own thread and epoll set, and a connection
+ * belongs to the shard picked by key_shard() from its public key. Shards only
+ * ever touch their own connections; everything involving another shard or the
+ * onion goes through mailboxes.
+ */
+typedef struct TCP_Shard {
+    TCP_Server *tcp_server;
+    const Logger *logger;
+    uint16_t id;
+
+#ifdef TCP_SERVER_USE_EPOLL
+    int efd;
+
+    pthread_t thread;
+    bool thread_started;
+    bool stopping;
+
+    Shard_Mailbox mailbox;
+    int wake_fd;
+    bool wake_pending;
+
+    Shard_Message_Pool message_pool; /* Messages this shard sends. */
+#endif
+
+    TCP_Secure_Connection *accepted_connection_array;
+    uint32_t size_accepted_connections;
+    uint32_t num_accepted_connections;
+    uint32_t first_free; /* Unused slot to reuse next, TCP_TIMER_NONE if none. */
+
+    uint64_t counter;
+
+    /* Maps public keys of accepted connections to their (stable) index. */
+    Hash_Index accepted_key_index;
+
+    /* First connection of each slot of the ping timer wheel. */
+    uint32_t timers[TCP_TIMER_WHEEL_SIZE];
+    uint64_t last_run_pinged;
+
+    /* Connections that may have packets to read, first and last. */
+    uint32_t ready_head;
+    uint32_t ready_tail;
+
+    /* Bytes forwarded for the packet being handled, charged to the deficit of
+     * its connection along with the bytes read. */
+    uint32_t forwarded;
+
+    /* Time the packets being handled arrived at. */
+    uint64_t cur_time;
+} TCP_Shard;
+
+typedef struct TCP_Rate_Limit {
+    uint32_t rate; /* Bytes per second, 0 if unlimited. */
+    uint32_t burst;
+} TCP_Rate_Limit;
+
+/** Connections waiting for their handshake or their first packet. The queue
+ * grows up to the configured maximum; once it is full, new connections replace
+ * the oldest ones.
+ */
+typedef struct TCP_Pending_Queue {
+    TCP_Secure_Connection *conns;
+    uint32_t size;
+    uint32_t index; /* Slot to try next. */
+} TCP_Pending_Queue;
+
+/** Key exchange of an incoming connection whose handshake was read. */
+typedef struct Handshake_Job {
+    uint32_t index; /* In the incoming connection queue. */
+    int result; /* 1 if the response is ready, -1 if the handshake is invalid. */
+    uint8_t data[TCP_CLIENT_HANDSHAKE_SIZE];
+    uint8_t response[TCP_SERVER_HANDSHAKE_SIZE];
+} Handshake_Job;
+
 struct TCP_Server {
     const Logger *logger;
     Onion *onion;
 
 #ifdef TCP_SERVER_USE_EPOLL
     int efd;
-    uint64_t last_run_pinged;
+
+    /* Set by tcp_server_start_workers(). */
+    bool sharded;
+    const Mono_Time *mono_time;
+    Shard_Mailbox mailbox; /* Messages from the shards to the main thread. */
+    Shard_Message_Pool message_pool; /* Messages the main thread sends. */
+    uint8_t shard_key[CRYPTO_SIPHASH_KEY_SIZE]; /* Secret key of key_shard(). */
 #endif
     Socket *socks_listening;
     unsigned int num_listening_socks;
 
     uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
     uint8_t secret_key[CRYPTO_SECRET_KEY_SIZE];
-    TCP_Secure_Connection incoming_connection_queue[MAX_INCOMING_CONNECTIONS];
-    uint16_t incoming_connection_queue_index;
-    TCP_Secure_Connection unconfirmed_connection_queue[MAX_INCOMING_CONNECTIONS];
-    uint16_t unconfirmed_connection_queue_index;
+    TCP_Pending_Queue incoming;
+    TCP_Pending_Queue unconfirmed;
+    uint32_t max_pending_connections;
 
-    TCP_Secure_Connection *accepted_connection_array;
-    uint32_t size_accepted_connections;
-    uint32_t num_accepted_connections;
+    Thread_Pool *handshake_pool; /* nullptr if handshakes are done on the calling thread. */
 
-    uint64_t counter;
+    /* Read by all shards, only set before they start. */
+    TCP_Rate_Limit rate_limits[TCP_TRAFFIC_NUM];
+    Handshake_Job handshake_jobs[TCP_HANDSHAKE_BATCH_SIZE];
 
-    BS_List accepted_key_list;
+    TCP_Shard *shards;
+    uint16_t num_shards;
 };
 
 const uint8_t *tcp_server_public_key(const TCP_Server *tcp_server)
@@ -100,34 +316,40 @@ size_t tcp_server_listen_count(const TCP_Server *tcp_server)
 #endif
 #endif
 
-/** Increase the size of the connection list
+/** Increase the size of the connection list and put the new slots in the
+ * free list.
  *
  *  return -1 on failure
  *  return 0 on success.
  */
 non_null()
-static int alloc_new_connections(TCP_Server *tcp_server, uint32_t num)
+static int alloc_new_connections(TCP_Shard *shard, uint32_t num)
 {
-    const uint32_t new_size = tcp_server->size_accepted_connections + num;
+    const uint32_t new_size = shard->size_accepted_connections + num;
 
-    if (new_size < tcp_server->size_accepted_connections) {
+    if (new_size < shard->size_accepted_connections || new_size > INT32_MAX) {
         return -1;
     }
 
     TCP_Secure_Connection *new_connections = (TCP_Secure_Connection *)realloc(
-                tcp_server->accepted_connection_array,
+                shard->accepted_connection_array,
                 new_size * sizeof(TCP_Secure_Connection));
 
     if (new_connections == nullptr) {
         return -1;
     }
 
-    const uint32_t old_size = tcp_server->size_accepted_connections;
+    const uint32_t old_size = shard->size_accepted_connections;
     const uint32_t size_new_entries = num * sizeof(TCP_Secure_Connection);
     memset(new_connections + old_size, 0, size_new_entries);
 
-    tcp_server->accepted_connection_array = new_connections;
-    tcp_server->size_accepted_connections = new_size;
+    for (uint32_t i = new_size; i > old_size; --i) {
+        new_connections[i - 1].next_free = shard->first_free;
+        shard->first_free = i - 1;
+    }
+
+    shard->accepted_connection_array = new_connections;
+    shard->size_accepted_connections = new_size;
     return 0;
 }
 
@@ -135,7 +357,8 @@ non_null()
 static void wipe_secure_connection(TCP_Secure_Connection *con)
 {
     if (con->status) {
-        wipe_priority_list(con->con.priority_queue_start);
+        free(con->link_table);
+        wipe_connection_buffers(&con->con);
         crypto_memzero(con, sizeof(TCP_Secure_Connection));
     }
 }
@@ -147,113 +370,98 @@ static void move_secure_connection(TCP_Secure_Connection *con_new, TCP_Secure_Co
     crypto_memzero(con_old, sizeof(TCP_Secure_Connection));
 }
 
+/** return the route with connection id `id` if it is used.
+ * return nullptr otherwise.
+ */
 non_null()
-static void free_accepted_connection_array(TCP_Server *tcp_server)
+static TCP_Secure_Conn *get_link(TCP_Secure_Connection *con, uint8_t id)
 {
-    if (tcp_server->accepted_connection_array == nullptr) {
-        return;
+    if (con->link_table != nullptr) {
+        TCP_Secure_Conn *link = &con->link_table[id];
+        return link->status != 0 ? link : nullptr;
     }
 
-    for (uint32_t i = 0; i < tcp_server->size_accepted_connections; ++i) {
-        wipe_secure_connection(&tcp_server->accepted_connection_array[i]);
+    for (uint32_t i = 0; i < TCP_INLINE_LINKS; ++i) {
+        if (con->links[i].status != 0 && con->links[i].id == id) {
+            return &con->links[i];
+        }
     }
 
-    free(tcp_server->accepted_connection_array);
-    tcp_server->accepted_connection_array = nullptr;
-    tcp_server->size_accepted_connections = 0;
+    return nullptr;
 }
 
-/** return index corresponding to connection with peer on success
- * return -1 on failure.
- */
+/** Number of route entries link_at() can return, used or not. */
 non_null()
-static int get_TCP_connection_index(const TCP_Server *tcp_server, const uint8_t *public_key)
+static uint32_t num_links(const TCP_Secure_Connection *con)
 {
-    return bs_list_find(&tcp_server->accepted_key_list, public_key);
+    return con->link_table != nullptr ? NUM_CLIENT_CONNECTIONS : TCP_INLINE_LINKS;
 }
 
-
 non_null()
-static int kill_accepted(TCP_Server *tcp_server, int index);
+static TCP_Secure_Conn *link_at(TCP_Secure_Connection *con, uint32_t i)
+{
+    return con->link_table != nullptr ? &con->link_table[i] : &con->links[i];
+}
 
-/** Add accepted TCP connection to the list.
+/** Find an unused route with the lowest free connection id. Its status is
+ * still 0, the caller sets it once the route is in use.
  *
- * return index on success
- * return -1 on failure
+ * return nullptr if all connection ids are used or on allocation failure.
  */
 non_null()
-static int add_accepted(TCP_Server *tcp_server, const Mono_Time *mono_time, TCP_Secure_Connection *con)
+static TCP_Secure_Conn *new_link(TCP_Secure_Connection *con)
 {
-    int index = get_TCP_connection_index(tcp_server, con->public_key);
+    if (con->link_table != nullptr) {
+        for (uint32_t i = 0; i < NUM_CLIENT_CONNECTIONS; ++i) {
+            if (con->link_table[i].status == 0) {
+                return &con->link_table[i];
+            }
+        }
 
-    if (index != -1) { /* If an old connection to the same public key exists, kill it. */
-        kill_accepted(tcp_server, index);
-        index = -1;
+        return nullptr;
     }
 
-    if (tcp_server->size_accepted_connections == tcp_server->num_accepted_connections) {
-        if (alloc_new_connections(tcp_server, 4) == -1) {
-            return -1;
-        }
+    bool used[TCP_INLINE_LINKS + 1] = {false};
+    TCP_Secure_Conn *unused = nullptr;
 
-        index = tcp_server->num_accepted_connections;
-    } else {
-        for (uint32_t i = tcp_server->size_accepted_connections; i != 0; --i) {
-            if (tcp_server->accepted_connection_array[i - 1].status == TCP_STATUS_NO_STATUS) {
-                index = i - 1;
-                break;
+    for (uint32_t i = 0; i < TCP_INLINE_LINKS; ++i) {
+        if (con->links[i].status == 0) {
+            if (unused == nullptr) {
+                unused = &con->links[i];
             }
+        } else if (con->links[i].id <= TCP_INLINE_LINKS) {
+            used[con->links[i].id] = true;
         }
     }
 
-    if (index == -1) {
-        LOGGER_ERROR(tcp_server->logger, "FAIL index is -1");
-        return -1;
-    }
-
-    if (!bs_list_add(&tcp_server->accepted_key_list, con->public_key, index)) {
-        return -1;
-    }
-
-    move_secure_connection(&tcp_server->accepted_connection_array[index], con);
+    if (unused != nullptr) {
+        uint8_t id = 0;
 
-    tcp_server->accepted_connection_array[index].status = TCP_STATUS_CONFIRMED;
-    ++tcp_server->num_accepted_connections;
-    tcp_server->accepted_connection_array[index].identifier = ++tcp_server->counter;
-    tcp_server->accepted_connection_array[index].last_pinged = mono_time_get(mono_time);
-    tcp_server->accepted_connection_array[index].ping_id = 0;
-
-    return index;
-}
+        while (used[id]) {
+            ++id;
+        }
 
-/** Delete accepted connection from list.
- *
- * return 0 on success
- * return -1 on failure
- */
-non_null()
-static int del_accepted(TCP_Server *tcp_server, int index)
-{
-    if ((uint32_t)index >= tcp_server->size_accepted_connections) {
-        return -1;
+        unused->id = id;
+        return unused;
     }
 
-    if (tcp_server->accepted_connection_array[index].status == TCP_STATUS_NO_STATUS) {
-        return -1;
-    }
+    TCP_Secure_Conn *table = (TCP_Secure_Conn *)calloc(NUM_CLIENT_CONNECTIONS, sizeof(TCP_Secure_Conn));
 
-    if (!bs_list_remove(&tcp_server->accepted_key_list, tcp_server->accepted_connection_array[index].public_key, index)) {
-        return -1;
+    if (table == nullptr) {
+        return nullptr;
     }
 
-    wipe_secure_connection(&tcp_server->accepted_connection_array[index]);
-    --tcp_server->num_accepted_connections;
+    for (uint32_t i = 0; i < NUM_CLIENT_CONNECTIONS; ++i) {
+        table[i].id = i;
+    }
 
-    if (tcp_server->num_accepted_connections == 0) {
-        free_accepted_connection_array(tcp_server);
+    for (uint32_t i = 0; i < TCP_INLINE_LINKS; ++i) {
+        table[con->links[i].id] = con->links[i];
     }
 
-    return 0;
+    memset(con->links, 0, sizeof(con->links));
+    con->link_table = table;
+    return new_link(con);
 }
 
 /** Kill a TCP_Secure_Connection
@@ -265,501 +473,1541 @@ static void kill_TCP_secure_connection(TCP_Secure_Connection *con)
     wipe_secure_connection(con);
 }
 
+#ifdef TCP_SERVER_USE_EPOLL
+non_null()
+static void mailbox_init(Shard_Mailbox *mailbox)
+{
+    mailbox->stub.next = nullptr;
+    mailbox->head = &mailbox->stub;
+    mailbox->tail = &mailbox->stub;
+}
+
+/** Add a message to the mailbox. Can be called from any thread. */
 non_null()
-static int rm_connection_index(TCP_Server *tcp_server, TCP_Secure_Connection *con, uint8_t con_number);
+static void mailbox_push(Shard_Mailbox *mailbox, Shard_Message *msg)
+{
+    __atomic_store_n(&msg->next, nullptr, __ATOMIC_RELAXED);
+    Shard_Message *prev = __atomic_exchange_n(&mailbox->head, msg, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, msg, __ATOMIC_RELEASE);
+}
 
-/** Kill an accepted TCP_Secure_Connection
+/** Take the oldest message out of the mailbox. Must only be called by the owner of the mailbox.
  *
- * return -1 on failure.
- * return 0 on success.
+ * return nullptr if the mailbox is empty or the next message is still being pushed.
  */
-static int kill_accepted(TCP_Server *tcp_server, int index)
+non_null()
+static Shard_Message *mailbox_pop(Shard_Mailbox *mailbox)
 {
-    if ((uint32_t)index >= tcp_server->size_accepted_connections) {
-        return -1;
+    Shard_Message *tail = mailbox->tail;
+    Shard_Message *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+    if (tail == &mailbox->stub) {
+        if (next == nullptr) {
+            return nullptr;
+        }
+
+        mailbox->tail = next;
+        tail = next;
+        next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
     }
 
-    for (uint32_t i = 0; i < NUM_CLIENT_CONNECTIONS; ++i) {
-        rm_connection_index(tcp_server, &tcp_server->accepted_connection_array[index], i);
+    if (next != nullptr) {
+        mailbox->tail = next;
+        return tail;
     }
 
-    Socket sock = tcp_server->accepted_connection_array[index].con.sock;
+    if (tail != __atomic_load_n(&mailbox->head, __ATOMIC_ACQUIRE)) {
+        return nullptr;
+    }
 
-    if (del_accepted(tcp_server, index) != 0) {
-        return -1;
+    mailbox_push(mailbox, &mailbox->stub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+    if (next != nullptr) {
+        mailbox->tail = next;
+        return tail;
     }
 
-    kill_sock(sock);
-    return 0;
+    return nullptr;
 }
 
-/** return 1 if everything went well.
- * return -1 if the connection must be killed.
+/** Take a message with room for length bytes of data out of the pool, or
+ * allocate one if the pool is empty. Must only be called by the owner of the pool.
+ *
+ * return nullptr on failure.
  */
 non_null()
-static int handle_TCP_handshake(const Logger *logger, TCP_Secure_Connection *con, const uint8_t *data, uint16_t length,
-                                const uint8_t *self_secret_key)
+static Shard_Message *new_shard_message(Shard_Message_Pool *pool, const Logger *logger, Shard_Message_Type type,
+                                        uint16_t length)
 {
-    if (length != TCP_CLIENT_HANDSHAKE_SIZE) {
-        LOGGER_WARNING(logger, "invalid handshake length: %d != %d", length, TCP_CLIENT_HANDSHAKE_SIZE);
-        return -1;
-    }
+    Shard_Message *msg;
 
-    if (con->status != TCP_STATUS_CONNECTED) {
-        LOGGER_WARNING(logger, "TCP connection %u not connected", (unsigned int)con->identifier);
-        return -1;
-    }
+    if (length <= SHARD_MESSAGE_POOL_DATA_SIZE) {
+        if (pool->free == nullptr) {
+            pool->free = __atomic_exchange_n(&pool->returned, nullptr, __ATOMIC_ACQUIRE);
+            __atomic_store_n(&pool->num_returned, 0, __ATOMIC_RELAXED);
+        }
 
-    uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
-    encrypt_precompute(data, self_secret_key, shared_key);
-    uint8_t plain[TCP_HANDSHAKE_PLAIN_SIZE];
-    int len = decrypt_data_symmetric(shared_key, data + CRYPTO_PUBLIC_KEY_SIZE,
-                                     data + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_NONCE_SIZE, TCP_HANDSHAKE_PLAIN_SIZE + CRYPTO_MAC_SIZE, plain);
+        msg = pool->free;
 
-    if (len != TCP_HANDSHAKE_PLAIN_SIZE) {
-        LOGGER_WARNING(logger, "invalid TCP handshake decrypted length: %d != %d", len, TCP_HANDSHAKE_PLAIN_SIZE);
-        crypto_memzero(shared_key, sizeof(shared_key));
-        return -1;
-    }
+        if (msg != nullptr) {
+            pool->free = msg->next;
+            memset(msg, 0, sizeof(Shard_Message));
+        } else {
+            msg = (Shard_Message *)calloc(1, sizeof(Shard_Message) + SHARD_MESSAGE_POOL_DATA_SIZE);
+        }
 
-    memcpy(con->public_key, data, CRYPTO_PUBLIC_KEY_SIZE);
-    uint8_t temp_secret_key[CRYPTO_SECRET_KEY_SIZE];
-    uint8_t resp_plain[TCP_HANDSHAKE_PLAIN_SIZE];
-    crypto_new_keypair(resp_plain, temp_secret_key);
-    random_nonce(con->con.sent_nonce);
-    memcpy(resp_plain + CRYPTO_PUBLIC_KEY_SIZE, con->con.sent_nonce, CRYPTO_NONCE_SIZE);
-    memcpy(con->recv_nonce, plain + CRYPTO_PUBLIC_KEY_SIZE, CRYPTO_NONCE_SIZE);
+        if (msg != nullptr) {
+            msg->pool = pool;
+        }
+    } else {
+        msg = (Shard_Message *)calloc(1, sizeof(Shard_Message) + length);
+    }
 
-    uint8_t response[TCP_SERVER_HANDSHAKE_SIZE];
-    random_nonce(response);
+    if (msg == nullptr) {
+        LOGGER_ERROR(logger, "could not allocate message of type %d", type);
+        return nullptr;
+    }
 
-    len = encrypt_data_symmetric(shared_key, response, resp_plain, TCP_HANDSHAKE_PLAIN_SIZE,
-                                 response + CRYPTO_NONCE_SIZE);
+    msg->type = type;
+    msg->data = (uint8_t *)(msg + 1);
+    msg->length = length;
+    return msg;
+}
 
-    if (len != TCP_HANDSHAKE_PLAIN_SIZE + CRYPTO_MAC_SIZE) {
-        crypto_memzero(shared_key, sizeof(shared_key));
-        return -1;
+/** Give a message back to its pool. Can be called from any thread. */
+non_null()
+static void free_shard_message(Shard_Message *msg)
+{
+    if (msg->type == SHARD_MESSAGE_ADOPT && msg->con.status != TCP_STATUS_NO_STATUS) {
+        kill_TCP_secure_connection(&msg->con);
     }
 
-    IP_Port ipp = {0};
+    Shard_Message_Pool *pool = msg->pool;
 
-    if (TCP_SERVER_HANDSHAKE_SIZE != net_send(logger, con->con.sock, response, TCP_SERVER_HANDSHAKE_SIZE, &ipp)) {
-        crypto_memzero(shared_key, sizeof(shared_key));
-        return -1;
+    if (pool == nullptr) {
+        free(msg);
+        return;
     }
 
-    encrypt_precompute(plain, temp_secret_key, con->con.shared_key);
-    con->status = TCP_STATUS_UNCONFIRMED;
+    /* The count may be off by the messages being given back right now, which
+     * only moves the limit by as much. */
+    if (__atomic_add_fetch(&pool->num_returned, 1, __ATOMIC_RELAXED) > SHARD_MESSAGE_POOL_MAX_FREE) {
+        __atomic_sub_fetch(&pool->num_returned, 1, __ATOMIC_RELAXED);
+        free(msg);
+        return;
+    }
 
-    crypto_memzero(shared_key, sizeof(shared_key));
+    Shard_Message *head = __atomic_load_n(&pool->returned, __ATOMIC_RELAXED);
 
-    return 1;
+    do {
+        msg->next = head;
+    } while (!__atomic_compare_exchange_n(&pool->returned, &head, msg, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
 }
 
-/** return 1 if connection handshake was handled correctly.
- * return 0 if we didn't get it yet.
- * return -1 if the connection must be killed.
- */
+/** Free the messages of a pool. None of them may still be in a mailbox. */
 non_null()
-static int read_connection_handshake(const Logger *logger, TCP_Secure_Connection *con, const uint8_t *self_secret_key)
+static void free_message_pool(Shard_Message_Pool *pool)
 {
-    uint8_t data[TCP_CLIENT_HANDSHAKE_SIZE];
-    const int len = read_TCP_packet(logger, con->con.sock, data, TCP_CLIENT_HANDSHAKE_SIZE, &con->con.ip_port);
+    Shard_Message *lists[2] = {pool->free, pool->returned};
 
-    if (len == -1) {
-        LOGGER_TRACE(logger, "connection handshake is not ready yet");
-        return 0;
+    for (uint32_t i = 0; i < 2; ++i) {
+        while (lists[i] != nullptr) {
+            Shard_Message *next = lists[i]->next;
+            free(lists[i]);
+            lists[i] = next;
+        }
     }
 
-    return handle_TCP_handshake(logger, con, data, len, self_secret_key);
+    pool->free = nullptr;
+    pool->returned = nullptr;
 }
 
-/** return 1 on success.
- * return 0 if could not send packet.
- * return -1 on failure (connection must be killed).
- */
 non_null()
-static int send_routing_response(const Logger *logger, TCP_Secure_Connection *con, uint8_t rpid,
-                                 const uint8_t *public_key)
+static void free_mailbox(Shard_Mailbox *mailbox)
 {
-    uint8_t data[1 + 1 + CRYPTO_PUBLIC_KEY_SIZE];
-    data[0] = TCP_PACKET_ROUTING_RESPONSE;
-    data[1] = rpid;
-    memcpy(data + 2, public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    Shard_Message *msg;
 
-    return write_packet_TCP_secure_connection(logger, &con->con, data, sizeof(data), 1);
+    while ((msg = mailbox_pop(mailbox)) != nullptr) {
+        free_shard_message(msg);
+    }
 }
 
-/** return 1 on success.
- * return 0 if could not send packet.
- * return -1 on failure (connection must be killed).
+/** Free the messages left in the mailboxes of the shards. Must be done for all
+ * shards before any of them is freed, as the messages belong to the pools of
+ * their senders.
  */
 non_null()
-static int send_connect_notification(const Logger *logger, TCP_Secure_Connection *con, uint8_t id)
+static void free_shard_mailboxes(TCP_Shard *shards, uint16_t num_shards)
 {
-    uint8_t data[2] = {TCP_PACKET_CONNECTION_NOTIFICATION, (uint8_t)(id + NUM_RESERVED_PORTS)};
-    return write_packet_TCP_secure_connection(logger, &con->con, data, sizeof(data), 1);
+    for (uint16_t i = 0; i < num_shards; ++i) {
+        free_mailbox(&shards[i].mailbox);
+    }
 }
 
-/** return 1 on success.
- * return 0 if could not send packet.
- * return -1 on failure (connection must be killed).
- */
+/** Send a message to a shard and wake up its thread. */
 non_null()
-static int send_disconnect_notification(const Logger *logger, TCP_Secure_Connection *con, uint8_t id)
+static void shard_post(TCP_Shard *shard, Shard_Message *msg)
 {
-    uint8_t data[2] = {TCP_PACKET_DISCONNECT_NOTIFICATION, (uint8_t)(id + NUM_RESERVED_PORTS)};
-    return write_packet_TCP_secure_connection(logger, &con->con, data, sizeof(data), 1);
+    mailbox_push(&shard->mailbox, msg);
+
+    if (!__atomic_exchange_n(&shard->wake_pending, true, __ATOMIC_SEQ_CST)) {
+        const uint64_t one = 1;
+
+        if (write(shard->wake_fd, &one, sizeof(one)) != sizeof(one)) {
+            LOGGER_ERROR(shard->logger, "could not wake up shard %d", shard->id);
+        }
+    }
 }
 
-/** return 0 on success.
- * return -1 on failure (connection must be killed).
+/** return the shard of the connection with public_key.
+ *
+ * The key is hashed with a secret of the server, so that clients cannot pick
+ * keys that all land on the same shard.
  */
 non_null()
-static int handle_TCP_routing_req(TCP_Server *tcp_server, uint32_t con_id, const uint8_t *public_key)
+static uint16_t key_shard(const TCP_Server *tcp_server, const uint8_t *public_key)
 {
-    uint32_t index = -1;
-    TCP_Secure_Connection *con = &tcp_server->accepted_connection_array[con_id];
+    return crypto_siphash(tcp_server->shard_key, public_key, CRYPTO_PUBLIC_KEY_SIZE) % tcp_server->num_shards;
+}
+#endif
 
-    /* If person tries to cennect to himself we deny the request*/
-    if (public_key_cmp(con->public_key, public_key) == 0) {
-        if (send_routing_response(tcp_server->logger, con, 0, public_key) == -1) {
-            return -1;
-        }
+non_null()
+static void free_accepted_connection_array(TCP_Shard *shard)
+{
+    if (shard->accepted_connection_array == nullptr) {
+        return;
+    }
 
-        return 0;
+    for (uint32_t i = 0; i < shard->size_accepted_connections; ++i) {
+        wipe_secure_connection(&shard->accepted_connection_array[i]);
     }
 
-    for (uint32_t i = 0; i < NUM_CLIENT_CONNECTIONS; ++i) {
-        if (con->connections[i].status != 0) {
-            if (public_key_cmp(public_key, con->connections[i].public_key) == 0) {
-                if (send_routing_response(tcp_server->logger, con, i + NUM_RESERVED_PORTS, public_key) == -1) {
-                    return -1;
-                }
+    free(shard->accepted_connection_array);
+    shard->accepted_connection_array = nullptr;
+    shard->size_accepted_connections = 0;
+    shard->first_free = TCP_TIMER_NONE;
+}
 
-                return 0;
-            }
-        } else if (index == (uint32_t) -1) {
-            index = i;
-        }
-    }
+/** return index corresponding to connection with peer on success
+ * return -1 on failure.
+ */
+non_null()
+static int get_TCP_connection_index(const TCP_Shard *shard, const uint8_t *public_key)
+{
+    return hash_index_find(&shard->accepted_key_index, public_key);
+}
 
-    if (index == (uint32_t) -1) {
-        if (send_routing_response(tcp_server->logger, con, 0, public_key) == -1) {
-            return -1;
-        }
 
-        return 0;
-    }
+non_null()
+static int kill_accepted(TCP_Shard *shard, int index);
 
-    int ret = send_routing_response(tcp_server->logger, con, index + NUM_RESERVED_PORTS, public_key);
+non_null()
+static void timer_unlink(TCP_Shard *shard, uint32_t index)
+{
+    TCP_Secure_Connection *con = &shard->accepted_connection_array[index];
 
-    if (ret == 0) {
-        return 0;
+    if (con->timer_deadline == 0) {
+        return;
     }
 
-    if (ret == -1) {
-        return -1;
+    if (con->timer_prev == TCP_TIMER_NONE) {
+        shard->timers[con->timer_deadline % TCP_TIMER_WHEEL_SIZE] = con->timer_next;
+    } else {
+        shard->accepted_connection_array[con->timer_prev].timer_next = con->timer_next;
     }
 
-    con->connections[index].status = 1;
-    memcpy(con->connections[index].public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
-    int other_index = get_TCP_connection_index(tcp_server, public_key);
+    if (con->timer_next != TCP_TIMER_NONE) {
+        shard->accepted_connection_array[con->timer_next].timer_prev = con->timer_prev;
+    }
 
-    if (other_index != -1) {
-        uint32_t other_id = -1;
-        TCP_Secure_Connection *other_conn = &tcp_server->accepted_connection_array[other_index];
+    con->timer_deadline = 0;
+}
 
-        for (uint32_t i = 0; i < NUM_CLIENT_CONNECTIONS; ++i) {
-            if (other_conn->connections[i].status == 1
-                    && public_key_cmp(other_conn->connections[i].public_key, con->public_key) == 0) {
-                other_id = i;
-                break;
-            }
+/** Put the connection in the timer wheel slot of deadline (in seconds, non-zero). */
+non_null()
+static void timer_schedule(TCP_Shard *shard, uint32_t index, uint64_t deadline)
+{
+    timer_unlink(shard, index);
+
+    TCP_Secure_Connection *con = &shard->accepted_connection_array[index];
+    uint32_t *const slot = &shard->timers[deadline % TCP_TIMER_WHEEL_SIZE];
+
+    con->timer_deadline = deadline;
+    con->timer_prev = TCP_TIMER_NONE;
+    con->timer_next = *slot;
+
+    if (*slot != TCP_TIMER_NONE) {
+        shard->accepted_connection_array[*slot].timer_prev = index;
+    }
+
+    *slot = index;
+}
+
+/** Append the connection to the list of connections that may have packets to
+ * read, unless it already is in it.
+ */
+non_null()
+static void ready_push(TCP_Shard *shard, uint32_t index)
+{
+    TCP_Secure_Connection *con = &shard->accepted_connection_array[index];
+
+    if (con->ready) {
+        return;
+    }
+
+    con->ready = true;
+    con->ready_prev = shard->ready_tail;
+    con->ready_next = TCP_TIMER_NONE;
+
+    if (shard->ready_tail == TCP_TIMER_NONE) {
+        shard->ready_head = index;
+    } else {
+        shard->accepted_connection_array[shard->ready_tail].ready_next = index;
+    }
+
+    shard->ready_tail = index;
+}
+
+non_null()
+static void ready_unlink(TCP_Shard *shard, uint32_t index)
+{
+    TCP_Secure_Connection *con = &shard->accepted_connection_array[index];
+
+    if (!con->ready) {
+        return;
+    }
+
+    if (con->ready_prev == TCP_TIMER_NONE) {
+        shard->ready_head = con->ready_next;
+    } else {
+        shard->accepted_connection_array[con->ready_prev].ready_next = con->ready_next;
+    }
+
+    if (con->ready_next == TCP_TIMER_NONE) {
+        shard->ready_tail = con->ready_prev;
+    } else {
+        shard->accepted_connection_array[con->ready_next].ready_prev = con->ready_prev;
+    }
+
+    con->ready = false;
+}
+
+/** Take length bytes from the budget of the client for the kind of traffic.
+ *
+ * return true if the client may send the packet.
+ * return false if it is over its rate limit and the packet must be dropped.
+ */
+non_null()
+static bool take_tokens(const TCP_Shard *shard, TCP_Secure_Connection *con, TCP_Traffic traffic, uint16_t length)
+{
+    const TCP_Rate_Limit *limit = &shard->tcp_server->rate_limits[traffic];
+
+    if (limit->rate == 0) {
+        return true;
+    }
+
+    if (shard->cur_time > con->tokens_refilled) {
+        for (uint32_t i = 0; i < TCP_TRAFFIC_NUM; ++i) {
+            const TCP_Rate_Limit *refill = &shard->tcp_server->rate_limits[i];
+            con->tokens[i] = min_u64(refill->burst, con->tokens[i] + (shard->cur_time - con->tokens_refilled) * refill->rate);
+        }
+
+        con->tokens_refilled = shard->cur_time;
+    }
+
+    if (con->tokens[traffic] < length) {
+        return false;
+    }
+
+    con->tokens[traffic] -= length;
+    return true;
+}
+
+/** Add accepted TCP connection to the list.
+ *
+ * return index on success
+ * return -1 on failure
+ */
+non_null()
+static int add_accepted(TCP_Shard *shard, const Mono_Time *mono_time, TCP_Secure_Connection *con)
+{
+    int index = get_TCP_connection_index(shard, con->public_key);
+
+    if (index != -1) { /* If an old connection to the same public key exists, kill it. */
+        kill_accepted(shard, index);
+    }
+
+    if (shard->first_free == TCP_TIMER_NONE) {
+        /* Grow geometrically so that many connects in a row don't copy the array each time. */
+        if (alloc_new_connections(shard, max_u32(4, shard->size_accepted_connections)) == -1) {
+            return -1;
         }
+    }
+
+    index = shard->first_free;
+
+    if (!hash_index_add(&shard->accepted_key_index, con->public_key, index)) {
+        return -1;
+    }
+
+    shard->first_free = shard->accepted_connection_array[index].next_free;
+
+    move_secure_connection(&shard->accepted_connection_array[index], con);
+
+    shard->accepted_connection_array[index].status = TCP_STATUS_CONFIRMED;
+    ++shard->num_accepted_connections;
+    shard->accepted_connection_array[index].identifier = ++shard->counter;
+    shard->accepted_connection_array[index].last_pinged = mono_time_get(mono_time);
+    shard->accepted_connection_array[index].ping_id = 0;
+    shard->accepted_connection_array[index].timer_deadline = 0;
+    timer_schedule(shard, index, mono_time_get(mono_time) + TCP_PING_FREQUENCY);
+
+    shard->accepted_connection_array[index].ready = false;
+    shard->accepted_connection_array[index].deficit = 0;
+    shard->accepted_connection_array[index].tokens_refilled = mono_time_get(mono_time);
+
+    for (uint32_t i = 0; i < TCP_TRAFFIC_NUM; ++i) {
+        shard->accepted_connection_array[index].tokens[i] = shard->tcp_server->rate_limits[i].burst;
+    }
+
+    return index;
+}
+
+/** Delete accepted connection from list.
+ *
+ * return 0 on success
+ * return -1 on failure
+ */
+non_null()
+static int del_accepted(TCP_Shard *shard, int index)
+{
+    if ((uint32_t)index >= shard->size_accepted_connections) {
+        return -1;
+    }
+
+    if (shard->accepted_connection_array[index].status == TCP_STATUS_NO_STATUS) {
+        return -1;
+    }
+
+    if (!hash_index_remove(&shard->accepted_key_index, shard->accepted_connection_array[index].public_key, index)) {
+        return -1;
+    }
+
+    timer_unlink(shard, index);
+    ready_unlink(shard, index);
+    wipe_secure_connection(&shard->accepted_connection_array[index]);
+    --shard->num_accepted_connections;
+
+    if (shard->num_accepted_connections == 0) {
+        free_accepted_connection_array(shard);
+    } else {
+        shard->accepted_connection_array[index].next_free = shard->first_free;
+        shard->first_free = index;
+    }
+
+    return 0;
+}
+
+non_null()
+static int rm_connection_index(TCP_Shard *shard, TCP_Secure_Connection *con, uint8_t con_number);
+
+/** Kill an accepted TCP_Secure_Connection
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int kill_accepted(TCP_Shard *shard, int index)
+{
+    if ((uint32_t)index >= shard->size_accepted_connections) {
+        return -1;
+    }
+
+    TCP_Secure_Connection *con = &shard->accepted_connection_array[index];
 
-        if (other_id != (uint32_t) -1) {
-            con->connections[index].status = 2;
-            con->connections[index].index = other_index;
-            con->connections[index].other_id = other_id;
-            other_conn->connections[other_id].status = 2;
-            other_conn->connections[other_id].index = con_id;
-            other_conn->connections[other_id].other_id = index;
-            // TODO(irungentoo): return values?
-            send_connect_notification(tcp_server->logger, con, index);
-            send_connect_notification(tcp_server->logger, other_conn, other_id);
+    for (uint32_t i = 0; i < num_links(con); ++i) {
+        const TCP_Secure_Conn *link = link_at(con, i);
+
+        if (link->status != 0) {
+            rm_connection_index(shard, con, link->id);
         }
     }
 
+    Socket sock = shard->accepted_connection_array[index].con.sock;
+
+    if (del_accepted(shard, index) != 0) {
+        return -1;
+    }
+
+    kill_sock(sock);
     return 0;
 }
 
+/** Do the key exchange for the client handshake in data and create the server
+ * handshake to send back in response.
+ *
+ * Only touches con, so handshakes of different connections can be done at the
+ * same time on several threads.
+ *
+ * return 1 if everything went well.
+ * return -1 if the connection must be killed.
+ */
+non_null()
+static int handle_TCP_handshake(TCP_Secure_Connection *con, const uint8_t *data, const uint8_t *self_secret_key,
+                                uint8_t *response)
+{
+    uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
+    encrypt_precompute(data, self_secret_key, shared_key);
+    uint8_t plain[TCP_HANDSHAKE_PLAIN_SIZE];
+    int len = decrypt_data_symmetric(shared_key, data + CRYPTO_PUBLIC_KEY_SIZE,
+                                     data + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_NONCE_SIZE, TCP_HANDSHAKE_PLAIN_SIZE + CRYPTO_MAC_SIZE, plain);
+
+    if (len != TCP_HANDSHAKE_PLAIN_SIZE) {
+        crypto_memzero(shared_key, sizeof(shared_key));
+        return -1;
+    }
+
+    memcpy(con->public_key, data, CRYPTO_PUBLIC_KEY_SIZE);
+    uint8_t temp_secret_key[CRYPTO_SECRET_KEY_SIZE];
+    uint8_t resp_plain[TCP_HANDSHAKE_PLAIN_SIZE];
+    crypto_new_keypair(resp_plain, temp_secret_key);
+    random_nonce(con->con.sent_nonce);
+    memcpy(resp_plain + CRYPTO_PUBLIC_KEY_SIZE, con->con.sent_nonce, CRYPTO_NONCE_SIZE);
+    memcpy(con->recv_nonce, plain + CRYPTO_PUBLIC_KEY_SIZE, CRYPTO_NONCE_SIZE);
+
+    random_nonce(response);
+
+    len = encrypt_data_symmetric(shared_key, response, resp_plain, TCP_HANDSHAKE_PLAIN_SIZE,
+                                 response + CRYPTO_NONCE_SIZE);
+
+    crypto_memzero(shared_key, sizeof(shared_key));
+
+    if (len != TCP_HANDSHAKE_PLAIN_SIZE + CRYPTO_MAC_SIZE) {
+        crypto_memzero(temp_secret_key, sizeof(temp_secret_key));
+        return -1;
+    }
+
+    encrypt_precompute(plain, temp_secret_key, con->con.shared_key);
+    crypto_memzero(temp_secret_key, sizeof(temp_secret_key));
+
+    return 1;
+}
+
+/** Thread pool callback: do the key exchange of one Handshake_Job. */
+non_null()
+static void handshake_job(void *object, uint32_t index)
+{
+    TCP_Server *tcp_server = (TCP_Server *)object;
+    Handshake_Job *job = &tcp_server->handshake_jobs[index];
+    job->result = handle_TCP_handshake(&tcp_server->incoming.conns[job->index], job->data, tcp_server->secret_key,
+                                       job->response);
+}
+
+/** return 1 on success.
+ * return 0 if could not send packet.
+ * return -1 on failure (connection must be killed).
+ */
+non_null()
+static int send_routing_response(const Logger *logger, TCP_Secure_Connection *con, uint8_t rpid,
+                                 const uint8_t *public_key)
+{
+    uint8_t data[1 + 1 + CRYPTO_PUBLIC_KEY_SIZE];
+    data[0] = TCP_PACKET_ROUTING_RESPONSE;
+    data[1] = rpid;
+    memcpy(data + 2, public_key, CRYPTO_PUBLIC_KEY_SIZE);
+
+    return write_packet_TCP_secure_connection(logger, &con->con, data, sizeof(data), 1);
+}
+
+/** return 1 on success.
+ * return 0 if could not send packet.
+ * return -1 on failure (connection must be killed).
+ */
+non_null()
+static int send_connect_notification(const Logger *logger, TCP_Secure_Connection *con, uint8_t id)
+{
+    uint8_t data[2] = {TCP_PACKET_CONNECTION_NOTIFICATION, (uint8_t)(id + NUM_RESERVED_PORTS)};
+    return write_packet_TCP_secure_connection(logger, &con->con, data, sizeof(data), 1);
+}
+
+/** return 1 on success.
+ * return 0 if could not send packet.
+ * return -1 on failure (connection must be killed).
+ */
+non_null()
+static int send_disconnect_notification(const Logger *logger, TCP_Secure_Connection *con, uint8_t id)
+{
+    uint8_t data[2] = {TCP_PACKET_DISCONNECT_NOTIFICATION, (uint8_t)(id + NUM_RESERVED_PORTS)};
+    return write_packet_TCP_secure_connection(logger, &con->con, data, sizeof(data), 1);
+}
+
 /** return 0 on success.
  * return -1 on failure (connection must be killed).
  */
 non_null()
-static int handle_TCP_oob_send(TCP_Server *tcp_server, uint32_t con_id, const uint8_t *public_key, const uint8_t *data,
-                               uint16_t length)
+static int handle_TCP_routing_req(TCP_Shard *shard, uint32_t con_id, const uint8_t *public_key)
 {
-    if (length == 0 || length > TCP_MAX_OOB_DATA_LENGTH) {
+    TCP_Secure_Connection *con = &shard->accepted_connection_array[con_id];
+
+    /* If person tries to cennect to himself we deny the request*/
+    if (public_key_cmp(con->public_key, public_key) == 0) {
+        if (send_routing_response(shard->logger, con, 0, public_key) == -1) {
+            return -1;
+        }
+
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < num_links(con); ++i) {
+        const TCP_Secure_Conn *link = link_at(con, i);
+
+        if (link->status != 0 && public_key_cmp(public_key, link->public_key) == 0) {
+            if (send_routing_response(shard->logger, con, link->id + NUM_RESERVED_PORTS, public_key) == -1) {
+                return -1;
+            }
+
+            return 0;
+        }
+    }
+
+    TCP_Secure_Conn *link = new_link(con);
+
+    if (link == nullptr) {
+        if (send_routing_response(shard->logger, con, 0, public_key) == -1) {
+            return -1;
+        }
+
+        return 0;
+    }
+
+    const uint8_t index = link->id;
+    int ret = send_routing_response(shard->logger, con, index + NUM_RESERVED_PORTS, public_key);
+
+    if (ret == 0) {
+        return 0;
+    }
+
+    if (ret == -1) {
         return -1;
     }
 
-    const TCP_Secure_Connection *con = &tcp_server->accepted_connection_array[con_id];
+    link->status = 1;
+    memcpy(link->public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
+
+#ifdef TCP_SERVER_USE_EPOLL
+    const uint16_t other_shard = key_shard(shard->tcp_server, public_key);
+
+    if (other_shard != shard->id) {
+        /* The other shard links the two connections if the other side asked for it too. */
+        Shard_Message *msg = new_shard_message(&shard->message_pool, shard->logger, SHARD_MESSAGE_ROUTE, 0);
+
+        if (msg != nullptr) {
+            msg->shard = shard->id;
+            msg->index = con_id;
+            msg->con_id = index;
+            msg->identifier = con->identifier;
+            memcpy(msg->public_key, con->public_key, CRYPTO_PUBLIC_KEY_SIZE);
+            memcpy(msg->other_public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
+            shard_post(&shard->tcp_server->shards[other_shard], msg);
+        }
+
+        return 0;
+    }
+
+#endif
+    int other_index = get_TCP_connection_index(shard, public_key);
+
+    if (other_index != -1) {
+        TCP_Secure_Connection *other_conn = &shard->accepted_connection_array[other_index];
+
+        for (uint32_t i = 0; i < num_links(other_conn); ++i) {
+            TCP_Secure_Conn *other_link = link_at(other_conn, i);
+
+            if (other_link->status == 1 && public_key_cmp(other_link->public_key, con->public_key) == 0) {
+                link->status = 2;
+                link->index = other_index;
+                link->other_id = other_link->id;
+                link->shard = shard->id;
+                other_link->status = 2;
+                other_link->index = con_id;
+                other_link->other_id = index;
+                other_link->shard = shard->id;
+                // TODO(irungentoo): return values?
+                send_connect_notification(shard->logger, con, index);
+                send_connect_notification(shard->logger, other_conn, other_link->id);
+                break;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/** return 0 on success.
+ * return -1 on failure (connection must be killed).
+ */
+non_null()
+static int handle_TCP_oob_send(TCP_Shard *shard, uint32_t con_id, const uint8_t *public_key, const uint8_t *data,
+                               uint16_t length)
+{
+    if (length == 0 || length > TCP_MAX_OOB_DATA_LENGTH) {
+        return -1;
+    }
+
+    const TCP_Secure_Connection *con = &shard->accepted_connection_array[con_id];
+
+#ifdef TCP_SERVER_USE_EPOLL
+    const uint16_t other_shard = key_shard(shard->tcp_server, public_key);
+
+    if (other_shard != shard->id) {
+        Shard_Message *msg = new_shard_message(&shard->message_pool, shard->logger, SHARD_MESSAGE_OOB,
+                                               1 + CRYPTO_PUBLIC_KEY_SIZE + length);
+
+        if (msg != nullptr) {
+            msg->data[0] = TCP_PACKET_OOB_RECV;
+            memcpy(msg->data + 1, con->public_key, CRYPTO_PUBLIC_KEY_SIZE);
+            memcpy(msg->data + 1 + CRYPTO_PUBLIC_KEY_SIZE, data, length);
+            memcpy(msg->other_public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
+            shard_post(&shard->tcp_server->shards[other_shard], msg);
+            shard->forwarded += 1 + CRYPTO_PUBLIC_KEY_SIZE + length;
+        }
+
+        return 0;
+    }
+
+#endif
+    int other_index = get_TCP_connection_index(shard, public_key);
+
+    if (other_index != -1) {
+        VLA(uint8_t, resp_packet, 1 + CRYPTO_PUBLIC_KEY_SIZE + length);
+        resp_packet[0] = TCP_PACKET_OOB_RECV;
+        memcpy(resp_packet + 1, con->public_key, CRYPTO_PUBLIC_KEY_SIZE);
+        memcpy(resp_packet + 1 + CRYPTO_PUBLIC_KEY_SIZE, data, length);
+        write_packet_TCP_secure_connection(shard->logger, &shard->accepted_connection_array[other_index].con,
+                                           resp_packet, SIZEOF_VLA(resp_packet), 0);
+        shard->forwarded += SIZEOF_VLA(resp_packet);
+    }
+
+    return 0;
+}
+
+/** Tell the connection at the other end of the link of con that con disconnected from it.
+ *
+ * return false if the link is invalid.
+ */
+non_null()
+static bool unlink_other(TCP_Shard *shard, const TCP_Secure_Connection *con, const TCP_Secure_Conn *link)
+{
+    const uint32_t index = link->index;
+    const uint8_t other_id = link->other_id;
+
+#ifdef TCP_SERVER_USE_EPOLL
+
+    if (link->shard != shard->id) {
+        Shard_Message *msg = new_shard_message(&shard->message_pool, shard->logger, SHARD_MESSAGE_UNLINK, 0);
+
+        if (msg != nullptr) {
+            msg->shard = shard->id;
+            msg->index = index;
+            msg->con_id = other_id;
+            msg->other_index = con - shard->accepted_connection_array;
+            msg->other_id = link->id;
+            shard_post(&shard->tcp_server->shards[link->shard], msg);
+        }
+
+        return true;
+    }
+
+#endif
+
+    if (index >= shard->size_accepted_connections) {
+        return false;
+    }
+
+    TCP_Secure_Conn *other_link = get_link(&shard->accepted_connection_array[index], other_id);
+
+    if (other_link == nullptr) {
+        return false;
+    }
+
+    other_link->other_id = 0;
+    other_link->index = 0;
+    other_link->status = 1;
+    // TODO(irungentoo): return values?
+    send_disconnect_notification(shard->logger, &shard->accepted_connection_array[index], other_id);
+    return true;
+}
+
+/** Remove connection with con_number from the connections array of con.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int rm_connection_index(TCP_Shard *shard, TCP_Secure_Connection *con, uint8_t con_number)
+{
+    if (con_number >= NUM_CLIENT_CONNECTIONS) {
+        return -1;
+    }
+
+    TCP_Secure_Conn *link = get_link(con, con_number);
+
+    if (link != nullptr) {
+        if (link->status == 2 && !unlink_other(shard, con, link)) {
+            return -1;
+        }
+
+        link->index = 0;
+        link->other_id = 0;
+        link->status = 0;
+        return 0;
+    }
+
+    return -1;
+}
+
+non_null()
+static int handle_onion_recv_1(void *object, const IP_Port *dest, const uint8_t *data, uint16_t length)
+{
+    TCP_Server *tcp_server = (TCP_Server *)object;
+    const uint32_t index = dest->ip.ip.v6.uint32[0];
+    const uint32_t shard_id = dest->ip.ip.v6.uint32[1];
+
+    if (shard_id >= tcp_server->num_shards) {
+        return 1;
+    }
+
+    TCP_Shard *shard = &tcp_server->shards[shard_id];
+
+#ifdef TCP_SERVER_USE_EPOLL
+
+    if (tcp_server->sharded) {
+        Shard_Message *msg = new_shard_message(&tcp_server->message_pool, tcp_server->logger,
+                                               SHARD_MESSAGE_ONION_RESPONSE, 1 + length);
+
+        if (msg == nullptr) {
+            return 1;
+        }
+
+        msg->index = index;
+        msg->identifier = dest->ip.ip.v6.uint64[1];
+        msg->data[0] = TCP_PACKET_ONION_RESPONSE;
+        memcpy(msg->data + 1, data, length);
+        shard_post(shard, msg);
+        return 0;
+    }
+
+#endif
+
+    if (index >= shard->size_accepted_connections) {
+        return 1;
+    }
+
+    TCP_Secure_Connection *con = &shard->accepted_connection_array[index];
+
+    if (con->identifier != dest->ip.ip.v6.uint64[1]) {
+        return 1;
+    }
+
+    VLA(uint8_t, packet, 1 + length);
+    memcpy(packet + 1, data, length);
+    packet[0] = TCP_PACKET_ONION_RESPONSE;
+
+    if (write_packet_TCP_secure_connection(tcp_server->logger, &con->con, packet, SIZEOF_VLA(packet), 0) != 1) {
+        return 1;
+    }
+
+    return 0;
+}
+
+/** return 0 on success
+ * return -1 on failure
+ */
+non_null()
+static int handle_TCP_packet(TCP_Shard *shard, uint32_t con_id, const uint8_t *data, uint16_t length)
+{
+    if (length == 0) {
+        return -1;
+    }
+
+    TCP_Secure_Connection *const con = &shard->accepted_connection_array[con_id];
+
+    switch (data[0]) {
+        case TCP_PACKET_ROUTING_REQUEST: {
+            if (length != 1 + CRYPTO_PUBLIC_KEY_SIZE) {
+                return -1;
+            }
+
+            LOGGER_TRACE(shard->logger, "handling routing request for %d", con_id);
+            return handle_TCP_routing_req(shard, con_id, data + 1);
+        }
+
+        case TCP_PACKET_CONNECTION_NOTIFICATION: {
+            if (length != 2) {
+                return -1;
+            }
+
+            LOGGER_TRACE(shard->logger, "handling connection notification for %d", con_id);
+            break;
+        }
+
+        case TCP_PACKET_DISCONNECT_NOTIFICATION: {
+            if (length != 2) {
+                return -1;
+            }
+
+            LOGGER_TRACE(shard->logger, "handling disconnect notification for %d", con_id);
+            return rm_connection_index(shard, con, data[1] - NUM_RESERVED_PORTS);
+        }
+
+        case TCP_PACKET_PING: {
+            if (length != 1 + sizeof(uint64_t)) {
+                return -1;
+            }
+
+            LOGGER_TRACE(shard->logger, "handling ping for %d", con_id);
+
+            uint8_t response[1 + sizeof(uint64_t)];
+            response[0] = TCP_PACKET_PONG;
+            memcpy(response + 1, data + 1, sizeof(uint64_t));
+            write_packet_TCP_secure_connection(shard->logger, &con->con, response, sizeof(response), 1);
+            return 0;
+        }
+
+        case TCP_PACKET_PONG: {
+            if (length != 1 + sizeof(uint64_t)) {
+                return -1;
+            }
+
+            LOGGER_TRACE(shard->logger, "handling pong for %d", con_id);
+
+            uint64_t ping_id;
+            memcpy(&ping_id, data + 1, sizeof(uint64_t));
+
+            if (ping_id) {
+                if (ping_id == con->ping_id) {
+                    con->ping_id = 0;
+                }
+
+                return 0;
+            }
+
+            return -1;
+        }
+
+        case TCP_PACKET_OOB_SEND: {
+            if (length <= 1 + CRYPTO_PUBLIC_KEY_SIZE) {
+                return -1;
+            }
+
+            LOGGER_TRACE(shard->logger, "handling oob send for %d", con_id);
+
+            if (!take_tokens(shard, con, TCP_TRAFFIC_OOB, length)) {
+                LOGGER_TRACE(shard->logger, "dropping oob packet of %d: over rate limit", con_id);
+                return 0;
+            }
+
+            return handle_TCP_oob_send(shard, con_id, data + 1, data + 1 + CRYPTO_PUBLIC_KEY_SIZE,
+                                       length - (1 + CRYPTO_PUBLIC_KEY_SIZE));
+        }
+
+        case TCP_PACKET_ONION_REQUEST: {
+            LOGGER_TRACE(shard->logger, "handling onion request for %d", con_id);
+
+            if (shard->tcp_server->onion) {
+                if (length <= 1 + CRYPTO_NONCE_SIZE + ONION_SEND_BASE * 2) {
+                    return -1;
+                }
+
+                if (!take_tokens(shard, con, TCP_TRAFFIC_ONION, length)) {
+                    LOGGER_TRACE(shard->logger, "dropping onion request of %d: over rate limit", con_id);
+                    return 0;
+                }
+
+#ifdef TCP_SERVER_USE_EPOLL
+
+                if (shard->tcp_server->sharded) {
+                    /* The onion is not thread safe, the main thread sends it. */
+                    Shard_Message *msg = new_shard_message(&shard->message_pool, shard->logger,
+                                                           SHARD_MESSAGE_ONION_REQUEST, length);
+
+                    if (msg != nullptr) {
+                        msg->shard = shard->id;
+                        msg->index = con_id;
+                        msg->identifier = con->identifier;
+                        memcpy(msg->data, data, length);
+                        mailbox_push(&shard->tcp_server->mailbox, msg);
+                        shard->forwarded += length;
+                    }
+
+                    return 0;
+                }
+
+#endif
+                shard->forwarded += length;
+
+                IP_Port source;
+                source.port = 0;  // dummy initialise
+                source.ip.family = net_family_tcp_onion;
+                source.ip.ip.v6.uint32[0] = con_id;
+                source.ip.ip.v6.uint32[1] = shard->id;
+                source.ip.ip.v6.uint64[1] = con->identifier;
+                onion_send_1(shard->tcp_server->onion, data + 1 + CRYPTO_NONCE_SIZE, length - (1 + CRYPTO_NONCE_SIZE), &source,
+                             data + 1);
+            }
+
+            return 0;
+        }
+
+        case TCP_PACKET_ONION_RESPONSE: {
+            LOGGER_TRACE(shard->logger, "handling onion response for %d", con_id);
+            return -1;
+        }
+
+        default: {
+            if (data[0] < NUM_RESERVED_PORTS) {
+                return -1;
+            }
+
+            const uint8_t c_id = data[0] - NUM_RESERVED_PORTS;
+            LOGGER_TRACE(shard->logger, "handling packet id %d for %d", c_id, con_id);
+
+            if (c_id >= NUM_CLIENT_CONNECTIONS) {
+                return -1;
+            }
+
+            const TCP_Secure_Conn *link = get_link(con, c_id);
+
+            if (link == nullptr) {
+                return -1;
+            }
+
+            if (link->status != 2) {
+                return 0;
+            }
+
+            if (!take_tokens(shard, con, TCP_TRAFFIC_DATA, length)) {
+                LOGGER_TRACE(shard->logger, "dropping data packet of %d: over rate limit", con_id);
+                return 0;
+            }
+
+            const uint32_t index = link->index;
+            const uint8_t other_c_id = link->other_id + NUM_RESERVED_PORTS;
+
+#ifdef TCP_SERVER_USE_EPOLL
+
+            if (link->shard != shard->id) {
+                Shard_Message *msg = new_shard_message(&shard->message_pool, shard->logger, SHARD_MESSAGE_DATA, length);
+
+                if (msg != nullptr) {
+                    msg->shard = shard->id;
+                    msg->index = index;
+                    msg->con_id = link->other_id;
+                    msg->other_index = con_id;
+                    msg->other_id = c_id;
+                    memcpy(msg->data, data, length);
+                    msg->data[0] = other_c_id;
+                    shard_post(&shard->tcp_server->shards[link->shard], msg);
+                    shard->forwarded += length;
+                }
+
+                return 0;
+            }
+
+#endif
+            VLA(uint8_t, new_data, length);
+            memcpy(new_data, data, length);
+            new_data[0] = other_c_id;
+            const int ret = write_packet_TCP_secure_connection(shard->logger,
+                            &shard->accepted_connection_array[index].con, new_data, length, 0);
+            shard->forwarded += length;
+
+            if (ret == -1) {
+                return -1;
+            }
+
+            return 0;
+        }
+    }
+
+    return 0;
+}
+
+
+non_null()
+static int confirm_TCP_connection(TCP_Shard *shard, const Mono_Time *mono_time, TCP_Secure_Connection *con,
+                                  const uint8_t *data, uint16_t length)
+{
+    const int index = add_accepted(shard, mono_time, con);
+
+    if (index == -1) {
+        LOGGER_DEBUG(shard->logger, "dropping connection %u: not accepted", (unsigned int)con->identifier);
+        kill_TCP_secure_connection(con);
+        return -1;
+    }
+
+    wipe_secure_connection(con);
+
+    if (handle_TCP_packet(shard, index, data, length) == -1) {
+        LOGGER_DEBUG(shard->logger, "dropping connection %u: data packet (len=%d) not handled",
+                     (unsigned int)con->identifier, length);
+        kill_accepted(shard, index);
+        return -1;
+    }
+
+    return index;
+}
+
+/** return length of the packet that was read and handled.
+ * return 0 if there was none or the connection was killed.
+ */
+non_null()
+static int tcp_process_secure_packet(TCP_Shard *shard, uint32_t i)
+{
+    TCP_Secure_Connection *const conn = &shard->accepted_connection_array[i];
+
+    uint8_t packet[MAX_PACKET_SIZE];
+    const int len = read_packet_TCP_secure_connection(shard->logger, &conn->con, conn->recv_nonce, packet,
+                    sizeof(packet));
+    LOGGER_TRACE(shard->logger, "processing packet for %d: %d", i, len);
+
+    if (len == 0) {
+        return 0;
+    }
+
+    if (len == -1) {
+        kill_accepted(shard, i);
+        return 0;
+    }
+
+    if (handle_TCP_packet(shard, i, packet, len) == -1) {
+        LOGGER_TRACE(shard->logger, "dropping connection %d: data packet (len=%d) not handled", i, len);
+        kill_accepted(shard, i);
+        return 0;
+    }
+
+    return len;
+}
+
+#ifdef TCP_SERVER_USE_EPOLL
+/** Flush the send queue of a connection whose socket became writable.
+ *
+ * Sockets only have queued data after a send filled them up, so the edge
+ * triggered EPOLLOUT that follows is enough and idle connections are never
+ * looked at.
+ */
+non_null()
+static void do_confirmed_send(TCP_Shard *shard, uint32_t i)
+{
+    if (i >= shard->size_accepted_connections) {
+        return;
+    }
+
+    TCP_Secure_Connection *conn = &shard->accepted_connection_array[i];
+
+    if (conn->status == TCP_STATUS_CONFIRMED) {
+        send_pending_data(shard->logger, &conn->con);
+    }
+}
+#endif
+
+/** Have do_ready_connections() read the packets of a confirmed connection. */
+non_null()
+static void queue_confirmed_recv(TCP_Shard *shard, uint32_t i)
+{
+    if (i < shard->size_accepted_connections && shard->accepted_connection_array[i].status == TCP_STATUS_CONFIRMED) {
+        ready_push(shard, i);
+    }
+}
+
+/** Read the packets of the connections in the ready list. They take turns,
+ * each reading and forwarding TCP_RECV_QUANTUM more bytes per turn (deficit
+ * round robin), so that a client sending a lot does not hold up the packets
+ * of the others. Stops after TCP_READY_BUDGET bytes.
+ *
+ * return true if connections are left with packets to read.
+ */
+non_null()
+static bool do_ready_connections(TCP_Shard *shard, const Mono_Time *mono_time)
+{
+    shard->cur_time = mono_time_get(mono_time);
+    int32_t budget = TCP_READY_BUDGET;
+
+    while (shard->ready_head != TCP_TIMER_NONE) {
+        if (budget <= 0) {
+            return true;
+        }
+
+        const uint32_t i = shard->ready_head;
+        ready_unlink(shard, i);
+        shard->accepted_connection_array[i].deficit += TCP_RECV_QUANTUM;
 
-    int other_index = get_TCP_connection_index(tcp_server, public_key);
+        bool more = false;
 
-    if (other_index != -1) {
-        VLA(uint8_t, resp_packet, 1 + CRYPTO_PUBLIC_KEY_SIZE + length);
-        resp_packet[0] = TCP_PACKET_OOB_RECV;
-        memcpy(resp_packet + 1, con->public_key, CRYPTO_PUBLIC_KEY_SIZE);
-        memcpy(resp_packet + 1 + CRYPTO_PUBLIC_KEY_SIZE, data, length);
-        write_packet_TCP_secure_connection(tcp_server->logger, &tcp_server->accepted_connection_array[other_index].con,
-                                           resp_packet, SIZEOF_VLA(resp_packet), 0);
+        do {
+            shard->forwarded = 0;
+            const int len = tcp_process_secure_packet(shard, i);
+            more = len > 0;
+
+            if (!more) {
+                break;
+            }
+
+            const int32_t cost = len + shard->forwarded;
+            budget -= cost;
+            shard->accepted_connection_array[i].deficit -= cost;
+        } while (shard->accepted_connection_array[i].deficit > 0);
+
+        if (!more) {
+            /* The connection may be gone. */
+            if (i < shard->size_accepted_connections) {
+                shard->accepted_connection_array[i].deficit = 0;
+            }
+
+            continue;
+        }
+
+        ready_push(shard, i);
     }
 
-    return 0;
+    return false;
 }
 
-/** Remove connection with con_number from the connections array of con.
- *
- * return -1 on failure.
- * return 0 on success.
+#ifdef TCP_SERVER_USE_EPOLL
+/** return the confirmed connection at index if its slot con_id is linked to
+ *   slot other_id of the connection at other_index in shard other_shard.
+ * return nullptr otherwise.
  */
-static int rm_connection_index(TCP_Server *tcp_server, TCP_Secure_Connection *con, uint8_t con_number)
+non_null()
+static TCP_Secure_Connection *get_linked_connection(TCP_Shard *shard, uint32_t index, uint8_t con_id,
+        uint16_t other_shard, uint32_t other_index, uint8_t other_id)
 {
-    if (con_number >= NUM_CLIENT_CONNECTIONS) {
-        return -1;
+    if (index >= shard->size_accepted_connections || con_id >= NUM_CLIENT_CONNECTIONS) {
+        return nullptr;
     }
 
-    if (con->connections[con_number].status) {
-        if (con->connections[con_number].status == 2) {
-            const uint32_t index = con->connections[con_number].index;
-            const uint8_t other_id = con->connections[con_number].other_id;
+    TCP_Secure_Connection *con = &shard->accepted_connection_array[index];
 
-            if (index >= tcp_server->size_accepted_connections) {
-                return -1;
-            }
+    if (con->status != TCP_STATUS_CONFIRMED) {
+        return nullptr;
+    }
 
-            tcp_server->accepted_connection_array[index].connections[other_id].other_id = 0;
-            tcp_server->accepted_connection_array[index].connections[other_id].index = 0;
-            tcp_server->accepted_connection_array[index].connections[other_id].status = 1;
-            // TODO(irungentoo): return values?
-            send_disconnect_notification(tcp_server->logger, &tcp_server->accepted_connection_array[index], other_id);
-        }
+    const TCP_Secure_Conn *link = get_link(con, con_id);
 
-        con->connections[con_number].index = 0;
-        con->connections[con_number].other_id = 0;
-        con->connections[con_number].status = 0;
-        return 0;
+    if (link == nullptr || link->status != 2 || link->shard != other_shard
+            || link->index != other_index || link->other_id != other_id) {
+        return nullptr;
     }
 
-    return -1;
+    return con;
 }
 
 non_null()
-static int handle_onion_recv_1(void *object, const IP_Port *dest, const uint8_t *data, uint16_t length)
+static void post_unlink(TCP_Shard *shard, uint16_t other_shard, uint32_t other_index, uint8_t other_id,
+                        uint32_t index, uint8_t con_id)
 {
-    TCP_Server *tcp_server = (TCP_Server *)object;
-    uint32_t index = dest->ip.ip.v6.uint32[0];
+    Shard_Message *msg = new_shard_message(&shard->message_pool, shard->logger, SHARD_MESSAGE_UNLINK, 0);
 
-    if (index >= tcp_server->size_accepted_connections) {
-        return 1;
+    if (msg != nullptr) {
+        msg->shard = shard->id;
+        msg->index = other_index;
+        msg->con_id = other_id;
+        msg->other_index = index;
+        msg->other_id = con_id;
+        shard_post(&shard->tcp_server->shards[other_shard], msg);
     }
+}
 
-    TCP_Secure_Connection *con = &tcp_server->accepted_connection_array[index];
+/** Add a connection that was just confirmed on the shard to its epoll set. */
+non_null()
+static void shard_watch_connection(TCP_Shard *shard, Socket sock, int index)
+{
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP;
+    ev.data.u64 = sock.socket | ((uint64_t)TCP_SOCKET_CONFIRMED << 32) | ((uint64_t)index << 40);
 
-    if (con->identifier != dest->ip.ip.v6.uint64[1]) {
-        return 1;
+    if (epoll_ctl(shard->efd, EPOLL_CTL_ADD, sock.socket, &ev) == -1) {
+        LOGGER_DEBUG(shard->logger, "confirmed connection %d was dropped due to epoll error %d", index, net_error());
+        kill_accepted(shard, index);
+        return;
     }
 
-    VLA(uint8_t, packet, 1 + length);
-    memcpy(packet + 1, data, length);
-    packet[0] = TCP_PACKET_ONION_RESPONSE;
+    /* Packets that came with the first one are already in the receive buffer. */
+    queue_confirmed_recv(shard, index);
+}
 
-    if (write_packet_TCP_secure_connection(tcp_server->logger, &con->con, packet, SIZEOF_VLA(packet), 0) != 1) {
-        return 1;
-    }
+non_null()
+static void handle_shard_adopt(TCP_Shard *shard, Shard_Message *msg)
+{
+    /* The connection is moved out of the message or killed either way. */
+    const Socket sock = msg->con.con.sock;
+    const int index = confirm_TCP_connection(shard, shard->tcp_server->mono_time, &msg->con, msg->data, msg->length);
 
-    return 0;
+    if (index != -1) {
+        shard_watch_connection(shard, sock, index);
+    }
 }
 
-/** return 0 on success
- * return -1 on failure
+/** Link the connections if the other side asked for a route to the sender too,
+ * like handle_TCP_routing_req() does for connections on the same shard.
  */
 non_null()
-static int handle_TCP_packet(TCP_Server *tcp_server, uint32_t con_id, const uint8_t *data, uint16_t length)
+static void handle_shard_route(TCP_Shard *shard, const Shard_Message *msg)
 {
-    if (length == 0) {
-        return -1;
+    const int index = get_TCP_connection_index(shard, msg->other_public_key);
+
+    if (index == -1) {
+        return;
     }
 
-    TCP_Secure_Connection *const con = &tcp_server->accepted_connection_array[con_id];
+    TCP_Secure_Connection *con = &shard->accepted_connection_array[index];
 
-    switch (data[0]) {
-        case TCP_PACKET_ROUTING_REQUEST: {
-            if (length != 1 + CRYPTO_PUBLIC_KEY_SIZE) {
-                return -1;
-            }
+    for (uint32_t i = 0; i < num_links(con); ++i) {
+        TCP_Secure_Conn *link = link_at(con, i);
 
-            LOGGER_TRACE(tcp_server->logger, "handling routing request for %d", con_id);
-            return handle_TCP_routing_req(tcp_server, con_id, data + 1);
+        if (link->status != 1 || public_key_cmp(link->public_key, msg->public_key) != 0) {
+            continue;
         }
 
-        case TCP_PACKET_CONNECTION_NOTIFICATION: {
-            if (length != 2) {
-                return -1;
-            }
+        Shard_Message *reply = new_shard_message(&shard->message_pool, shard->logger, SHARD_MESSAGE_LINK, 0);
 
-            LOGGER_TRACE(tcp_server->logger, "handling connection notification for %d", con_id);
-            break;
+        if (reply == nullptr) {
+            return;
         }
 
-        case TCP_PACKET_DISCONNECT_NOTIFICATION: {
-            if (length != 2) {
-                return -1;
-            }
+        link->status = 2;
+        link->index = msg->index;
+        link->other_id = msg->con_id;
+        link->shard = msg->shard;
+        send_connect_notification(shard->logger, con, link->id);
+
+        reply->shard = shard->id;
+        reply->index = msg->index;
+        reply->con_id = msg->con_id;
+        reply->identifier = msg->identifier;
+        reply->other_index = index;
+        reply->other_id = link->id;
+        memcpy(reply->public_key, con->public_key, CRYPTO_PUBLIC_KEY_SIZE);
+        shard_post(&shard->tcp_server->shards[msg->shard], reply);
+        return;
+    }
+}
 
-            LOGGER_TRACE(tcp_server->logger, "handling disconnect notification for %d", con_id);
-            return rm_connection_index(tcp_server, con, data[1] - NUM_RESERVED_PORTS);
+non_null()
+static void handle_shard_link(TCP_Shard *shard, const Shard_Message *msg)
+{
+    if (msg->index < shard->size_accepted_connections) {
+        TCP_Secure_Connection *con = &shard->accepted_connection_array[msg->index];
+        TCP_Secure_Conn *link = con->status == TCP_STATUS_CONFIRMED ? get_link(con, msg->con_id) : nullptr;
+
+        if (link != nullptr && con->identifier == msg->identifier && link->status == 1
+                && public_key_cmp(link->public_key, msg->public_key) == 0) {
+            link->status = 2;
+            link->index = msg->other_index;
+            link->other_id = msg->other_id;
+            link->shard = msg->shard;
+            send_connect_notification(shard->logger, con, msg->con_id);
+            return;
         }
 
-        case TCP_PACKET_PING: {
-            if (length != 1 + sizeof(uint64_t)) {
-                return -1;
-            }
-
-            LOGGER_TRACE(tcp_server->logger, "handling ping for %d", con_id);
-
-            uint8_t response[1 + sizeof(uint64_t)];
-            response[0] = TCP_PACKET_PONG;
-            memcpy(response + 1, data + 1, sizeof(uint64_t));
-            write_packet_TCP_secure_connection(tcp_server->logger, &con->con, response, sizeof(response), 1);
-            return 0;
+        if (get_linked_connection(shard, msg->index, msg->con_id, msg->shard, msg->other_index, msg->other_id) != nullptr) {
+            /* Both sides asked for the route at the same time. */
+            return;
         }
+    }
 
-        case TCP_PACKET_PONG: {
-            if (length != 1 + sizeof(uint64_t)) {
-                return -1;
-            }
-
-            LOGGER_TRACE(tcp_server->logger, "handling pong for %d", con_id);
+    /* The connection went away while the other shard was linking it. */
+    post_unlink(shard, msg->shard, msg->other_index, msg->other_id, msg->index, msg->con_id);
+}
 
-            uint64_t ping_id;
-            memcpy(&ping_id, data + 1, sizeof(uint64_t));
+non_null()
+static void handle_shard_unlink(TCP_Shard *shard, const Shard_Message *msg)
+{
+    TCP_Secure_Connection *con = get_linked_connection(shard, msg->index, msg->con_id, msg->shard, msg->other_index,
+                                 msg->other_id);
 
-            if (ping_id) {
-                if (ping_id == con->ping_id) {
-                    con->ping_id = 0;
-                }
+    if (con == nullptr) {
+        return;
+    }
 
-                return 0;
-            }
+    TCP_Secure_Conn *link = get_link(con, msg->con_id);
+    link->other_id = 0;
+    link->index = 0;
+    link->status = 1;
+    send_disconnect_notification(shard->logger, con, msg->con_id);
+}
 
-            return -1;
+non_null()
+static void handle_shard_message(TCP_Shard *shard, Shard_Message *msg)
+{
+    switch (msg->type) {
+        case SHARD_MESSAGE_ADOPT: {
+            handle_shard_adopt(shard, msg);
+            break;
         }
 
-        case TCP_PACKET_OOB_SEND: {
-            if (length <= 1 + CRYPTO_PUBLIC_KEY_SIZE) {
-                return -1;
-            }
-
-            LOGGER_TRACE(tcp_server->logger, "handling oob send for %d", con_id);
+        case SHARD_MESSAGE_ROUTE: {
+            handle_shard_route(shard, msg);
+            break;
+        }
 
-            return handle_TCP_oob_send(tcp_server, con_id, data + 1, data + 1 + CRYPTO_PUBLIC_KEY_SIZE,
-                                       length - (1 + CRYPTO_PUBLIC_KEY_SIZE));
+        case SHARD_MESSAGE_LINK: {
+            handle_shard_link(shard, msg);
+            break;
         }
 
-        case TCP_PACKET_ONION_REQUEST: {
-            LOGGER_TRACE(tcp_server->logger, "handling onion request for %d", con_id);
+        case SHARD_MESSAGE_UNLINK: {
+            handle_shard_unlink(shard, msg);
+            break;
+        }
 
-            if (tcp_server->onion) {
-                if (length <= 1 + CRYPTO_NONCE_SIZE + ONION_SEND_BASE * 2) {
-                    return -1;
-                }
+        case SHARD_MESSAGE_DATA: {
+            TCP_Secure_Connection *con = get_linked_connection(shard, msg->index, msg->con_id, msg->shard,
+                                         msg->other_index, msg->other_id);
 
-                IP_Port source;
-                source.port = 0;  // dummy initialise
-                source.ip.family = net_family_tcp_onion;
-                source.ip.ip.v6.uint32[0] = con_id;
-                source.ip.ip.v6.uint32[1] = 0;
-                source.ip.ip.v6.uint64[1] = con->identifier;
-                onion_send_1(tcp_server->onion, data + 1 + CRYPTO_NONCE_SIZE, length - (1 + CRYPTO_NONCE_SIZE), &source,
-                             data + 1);
+            if (con != nullptr) {
+                write_packet_TCP_secure_connection(shard->logger, &con->con, msg->data, msg->length, 0);
             }
 
-            return 0;
+            break;
         }
 
-        case TCP_PACKET_ONION_RESPONSE: {
-            LOGGER_TRACE(tcp_server->logger, "handling onion response for %d", con_id);
-            return -1;
-        }
+        case SHARD_MESSAGE_OOB: {
+            const int index = get_TCP_connection_index(shard, msg->other_public_key);
 
-        default: {
-            if (data[0] < NUM_RESERVED_PORTS) {
-                return -1;
+            if (index != -1) {
+                write_packet_TCP_secure_connection(shard->logger, &shard->accepted_connection_array[index].con,
+                                                   msg->data, msg->length, 0);
             }
 
-            const uint8_t c_id = data[0] - NUM_RESERVED_PORTS;
-            LOGGER_TRACE(tcp_server->logger, "handling packet id %d for %d", c_id, con_id);
+            break;
+        }
 
-            if (c_id >= NUM_CLIENT_CONNECTIONS) {
-                return -1;
+        case SHARD_MESSAGE_ONION_RESPONSE: {
+            if (msg->index >= shard->size_accepted_connections) {
+                break;
             }
 
-            if (con->connections[c_id].status == 0) {
-                return -1;
-            }
+            TCP_Secure_Connection *con = &shard->accepted_connection_array[msg->index];
 
-            if (con->connections[c_id].status != 2) {
-                return 0;
+            if (con->identifier == msg->identifier) {
+                write_packet_TCP_secure_connection(shard->logger, &con->con, msg->data, msg->length, 0);
             }
 
-            const uint32_t index = con->connections[c_id].index;
-            const uint8_t other_c_id = con->connections[c_id].other_id + NUM_RESERVED_PORTS;
-            VLA(uint8_t, new_data, length);
-            memcpy(new_data, data, length);
-            new_data[0] = other_c_id;
-            const int ret = write_packet_TCP_secure_connection(tcp_server->logger,
-                            &tcp_server->accepted_connection_array[index].con, new_data, length, 0);
-
-            if (ret == -1) {
-                return -1;
-            }
+            break;
+        }
 
-            return 0;
+        case SHARD_MESSAGE_ONION_REQUEST: {
+            LOGGER_ERROR(shard->logger, "onion request sent to shard %d", shard->id);
+            break;
         }
     }
+}
 
-    return 0;
+/** Pass the onion requests received by the shards to the onion. */
+non_null()
+static void do_TCP_mailbox(TCP_Server *tcp_server)
+{
+    Shard_Message *msg;
+
+    while ((msg = mailbox_pop(&tcp_server->mailbox)) != nullptr) {
+        if (msg->type == SHARD_MESSAGE_ONION_REQUEST && tcp_server->onion != nullptr) {
+            IP_Port source;
+            source.port = 0;  // dummy initialise
+            source.ip.family = net_family_tcp_onion;
+            source.ip.ip.v6.uint32[0] = msg->index;
+            source.ip.ip.v6.uint32[1] = msg->shard;
+            source.ip.ip.v6.uint64[1] = msg->identifier;
+            onion_send_1(tcp_server->onion, msg->data + 1 + CRYPTO_NONCE_SIZE, msg->length - (1 + CRYPTO_NONCE_SIZE),
+                         &source, msg->data + 1);
+        }
+
+        free_shard_message(msg);
+    }
 }
 
+/** Move a connection that just sent its first packet to the shard of its public key. */
+non_null()
+static void hand_over_connection(TCP_Server *tcp_server, TCP_Secure_Connection *conn, const uint8_t *data,
+                                 uint16_t length)
+{
+    struct epoll_event ev = {0};
+
+    if (epoll_ctl(tcp_server->efd, EPOLL_CTL_DEL, conn->con.sock.socket, &ev) == -1) {
+        LOGGER_DEBUG(tcp_server->logger, "could not remove connection from epoll: %d", net_error());
+    }
+
+    Shard_Message *msg = new_shard_message(&tcp_server->message_pool, tcp_server->logger, SHARD_MESSAGE_ADOPT, length);
+
+    if (msg == nullptr) {
+        kill_TCP_secure_connection(conn);
+        return;
+    }
+
+    move_secure_connection(&msg->con, conn);
+    memcpy(msg->data, data, length);
+    shard_post(&tcp_server->shards[key_shard(tcp_server, msg->con.public_key)], msg);
+}
+#endif
 
+/** Find a slot for a new connection in the queue, growing it if the next slot
+ * is in use and the queue is smaller than max_size. If it can't grow, the
+ * connection in the next slot is dropped.
+ *
+ * return index of the slot on success.
+ * return -1 on allocation failure.
+ */
 non_null()
-static int confirm_TCP_connection(TCP_Server *tcp_server, const Mono_Time *mono_time, TCP_Secure_Connection *con,
-                                  const uint8_t *data, uint16_t length)
+static int pending_queue_slot(const Logger *logger, TCP_Pending_Queue *queue, uint32_t max_size)
 {
-    const int index = add_accepted(tcp_server, mono_time, con);
+    uint32_t index = 0;
 
-    if (index == -1) {
-        LOGGER_DEBUG(tcp_server->logger, "dropping connection %u: not accepted", (unsigned int)con->identifier);
-        kill_TCP_secure_connection(con);
-        return -1;
+    if (queue->size > 0) {
+        index = queue->index % queue->size;
+
+        if (queue->conns[index].status == TCP_STATUS_NO_STATUS) {
+            queue->index = index + 1;
+            return index;
+        }
     }
 
-    wipe_secure_connection(con);
+    if (queue->size < max_size) {
+        const uint32_t new_size = min_u32(max_u32(TCP_PENDING_QUEUE_MIN_SIZE, queue->size * 2), max_size);
+        TCP_Secure_Connection *new_conns = (TCP_Secure_Connection *)realloc(queue->conns,
+                                           new_size * sizeof(TCP_Secure_Connection));
 
-    if (handle_TCP_packet(tcp_server, index, data, length) == -1) {
-        LOGGER_DEBUG(tcp_server->logger, "dropping connection %u: data packet (len=%d) not handled",
-                     (unsigned int)con->identifier, length);
-        kill_accepted(tcp_server, index);
-        return -1;
+        if (new_conns != nullptr) {
+            memset(new_conns + queue->size, 0, (new_size - queue->size) * sizeof(TCP_Secure_Connection));
+            index = queue->size;
+            queue->conns = new_conns;
+            queue->size = new_size;
+            queue->index = index + 1;
+            return index;
+        }
+
+        if (queue->size == 0) {
+            return -1;
+        }
     }
 
+    LOGGER_DEBUG(logger, "pending connection %u dropped to make room for a new one", index);
+    kill_TCP_secure_connection(&queue->conns[index]);
+    queue->index = index + 1;
     return index;
 }
 
+non_null()
+static void free_pending_queue(TCP_Pending_Queue *queue)
+{
+    for (uint32_t i = 0; i < queue->size; ++i) {
+        wipe_secure_connection(&queue->conns[i]);
+    }
+
+    free(queue->conns);
+    queue->conns = nullptr;
+    queue->size = 0;
+    queue->index = 0;
+}
+
 /** return index on success
  * return -1 on failure
  */
@@ -780,20 +2028,17 @@ static int accept_connection(TCP_Server *tcp_server, Socket sock)
         return -1;
     }
 
-    const uint16_t index = tcp_server->incoming_connection_queue_index % MAX_INCOMING_CONNECTIONS;
-
-    TCP_Secure_Connection *conn = &tcp_server->incoming_connection_queue[index];
+    const int index = pending_queue_slot(tcp_server->logger, &tcp_server->incoming, tcp_server->max_pending_connections);
 
-    if (conn->status != TCP_STATUS_NO_STATUS) {
-        LOGGER_DEBUG(tcp_server->logger, "connection %d dropped before accepting", index);
-        kill_TCP_secure_connection(conn);
+    if (index == -1) {
+        kill_sock(sock);
+        return -1;
     }
 
+    TCP_Secure_Connection *conn = &tcp_server->incoming.conns[index];
     conn->status = TCP_STATUS_CONNECTED;
     conn->con.sock = sock;
-    conn->next_packet_length = 0;
 
-    ++tcp_server->incoming_connection_queue_index;
     return index;
 }
 
@@ -825,6 +2070,70 @@ static Socket new_listening_TCP_socket(Family family, uint16_t port)
     return sock;
 }
 
+non_null()
+static void init_shard(TCP_Shard *shard, TCP_Server *tcp_server, uint16_t id)
+{
+    shard->tcp_server = tcp_server;
+    shard->logger = tcp_server->logger;
+    shard->id = id;
+
+    for (uint32_t i = 0; i < TCP_TIMER_WHEEL_SIZE; ++i) {
+        shard->timers[i] = TCP_TIMER_NONE;
+    }
+
+    shard->ready_head = TCP_TIMER_NONE;
+    shard->ready_tail = TCP_TIMER_NONE;
+
+#ifdef TCP_SERVER_USE_EPOLL
+    shard->efd = -1;
+    shard->wake_fd = -1;
+    mailbox_init(&shard->mailbox);
+#endif
+
+    shard->first_free = TCP_TIMER_NONE;
+    hash_index_init(&shard->accepted_key_index, CRYPTO_PUBLIC_KEY_SIZE);
+}
+
+non_null()
+static void free_shard(TCP_Shard *shard)
+{
+#ifdef TCP_SERVER_USE_EPOLL
+    free_message_pool(&shard->message_pool);
+
+    if (shard->wake_fd != -1) {
+        close(shard->wake_fd);
+    }
+
+    if (shard->efd != -1) {
+        close(shard->efd);
+    }
+
+#endif
+
+    hash_index_free(&shard->accepted_key_index);
+    free_accepted_connection_array(shard);
+}
+
+#ifdef TCP_SERVER_USE_EPOLL
+/** Create the epoll set of the shard and the eventfd that wakes it up. */
+non_null()
+static bool open_shard_epoll(TCP_Shard *shard)
+{
+    shard->efd = epoll_create(8);
+    shard->wake_fd = eventfd(0, EFD_NONBLOCK);
+
+    if (shard->efd == -1 || shard->wake_fd == -1) {
+        return false;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.u64 = shard->wake_fd | ((uint64_t)TCP_SOCKET_MAILBOX << 32);
+
+    return epoll_ctl(shard->efd, EPOLL_CTL_ADD, shard->wake_fd, &ev) != -1;
+}
+#endif
+
 TCP_Server *new_TCP_server(const Logger *logger, uint8_t ipv6_enabled, uint16_t num_sockets, const uint16_t *ports,
                            const uint8_t *secret_key, Onion *onion)
 {
@@ -851,10 +2160,19 @@ TCP_Server *new_TCP_server(const Logger *logger, uint8_t ipv6_enabled, uint16_t
         return nullptr;
     }
 
+    temp->shards = (TCP_Shard *)calloc(1, sizeof(TCP_Shard));
+
+    if (temp->shards == nullptr) {
+        free(temp->socks_listening);
+        free(temp);
+        return nullptr;
+    }
+
 #ifdef TCP_SERVER_USE_EPOLL
     temp->efd = epoll_create(8);
 
     if (temp->efd == -1) {
+        free(temp->shards);
         free(temp->socks_listening);
         free(temp);
         return nullptr;
@@ -886,6 +2204,10 @@ TCP_Server *new_TCP_server(const Logger *logger, uint8_t ipv6_enabled, uint16_t
     }
 
     if (temp->num_listening_socks == 0) {
+#ifdef TCP_SERVER_USE_EPOLL
+        close(temp->efd);
+#endif
+        free(temp->shards);
         free(temp->socks_listening);
         free(temp);
         return nullptr;
@@ -899,7 +2221,21 @@ TCP_Server *new_TCP_server(const Logger *logger, uint8_t ipv6_enabled, uint16_t
     memcpy(temp->secret_key, secret_key, CRYPTO_SECRET_KEY_SIZE);
     crypto_derive_public_key(temp->public_key, temp->secret_key);
 
-    bs_list_init(&temp->accepted_key_list, CRYPTO_PUBLIC_KEY_SIZE, 8);
+    init_shard(&temp->shards[0], temp, 0);
+    temp->num_shards = 1;
+    temp->max_pending_connections = MAX_INCOMING_CONNECTIONS;
+
+#ifdef TCP_SERVER_USE_EPOLL
+    mailbox_init(&temp->mailbox);
+    random_bytes(temp->shard_key, sizeof(temp->shard_key));
+
+    /* Confirmed connections are watched by their shard, even without worker threads. */
+    if (!open_shard_epoll(&temp->shards[0])) {
+        kill_TCP_server(temp);
+        return nullptr;
+    }
+
+#endif
 
     return temp;
 }
@@ -918,48 +2254,100 @@ static void do_TCP_accept_new(TCP_Server *tcp_server)
 }
 #endif
 
+/** Send the response to a handshake and move the connection to the unconfirmed queue.
+ *
+ * return index in the unconfirmed queue on success.
+ * return -1 on failure.
+ */
 non_null()
-static int do_incoming(TCP_Server *tcp_server, uint32_t i)
+static int finish_incoming(TCP_Server *tcp_server, const Handshake_Job *job)
 {
-    TCP_Secure_Connection *const conn = &tcp_server->incoming_connection_queue[i];
+    TCP_Secure_Connection *const conn = &tcp_server->incoming.conns[job->index];
 
-    if (conn->status != TCP_STATUS_CONNECTED) {
+    if (job->result != 1) {
+        LOGGER_TRACE(tcp_server->logger, "incoming connection %u dropped due to failed handshake", job->index);
+        kill_TCP_secure_connection(conn);
         return -1;
     }
 
-    LOGGER_TRACE(tcp_server->logger, "handling incoming TCP connection %d", i);
-
-    const int ret = read_connection_handshake(tcp_server->logger, conn, tcp_server->secret_key);
+    IP_Port ipp = {0};
 
-    if (ret == -1) {
-        LOGGER_TRACE(tcp_server->logger, "incoming connection %d dropped due to failed handshake", i);
+    if (net_send(tcp_server->logger, conn->con.sock, job->response, TCP_SERVER_HANDSHAKE_SIZE,
+                 &ipp) != TCP_SERVER_HANDSHAKE_SIZE) {
         kill_TCP_secure_connection(conn);
         return -1;
     }
 
-    if (ret != 1) {
+    const int index_new = pending_queue_slot(tcp_server->logger, &tcp_server->unconfirmed,
+                          tcp_server->max_pending_connections);
+
+    if (index_new == -1) {
+        kill_TCP_secure_connection(conn);
         return -1;
     }
 
-    const int index_new = tcp_server->unconfirmed_connection_queue_index % MAX_INCOMING_CONNECTIONS;
-    TCP_Secure_Connection *conn_old = conn;
-    TCP_Secure_Connection *conn_new = &tcp_server->unconfirmed_connection_queue[index_new];
+    conn->status = TCP_STATUS_UNCONFIRMED;
+    move_secure_connection(&tcp_server->unconfirmed.conns[index_new], conn);
+    return index_new;
+}
+
+/** Read the handshakes of the incoming connections in indices, do the key
+ * exchanges, on the handshake threads if there are any, and move the
+ * connections that completed them to the unconfirmed queue.
+ *
+ * index_new[i] is set to the unconfirmed queue index of the connection of
+ * indices[i], or -1 if it was not moved.
+ */
+non_null()
+static void do_incoming_batch(TCP_Server *tcp_server, const uint32_t *indices, uint32_t num_indices, int *index_new)
+{
+    assert(num_indices <= TCP_HANDSHAKE_BATCH_SIZE);
+
+    uint32_t num_jobs = 0;
+
+    for (uint32_t i = 0; i < num_indices; ++i) {
+        index_new[i] = -1;
+        TCP_Secure_Connection *const conn = &tcp_server->incoming.conns[indices[i]];
+
+        if (conn->status != TCP_STATUS_CONNECTED) {
+            continue;
+        }
+
+        LOGGER_TRACE(tcp_server->logger, "handling incoming TCP connection %u", indices[i]);
+
+        Handshake_Job *job = &tcp_server->handshake_jobs[num_jobs];
+
+        if (read_TCP_packet(tcp_server->logger, conn->con.sock, job->data, sizeof(job->data), &conn->con.ip_port) == -1) {
+            LOGGER_TRACE(tcp_server->logger, "connection handshake is not ready yet");
+            continue;
+        }
+
+        job->index = indices[i];
+        ++num_jobs;
+    }
 
-    if (conn_new->status != TCP_STATUS_NO_STATUS) {
-        LOGGER_WARNING(tcp_server->logger, "incoming connection %d would overwrite existing", i);
-        kill_TCP_secure_connection(conn_new);
+    if (tcp_server->handshake_pool != nullptr) {
+        thread_pool_run(tcp_server->handshake_pool, &handshake_job, tcp_server, num_jobs);
+    } else {
+        for (uint32_t i = 0; i < num_jobs; ++i) {
+            handshake_job(tcp_server, i);
+        }
     }
 
-    move_secure_connection(conn_new, conn_old);
-    ++tcp_server->unconfirmed_connection_queue_index;
+    uint32_t job = 0;
 
-    return index_new;
+    for (uint32_t i = 0; i < num_indices && job < num_jobs; ++i) {
+        if (tcp_server->handshake_jobs[job].index == indices[i]) {
+            index_new[i] = finish_incoming(tcp_server, &tcp_server->handshake_jobs[job]);
+            ++job;
+        }
+    }
 }
 
 non_null()
 static int do_unconfirmed(TCP_Server *tcp_server, const Mono_Time *mono_time, uint32_t i)
 {
-    TCP_Secure_Connection *const conn = &tcp_server->unconfirmed_connection_queue[i];
+    TCP_Secure_Connection *const conn = &tcp_server->unconfirmed.conns[i];
 
     if (conn->status != TCP_STATUS_UNCONFIRMED) {
         return -1;
@@ -968,8 +2356,8 @@ static int do_unconfirmed(TCP_Server *tcp_server, const Mono_Time *mono_time, ui
     LOGGER_TRACE(tcp_server->logger, "handling unconfirmed TCP connection %d", i);
 
     uint8_t packet[MAX_PACKET_SIZE];
-    const int len = read_packet_TCP_secure_connection(tcp_server->logger, conn->con.sock, &conn->next_packet_length,
-                    conn->con.shared_key, conn->recv_nonce, packet, sizeof(packet), &conn->con.ip_port);
+    const int len = read_packet_TCP_secure_connection(tcp_server->logger, &conn->con, conn->recv_nonce, packet,
+                    sizeof(packet));
 
     if (len == 0) {
         return -1;
@@ -980,119 +2368,141 @@ static int do_unconfirmed(TCP_Server *tcp_server, const Mono_Time *mono_time, ui
         return -1;
     }
 
-    return confirm_TCP_connection(tcp_server, mono_time, conn, packet, len);
+#ifdef TCP_SERVER_USE_EPOLL
+
+    if (tcp_server->sharded) {
+        hand_over_connection(tcp_server, conn, packet, len);
+        return -1;
+    }
+
+#endif
+    return confirm_TCP_connection(&tcp_server->shards[0], mono_time, conn, packet, len);
 }
 
+#ifndef TCP_SERVER_USE_EPOLL
 non_null()
-static bool tcp_process_secure_packet(TCP_Server *tcp_server, uint32_t i)
+static void do_TCP_incoming(TCP_Server *tcp_server)
 {
-    TCP_Secure_Connection *const conn = &tcp_server->accepted_connection_array[i];
+    uint32_t indices[TCP_HANDSHAKE_BATCH_SIZE];
+    int index_new[TCP_HANDSHAKE_BATCH_SIZE];
+    uint32_t num_indices = 0;
 
-    uint8_t packet[MAX_PACKET_SIZE];
-    const int len = read_packet_TCP_secure_connection(tcp_server->logger, conn->con.sock, &conn->next_packet_length,
-                    conn->con.shared_key, conn->recv_nonce, packet, sizeof(packet), &conn->con.ip_port);
-    LOGGER_TRACE(tcp_server->logger, "processing packet for %d: %d", i, len);
-
-    if (len == 0) {
-        return false;
-    }
+    for (uint32_t i = 0; i < tcp_server->incoming.size; ++i) {
+        if (tcp_server->incoming.conns[i].status != TCP_STATUS_CONNECTED) {
+            continue;
+        }
 
-    if (len == -1) {
-        kill_accepted(tcp_server, i);
-        return false;
-    }
+        indices[num_indices] = i;
+        ++num_indices;
 
-    if (handle_TCP_packet(tcp_server, i, packet, len) == -1) {
-        LOGGER_TRACE(tcp_server->logger, "dropping connection %d: data packet (len=%d) not handled", i, len);
-        kill_accepted(tcp_server, i);
-        return false;
+        if (num_indices == TCP_HANDSHAKE_BATCH_SIZE) {
+            do_incoming_batch(tcp_server, indices, num_indices, index_new);
+            num_indices = 0;
+        }
     }
 
-    return true;
+    do_incoming_batch(tcp_server, indices, num_indices, index_new);
 }
 
 non_null()
-static void do_confirmed_recv(TCP_Server *tcp_server, uint32_t i)
+static void do_TCP_unconfirmed(TCP_Server *tcp_server, const Mono_Time *mono_time)
 {
-    while (tcp_process_secure_packet(tcp_server, i)) {
-        // Keep reading until an error occurs or there is no more data to read.
-        continue;
+    for (uint32_t i = 0; i < tcp_server->unconfirmed.size; ++i) {
+        do_unconfirmed(tcp_server, mono_time, i);
     }
 }
+#endif
 
-#ifndef TCP_SERVER_USE_EPOLL
+/** Send a ping or drop the connection if it is due, and schedule the next check. */
 non_null()
-static void do_TCP_incoming(TCP_Server *tcp_server)
+static void do_TCP_ping(TCP_Shard *shard, const Mono_Time *mono_time, uint32_t i)
 {
-    for (uint32_t i = 0; i < MAX_INCOMING_CONNECTIONS; ++i) {
-        do_incoming(tcp_server, i);
+    TCP_Secure_Connection *conn = &shard->accepted_connection_array[i];
+
+    if (mono_time_is_timeout(mono_time, conn->last_pinged, TCP_PING_FREQUENCY)) {
+        release_idle_buffers(&conn->con);
+
+        uint8_t ping[1 + sizeof(uint64_t)];
+        ping[0] = TCP_PACKET_PING;
+        uint64_t ping_id = random_u64();
+
+        if (!ping_id) {
+            ++ping_id;
+        }
+
+        memcpy(ping + 1, &ping_id, sizeof(uint64_t));
+        int ret = write_packet_TCP_secure_connection(shard->logger, &conn->con, ping, sizeof(ping), 1);
+
+        if (ret == 1) {
+            conn->last_pinged = mono_time_get(mono_time);
+            conn->ping_id = ping_id;
+        } else {
+            if (mono_time_is_timeout(mono_time, conn->last_pinged, TCP_PING_FREQUENCY + TCP_PING_TIMEOUT)) {
+                kill_accepted(shard, i);
+                return;
+            }
+        }
     }
-}
 
-non_null()
-static void do_TCP_unconfirmed(TCP_Server *tcp_server, const Mono_Time *mono_time)
-{
-    for (uint32_t i = 0; i < MAX_INCOMING_CONNECTIONS; ++i) {
-        do_unconfirmed(tcp_server, mono_time, i);
+    if (conn->ping_id && mono_time_is_timeout(mono_time, conn->last_pinged, TCP_PING_TIMEOUT)) {
+        kill_accepted(shard, i);
+        return;
     }
+
+    const uint64_t deadline = conn->last_pinged + (conn->ping_id ? TCP_PING_TIMEOUT : TCP_PING_FREQUENCY);
+    timer_schedule(shard, i, max_u64(deadline, mono_time_get(mono_time) + 1));
 }
-#endif
 
+/** Run the timer wheel slots of the seconds since the last run. */
 non_null()
-static void do_TCP_confirmed(TCP_Server *tcp_server, const Mono_Time *mono_time)
+static void do_TCP_timers(TCP_Shard *shard, const Mono_Time *mono_time)
 {
-#ifdef TCP_SERVER_USE_EPOLL
+    const uint64_t now = mono_time_get(mono_time);
 
-    if (tcp_server->last_run_pinged == mono_time_get(mono_time)) {
+    if (shard->last_run_pinged == now) {
         return;
     }
 
-    tcp_server->last_run_pinged = mono_time_get(mono_time);
-#endif
-
-    for (uint32_t i = 0; i < tcp_server->size_accepted_connections; ++i) {
-        TCP_Secure_Connection *conn = &tcp_server->accepted_connection_array[i];
+    const uint64_t num_slots = min_u64(now - shard->last_run_pinged, TCP_TIMER_WHEEL_SIZE);
+    shard->last_run_pinged = now;
 
-        if (conn->status != TCP_STATUS_CONFIRMED) {
-            continue;
-        }
+    for (uint64_t t = now - num_slots + 1; t <= now; ++t) {
+        uint32_t i = shard->timers[t % TCP_TIMER_WHEEL_SIZE];
 
-        if (mono_time_is_timeout(mono_time, conn->last_pinged, TCP_PING_FREQUENCY)) {
-            uint8_t ping[1 + sizeof(uint64_t)];
-            ping[0] = TCP_PACKET_PING;
-            uint64_t ping_id = random_u64();
+        while (i != TCP_TIMER_NONE) {
+            const uint32_t next = shard->accepted_connection_array[i].timer_next;
 
-            if (!ping_id) {
-                ++ping_id;
+            if (shard->accepted_connection_array[i].timer_deadline <= now) {
+                do_TCP_ping(shard, mono_time, i);
             }
 
-            memcpy(ping + 1, &ping_id, sizeof(uint64_t));
-            int ret = write_packet_TCP_secure_connection(tcp_server->logger, &conn->con, ping, sizeof(ping), 1);
-
-            if (ret == 1) {
-                conn->last_pinged = mono_time_get(mono_time);
-                conn->ping_id = ping_id;
-            } else {
-                if (mono_time_is_timeout(mono_time, conn->last_pinged, TCP_PING_FREQUENCY + TCP_PING_TIMEOUT)) {
-                    kill_accepted(tcp_server, i);
-                    continue;
-                }
-            }
+            i = next;
         }
+    }
+}
 
-        if (conn->ping_id && mono_time_is_timeout(mono_time, conn->last_pinged, TCP_PING_TIMEOUT)) {
-            kill_accepted(tcp_server, i);
-            continue;
-        }
+/** return true if connections are left with packets to read. */
+non_null()
+static bool do_TCP_confirmed(TCP_Shard *shard, const Mono_Time *mono_time)
+{
+#ifndef TCP_SERVER_USE_EPOLL
 
-        send_pending_data(tcp_server->logger, &conn->con);
+    for (uint32_t i = 0; i < shard->size_accepted_connections; ++i) {
+        TCP_Secure_Connection *conn = &shard->accepted_connection_array[i];
 
-#ifndef TCP_SERVER_USE_EPOLL
+        if (conn->status != TCP_STATUS_CONFIRMED) {
+            continue;
+        }
 
-        do_confirmed_recv(tcp_server, i);
+        send_pending_data(shard->logger, &conn->con);
+        ready_push(shard, i);
+    }
 
 #endif
-    }
+
+    const bool busy = do_ready_connections(shard, mono_time);
+    do_TCP_timers(shard, mono_time);
+    return busy;
 }
 
 #ifdef TCP_SERVER_USE_EPOLL
@@ -1102,6 +2512,12 @@ static bool tcp_epoll_process(TCP_Server *tcp_server, const Mono_Time *mono_time
 #define MAX_EVENTS 16
     struct epoll_event events[MAX_EVENTS];
     const int nfds = epoll_wait(tcp_server->efd, events, MAX_EVENTS, 0);
+
+    /* Incoming connections are handled together after the other events, so
+     * that their handshakes can be done in parallel. */
+    uint32_t incoming[MAX_EVENTS];
+    int incoming_new[MAX_EVENTS];
+    uint32_t num_incoming = 0;
 #undef MAX_EVENTS
 
     for (int n = 0; n < nfds; ++n) {
@@ -1119,19 +2535,13 @@ static bool tcp_epoll_process(TCP_Server *tcp_server, const Mono_Time *mono_time
 
                 case TCP_SOCKET_INCOMING: {
                     LOGGER_TRACE(tcp_server->logger, "incoming connection %d dropped", index);
-                    kill_TCP_secure_connection(&tcp_server->incoming_connection_queue[index]);
+                    kill_TCP_secure_connection(&tcp_server->incoming.conns[index]);
                     break;
                 }
 
                 case TCP_SOCKET_UNCONFIRMED: {
                     LOGGER_TRACE(tcp_server->logger, "unconfirmed connection %d dropped", index);
-                    kill_TCP_secure_connection(&tcp_server->unconfirmed_connection_queue[index]);
-                    break;
-                }
-
-                case TCP_SOCKET_CONFIRMED: {
-                    LOGGER_TRACE(tcp_server->logger, "confirmed connection %d dropped", index);
-                    kill_accepted(tcp_server, index);
+                    kill_TCP_secure_connection(&tcp_server->unconfirmed.conns[index]);
                     break;
                 }
             }
@@ -1139,7 +2549,6 @@ static bool tcp_epoll_process(TCP_Server *tcp_server, const Mono_Time *mono_time
             continue;
         }
 
-
         if (!(events[n].events & EPOLLIN)) {
             continue;
         }
@@ -1168,7 +2577,7 @@ static bool tcp_epoll_process(TCP_Server *tcp_server, const Mono_Time *mono_time
 
                     if (epoll_ctl(tcp_server->efd, EPOLL_CTL_ADD, sock_new.socket, &ev) == -1) {
                         LOGGER_DEBUG(tcp_server->logger, "new connection %d was dropped due to epoll error %d", index, net_error());
-                        kill_TCP_secure_connection(&tcp_server->incoming_connection_queue[index_new]);
+                        kill_TCP_secure_connection(&tcp_server->incoming.conns[index_new]);
                         continue;
                     }
                 }
@@ -1177,20 +2586,8 @@ static bool tcp_epoll_process(TCP_Server *tcp_server, const Mono_Time *mono_time
             }
 
             case TCP_SOCKET_INCOMING: {
-                const int index_new = do_incoming(tcp_server, index);
-
-                if (index_new != -1) {
-                    LOGGER_TRACE(tcp_server->logger, "incoming connection %d was accepted as %d", index, index_new);
-                    events[n].events = EPOLLIN | EPOLLET | EPOLLRDHUP;
-                    events[n].data.u64 = sock.socket | ((uint64_t)TCP_SOCKET_UNCONFIRMED << 32) | ((uint64_t)index_new << 40);
-
-                    if (epoll_ctl(tcp_server->efd, EPOLL_CTL_MOD, sock.socket, &events[n]) == -1) {
-                        LOGGER_DEBUG(tcp_server->logger, "incoming connection %d was dropped due to epoll error %d", index, net_error());
-                        kill_TCP_secure_connection(&tcp_server->unconfirmed_connection_queue[index_new]);
-                        break;
-                    }
-                }
-
+                incoming[num_incoming] = index;
+                ++num_incoming;
                 break;
             }
 
@@ -1198,25 +2595,40 @@ static bool tcp_epoll_process(TCP_Server *tcp_server, const Mono_Time *mono_time
                 const int index_new = do_unconfirmed(tcp_server, mono_time, index);
 
                 if (index_new != -1) {
+                    /* Without worker threads, the connection was confirmed on the only
+                     * shard, which watches it from now on. */
                     LOGGER_TRACE(tcp_server->logger, "unconfirmed connection %d was confirmed as %d", index, index_new);
-                    events[n].events = EPOLLIN | EPOLLET | EPOLLRDHUP;
-                    events[n].data.u64 = sock.socket | ((uint64_t)TCP_SOCKET_CONFIRMED << 32) | ((uint64_t)index_new << 40);
 
-                    if (epoll_ctl(tcp_server->efd, EPOLL_CTL_MOD, sock.socket, &events[n]) == -1) {
-                        // remove from confirmed connections
-                        LOGGER_DEBUG(tcp_server->logger, "unconfirmed connection %d was dropped due to epoll error %d", index, net_error());
-                        kill_accepted(tcp_server, index_new);
-                        break;
+                    if (epoll_ctl(tcp_server->efd, EPOLL_CTL_DEL, sock.socket, &events[n]) == -1) {
+                        LOGGER_DEBUG(tcp_server->logger, "could not remove connection from epoll: %d", net_error());
                     }
+
+                    shard_watch_connection(&tcp_server->shards[0], sock, index_new);
                 }
 
                 break;
             }
+        }
+    }
 
-            case TCP_SOCKET_CONFIRMED: {
-                do_confirmed_recv(tcp_server, index);
-                break;
-            }
+    do_incoming_batch(tcp_server, incoming, num_incoming, incoming_new);
+
+    for (uint32_t i = 0; i < num_incoming; ++i) {
+        const int index_new = incoming_new[i];
+
+        if (index_new == -1) {
+            continue;
+        }
+
+        LOGGER_TRACE(tcp_server->logger, "incoming connection %u was accepted as %d", incoming[i], index_new);
+        const Socket sock = tcp_server->unconfirmed.conns[index_new].con.sock;
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLET | EPOLLRDHUP;
+        ev.data.u64 = sock.socket | ((uint64_t)TCP_SOCKET_UNCONFIRMED << 32) | ((uint64_t)index_new << 40);
+
+        if (epoll_ctl(tcp_server->efd, EPOLL_CTL_MOD, sock.socket, &ev) == -1) {
+            LOGGER_DEBUG(tcp_server->logger, "incoming connection %u was dropped due to epoll error %d", incoming[i], net_error());
+            kill_TCP_secure_connection(&tcp_server->unconfirmed.conns[index_new]);
         }
     }
 
@@ -1231,20 +2643,242 @@ static void do_TCP_epoll(TCP_Server *tcp_server, const Mono_Time *mono_time)
         continue;
     }
 }
+
+/** Handle the events of the sockets of the shard, waiting up to timeout
+ * milliseconds for them.
+ *
+ * return true if there were any.
+ */
+non_null()
+static bool tcp_shard_epoll_process(TCP_Shard *shard, int timeout)
+{
+#define MAX_EVENTS 16
+    struct epoll_event events[MAX_EVENTS];
+    const int nfds = epoll_wait(shard->efd, events, MAX_EVENTS, timeout);
+#undef MAX_EVENTS
+
+    for (int n = 0; n < nfds; ++n) {
+        const int status = (events[n].data.u64 >> 32) & 0xFF;
+        const int index = events[n].data.u64 >> 40;
+
+        if (status == TCP_SOCKET_MAILBOX) {
+            uint64_t count;
+
+            if (read(shard->wake_fd, &count, sizeof(count)) != sizeof(count)) {
+                LOGGER_TRACE(shard->logger, "spurious wakeup of shard %d", shard->id);
+            }
+
+            continue;
+        }
+
+        if ((events[n].events & EPOLLERR) || (events[n].events & EPOLLHUP) || (events[n].events & EPOLLRDHUP)) {
+            LOGGER_TRACE(shard->logger, "confirmed connection %d dropped", index);
+            kill_accepted(shard, index);
+            continue;
+        }
+
+        if (events[n].events & EPOLLOUT) {
+            do_confirmed_send(shard, index);
+        }
+
+        if (events[n].events & EPOLLIN) {
+            queue_confirmed_recv(shard, index);
+        }
+    }
+
+    return nfds > 0;
+}
+
+non_null()
+static void do_shard_mailbox(TCP_Shard *shard)
+{
+    /* Clear the flag first so that messages posted while draining wake us up again. */
+    __atomic_store_n(&shard->wake_pending, false, __ATOMIC_SEQ_CST);
+
+    Shard_Message *msg;
+
+    while ((msg = mailbox_pop(&shard->mailbox)) != nullptr) {
+        handle_shard_message(shard, msg);
+        free_shard_message(msg);
+    }
+}
+
+non_null()
+static void *tcp_shard_thread(void *arg)
+{
+    TCP_Shard *shard = (TCP_Shard *)arg;
+
+    bool busy = false;
+
+    while (!__atomic_load_n(&shard->stopping, __ATOMIC_ACQUIRE)) {
+        tcp_shard_epoll_process(shard, busy ? 0 : TCP_WORKER_POLL_TIMEOUT);
+        do_shard_mailbox(shard);
+        busy = do_TCP_confirmed(shard, shard->tcp_server->mono_time);
+    }
+
+    return nullptr;
+}
+
+non_null()
+static void stop_workers(TCP_Server *tcp_server)
+{
+    for (uint32_t i = 0; i < tcp_server->num_shards; ++i) {
+        TCP_Shard *shard = &tcp_server->shards[i];
+
+        if (!shard->thread_started) {
+            continue;
+        }
+
+        __atomic_store_n(&shard->stopping, true, __ATOMIC_RELEASE);
+
+        const uint64_t one = 1;
+
+        if (write(shard->wake_fd, &one, sizeof(one)) != sizeof(one)) {
+            LOGGER_WARNING(tcp_server->logger, "could not wake up shard %d", shard->id);
+        }
+
+        pthread_join(shard->thread, nullptr);
+        shard->thread_started = false;
+    }
+}
+
+non_null()
+static bool start_shard(TCP_Shard *shard)
+{
+    if (!open_shard_epoll(shard)) {
+        return false;
+    }
+
+    shard->thread_started = pthread_create(&shard->thread, nullptr, &tcp_shard_thread, shard) == 0;
+    return shard->thread_started;
+}
+#endif
+
+bool tcp_server_start_workers(TCP_Server *tcp_server, const Mono_Time *mono_time, uint16_t num_workers)
+{
+#ifdef TCP_SERVER_USE_EPOLL
+
+    if (num_workers == 0 || tcp_server->sharded || tcp_server->shards[0].num_accepted_connections != 0) {
+        return false;
+    }
+
+    TCP_Shard *shards = (TCP_Shard *)calloc(num_workers, sizeof(TCP_Shard));
+
+    if (shards == nullptr) {
+        return false;
+    }
+
+    TCP_Shard *const old_shards = tcp_server->shards;
+    const uint16_t old_num_shards = tcp_server->num_shards;
+
+    for (uint16_t i = 0; i < num_workers; ++i) {
+        init_shard(&shards[i], tcp_server, i);
+    }
+
+    tcp_server->shards = shards;
+    tcp_server->num_shards = num_workers;
+    tcp_server->mono_time = mono_time;
+    tcp_server->sharded = true;
+
+    for (uint16_t i = 0; i < num_workers; ++i) {
+        if (!start_shard(&shards[i])) {
+            LOGGER_ERROR(tcp_server->logger, "failed to start TCP server worker %d", i);
+            stop_workers(tcp_server);
+            free_mailbox(&tcp_server->mailbox);
+            free_shard_mailboxes(shards, num_workers);
+
+            for (uint16_t j = 0; j < num_workers; ++j) {
+                free_shard(&shards[j]);
+            }
+
+            free(shards);
+            tcp_server->shards = old_shards;
+            tcp_server->num_shards = old_num_shards;
+            tcp_server->sharded = false;
+            return false;
+        }
+    }
+
+    free_shard_mailboxes(old_shards, old_num_shards);
+
+    for (uint16_t i = 0; i < old_num_shards; ++i) {
+        free_shard(&old_shards[i]);
+    }
+
+    free(old_shards);
+    return true;
+#else
+    return false;
 #endif
+}
+
+bool tcp_server_set_handshake_threads(TCP_Server *tcp_server, uint32_t num_threads)
+{
+    Thread_Pool *pool = nullptr;
+
+    if (num_threads > 0) {
+        pool = thread_pool_new(num_threads);
+
+        if (pool == nullptr) {
+            return false;
+        }
+    }
+
+    thread_pool_kill(tcp_server->handshake_pool);
+    tcp_server->handshake_pool = pool;
+    return true;
+}
+
+void tcp_server_set_rate_limit(TCP_Server *tcp_server, TCP_Traffic traffic, uint32_t rate, uint32_t burst)
+{
+    TCP_Rate_Limit *limit = &tcp_server->rate_limits[traffic];
+    limit->rate = rate;
+    limit->burst = rate == 0 ? 0 : max_u32(max_u32(burst, rate), MAX_PACKET_SIZE);
+}
+
+bool tcp_server_set_max_pending_connections(TCP_Server *tcp_server, uint32_t max_pending)
+{
+    if (max_pending == 0 || max_pending > TCP_MAX_PENDING_CONNECTIONS) {
+        return false;
+    }
+
+    tcp_server->max_pending_connections = max_pending;
+    return true;
+}
 
 void do_TCP_server(TCP_Server *tcp_server, const Mono_Time *mono_time)
 {
 #ifdef TCP_SERVER_USE_EPOLL
-    do_TCP_epoll(tcp_server, mono_time);
+
+    if (tcp_server->sharded) {
+        do_TCP_epoll(tcp_server, mono_time);
+        do_TCP_mailbox(tcp_server);
+        return;
+    }
+
+#endif
+
+    /* Connections with a lot to read are served in rounds, with new
+     * connections and timers handled in between. */
+    for (uint32_t round = 0; round < TCP_MAX_READY_ROUNDS; ++round) {
+#ifdef TCP_SERVER_USE_EPOLL
+        do_TCP_epoll(tcp_server, mono_time);
+
+        while (tcp_shard_epoll_process(&tcp_server->shards[0], 0)) {
+            // Keep reading events until there are no more sockets ready.
+            continue;
+        }
 
 #else
-    do_TCP_accept_new(tcp_server);
-    do_TCP_incoming(tcp_server);
-    do_TCP_unconfirmed(tcp_server, mono_time);
+        do_TCP_accept_new(tcp_server);
+        do_TCP_incoming(tcp_server);
+        do_TCP_unconfirmed(tcp_server, mono_time);
 #endif
 
-    do_TCP_confirmed(tcp_server, mono_time);
+        if (!do_TCP_confirmed(&tcp_server->shards[0], mono_time)) {
+            break;
+        }
+    }
 }
 
 void kill_TCP_server(TCP_Server *tcp_server)
@@ -1257,18 +2891,26 @@ void kill_TCP_server(TCP_Server *tcp_server)
         set_callback_handle_recv_1(tcp_server->onion, nullptr, nullptr);
     }
 
-    bs_list_free(&tcp_server->accepted_key_list);
-
 #ifdef TCP_SERVER_USE_EPOLL
+    stop_workers(tcp_server);
+    free_mailbox(&tcp_server->mailbox);
+    free_shard_mailboxes(tcp_server->shards, tcp_server->num_shards);
     close(tcp_server->efd);
 #endif
 
-    for (uint32_t i = 0; i < MAX_INCOMING_CONNECTIONS; ++i) {
-        wipe_secure_connection(&tcp_server->incoming_connection_queue[i]);
-        wipe_secure_connection(&tcp_server->unconfirmed_connection_queue[i]);
+    thread_pool_kill(tcp_server->handshake_pool);
+    free_pending_queue(&tcp_server->incoming);
+    free_pending_queue(&tcp_server->unconfirmed);
+
+    for (uint32_t i = 0; i < tcp_server->num_shards; ++i) {
+        free_shard(&tcp_server->shards[i]);
     }
 
-    free_accepted_connection_array(tcp_server);
+    free(tcp_server->shards);
+
+#ifdef TCP_SERVER_USE_EPOLL
+    free_message_pool(&tcp_server->message_pool);
+#endif
 
     crypto_memzero(tcp_server->secret_key, sizeof(tcp_server->secret_key));
 
@@ -12,8 +12,17 @@
 #include "crypto_core.h"
 #include "onion.h"
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Default maximum number of connections waiting for their handshake, and of
+ * connections waiting for their first packet. */
 #define MAX_INCOMING_CONNECTIONS 256
 
+/** Largest value tcp_server_set_max_pending_connections() accepts. */
+#define TCP_MAX_PENDING_CONNECTIONS (1 << 20)
+
 #define TCP_MAX_BACKLOG MAX_INCOMING_CONNECTIONS
 
 #define ARRAY_ENTRY_SIZE 6
@@ -25,6 +34,15 @@ typedef enum TCP_Status {
     TCP_STATUS_CONFIRMED,
 } TCP_Status;
 
+/** Kinds of traffic a client sends through the relay, each with its own rate limit. */
+typedef enum TCP_Traffic {
+    TCP_TRAFFIC_DATA, /* Packets to the clients it has a route to. */
+    TCP_TRAFFIC_ONION, /* Onion requests. */
+    TCP_TRAFFIC_OOB, /* Out of band packets. */
+} TCP_Traffic;
+
+#define TCP_TRAFFIC_NUM 3
+
 typedef struct TCP_Server TCP_Server;
 
 non_null()
@@ -43,10 +61,60 @@ TCP_Server *new_TCP_server(const Logger *logger, uint8_t ipv6_enabled, uint16_t
 non_null()
 void do_TCP_server(TCP_Server *tcp_server, const Mono_Time *mono_time);
 
+/** Serve the confirmed connections from num_workers threads, each owning the
+ * connections whose public key hashes to it. do_TCP_server() keeps accepting
+ * connections and doing handshakes. mono_time must outlive the server.
+ *
+ * Must be called before any connection is confirmed.
+ *
+ * return true on success.
+ * return false if the server was built without epoll support or on failure.
+ */
+non_null()
+bool tcp_server_start_workers(TCP_Server *tcp_server, const Mono_Time *mono_time, uint16_t num_workers);
+
+/** Do the key exchanges of new connections on num_threads threads besides the
+ * one running do_TCP_server(), so that a burst of new connections does not
+ * hold up established ones. 0 does them all on the do_TCP_server() thread,
+ * which is the default.
+ *
+ * return true on success.
+ * return false on failure.
+ */
+non_null()
+bool tcp_server_set_handshake_threads(TCP_Server *tcp_server, uint32_t num_threads);
+
+/** Set how many connections may wait for their handshake, and how many for
+ * their first packet, before new ones replace the oldest. The queues only
+ * take memory for the connections they have held. Default is
+ * MAX_INCOMING_CONNECTIONS. Queues that grew past a new lower maximum keep
+ * their size.
+ *
+ * return true on success.
+ * return false if max_pending is 0 or larger than TCP_MAX_PENDING_CONNECTIONS.
+ */
+non_null()
+bool tcp_server_set_max_pending_connections(TCP_Server *tcp_server, uint32_t max_pending);
+
+/** Limit each client to sending rate bytes per second of a kind of traffic,
+ * after an initial burst of up to burst bytes. Packets over the limit are
+ * dropped. The budget of a client is refilled every second. burst is raised to
+ * at least rate and the size of the largest packet.
+ *
+ * A rate of 0 removes the limit, which is the default.
+ *
+ * Must be called before tcp_server_start_workers().
+ */
+non_null()
+void tcp_server_set_rate_limit(TCP_Server *tcp_server, TCP_Traffic traffic, uint32_t rate, uint32_t burst);
+
 /** Kill the TCP server
  */
 non_null()
 void kill_TCP_server(TCP_Server *tcp_server);
 
+#ifdef __cplusplus
+}  // extern "C"
+#endif
 
 #endif
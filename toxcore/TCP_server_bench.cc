@@ -0,0 +1,147 @@
+#include <benchmark/benchmark.h>
+
+#ifndef _WIN32
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <array>
+#include <cstring>
+#include <vector>
+
+#include "TCP_common.h"
+#include "TCP_server.h"
+#include "logger.h"
+#include "mono_time.h"
+
+namespace {
+
+constexpr uint16_t kPort = 33449;
+
+/** Number of clients connecting at once. */
+constexpr uint32_t kBurst = 32;
+
+using Handshake = std::array<uint8_t, TCP_CLIENT_HANDSHAKE_SIZE>;
+
+Handshake make_handshake(const uint8_t *server_public_key) {
+  uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
+  uint8_t secret_key[CRYPTO_SECRET_KEY_SIZE];
+  crypto_new_keypair(public_key, secret_key);
+
+  uint8_t plain[TCP_HANDSHAKE_PLAIN_SIZE];
+  uint8_t temp_secret_key[CRYPTO_SECRET_KEY_SIZE];
+  crypto_new_keypair(plain, temp_secret_key);
+  random_nonce(plain + CRYPTO_PUBLIC_KEY_SIZE);
+
+  Handshake handshake;
+  memcpy(handshake.data(), public_key, CRYPTO_PUBLIC_KEY_SIZE);
+  random_nonce(handshake.data() + CRYPTO_PUBLIC_KEY_SIZE);
+  encrypt_data(server_public_key, secret_key, handshake.data() + CRYPTO_PUBLIC_KEY_SIZE, plain, sizeof(plain),
+               handshake.data() + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_NONCE_SIZE);
+  return handshake;
+}
+
+int connect_client() {
+  const int fd = socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(kPort);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  if (fd != -1 && connect(fd, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) != 0) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+/** Bursts of clients send their handshake at once, and the relay answers all
+ * of them. range(0) is the number of handshake threads.
+ */
+void BM_TCPServerHandshakes(benchmark::State &state) {
+  Logger *logger = logger_new();
+  Mono_Time *mono_time = mono_time_new();
+  uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
+  uint8_t secret_key[CRYPTO_SECRET_KEY_SIZE];
+  crypto_new_keypair(public_key, secret_key);
+  const uint16_t ports[] = {kPort};
+  TCP_Server *tcp_s = new_TCP_server(logger, false, 1, ports, secret_key, nullptr);
+
+  if (tcp_s == nullptr) {
+    state.SkipWithError("could not start the TCP server");
+    mono_time_free(mono_time);
+    logger_kill(logger);
+    return;
+  }
+
+  if (!tcp_server_set_handshake_threads(tcp_s, state.range(0))) {
+    state.SkipWithError("could not start the handshake threads");
+  }
+
+  // Client key exchanges are not what is measured, so the same handshakes
+  // are sent by every burst.
+  std::vector<Handshake> handshakes;
+
+  for (uint32_t i = 0; i < kBurst; ++i) {
+    handshakes.push_back(make_handshake(public_key));
+  }
+
+  std::vector<int> fds(kBurst, -1);
+
+  for (auto _ : state) {
+    state.PauseTiming();
+
+    for (uint32_t i = 0; i < kBurst; ++i) {
+      fds[i] = connect_client();
+
+      if (fds[i] == -1 || write(fds[i], handshakes[i].data(), handshakes[i].size()) != TCP_CLIENT_HANDSHAKE_SIZE) {
+        state.SkipWithError("could not connect to the TCP server");
+        break;
+      }
+    }
+
+    state.ResumeTiming();
+
+    uint32_t answered = 0;
+
+    while (answered < kBurst && !state.error_occurred()) {
+      mono_time_update(mono_time);
+      do_TCP_server(tcp_s, mono_time);
+
+      for (int &fd : fds) {
+        uint8_t response[TCP_SERVER_HANDSHAKE_SIZE];
+
+        if (fd != -1 && recv(fd, response, sizeof(response), MSG_DONTWAIT) == sizeof(response)) {
+          close(fd);
+          fd = -1;
+          ++answered;
+        }
+      }
+    }
+
+    state.PauseTiming();
+
+    // Let the server notice the closed connections outside the measurement.
+    for (int &fd : fds) {
+      if (fd != -1) {
+        close(fd);
+        fd = -1;
+      }
+    }
+
+    do_TCP_server(tcp_s, mono_time);
+    state.ResumeTiming();
+  }
+
+  state.SetItemsProcessed(state.iterations() * kBurst);
+
+  kill_TCP_server(tcp_s);
+  mono_time_free(mono_time);
+  logger_kill(logger);
+}
+BENCHMARK(BM_TCPServerHandshakes)->Arg(0)->Arg(1)->Arg(3)->UseRealTime();
+
+}  // namespace
+#endif  // _WIN32
@@ -54,6 +54,10 @@ static_assert(CRYPTO_SHA256_SIZE == crypto_hash_sha256_BYTES,
               "CRYPTO_SHA256_SIZE should be equal to crypto_hash_sha256_BYTES");
 static_assert(CRYPTO_SHA512_SIZE == crypto_hash_sha512_BYTES,
               "CRYPTO_SHA512_SIZE should be equal to crypto_hash_sha512_BYTES");
+static_assert(CRYPTO_ENCRYPT_PLAIN_HEADROOM == crypto_box_ZEROBYTES,
+              "CRYPTO_ENCRYPT_PLAIN_HEADROOM should be equal to crypto_box_ZEROBYTES");
+static_assert(CRYPTO_ENCRYPT_CIPHER_HEADROOM == crypto_box_BOXZEROBYTES,
+              "CRYPTO_ENCRYPT_CIPHER_HEADROOM should be equal to crypto_box_BOXZEROBYTES");
 static_assert(CRYPTO_PUBLIC_KEY_SIZE == 32,
               "CRYPTO_PUBLIC_KEY_SIZE is required to be 32 bytes for public_key_cmp to work");
 
@@ -240,6 +244,66 @@ int32_t encrypt_data_symmetric(const uint8_t *secret_key, const uint8_t *nonce,
     return length + crypto_box_MACBYTES;
 }
 
+int32_t encrypt_data_symmetric_headroom(const uint8_t *shared_key, const uint8_t *nonce,
+                                        uint8_t *plain, size_t length, uint8_t *encrypted)
+{
+    if (length == 0 || !shared_key || !nonce || !plain || !encrypted) {
+        return -1;
+    }
+
+#ifdef FUZZING_BUILD_MODE_UNSAFE_FOR_PRODUCTION
+    // Don't encrypt anything.
+    memmove(encrypted, plain, length);
+    // Zero MAC to avoid uninitialized memory reads.
+    memset(encrypted + length, 0, crypto_box_MACBYTES);
+#else
+
+    uint8_t *const padded_plain = plain - crypto_box_ZEROBYTES;
+    uint8_t *const padded_encrypted = encrypted - crypto_box_BOXZEROBYTES;
+
+    // crypto_box_afternm requires the entire range of the output array be
+    // initialised with something, see encrypt_data_symmetric.
+    memset(padded_encrypted, 0, length + crypto_box_ZEROBYTES);
+
+    // The message is already in place, only the padding needs to be zeroed.
+    memset(padded_plain, 0, crypto_box_ZEROBYTES);
+
+    if (crypto_box_afternm(padded_encrypted, padded_plain, length + crypto_box_ZEROBYTES, nonce, shared_key) != 0) {
+        return -1;
+    }
+
+#endif
+    return length + crypto_box_MACBYTES;
+}
+
+int32_t encrypt_data_symmetric_in_place(const uint8_t *shared_key, const uint8_t *nonce, uint8_t *plain,
+                                        size_t length)
+{
+    if (length == 0 || !shared_key || !nonce || !plain) {
+        return -1;
+    }
+
+#ifdef FUZZING_BUILD_MODE_UNSAFE_FOR_PRODUCTION
+    // Don't encrypt anything.
+    memmove(plain - crypto_box_MACBYTES, plain, length);
+    // Zero MAC to avoid uninitialized memory reads.
+    memset(plain - crypto_box_MACBYTES + length, 0, crypto_box_MACBYTES);
+#else
+
+    uint8_t *const padded = plain - crypto_box_ZEROBYTES;
+
+    // crypto_box_afternm may encrypt in place, and the message initialises
+    // the output, so only the padding needs to be zeroed.
+    memset(padded, 0, crypto_box_ZEROBYTES);
+
+    if (crypto_box_afternm(padded, padded, length + crypto_box_ZEROBYTES, nonce, shared_key) != 0) {
+        return -1;
+    }
+
+#endif
+    return length + crypto_box_MACBYTES;
+}
+
 int32_t decrypt_data_symmetric(const uint8_t *secret_key, const uint8_t *nonce,
                                const uint8_t *encrypted, size_t length, uint8_t *plain)
 {
@@ -288,6 +352,31 @@ int32_t decrypt_data_symmetric(const uint8_t *secret_key, const uint8_t *nonce,
     return length - crypto_box_MACBYTES;
 }
 
+int32_t decrypt_data_symmetric_in_place(const uint8_t *shared_key, const uint8_t *nonce, uint8_t *encrypted,
+                                        size_t length)
+{
+    if (length <= crypto_box_BOXZEROBYTES || !shared_key || !nonce || !encrypted) {
+        return -1;
+    }
+
+#ifdef FUZZING_BUILD_MODE_UNSAFE_FOR_PRODUCTION
+    // Don't decrypt anything.
+    memmove(encrypted + crypto_box_MACBYTES, encrypted, length - crypto_box_MACBYTES);
+#else
+
+    uint8_t *const padded = encrypted - crypto_box_BOXZEROBYTES;
+    memset(padded, 0, crypto_box_BOXZEROBYTES);
+
+    // crypto_box_open_afternm may decrypt in place: the message ends up
+    // crypto_box_ZEROBYTES into the padded box, right after the MAC.
+    if (crypto_box_open_afternm(padded, padded, length + crypto_box_BOXZEROBYTES, nonce, shared_key) != 0) {
+        return -1;
+    }
+
+#endif
+    return length - crypto_box_MACBYTES;
+}
+
 int32_t encrypt_data(const uint8_t *public_key, const uint8_t *secret_key, const uint8_t *nonce,
                      const uint8_t *plain, size_t length, uint8_t *encrypted)
 {
@@ -394,6 +483,36 @@ void crypto_sha512(uint8_t *hash, const uint8_t *data, size_t length)
     crypto_hash_sha512(hash, data, length);
 }
 
+uint64_t crypto_siphash(const uint8_t *key, const uint8_t *data, size_t length)
+{
+    uint8_t hash[8];
+#ifndef VANILLA_NACL
+    crypto_shorthash_siphash24(hash, data, length, key);
+#else
+    // NaCl has no SipHash, fall back to a (much slower) hash of the key and the data.
+    uint8_t sha[CRYPTO_SHA256_SIZE];
+    uint8_t *keyed = (uint8_t *)malloc(CRYPTO_SIPHASH_KEY_SIZE + length);
+
+    if (keyed == nullptr) {
+        return 0;
+    }
+
+    memcpy(keyed, key, CRYPTO_SIPHASH_KEY_SIZE);
+    memcpy(keyed + CRYPTO_SIPHASH_KEY_SIZE, data, length);
+    crypto_hash_sha256(sha, keyed, CRYPTO_SIPHASH_KEY_SIZE + length);
+    free(keyed);
+    memcpy(hash, sha, sizeof(hash));
+#endif
+
+    uint64_t result = 0;
+
+    for (int i = 7; i >= 0; --i) {
+        result = (result << 8) | hash[i];
+    }
+
+    return result;
+}
+
 void random_bytes(uint8_t *data, size_t length)
 {
 #ifdef FUZZING_BUILD_MODE_UNSAFE_FOR_PRODUCTION
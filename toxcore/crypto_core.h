@@ -60,6 +60,11 @@ extern "C" {
  */
 #define CRYPTO_SHA512_SIZE             64
 
+/**
+ * @brief The number of bytes in a key for crypto_siphash().
+ */
+#define CRYPTO_SIPHASH_KEY_SIZE        16
+
 /**
  * @brief A `bzero`-like function which won't be optimised away by the compiler.
  *
@@ -82,6 +87,16 @@ void crypto_sha256(uint8_t *hash, const uint8_t *data, size_t length);
 non_null()
 void crypto_sha512(uint8_t *hash, const uint8_t *data, size_t length);
 
+/**
+ * @brief Compute a keyed 64 bit hash (SipHash-2-4) of the data.
+ *
+ * Without the key, nobody can choose data whose hashes collide, so it is the
+ * hash to use for tables indexed by keys that peers choose. The key must be
+ * CRYPTO_SIPHASH_KEY_SIZE bytes.
+ */
+non_null()
+uint64_t crypto_siphash(const uint8_t *key, const uint8_t *data, size_t length);
+
 /**
  * @brief Compare 2 public keys of length @ref CRYPTO_PUBLIC_KEY_SIZE, not vulnerable to
  * timing attacks.
@@ -219,6 +234,44 @@ non_null()
 int32_t encrypt_data_symmetric(const uint8_t *shared_key, const uint8_t *nonce, const uint8_t *plain, size_t length,
                                uint8_t *encrypted);
 
+/**
+ * @brief Number of bytes of scratch space needed in front of the buffers
+ * passed to @ref encrypt_data_symmetric_headroom.
+ */
+#define CRYPTO_ENCRYPT_PLAIN_HEADROOM  32
+#define CRYPTO_ENCRYPT_CIPHER_HEADROOM 16
+
+/**
+ * @brief Encrypt message with precomputed shared key, without intermediate copies.
+ *
+ * Same as @ref encrypt_data_symmetric, but the caller reserves scratch space
+ * instead of the message being copied into temporary buffers: the
+ * @ref CRYPTO_ENCRYPT_PLAIN_HEADROOM bytes before `plain` and the
+ * @ref CRYPTO_ENCRYPT_CIPHER_HEADROOM bytes before `encrypted` are overwritten.
+ * The two buffers must not overlap.
+ *
+ * @return -1 if there was a problem, length of encrypted data if everything
+ * was fine.
+ */
+non_null()
+int32_t encrypt_data_symmetric_headroom(const uint8_t *shared_key, const uint8_t *nonce, uint8_t *plain, size_t length,
+                                        uint8_t *encrypted);
+
+/**
+ * @brief Encrypt message with precomputed shared key in place.
+ *
+ * Same as @ref encrypt_data_symmetric, but the encrypted message is written
+ * over `plain`, starting @ref CRYPTO_MAC_SIZE bytes before it. The
+ * @ref CRYPTO_ENCRYPT_PLAIN_HEADROOM bytes before `plain` are overwritten.
+ * This lets nested layers be encrypted one after the other in one buffer.
+ *
+ * @return -1 if there was a problem, length of encrypted data if everything
+ * was fine.
+ */
+non_null()
+int32_t encrypt_data_symmetric_in_place(const uint8_t *shared_key, const uint8_t *nonce, uint8_t *plain,
+                                        size_t length);
+
 /**
  * @brief Decrypt message with precomputed shared key.
  *
@@ -233,6 +286,27 @@ non_null()
 int32_t decrypt_data_symmetric(const uint8_t *shared_key, const uint8_t *nonce, const uint8_t *encrypted, size_t length,
                                uint8_t *plain);
 
+/**
+ * @brief Number of bytes of scratch space needed in front of the buffer
+ * passed to @ref decrypt_data_symmetric_in_place.
+ */
+#define CRYPTO_DECRYPT_HEADROOM 16
+
+/**
+ * @brief Decrypt message with precomputed shared key in place.
+ *
+ * Same as @ref decrypt_data_symmetric, but the decrypted message is written
+ * over `encrypted`, starting @ref CRYPTO_MAC_SIZE bytes after it. The
+ * @ref CRYPTO_DECRYPT_HEADROOM bytes before `encrypted` are overwritten.
+ * This lets nested layers be peeled off one after the other in one buffer.
+ *
+ * @return -1 if there was a problem (decryption failed), length of plain data
+ * if everything was fine.
+ */
+non_null()
+int32_t decrypt_data_symmetric_in_place(const uint8_t *shared_key, const uint8_t *nonce, uint8_t *encrypted,
+                                        size_t length);
+
 /**
  * @brief Increment the given nonce by 1 in big endian (rightmost byte incremented
  * first).
@@ -0,0 +1,52 @@
+#include <benchmark/benchmark.h>
+
+#include <array>
+#include <vector>
+
+#include "crypto_core.h"
+
+namespace {
+
+/** Plaintext sizes from a short chat message up to a full data packet. */
+void PacketSizes(benchmark::internal::Benchmark *b) { b->Arg(64)->Arg(512)->Arg(1373); }
+
+void BM_EncryptDataSymmetric(benchmark::State &state) {
+  const size_t length = state.range(0);
+  std::array<uint8_t, CRYPTO_SHARED_KEY_SIZE> key;
+  std::array<uint8_t, CRYPTO_NONCE_SIZE> nonce;
+  new_symmetric_key(key.data());
+  random_nonce(nonce.data());
+  std::vector<uint8_t> plain(length, 1);
+  std::vector<uint8_t> encrypted(length + CRYPTO_MAC_SIZE);
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(
+        encrypt_data_symmetric(key.data(), nonce.data(), plain.data(), length, encrypted.data()));
+    increment_nonce(nonce.data());
+  }
+
+  state.SetBytesProcessed(state.iterations() * length);
+}
+BENCHMARK(BM_EncryptDataSymmetric)->Apply(PacketSizes);
+
+void BM_EncryptDataSymmetricHeadroom(benchmark::State &state) {
+  const size_t length = state.range(0);
+  std::array<uint8_t, CRYPTO_SHARED_KEY_SIZE> key;
+  std::array<uint8_t, CRYPTO_NONCE_SIZE> nonce;
+  new_symmetric_key(key.data());
+  random_nonce(nonce.data());
+  std::vector<uint8_t> plain(CRYPTO_ENCRYPT_PLAIN_HEADROOM + length, 1);
+  std::vector<uint8_t> encrypted(CRYPTO_ENCRYPT_CIPHER_HEADROOM + length + CRYPTO_MAC_SIZE);
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(encrypt_data_symmetric_headroom(
+        key.data(), nonce.data(), plain.data() + CRYPTO_ENCRYPT_PLAIN_HEADROOM, length,
+        encrypted.data() + CRYPTO_ENCRYPT_CIPHER_HEADROOM));
+    increment_nonce(nonce.data());
+  }
+
+  state.SetBytesProcessed(state.iterations() * length);
+}
+BENCHMARK(BM_EncryptDataSymmetricHeadroom)->Apply(PacketSizes);
+
+}  // namespace
@@ -43,4 +43,124 @@ TEST(CryptoCore, IncrementNonceNumber) {
                            0, 0, 0, 0, 0, 0, 0, 0, 0x12, 0x34, 0x5A, 0x62}}));
 }
 
+TEST(CryptoCore, EncryptDataSymmetricHeadroomMatchesEncryptDataSymmetric) {
+  std::array<uint8_t, CRYPTO_SHARED_KEY_SIZE> key;
+  std::array<uint8_t, CRYPTO_NONCE_SIZE> nonce;
+  new_symmetric_key(key.data());
+  random_nonce(nonce.data());
+
+  std::vector<uint8_t> message(100);
+  for (size_t i = 0; i < message.size(); ++i) {
+    message[i] = static_cast<uint8_t>(i);
+  }
+
+  std::vector<uint8_t> expected(message.size() + CRYPTO_MAC_SIZE);
+  ASSERT_EQ(encrypt_data_symmetric(key.data(), nonce.data(), message.data(), message.size(),
+                                   expected.data()),
+            static_cast<int32_t>(expected.size()));
+
+  std::vector<uint8_t> plain(CRYPTO_ENCRYPT_PLAIN_HEADROOM + message.size());
+  std::copy(message.begin(), message.end(), plain.begin() + CRYPTO_ENCRYPT_PLAIN_HEADROOM);
+  std::vector<uint8_t> encrypted(CRYPTO_ENCRYPT_CIPHER_HEADROOM + expected.size());
+  ASSERT_EQ(encrypt_data_symmetric_headroom(key.data(), nonce.data(),
+                                            plain.data() + CRYPTO_ENCRYPT_PLAIN_HEADROOM,
+                                            message.size(),
+                                            encrypted.data() + CRYPTO_ENCRYPT_CIPHER_HEADROOM),
+            static_cast<int32_t>(expected.size()));
+
+  EXPECT_EQ(std::vector<uint8_t>(encrypted.begin() + CRYPTO_ENCRYPT_CIPHER_HEADROOM, encrypted.end()),
+            expected);
+}
+
+TEST(CryptoCore, EncryptDataSymmetricInPlaceMatchesEncryptDataSymmetric) {
+  std::array<uint8_t, CRYPTO_SHARED_KEY_SIZE> key;
+  std::array<uint8_t, CRYPTO_NONCE_SIZE> nonce;
+  new_symmetric_key(key.data());
+  random_nonce(nonce.data());
+
+  for (size_t length : {1, 15, 16, 100, 1000}) {
+    std::vector<uint8_t> message(length);
+    for (size_t i = 0; i < message.size(); ++i) {
+      message[i] = static_cast<uint8_t>(i * 7);
+    }
+
+    std::vector<uint8_t> expected(message.size() + CRYPTO_MAC_SIZE);
+    ASSERT_EQ(encrypt_data_symmetric(key.data(), nonce.data(), message.data(), message.size(),
+                                     expected.data()),
+              static_cast<int32_t>(expected.size()));
+
+    std::vector<uint8_t> buffer(CRYPTO_ENCRYPT_PLAIN_HEADROOM + message.size());
+    std::copy(message.begin(), message.end(), buffer.begin() + CRYPTO_ENCRYPT_PLAIN_HEADROOM);
+    ASSERT_EQ(encrypt_data_symmetric_in_place(key.data(), nonce.data(),
+                                              buffer.data() + CRYPTO_ENCRYPT_PLAIN_HEADROOM,
+                                              message.size()),
+              static_cast<int32_t>(expected.size()));
+
+    EXPECT_EQ(std::vector<uint8_t>(
+                  buffer.begin() + CRYPTO_ENCRYPT_PLAIN_HEADROOM - CRYPTO_MAC_SIZE, buffer.end()),
+              expected);
+
+    std::vector<uint8_t> decrypted(message.size());
+    ASSERT_EQ(decrypt_data_symmetric(key.data(), nonce.data(), expected.data(), expected.size(),
+                                     decrypted.data()),
+              static_cast<int32_t>(message.size()));
+    EXPECT_EQ(decrypted, message);
+  }
+}
+
+TEST(CryptoCore, DecryptDataSymmetricInPlaceMatchesDecryptDataSymmetric) {
+  std::array<uint8_t, CRYPTO_SHARED_KEY_SIZE> key;
+  std::array<uint8_t, CRYPTO_NONCE_SIZE> nonce;
+  new_symmetric_key(key.data());
+  random_nonce(nonce.data());
+
+  for (size_t length : {1, 15, 16, 100, 1000}) {
+    std::vector<uint8_t> message(length);
+    for (size_t i = 0; i < message.size(); ++i) {
+      message[i] = static_cast<uint8_t>(i * 7);
+    }
+
+    std::vector<uint8_t> encrypted(message.size() + CRYPTO_MAC_SIZE);
+    ASSERT_EQ(encrypt_data_symmetric(key.data(), nonce.data(), message.data(), message.size(),
+                                     encrypted.data()),
+              static_cast<int32_t>(encrypted.size()));
+
+    std::vector<uint8_t> buffer(CRYPTO_DECRYPT_HEADROOM + encrypted.size());
+    std::copy(encrypted.begin(), encrypted.end(), buffer.begin() + CRYPTO_DECRYPT_HEADROOM);
+    ASSERT_EQ(decrypt_data_symmetric_in_place(key.data(), nonce.data(),
+                                              buffer.data() + CRYPTO_DECRYPT_HEADROOM,
+                                              encrypted.size()),
+              static_cast<int32_t>(message.size()));
+
+    EXPECT_EQ(std::vector<uint8_t>(buffer.begin() + CRYPTO_DECRYPT_HEADROOM + CRYPTO_MAC_SIZE,
+                                   buffer.end()),
+              message);
+
+    // A tampered message is rejected.
+    std::copy(encrypted.begin(), encrypted.end(), buffer.begin() + CRYPTO_DECRYPT_HEADROOM);
+    buffer.back() ^= 1;
+    EXPECT_EQ(decrypt_data_symmetric_in_place(key.data(), nonce.data(),
+                                              buffer.data() + CRYPTO_DECRYPT_HEADROOM,
+                                              encrypted.size()),
+              -1);
+  }
+}
+
+TEST(CryptoCore, SiphashMatchesTheReferenceVectors) {
+  std::array<uint8_t, CRYPTO_SIPHASH_KEY_SIZE> key;
+  std::array<uint8_t, 15> data;
+
+  for (uint8_t i = 0; i < key.size(); ++i) {
+    key[i] = i;
+  }
+
+  for (uint8_t i = 0; i < data.size(); ++i) {
+    data[i] = i;
+  }
+
+  // From the SipHash paper, appendix A, and the vectors of its reference implementation.
+  EXPECT_EQ(crypto_siphash(key.data(), data.data(), 0), 0x726fdb47dd0e0e31ULL);
+  EXPECT_EQ(crypto_siphash(key.data(), data.data(), data.size()), 0xa129ca6149be45e5ULL);
+}
+
 }  // namespace
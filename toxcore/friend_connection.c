@@ -11,7 +11,9 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "hash_index.h"
 #include "mono_time.h"
+#include "run_queue.h"
 #include "util.h"
 
 #define PORTS_PER_DISCOVERY 10
@@ -63,6 +65,9 @@ struct Friend_Connections {
 
     Friend_Conn *conns;
     uint32_t num_cons;
+    Hash_Index key_index; /* Connections by the real public key of the friend. */
+
+    Run_Queue run_queue; /* Connections by when do_friend_conn() next has something to do for them. */
 
     fr_request_cb *fr_request_callback;
     void *fr_request_object;
@@ -142,6 +147,10 @@ static int create_friend_conn(Friend_Connections *fr_c)
         }
     }
 
+    if (!run_queue_reserve(&fr_c->run_queue, fr_c->num_cons + 1)) {
+        return -1;
+    }
+
     if (!realloc_friendconns(fr_c, fr_c->num_cons + 1)) {
         return -1;
     }
@@ -165,6 +174,8 @@ static int wipe_friend_conn(Friend_Connections *fr_c, int friendcon_id)
         return -1;
     }
 
+    run_queue_unschedule(&fr_c->run_queue, friendcon_id);
+    hash_index_remove(&fr_c->key_index, fr_c->conns[friendcon_id].real_public_key, friendcon_id);
     memset(&fr_c->conns[friendcon_id], 0, sizeof(Friend_Conn));
 
     uint32_t i;
@@ -192,22 +203,21 @@ Friend_Conn *get_conn(const Friend_Connections *fr_c, int friendcon_id)
     return &fr_c->conns[friendcon_id];
 }
 
+/** Have do_friend_connections() look at the connection on its next run,
+ * because something it looks at changed.
+ */
+non_null()
+static void wake_conn(Friend_Connections *fr_c, int friendcon_id)
+{
+    run_queue_wake(&fr_c->run_queue, friendcon_id, mono_time_get(fr_c->mono_time));
+}
+
 /** return friendcon_id corresponding to the real public key on success.
  * return -1 on failure.
  */
 int getfriend_conn_id_pk(const Friend_Connections *fr_c, const uint8_t *real_pk)
 {
-    for (uint32_t i = 0; i < fr_c->num_cons; ++i) {
-        const Friend_Conn *friend_con = get_conn(fr_c, i);
-
-        if (friend_con) {
-            if (public_key_cmp(friend_con->real_public_key, real_pk) == 0) {
-                return i;
-            }
-        }
-    }
-
-    return -1;
+    return hash_index_find(&fr_c->key_index, real_pk);
 }
 
 /** Add a TCP relay associated to the friend.
@@ -350,6 +360,7 @@ static void dht_ip_callback(void *object, int32_t number, const IP_Port *ip_port
     set_direct_ip_port(fr_c->net_crypto, friend_con->crypt_connection_id, ip_port, 1);
     friend_con->dht_ip_port = *ip_port;
     friend_con->dht_ip_port_lastrecv = mono_time_get(fr_c->mono_time);
+    wake_conn(fr_c, number);
 
     if (friend_con->hosting_tcp_relay) {
         friend_add_tcp_relay(fr_c, number, ip_port, friend_con->dht_temp_pk);
@@ -379,6 +390,7 @@ static void change_dht_pk(Friend_Connections *fr_c, int friendcon_id, const uint
 
     dht_addfriend(fr_c->dht, dht_public_key, dht_ip_callback, fr_c, friendcon_id, &friend_con->dht_lock);
     memcpy(friend_con->dht_temp_pk, dht_public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    wake_conn(fr_c, friendcon_id);
 }
 
 non_null()
@@ -411,6 +423,8 @@ static int handle_status(void *object, int number, uint8_t status, void *userdat
         friend_con->hosting_tcp_relay = 0;
     }
 
+    wake_conn(fr_c, number);
+
     if (status_changed) {
         if (fr_c->global_status_callback) {
             fr_c->global_status_callback(fr_c->global_status_callback_object, number, status, userdata);
@@ -571,6 +585,7 @@ static int handle_new_connections(void *object, const New_Connection *n_c)
     connection_data_handler(fr_c->net_crypto, id, &handle_packet, fr_c, friendcon_id);
     connection_lossy_data_handler(fr_c->net_crypto, id, &handle_lossy_packet, fr_c, friendcon_id);
     friend_con->crypt_connection_id = id;
+    wake_conn(fr_c, friendcon_id);
 
     if (!net_family_is_ipv4(n_c->source.ip.family) && !net_family_is_ipv6(n_c->source.ip.family)) {
         set_direct_ip_port(fr_c->net_crypto, friend_con->crypt_connection_id, &friend_con->dht_ip_port, 0);
@@ -656,6 +671,17 @@ int friend_connection_lock(const Friend_Connections *fr_c, int friendcon_id)
     return 0;
 }
 
+int friend_connection_set_last_online(const Friend_Connections *fr_c, int friendcon_id, uint64_t seconds_ago)
+{
+    const Friend_Conn *const friend_con = get_conn(fr_c, friendcon_id);
+
+    if (!friend_con) {
+        return -1;
+    }
+
+    return onion_set_friend_last_online(fr_c->onion_c, friend_con->onion_friendnum, seconds_ago);
+}
+
 /** return FRIENDCONN_STATUS_CONNECTED if the friend is connected.
  * return FRIENDCONN_STATUS_CONNECTING if the friend isn't connected.
  * return FRIENDCONN_STATUS_NONE on failure.
@@ -794,6 +820,11 @@ int new_friend_connection(Friend_Connections *fr_c, const uint8_t *real_public_k
         return -1;
     }
 
+    if (!hash_index_add(&fr_c->key_index, real_public_key, friendcon_id)) {
+        onion_delfriend(fr_c->onion_c, onion_friendnum);
+        return -1;
+    }
+
     Friend_Conn *const friend_con = &fr_c->conns[friendcon_id];
 
     friend_con->crypt_connection_id = -1;
@@ -803,6 +834,7 @@ int new_friend_connection(Friend_Connections *fr_c, const uint8_t *real_public_k
 
     recv_tcp_relay_handler(fr_c->onion_c, onion_friendnum, &tcp_relay_node_callback, fr_c, friendcon_id);
     onion_dht_pk_callback(fr_c->onion_c, onion_friendnum, &dht_pk_callback, fr_c, friendcon_id);
+    wake_conn(fr_c, friendcon_id);
 
     return friendcon_id;
 }
@@ -907,6 +939,8 @@ Friend_Connections *new_friend_connections(const Logger *logger, const Mono_Time
     temp->local_discovery_enabled = local_discovery_enabled;
     // Don't include default port in port range
     temp->next_lan_port = TOX_PORTRANGE_FROM + 1;
+    run_queue_init(&temp->run_queue);
+    hash_index_init(&temp->key_index, CRYPTO_PUBLIC_KEY_SIZE);
 
     new_connection_handler(temp->net_crypto, &handle_new_connections, temp);
 
@@ -945,50 +979,94 @@ static void lan_discovery(Friend_Connections *fr_c)
     }
 }
 
+/** Do what is due for a friend connection. Its timestamps time out when they
+ * are more than the timeout in the past, one second after mono_time_is_timeout()
+ * would say so.
+ *
+ * return the time at which something is due next.
+ * return 0 if nothing is until the connection is woken.
+ */
+non_null(1) nullable(4)
+static uint64_t do_friend_conn(Friend_Connections *fr_c, int friendcon_id, uint64_t temp_time, void *userdata)
+{
+    Friend_Conn *const friend_con = get_conn(fr_c, friendcon_id);
+
+    if (!friend_con) {
+        return 0;
+    }
+
+    uint64_t next_run = UINT64_MAX;
+
+    if (friend_con->status == FRIENDCONN_STATUS_CONNECTING) {
+        if (friend_con->dht_pk_lastrecv + FRIEND_DHT_TIMEOUT < temp_time) {
+            if (friend_con->dht_lock) {
+                dht_delfriend(fr_c->dht, friend_con->dht_temp_pk, friend_con->dht_lock);
+                friend_con->dht_lock = 0;
+                memset(friend_con->dht_temp_pk, 0, CRYPTO_PUBLIC_KEY_SIZE);
+            }
+        } else if (friend_con->dht_lock) {
+            run_queue_at_timeout(&next_run, friend_con->dht_pk_lastrecv, FRIEND_DHT_TIMEOUT + 1);
+        }
+
+        if (friend_con->dht_ip_port_lastrecv + FRIEND_DHT_TIMEOUT < temp_time) {
+            friend_con->dht_ip_port.ip.family = net_family_unspec;
+        } else if (!net_family_is_unspec(friend_con->dht_ip_port.ip.family)) {
+            run_queue_at_timeout(&next_run, friend_con->dht_ip_port_lastrecv, FRIEND_DHT_TIMEOUT + 1);
+        }
+
+        if (friend_con->dht_lock) {
+            if (friend_new_connection(fr_c, friendcon_id) == 0) {
+                set_direct_ip_port(fr_c->net_crypto, friend_con->crypt_connection_id, &friend_con->dht_ip_port, 0);
+                connect_to_saved_tcp_relays(fr_c, friendcon_id, MAX_FRIEND_TCP_CONNECTIONS / 2); /* Only fill it half up. */
+            }
+
+            if (friend_con->crypt_connection_id == -1) {
+                // Try again on the next run.
+                next_run = temp_time;
+            }
+        }
+    } else if (friend_con->status == FRIENDCONN_STATUS_CONNECTED) {
+        if (friend_con->ping_lastsent + FRIEND_PING_INTERVAL < temp_time) {
+            send_ping(fr_c, friendcon_id);
+        }
+
+        if (friend_con->share_relays_lastsent + SHARE_RELAYS_INTERVAL < temp_time) {
+            send_relays(fr_c, friendcon_id);
+        }
+
+        if (friend_con->ping_lastrecv + FRIEND_CONNECTION_TIMEOUT < temp_time) {
+            /* If we stopped receiving ping packets, kill it. */
+            crypto_kill(fr_c->net_crypto, friend_con->crypt_connection_id);
+            friend_con->crypt_connection_id = -1;
+            handle_status(fr_c, friendcon_id, 0, userdata); /* Going offline. */
+            return temp_time;
+        }
+
+        // Sends that failed are tried again on the next run.
+        run_queue_at_timeout(&next_run, friend_con->ping_lastsent, FRIEND_PING_INTERVAL + 1);
+        run_queue_at_timeout(&next_run, friend_con->share_relays_lastsent, SHARE_RELAYS_INTERVAL + 1);
+        run_queue_at_timeout(&next_run, friend_con->ping_lastrecv, FRIEND_CONNECTION_TIMEOUT + 1);
+    }
+
+    if (next_run == UINT64_MAX) {
+        return 0;
+    }
+
+    return max_u64(next_run, temp_time);
+}
+
 /** main friend_connections loop. */
 void do_friend_connections(Friend_Connections *fr_c, void *userdata)
 {
     const uint64_t temp_time = mono_time_get(fr_c->mono_time);
+    const uint32_t num_due = run_queue_take_due(&fr_c->run_queue, temp_time);
 
-    for (uint32_t i = 0; i < fr_c->num_cons; ++i) {
-        Friend_Conn *const friend_con = get_conn(fr_c, i);
-
-        if (friend_con) {
-            if (friend_con->status == FRIENDCONN_STATUS_CONNECTING) {
-                if (friend_con->dht_pk_lastrecv + FRIEND_DHT_TIMEOUT < temp_time) {
-                    if (friend_con->dht_lock) {
-                        dht_delfriend(fr_c->dht, friend_con->dht_temp_pk, friend_con->dht_lock);
-                        friend_con->dht_lock = 0;
-                        memset(friend_con->dht_temp_pk, 0, CRYPTO_PUBLIC_KEY_SIZE);
-                    }
-                }
-
-                if (friend_con->dht_ip_port_lastrecv + FRIEND_DHT_TIMEOUT < temp_time) {
-                    friend_con->dht_ip_port.ip.family = net_family_unspec;
-                }
-
-                if (friend_con->dht_lock) {
-                    if (friend_new_connection(fr_c, i) == 0) {
-                        set_direct_ip_port(fr_c->net_crypto, friend_con->crypt_connection_id, &friend_con->dht_ip_port, 0);
-                        connect_to_saved_tcp_relays(fr_c, i, MAX_FRIEND_TCP_CONNECTIONS / 2); /* Only fill it half up. */
-                    }
-                }
-            } else if (friend_con->status == FRIENDCONN_STATUS_CONNECTED) {
-                if (friend_con->ping_lastsent + FRIEND_PING_INTERVAL < temp_time) {
-                    send_ping(fr_c, i);
-                }
-
-                if (friend_con->share_relays_lastsent + SHARE_RELAYS_INTERVAL < temp_time) {
-                    send_relays(fr_c, i);
-                }
-
-                if (friend_con->ping_lastrecv + FRIEND_CONNECTION_TIMEOUT < temp_time) {
-                    /* If we stopped receiving ping packets, kill it. */
-                    crypto_kill(fr_c->net_crypto, friend_con->crypt_connection_id);
-                    friend_con->crypt_connection_id = -1;
-                    handle_status(fr_c, i, 0, userdata); /* Going offline. */
-                }
-            }
+    for (uint32_t i = 0; i < num_due; ++i) {
+        const uint32_t friendcon_id = fr_c->run_queue.due[i];
+        const uint64_t next_run = do_friend_conn(fr_c, friendcon_id, temp_time, userdata);
+
+        if (next_run != 0 && get_conn(fr_c, friendcon_id) != nullptr) {
+            run_queue_wake(&fr_c->run_queue, friendcon_id, next_run);
         }
     }
 
@@ -1012,5 +1090,7 @@ void kill_friend_connections(Friend_Connections *fr_c)
         lan_discovery_kill(fr_c->dht, fr_c->broadcast);
     }
 
+    run_queue_free(&fr_c->run_queue);
+    hash_index_free(&fr_c->key_index);
     free(fr_c);
 }
@@ -64,6 +64,15 @@ int getfriend_conn_id_pk(const Friend_Connections *fr_c, const uint8_t *real_pk)
 non_null()
 int friend_connection_lock(const Friend_Connections *fr_c, int friendcon_id);
 
+/** Set how many seconds ago the friend was last online, so that friends that
+ * were online more recently get our DHT public key first.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+non_null()
+int friend_connection_set_last_online(const Friend_Connections *fr_c, int friendcon_id, uint64_t seconds_ago);
+
 /** return FRIENDCONN_STATUS_CONNECTED if the friend is connected.
  * return FRIENDCONN_STATUS_CONNECTING if the friend isn't connected.
  * return FRIENDCONN_STATUS_NONE on failure.
@@ -0,0 +1,195 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later
+ * Copyright © 2022 The TokTok team.
+ */
+
+/** @file
+ * @brief Open addressing hash table which associates ids with fixed size keys.
+ *
+ * Collisions are resolved by linear probing. Removed keys are not replaced by
+ * tombstones: the keys after them in the probe sequence are moved back
+ * instead, so lookups never get slower as keys come and go.
+ */
+#include "hash_index.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ccompat.h"
+#include "crypto_core.h"
+
+#define HASH_INDEX_MIN_CAPACITY 8
+
+/** Hash of the key under the seed of the index, truncated to 32 bits. */
+non_null()
+static uint32_t hash_key(const Hash_Index *index, const uint8_t *key)
+{
+    return (uint32_t)crypto_siphash(index->seed, key, index->key_size);
+}
+
+non_null()
+static const uint8_t *slot_key(const Hash_Index *index, uint32_t slot)
+{
+    return &index->keys[(size_t)slot * index->key_size];
+}
+
+/** Find the slot holding the key.
+ *
+ * return slot of the key, or of the empty slot where it would be inserted.
+ */
+non_null()
+static uint32_t find_slot(const Hash_Index *index, const uint8_t *key, uint32_t hash)
+{
+    const uint32_t mask = index->capacity - 1;
+    uint32_t slot = hash & mask;
+
+    while (index->ids[slot] != -1) {
+        if (index->hashes[slot] == hash && memcmp(slot_key(index, slot), key, index->key_size) == 0) {
+            break;
+        }
+
+        slot = (slot + 1) & mask;
+    }
+
+    return slot;
+}
+
+non_null()
+static void put_slot(Hash_Index *index, uint32_t slot, const uint8_t *key, uint32_t hash, int id)
+{
+    memcpy(&index->keys[(size_t)slot * index->key_size], key, index->key_size);
+    index->hashes[slot] = hash;
+    index->ids[slot] = id;
+}
+
+non_null()
+static bool resize(Hash_Index *index, uint32_t capacity)
+{
+    uint8_t *keys = (uint8_t *)calloc(capacity, index->key_size);
+    uint32_t *hashes = (uint32_t *)calloc(capacity, sizeof(uint32_t));
+    int *ids = (int *)malloc(capacity * sizeof(int));
+
+    if (keys == nullptr || hashes == nullptr || ids == nullptr) {
+        free(ids);
+        free(hashes);
+        free(keys);
+        return false;
+    }
+
+    for (uint32_t i = 0; i < capacity; ++i) {
+        ids[i] = -1;
+    }
+
+    Hash_Index resized = *index;
+    resized.capacity = capacity;
+    resized.keys = keys;
+    resized.hashes = hashes;
+    resized.ids = ids;
+
+    for (uint32_t i = 0; i < index->capacity; ++i) {
+        if (index->ids[i] != -1) {
+            const uint8_t *key = slot_key(index, i);
+            put_slot(&resized, find_slot(&resized, key, index->hashes[i]), key, index->hashes[i], index->ids[i]);
+        }
+    }
+
+    hash_index_free(index);
+    *index = resized;
+    return true;
+}
+
+void hash_index_init(Hash_Index *index, uint32_t key_size)
+{
+    index->n = 0;
+    index->capacity = 0;
+    index->key_size = key_size;
+    random_bytes(index->seed, sizeof(index->seed));
+    index->keys = nullptr;
+    index->hashes = nullptr;
+    index->ids = nullptr;
+}
+
+void hash_index_free(Hash_Index *index)
+{
+    free(index->ids);
+    free(index->hashes);
+    free(index->keys);
+    index->ids = nullptr;
+    index->hashes = nullptr;
+    index->keys = nullptr;
+    index->capacity = 0;
+    index->n = 0;
+}
+
+int hash_index_find(const Hash_Index *index, const uint8_t *key)
+{
+    if (index->n == 0) {
+        return -1;
+    }
+
+    return index->ids[find_slot(index, key, hash_key(index, key))];
+}
+
+bool hash_index_add(Hash_Index *index, const uint8_t *key, int id)
+{
+    if (id < 0 || hash_index_find(index, key) != -1) {
+        return false;
+    }
+
+    /* The index grows when it is more than half full. */
+    if ((index->n + 1) * 2 > index->capacity) {
+        const uint32_t capacity = index->capacity == 0 ? HASH_INDEX_MIN_CAPACITY : index->capacity * 2;
+
+        if (capacity < index->capacity || !resize(index, capacity)) {
+            return false;
+        }
+    }
+
+    const uint32_t hash = hash_key(index, key);
+    put_slot(index, find_slot(index, key, hash), key, hash, id);
+    ++index->n;
+    return true;
+}
+
+bool hash_index_remove(Hash_Index *index, const uint8_t *key, int id)
+{
+    if (index->n == 0) {
+        return false;
+    }
+
+    uint32_t slot = find_slot(index, key, hash_key(index, key));
+
+    if (index->ids[slot] == -1 || index->ids[slot] != id) {
+        return false;
+    }
+
+    /* Move back the keys that were placed after the removed one because their
+     * preferred slot was taken, up to the next empty slot. */
+    const uint32_t mask = index->capacity - 1;
+    uint32_t next = slot;
+
+    while (true) {
+        next = (next + 1) & mask;
+
+        if (index->ids[next] == -1) {
+            break;
+        }
+
+        const uint32_t preferred = index->hashes[next] & mask;
+
+        /* The key can stay if its preferred slot is cyclically in (slot, next]. */
+        const bool stays = slot <= next
+                           ? (slot < preferred && preferred <= next)
+                           : (slot < preferred || preferred <= next);
+
+        if (stays) {
+            continue;
+        }
+
+        put_slot(index, slot, slot_key(index, next), index->hashes[next], index->ids[next]);
+        slot = next;
+    }
+
+    index->ids[slot] = -1;
+    --index->n;
+    return true;
+}
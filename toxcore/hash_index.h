@@ -0,0 +1,72 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later
+ * Copyright © 2022 The TokTok team.
+ */
+
+/** @file
+ * @brief Open addressing hash table which associates ids with fixed size keys
+ *   such as IPs or public keys.
+ *
+ * Unlike BS_List, adding and removing keys takes constant time on average, so
+ * it can be used for indexes that change as often as they are searched.
+ *
+ * Keys are hashed with a random key chosen for each index, so that peers
+ * choosing the keys cannot make them collide.
+ */
+#ifndef C_TOXCORE_TOXCORE_HASH_INDEX_H
+#define C_TOXCORE_TOXCORE_HASH_INDEX_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "attributes.h"
+#include "crypto_core.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct Hash_Index {
+    uint32_t n; // number of keys
+    uint32_t capacity; // number of slots, 0 or a power of 2
+    uint32_t key_size; // size of the keys
+    uint8_t seed[CRYPTO_SIPHASH_KEY_SIZE]; // random key of the hash function
+    uint8_t *keys; // array of capacity keys
+    uint32_t *hashes; // hash of the key in each slot
+    int *ids; // id of the key in each slot, -1 if the slot is empty
+} Hash_Index;
+
+/** @brief Initialize an empty index of keys of key_size bytes. */
+non_null()
+void hash_index_init(Hash_Index *index, uint32_t key_size);
+
+/** @brief Free the memory used by the index. */
+non_null()
+void hash_index_free(Hash_Index *index);
+
+/** @brief Retrieve the id associated with a key.
+ *
+ * @retval >= 0 id associated with the key.
+ * @retval -1 the key is not in the index.
+ */
+non_null()
+int hash_index_find(const Hash_Index *index, const uint8_t *key);
+
+/** @brief Associate a key with a non-negative id.
+ *
+ * @retval false if the key is already in the index or memory allocation failed.
+ */
+non_null()
+bool hash_index_add(Hash_Index *index, const uint8_t *key, int id);
+
+/** @brief Remove a key from the index.
+ *
+ * @retval false if the key is not in the index or is associated with another id.
+ */
+non_null()
+bool hash_index_remove(Hash_Index *index, const uint8_t *key, int id);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif // C_TOXCORE_TOXCORE_HASH_INDEX_H
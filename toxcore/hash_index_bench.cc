@@ -0,0 +1,237 @@
+#include <benchmark/benchmark.h>
+
+#include <array>
+#include <cstring>
+#include <vector>
+
+#include "hash_index.h"
+#include "list.h"
+#include "network.h"
+
+namespace {
+
+using Public_Key = std::array<uint8_t, CRYPTO_PUBLIC_KEY_SIZE>;
+
+std::vector<Public_Key> random_keys(uint32_t count) {
+  std::vector<Public_Key> keys(count);
+
+  for (Public_Key &key : keys) {
+    random_bytes(key.data(), key.size());
+  }
+
+  return keys;
+}
+
+/** IP_Ports of peers in one subnet, zeroed first so the padding compares equal. */
+std::vector<IP_Port> subnet_ip_ports(uint32_t count) {
+  std::vector<IP_Port> ip_ports(count);
+
+  for (uint32_t i = 0; i < count; ++i) {
+    IP_Port &ip_port = ip_ports[i];
+    memset(&ip_port, 0, sizeof(ip_port));
+    ip_port.ip.family = net_family_ipv4;
+    ip_port.ip.ip.v4.uint8[0] = 10;
+    ip_port.ip.ip.v4.uint8[1] = i >> 16;
+    ip_port.ip.ip.v4.uint8[2] = i >> 8;
+    ip_port.ip.ip.v4.uint8[3] = i;
+    ip_port.port = net_htons(33445);
+  }
+
+  return ip_ports;
+}
+
+/** Number of connections, from a client to a busy bootstrap node. */
+void ConnectionCounts(benchmark::internal::Benchmark *b) { b->RangeMultiplier(10)->Range(10, 10000); }
+
+/** The public key search crypto connections used before they had an index. */
+void BM_PublicKeyLinearScan(benchmark::State &state) {
+  const std::vector<Public_Key> keys = random_keys(state.range(0));
+  uint32_t i = 0;
+
+  for (auto _ : state) {
+    const Public_Key &key = keys[i];
+    int found = -1;
+
+    for (uint32_t j = 0; j < keys.size(); ++j) {
+      if (public_key_cmp(key.data(), keys[j].data()) == 0) {
+        found = j;
+        break;
+      }
+    }
+
+    benchmark::DoNotOptimize(found);
+    i = (i + 1) % keys.size();
+  }
+}
+BENCHMARK(BM_PublicKeyLinearScan)->Apply(ConnectionCounts);
+
+void BM_PublicKeyHashIndexFind(benchmark::State &state) {
+  const std::vector<Public_Key> keys = random_keys(state.range(0));
+  Hash_Index index;
+  hash_index_init(&index, CRYPTO_PUBLIC_KEY_SIZE);
+
+  for (uint32_t i = 0; i < keys.size(); ++i) {
+    hash_index_add(&index, keys[i].data(), i);
+  }
+
+  uint32_t i = 0;
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(hash_index_find(&index, keys[i].data()));
+    i = (i + 1) % keys.size();
+  }
+
+  hash_index_free(&index);
+}
+BENCHMARK(BM_PublicKeyHashIndexFind)->Apply(ConnectionCounts);
+
+/** The public key search of the TCP relay before it had an index. */
+void BM_PublicKeyBsListFind(benchmark::State &state) {
+  const std::vector<Public_Key> keys = random_keys(state.range(0));
+  BS_List list;
+  bs_list_init(&list, CRYPTO_PUBLIC_KEY_SIZE, 8);
+
+  for (uint32_t i = 0; i < keys.size(); ++i) {
+    bs_list_add(&list, keys[i].data(), i);
+  }
+
+  uint32_t i = 0;
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(bs_list_find(&list, keys[i].data()));
+    i = (i + 1) % keys.size();
+  }
+
+  bs_list_free(&list);
+}
+BENCHMARK(BM_PublicKeyBsListFind)->Apply(ConnectionCounts);
+
+/** A TCP relay client reconnecting: its key is removed and added back. */
+void BM_PublicKeyBsListChurn(benchmark::State &state) {
+  const std::vector<Public_Key> keys = random_keys(state.range(0));
+  BS_List list;
+  bs_list_init(&list, CRYPTO_PUBLIC_KEY_SIZE, 8);
+
+  for (uint32_t i = 0; i < keys.size(); ++i) {
+    bs_list_add(&list, keys[i].data(), i);
+  }
+
+  uint32_t i = 0;
+
+  for (auto _ : state) {
+    bs_list_remove(&list, keys[i].data(), i);
+    bs_list_add(&list, keys[i].data(), i);
+    i = (i + 1) % keys.size();
+  }
+
+  bs_list_free(&list);
+}
+BENCHMARK(BM_PublicKeyBsListChurn)->Apply(ConnectionCounts);
+
+void BM_PublicKeyHashIndexChurn(benchmark::State &state) {
+  const std::vector<Public_Key> keys = random_keys(state.range(0));
+  Hash_Index index;
+  hash_index_init(&index, CRYPTO_PUBLIC_KEY_SIZE);
+
+  for (uint32_t i = 0; i < keys.size(); ++i) {
+    hash_index_add(&index, keys[i].data(), i);
+  }
+
+  uint32_t i = 0;
+
+  for (auto _ : state) {
+    hash_index_remove(&index, keys[i].data(), i);
+    hash_index_add(&index, keys[i].data(), i);
+    i = (i + 1) % keys.size();
+  }
+
+  hash_index_free(&index);
+}
+BENCHMARK(BM_PublicKeyHashIndexChurn)->Apply(ConnectionCounts);
+
+void BM_IpPortBsListFind(benchmark::State &state) {
+  const std::vector<IP_Port> ip_ports = subnet_ip_ports(state.range(0));
+  BS_List list;
+  bs_list_init(&list, sizeof(IP_Port), 8);
+
+  for (uint32_t i = 0; i < ip_ports.size(); ++i) {
+    bs_list_add(&list, reinterpret_cast<const uint8_t *>(&ip_ports[i]), i);
+  }
+
+  uint32_t i = 0;
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(bs_list_find(&list, reinterpret_cast<const uint8_t *>(&ip_ports[i])));
+    i = (i + 1) % ip_ports.size();
+  }
+
+  bs_list_free(&list);
+}
+BENCHMARK(BM_IpPortBsListFind)->Apply(ConnectionCounts);
+
+void BM_IpPortHashIndexFind(benchmark::State &state) {
+  const std::vector<IP_Port> ip_ports = subnet_ip_ports(state.range(0));
+  Hash_Index index;
+  hash_index_init(&index, sizeof(IP_Port));
+
+  for (uint32_t i = 0; i < ip_ports.size(); ++i) {
+    hash_index_add(&index, reinterpret_cast<const uint8_t *>(&ip_ports[i]), i);
+  }
+
+  uint32_t i = 0;
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(hash_index_find(&index, reinterpret_cast<const uint8_t *>(&ip_ports[i])));
+    i = (i + 1) % ip_ports.size();
+  }
+
+  hash_index_free(&index);
+}
+BENCHMARK(BM_IpPortHashIndexFind)->Apply(ConnectionCounts);
+
+/** A peer reconnecting from a new port: its IP_Port is removed and added back. */
+void BM_IpPortBsListChurn(benchmark::State &state) {
+  const std::vector<IP_Port> ip_ports = subnet_ip_ports(state.range(0));
+  BS_List list;
+  bs_list_init(&list, sizeof(IP_Port), 8);
+
+  for (uint32_t i = 0; i < ip_ports.size(); ++i) {
+    bs_list_add(&list, reinterpret_cast<const uint8_t *>(&ip_ports[i]), i);
+  }
+
+  uint32_t i = 0;
+
+  for (auto _ : state) {
+    const uint8_t *key = reinterpret_cast<const uint8_t *>(&ip_ports[i]);
+    bs_list_remove(&list, key, i);
+    bs_list_add(&list, key, i);
+    i = (i + 1) % ip_ports.size();
+  }
+
+  bs_list_free(&list);
+}
+BENCHMARK(BM_IpPortBsListChurn)->Apply(ConnectionCounts);
+
+void BM_IpPortHashIndexChurn(benchmark::State &state) {
+  const std::vector<IP_Port> ip_ports = subnet_ip_ports(state.range(0));
+  Hash_Index index;
+  hash_index_init(&index, sizeof(IP_Port));
+
+  for (uint32_t i = 0; i < ip_ports.size(); ++i) {
+    hash_index_add(&index, reinterpret_cast<const uint8_t *>(&ip_ports[i]), i);
+  }
+
+  uint32_t i = 0;
+
+  for (auto _ : state) {
+    const uint8_t *key = reinterpret_cast<const uint8_t *>(&ip_ports[i]);
+    hash_index_remove(&index, key, i);
+    hash_index_add(&index, key, i);
+    i = (i + 1) % ip_ports.size();
+  }
+
+  hash_index_free(&index);
+}
+BENCHMARK(BM_IpPortHashIndexChurn)->Apply(ConnectionCounts);
+
+}  // namespace
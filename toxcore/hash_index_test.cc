@@ -0,0 +1,108 @@
+#include "hash_index.h"
+
+#include <gtest/gtest.h>
+
+#include <array>
+#include <map>
+#include <random>
+
+namespace {
+
+using Key = std::array<uint8_t, 6>;
+
+Key make_key(uint32_t i) {
+  // Similar keys, like the IP_Ports of peers in the same subnet.
+  return Key{{10, 0, uint8_t(i >> 16), uint8_t(i >> 8), uint8_t(i), 0x21}};
+}
+
+TEST(HashIndex, FindInEmptyIndex) {
+  Hash_Index index;
+  hash_index_init(&index, sizeof(Key));
+  const Key key = make_key(1);
+  EXPECT_EQ(hash_index_find(&index, key.data()), -1);
+  EXPECT_FALSE(hash_index_remove(&index, key.data(), 0));
+  hash_index_free(&index);
+}
+
+TEST(HashIndex, AddFindRemove) {
+  Hash_Index index;
+  hash_index_init(&index, sizeof(Key));
+  const Key key = make_key(1);
+
+  EXPECT_FALSE(hash_index_add(&index, key.data(), -1));
+  ASSERT_TRUE(hash_index_add(&index, key.data(), 5));
+  EXPECT_FALSE(hash_index_add(&index, key.data(), 6));
+  EXPECT_EQ(hash_index_find(&index, key.data()), 5);
+
+  EXPECT_FALSE(hash_index_remove(&index, key.data(), 6));
+  EXPECT_TRUE(hash_index_remove(&index, key.data(), 5));
+  EXPECT_EQ(hash_index_find(&index, key.data()), -1);
+  EXPECT_FALSE(hash_index_remove(&index, key.data(), 5));
+  hash_index_free(&index);
+}
+
+TEST(HashIndex, MatchesMapUnderRandomAddAndRemove) {
+  Hash_Index index;
+  hash_index_init(&index, sizeof(Key));
+  std::map<Key, int> expected;
+  std::mt19937 rng(42);
+
+  for (int i = 0; i < 100000; ++i) {
+    const Key key = make_key(rng() % 10000);
+    const auto it = expected.find(key);
+
+    if (it == expected.end()) {
+      ASSERT_TRUE(hash_index_add(&index, key.data(), i));
+      expected.emplace(key, i);
+    } else if (rng() % 2 == 0) {
+      ASSERT_TRUE(hash_index_remove(&index, key.data(), it->second));
+      expected.erase(it);
+    }
+  }
+
+  ASSERT_EQ(index.n, expected.size());
+
+  for (uint32_t i = 0; i < 10000; ++i) {
+    const Key key = make_key(i);
+    const auto it = expected.find(key);
+    EXPECT_EQ(hash_index_find(&index, key.data()), it == expected.end() ? -1 : it->second);
+  }
+
+  hash_index_free(&index);
+}
+
+int slot_of(const Hash_Index &index, int id) {
+  for (uint32_t slot = 0; slot < index.capacity; ++slot) {
+    if (index.ids[slot] == id) {
+      return slot;
+    }
+  }
+
+  return -1;
+}
+
+TEST(HashIndex, IndexesPlaceTheSameKeysInDifferentSlots) {
+  Hash_Index index1;
+  Hash_Index index2;
+  hash_index_init(&index1, sizeof(Key));
+  hash_index_init(&index2, sizeof(Key));
+
+  for (uint32_t i = 0; i < 100; ++i) {
+    const Key key = make_key(i);
+    ASSERT_TRUE(hash_index_add(&index1, key.data(), i));
+    ASSERT_TRUE(hash_index_add(&index2, key.data(), i));
+  }
+
+  ASSERT_EQ(index1.capacity, index2.capacity);
+  int moved = 0;
+
+  for (uint32_t i = 0; i < 100; ++i) {
+    moved += slot_of(index1, i) != slot_of(index2, i);
+  }
+
+  EXPECT_GT(moved, 50);
+  hash_index_free(&index2);
+  hash_index_free(&index1);
+}
+
+}  // namespace
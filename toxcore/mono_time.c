@@ -41,6 +41,7 @@
 /** don't call into system billions of times for no reason */
 struct Mono_Time {
     uint64_t time;
+    uint64_t time_ms; /* Monotonic milliseconds at the last update. */
     uint64_t base_time;
 #ifdef OS_WIN32
     /* protect `last_clock_update` and `last_clock_mono` from concurrent access */
@@ -185,7 +186,8 @@ void mono_time_update(Mono_Time *mono_time)
     pthread_mutex_lock(&mono_time->last_clock_lock);
     mono_time->last_clock_update = true;
 #endif
-    time = mono_time->current_time_callback(mono_time, mono_time->user_data) / 1000ULL;
+    const uint64_t time_ms = mono_time->current_time_callback(mono_time, mono_time->user_data);
+    time = time_ms / 1000ULL;
     time += mono_time->base_time;
 #ifdef OS_WIN32
     pthread_mutex_unlock(&mono_time->last_clock_lock);
@@ -193,6 +195,7 @@ void mono_time_update(Mono_Time *mono_time)
 
     pthread_rwlock_wrlock(mono_time->time_update_lock);
     mono_time->time = time;
+    mono_time->time_ms = time_ms;
     pthread_rwlock_unlock(mono_time->time_update_lock);
 }
 
@@ -210,6 +213,19 @@ uint64_t mono_time_get(const Mono_Time *mono_time)
 #endif
 }
 
+uint64_t mono_time_get_ms(const Mono_Time *mono_time)
+{
+#ifdef FUZZING_BUILD_MODE_UNSAFE_FOR_PRODUCTION
+    return mono_time->time_ms;
+#else
+    uint64_t time_ms = 0;
+    pthread_rwlock_rdlock(mono_time->time_update_lock);
+    time_ms = mono_time->time_ms;
+    pthread_rwlock_unlock(mono_time->time_update_lock);
+    return time_ms;
+#endif
+}
+
 bool mono_time_is_timeout(const Mono_Time *mono_time, uint64_t timestamp, uint64_t timeout)
 {
     return timestamp + timeout <= mono_time_get(mono_time);
@@ -61,6 +61,13 @@ void mono_time_update(Mono_Time *mono_time);
 non_null()
 uint64_t mono_time_get(const Mono_Time *mono_time);
 
+/**
+ * Return the monotonic time in milliseconds (ms) at the last call to
+ * mono_time_update. The starting point is unspecified.
+ */
+non_null()
+uint64_t mono_time_get_ms(const Mono_Time *mono_time);
+
 /**
  * Return true iff timestamp is at least timeout seconds in the past.
  */
@@ -48,6 +48,7 @@ TEST(MonoTime, CustomTime) {
   mono_time_update(mono_time);
 
   EXPECT_EQ(current_time_monotonic(mono_time), test_time);
+  EXPECT_EQ(mono_time_get_ms(mono_time), test_time);
 
   uint64_t const start = mono_time_get(mono_time);
 
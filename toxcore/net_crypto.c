@@ -14,8 +14,9 @@
 #include <stdlib.h>
 #include <string.h>
 
-#include "list.h"
+#include "hash_index.h"
 #include "mono_time.h"
+#include "thread_pool.h"
 #include "util.h"
 
 typedef struct Packet_Data {
@@ -109,11 +110,35 @@ typedef struct Crypto_Connection {
     uint64_t last_congestion_event;
     uint64_t rtt_time;
 
+    /* Totals for crypto_connection_stats. */
+    uint64_t rtt_smoothed;
+    uint64_t stats_packets_sent;
+    uint64_t stats_packets_resent;
+    uint64_t stats_bytes_sent;
+    uint64_t stats_bytes_received;
+
     /* TCP_connection connection_number */
     unsigned int connection_number_tcp;
 
     uint8_t maximum_speed_reached;
 
+    /* Whether the last packet in send_array is a coalesced packet that can still be appended to. */
+    bool coalesced_open;
+
+    /* With the thread pool, the first lossless packet since the last iteration
+     * is sent at once and sets burst. The ones after it are queued from
+     * deferred_start to be encrypted together, see queue_deferred_packets. */
+    bool burst;
+    bool has_deferred;
+    uint32_t deferred_start;
+
+    /* Optional features announced by the peer, see CRYPTO_CAPABILITY_*. */
+    uint8_t peer_capabilities;
+    bool peer_capabilities_received;
+    bool peer_knows_capabilities; /* The peer has received our announcement. */
+    uint64_t capabilities_sent_time;
+    uint32_t capabilities_num_sent;
+
     /* Must be a pointer, because the struct is moved in memory */
     pthread_mutex_t *mutex;
 
@@ -150,7 +175,15 @@ struct Net_Crypto {
     /* The current optimal sleep time */
     uint32_t current_sleep_time;
 
-    BS_List ip_port_list;
+    bool lossless_coalescing;
+
+    /* Used to encrypt data packets in parallel, nullptr if disabled. */
+    Thread_Pool *thread_pool;
+    struct Encrypt_Batch *encrypt_batch;
+
+    /* Ids of the crypto connections by real public key and by IP_Port. */
+    Hash_Index public_key_index;
+    Hash_Index ip_port_index;
 };
 
 const uint8_t *nc_get_self_public_key(const Net_Crypto *c)
@@ -193,6 +226,14 @@ static bool crypt_connection_id_is_valid(const Net_Crypto *c, int crypt_connecti
     return true;
 }
 
+/** Capabilities we announce to our peers in PACKET_ID_CAPABILITIES packets. */
+#define CRYPTO_CAPABILITY_COALESCING 0x01
+#define CRYPTO_CAPABILITIES CRYPTO_CAPABILITY_COALESCING
+
+/** Interval in ms between capability announcements and the maximum number we send. */
+#define CRYPTO_CAPABILITIES_INTERVAL 500
+#define CRYPTO_MAX_CAPABILITIES_SENT 8
+
 /** cookie timeout in seconds */
 #define COOKIE_TIMEOUT 15
 #define COOKIE_DATA_LENGTH (uint16_t)(CRYPTO_PUBLIC_KEY_SIZE * 2)
@@ -589,21 +630,21 @@ static int add_ip_port_connection(Net_Crypto *c, int crypt_connection_id, const
 
     if (net_family_is_ipv4(ip_port->ip.family)) {
         if (!ipport_equal(ip_port, &conn->ip_portv4) && !ip_is_lan(&conn->ip_portv4.ip)) {
-            if (!bs_list_add(&c->ip_port_list, (const uint8_t *)ip_port, crypt_connection_id)) {
+            if (!hash_index_add(&c->ip_port_index, (const uint8_t *)ip_port, crypt_connection_id)) {
                 return -1;
             }
 
-            bs_list_remove(&c->ip_port_list, (uint8_t *)&conn->ip_portv4, crypt_connection_id);
+            hash_index_remove(&c->ip_port_index, (const uint8_t *)&conn->ip_portv4, crypt_connection_id);
             conn->ip_portv4 = *ip_port;
             return 0;
         }
     } else if (net_family_is_ipv6(ip_port->ip.family)) {
         if (!ipport_equal(ip_port, &conn->ip_portv6)) {
-            if (!bs_list_add(&c->ip_port_list, (const uint8_t *)ip_port, crypt_connection_id)) {
+            if (!hash_index_add(&c->ip_port_index, (const uint8_t *)ip_port, crypt_connection_id)) {
                 return -1;
             }
 
-            bs_list_remove(&c->ip_port_list, (uint8_t *)&conn->ip_portv6, crypt_connection_id);
+            hash_index_remove(&c->ip_port_index, (const uint8_t *)&conn->ip_portv6, crypt_connection_id);
             conn->ip_portv6 = *ip_port;
             return 0;
         }
@@ -811,13 +852,14 @@ static int get_data_pointer(const Packets_Array *array, Packet_Data **data, uint
     return 1;
 }
 
-/** Add data to end of array.
+/** Add an empty packet to the end of array and put a pointer to it in data,
+ * so the caller can fill it in place.
  *
  * return -1 on failure.
  * return packet number on success.
  */
 non_null()
-static int64_t add_data_end_of_buffer(Packets_Array *array, const Packet_Data *data)
+static int64_t new_data_end_of_buffer(Packets_Array *array, Packet_Data **data)
 {
     const uint32_t num_spots = num_packets_array(array);
 
@@ -831,7 +873,7 @@ static int64_t add_data_end_of_buffer(Packets_Array *array, const Packet_Data *d
         return -1;
     }
 
-    *new_d = *data;
+    *data = new_d;
     uint32_t id = array->buffer_end;
     array->buffer[id % CRYPTO_PACKET_BUFFER_SIZE] = new_d;
     ++array->buffer_end;
@@ -988,13 +1030,15 @@ static int generate_request_packet(uint8_t *data, uint16_t length, const Packets
 /** Handle a request data packet.
  * Remove all the packets the other received from the array.
  *
+ * num_resent is incremented by the number of packets marked to be sent again.
+ *
  * return -1 on failure.
  * return number of requested packets on success.
  */
 non_null()
 static int handle_request_packet(Mono_Time *mono_time, Packets_Array *send_array,
                                  const uint8_t *data, uint16_t length,
-                                 uint64_t *latest_send_time, uint64_t rtt_time)
+                                 uint64_t *latest_send_time, uint64_t rtt_time, uint64_t *num_resent)
 {
     if (length == 0) {
         return -1;
@@ -1028,8 +1072,9 @@ static int handle_request_packet(Mono_Time *mono_time, Packets_Array *send_array
             if (send_array->buffer[num]) {
                 uint64_t sent_time = send_array->buffer[num]->sent_time;
 
-                if ((sent_time + rtt_time) < temp_time) {
+                if (sent_time != 0 && (sent_time + rtt_time) < temp_time) {
                     send_array->buffer[num]->sent_time = 0;
+                    ++*num_resent;
                 }
             }
 
@@ -1069,13 +1114,50 @@ static int handle_request_packet(Mono_Time *mono_time, Packets_Array *send_array
 
 #define MAX_DATA_DATA_PACKET_SIZE (MAX_CRYPTO_PACKET_SIZE - (1 + sizeof(uint16_t) + CRYPTO_MAC_SIZE))
 
+/** Size of the unencrypted header of data packets: packet id and the last 2 bytes of the nonce. */
+#define DATA_PACKET_HEADER_SIZE (1 + sizeof(uint16_t))
+
+static_assert(DATA_PACKET_HEADER_SIZE <= CRYPTO_ENCRYPT_CIPHER_HEADROOM,
+              "the data packet header must fit in the headroom left by encryption");
+
+/** Offset of the packet in the buffer passed to encrypt_data_packet(). */
+#define DATA_PACKET_OFFSET (CRYPTO_ENCRYPT_CIPHER_HEADROOM - DATA_PACKET_HEADER_SIZE)
+
+/** Encrypt the plain text of a data packet into a packet ready to be sent.
+ *
+ * plain must be preceded by CRYPTO_ENCRYPT_PLAIN_HEADROOM bytes of scratch space,
+ * so it can be encrypted straight into the packet without being copied. The
+ * packet is written to buffer + DATA_PACKET_OFFSET, buffer must be
+ * CRYPTO_ENCRYPT_CIPHER_HEADROOM + length + CRYPTO_MAC_SIZE bytes big.
+ *
+ * return -1 on failure.
+ * return length of the packet on success.
+ */
+non_null()
+static int encrypt_data_packet(const uint8_t *shared_key, const uint8_t *nonce, uint8_t *plain, uint16_t length,
+                               uint8_t *buffer)
+{
+    uint8_t *const packet = buffer + DATA_PACKET_OFFSET;
+    const int len = encrypt_data_symmetric_headroom(shared_key, nonce, plain, length, packet + DATA_PACKET_HEADER_SIZE);
+
+    if (len != length + CRYPTO_MAC_SIZE) {
+        return -1;
+    }
+
+    packet[0] = NET_PACKET_CRYPTO_DATA;
+    memcpy(packet + 1, nonce + (CRYPTO_NONCE_SIZE - sizeof(uint16_t)), sizeof(uint16_t));
+    return DATA_PACKET_HEADER_SIZE + len;
+}
+
 /** Creates and sends a data packet to the peer using the fastest route.
+ *
+ * data must be preceded by CRYPTO_ENCRYPT_PLAIN_HEADROOM bytes of scratch space.
  *
  * return -1 on failure.
  * return 0 on success.
  */
 non_null()
-static int send_data_packet(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length)
+static int send_data_packet(Net_Crypto *c, int crypt_connection_id, uint8_t *data, uint16_t length)
 {
     const uint16_t max_length = MAX_CRYPTO_PACKET_SIZE - (1 + sizeof(uint16_t) + CRYPTO_MAC_SIZE);
 
@@ -1092,14 +1174,11 @@ static int send_data_packet(Net_Crypto *c, int crypt_connection_id, const uint8_
     }
 
     pthread_mutex_lock(conn->mutex);
-    const uint16_t packet_size = 1 + sizeof(uint16_t) + length + CRYPTO_MAC_SIZE;
-    VLA(uint8_t, packet, packet_size);
-    packet[0] = NET_PACKET_CRYPTO_DATA;
-    memcpy(packet + 1, conn->sent_nonce + (CRYPTO_NONCE_SIZE - sizeof(uint16_t)), sizeof(uint16_t));
-    const int len = encrypt_data_symmetric(conn->shared_key, conn->sent_nonce, data, length, packet + 1 + sizeof(uint16_t));
+    VLA(uint8_t, buffer, CRYPTO_ENCRYPT_CIPHER_HEADROOM + length + CRYPTO_MAC_SIZE);
+    const int packet_size = encrypt_data_packet(conn->shared_key, conn->sent_nonce, data, length, buffer);
 
-    if (len + 1 + sizeof(uint16_t) != packet_size) {
-        LOGGER_WARNING(c->log, "encryption failed: %d", len);
+    if (packet_size == -1) {
+        LOGGER_WARNING(c->log, "encryption failed");
         pthread_mutex_unlock(conn->mutex);
         return -1;
     }
@@ -1107,7 +1186,31 @@ static int send_data_packet(Net_Crypto *c, int crypt_connection_id, const uint8_
     increment_nonce(conn->sent_nonce);
     pthread_mutex_unlock(conn->mutex);
 
-    return send_packet_to(c, crypt_connection_id, packet, SIZEOF_VLA(packet));
+    if (send_packet_to(c, crypt_connection_id, buffer + DATA_PACKET_OFFSET, packet_size) != 0) {
+        return -1;
+    }
+
+    conn->stats_bytes_sent += packet_size;
+    return 0;
+}
+
+/** Write the plain text of a data packet with buffer_start and num to plain,
+ * which must have room for MAX_DATA_DATA_PACKET_SIZE bytes.
+ *
+ * return length of the plain text.
+ */
+non_null()
+static uint16_t create_data_packet_plain(uint8_t *plain, uint32_t buffer_start, uint32_t num, const uint8_t *data,
+        uint16_t length)
+{
+    num = net_htonl(num);
+    buffer_start = net_htonl(buffer_start);
+    uint16_t padding_length = (MAX_CRYPTO_DATA_SIZE - length) % CRYPTO_MAX_PADDING;
+    memcpy(plain, &buffer_start, sizeof(uint32_t));
+    memcpy(plain + sizeof(uint32_t), &num, sizeof(uint32_t));
+    memset(plain + (sizeof(uint32_t) * 2), PACKET_ID_PADDING, padding_length);
+    memcpy(plain + (sizeof(uint32_t) * 2) + padding_length, data, length);
+    return (sizeof(uint32_t) * 2) + padding_length + length;
 }
 
 /** Creates and sends a data packet with buffer_start and num to the peer using the fastest route.
@@ -1124,16 +1227,134 @@ static int send_data_packet_helper(Net_Crypto *c, int crypt_connection_id, uint3
         return -1;
     }
 
-    num = net_htonl(num);
-    buffer_start = net_htonl(buffer_start);
-    uint16_t padding_length = (MAX_CRYPTO_DATA_SIZE - length) % CRYPTO_MAX_PADDING;
-    VLA(uint8_t, packet, sizeof(uint32_t) + sizeof(uint32_t) + padding_length + length);
-    memcpy(packet, &buffer_start, sizeof(uint32_t));
-    memcpy(packet + sizeof(uint32_t), &num, sizeof(uint32_t));
-    memset(packet + (sizeof(uint32_t) * 2), PACKET_ID_PADDING, padding_length);
-    memcpy(packet + (sizeof(uint32_t) * 2) + padding_length, data, length);
+    uint8_t buffer[CRYPTO_ENCRYPT_PLAIN_HEADROOM + MAX_DATA_DATA_PACKET_SIZE];
+    uint8_t *const packet = buffer + CRYPTO_ENCRYPT_PLAIN_HEADROOM;
+    const uint16_t packet_length = create_data_packet_plain(packet, buffer_start, num, data, length);
 
-    return send_data_packet(c, crypt_connection_id, packet, SIZEOF_VLA(packet));
+    return send_data_packet(c, crypt_connection_id, packet, packet_length);
+}
+
+/** Maximum number of data packets encrypted in parallel at once. */
+#define ENCRYPT_BATCH_SIZE 64
+
+/** Smaller batches are encrypted on the calling thread, as waking up the
+ * thread pool costs more than it saves.
+ */
+#define ENCRYPT_PARALLEL_MIN 16
+
+typedef struct Encrypt_Job {
+    int crypt_connection_id;
+    uint32_t packet_num;
+    uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
+    uint8_t nonce[CRYPTO_NONCE_SIZE];
+    uint16_t plain_length;
+    int packet_length;
+    uint8_t plain[CRYPTO_ENCRYPT_PLAIN_HEADROOM + MAX_DATA_DATA_PACKET_SIZE];
+    uint8_t packet[CRYPTO_ENCRYPT_CIPHER_HEADROOM + MAX_DATA_DATA_PACKET_SIZE + CRYPTO_MAC_SIZE];
+} Encrypt_Job;
+
+/** Data packets of any number of connections to be encrypted together. */
+typedef struct Encrypt_Batch {
+    uint32_t num_jobs;
+    Encrypt_Job jobs[ENCRYPT_BATCH_SIZE];
+} Encrypt_Batch;
+
+/** Thread pool callback: encrypt one packet of an Encrypt_Batch. */
+non_null()
+static void encrypt_job(void *object, uint32_t index)
+{
+    Encrypt_Batch *batch = (Encrypt_Batch *)object;
+    Encrypt_Job *job = &batch->jobs[index];
+    job->packet_length = encrypt_data_packet(job->shared_key, job->nonce, job->plain + CRYPTO_ENCRYPT_PLAIN_HEADROOM,
+                         job->plain_length, job->packet);
+}
+
+/** Add packet number packet_num of the send array of the connection to the
+ * batch, and give it the next nonce of the connection.
+ *
+ * return true if the batch is full.
+ */
+non_null()
+static bool add_encrypt_job(Encrypt_Batch *batch, int crypt_connection_id, Crypto_Connection *conn,
+                            uint32_t packet_num, const Packet_Data *dt)
+{
+    Encrypt_Job *job = &batch->jobs[batch->num_jobs];
+    job->crypt_connection_id = crypt_connection_id;
+    job->packet_num = packet_num;
+    job->plain_length = create_data_packet_plain(job->plain + CRYPTO_ENCRYPT_PLAIN_HEADROOM,
+                        conn->recv_array.buffer_start, packet_num, dt->data, dt->length);
+
+    pthread_mutex_lock(conn->mutex);
+    memcpy(job->shared_key, conn->shared_key, CRYPTO_SHARED_KEY_SIZE);
+    memcpy(job->nonce, conn->sent_nonce, CRYPTO_NONCE_SIZE);
+    increment_nonce(conn->sent_nonce);
+    pthread_mutex_unlock(conn->mutex);
+
+    ++batch->num_jobs;
+    return batch->num_jobs == ENCRYPT_BATCH_SIZE;
+}
+
+/** Encrypt the packets in the batch, in parallel if there are enough of them,
+ * then send them in the order they were added, which for each connection is
+ * also the order of their nonces.
+ *
+ * Sets maximum_speed_reached of a connection and skips the rest of its
+ * packets if one could not be sent.
+ *
+ * return number of packets sent.
+ */
+non_null()
+static uint32_t send_encrypt_batch(Net_Crypto *c)
+{
+    Encrypt_Batch *batch = c->encrypt_batch;
+    const uint32_t num_jobs = batch->num_jobs;
+    batch->num_jobs = 0;
+
+    if (num_jobs < ENCRYPT_PARALLEL_MIN) {
+        for (uint32_t i = 0; i < num_jobs; ++i) {
+            encrypt_job(batch, i);
+        }
+    } else {
+        thread_pool_run(c->thread_pool, &encrypt_job, batch, num_jobs);
+    }
+
+    const uint64_t temp_time = current_time_monotonic(c->mono_time);
+    int failed_id = -1;
+    uint32_t num_sent = 0;
+
+    for (uint32_t i = 0; i < num_jobs; ++i) {
+        Encrypt_Job *job = &batch->jobs[i];
+        crypto_memzero(job->shared_key, CRYPTO_SHARED_KEY_SIZE);
+
+        Crypto_Connection *conn = get_crypto_connection(c, job->crypt_connection_id);
+
+        if (conn == nullptr || job->crypt_connection_id == failed_id) {
+            continue;
+        }
+
+        if (job->packet_length == -1) {
+            LOGGER_WARNING(c->log, "encryption failed");
+            continue;
+        }
+
+        if (send_packet_to(c, job->crypt_connection_id, job->packet + DATA_PACKET_OFFSET, job->packet_length) != 0) {
+            conn->maximum_speed_reached = 1;
+            LOGGER_DEBUG(c->log, "send_data_packet failed (packet_num = %ld)", (long)job->packet_num);
+            failed_id = job->crypt_connection_id;
+            continue;
+        }
+
+        conn->stats_bytes_sent += job->packet_length;
+        ++num_sent;
+
+        Packet_Data *dt = nullptr;
+
+        if (get_data_pointer(&conn->send_array, &dt, job->packet_num) == 1) {
+            dt->sent_time = temp_time;
+        }
+    }
+
+    return num_sent;
 }
 
 non_null()
@@ -1167,12 +1388,113 @@ static int reset_max_speed_reached(Net_Crypto *c, int crypt_connection_id)
     return 0;
 }
 
-/**  return -1 if data could not be put in packet queue.
+/** Send the last packet of the send array if it is a coalesced packet that
+ * hasn't been sent yet, and stop appending to it.
+ */
+non_null()
+static void flush_coalesced_packet(Net_Crypto *c, int crypt_connection_id)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == nullptr || !conn->coalesced_open) {
+        return;
+    }
+
+    conn->coalesced_open = false;
+
+    Packet_Data *dt = nullptr;
+    const uint32_t packet_num = conn->send_array.buffer_end - 1;
+
+    if (get_data_pointer(&conn->send_array, &dt, packet_num) != 1 || dt->sent_time != 0) {
+        return;
+    }
+
+    /* It will be sent by reset_max_speed_reached() or send_requested_packets(). */
+    if (conn->maximum_speed_reached) {
+        return;
+    }
+
+    if (send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, packet_num, dt->data,
+                                dt->length) == 0) {
+        dt->sent_time = current_time_monotonic(c->mono_time);
+    } else {
+        conn->maximum_speed_reached = 1;
+        LOGGER_DEBUG(c->log, "send_data_packet failed (packet_num = %ld)", (long)packet_num);
+    }
+}
+
+/** Copy the fragments of a packet to dest, one after the other. */
+non_null()
+static void gather_fragments(uint8_t *dest, const Crypto_Packet_Fragment *fragments, uint16_t num_fragments)
+{
+    for (uint16_t i = 0; i < num_fragments; ++i) {
+        if (fragments[i].length != 0) {
+            memcpy(dest, fragments[i].data, fragments[i].length);
+            dest += fragments[i].length;
+        }
+    }
+}
+
+/** Append data to the coalesced packet at the end of the send array, or start
+ * a new coalesced packet if there is none or it has no room left.
+ *
+ * A coalesced packet is PACKET_ID_COALESCED followed by any number of
+ * [uint16_t length][data] entries.
+ *
+ * return -1 if data could not be put in packet queue.
+ * return packet number of the coalesced packet on success.
+ */
+non_null()
+static int64_t coalesce_lossless_packet(Net_Crypto *c, int crypt_connection_id, const Crypto_Packet_Fragment *fragments,
+                                        uint16_t num_fragments, uint16_t length)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == nullptr) {
+        return -1;
+    }
+
+    Packet_Data *dt = nullptr;
+    const uint32_t last_num = conn->send_array.buffer_end - 1;
+
+    if (conn->coalesced_open && get_data_pointer(&conn->send_array, &dt, last_num) == 1 && dt->sent_time == 0
+            && dt->length + sizeof(uint16_t) + length <= MAX_CRYPTO_DATA_SIZE) {
+        pthread_mutex_lock(conn->mutex);
+        net_pack_u16(dt->data + dt->length, length);
+        gather_fragments(dt->data + dt->length + sizeof(uint16_t), fragments, num_fragments);
+        dt->length += sizeof(uint16_t) + length;
+        pthread_mutex_unlock(conn->mutex);
+        return last_num;
+    }
+
+    flush_coalesced_packet(c, crypt_connection_id);
+
+    pthread_mutex_lock(conn->mutex);
+    const int64_t packet_num = new_data_end_of_buffer(&conn->send_array, &dt);
+
+    if (packet_num != -1) {
+        dt->length = 1 + sizeof(uint16_t) + length;
+        dt->data[0] = PACKET_ID_COALESCED;
+        net_pack_u16(dt->data + 1, length);
+        gather_fragments(dt->data + 1 + sizeof(uint16_t), fragments, num_fragments);
+        conn->coalesced_open = true;
+        ++conn->stats_packets_sent;
+    }
+
+    pthread_mutex_unlock(conn->mutex);
+
+    return packet_num;
+}
+
+/** The fragments are copied once, into the send array, and the packet is sent
+ * from there.
+ *
+ *  return -1 if data could not be put in packet queue.
  *  return positive packet number if data was put into the queue.
  */
 non_null()
-static int64_t send_lossless_packet(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length,
-                                    uint8_t congestion_control)
+static int64_t send_lossless_packet(Net_Crypto *c, int crypt_connection_id, const Crypto_Packet_Fragment *fragments,
+                                    uint16_t num_fragments, uint16_t length, uint8_t congestion_control)
 {
     if (length == 0 || length > MAX_CRYPTO_DATA_SIZE) {
         return -1;
@@ -1192,28 +1514,55 @@ static int64_t send_lossless_packet(Net_Crypto *c, int crypt_connection_id, cons
         return -1;
     }
 
-    Packet_Data dt;
-    dt.sent_time = 0;
-    dt.length = length;
-    memcpy(dt.data, data, length);
+    if (c->lossless_coalescing && length <= CRYPTO_MAX_COALESCED_LENGTH
+            && (conn->peer_capabilities & CRYPTO_CAPABILITY_COALESCING) != 0) {
+        return coalesce_lossless_packet(c, crypt_connection_id, fragments, num_fragments, length);
+    }
+
+    /* Keep packets on the wire in the same order as their packet numbers. */
+    flush_coalesced_packet(c, crypt_connection_id);
+
+    Packet_Data *dt = nullptr;
     pthread_mutex_lock(conn->mutex);
-    const int64_t packet_num = add_data_end_of_buffer(&conn->send_array, &dt);
+    const int64_t packet_num = new_data_end_of_buffer(&conn->send_array, &dt);
+
+    if (packet_num != -1) {
+        dt->length = length;
+        gather_fragments(dt->data, fragments, num_fragments);
+        ++conn->stats_packets_sent;
+    }
+
+    /* A lone packet is not kept waiting: only the packets after the first one
+     * since the last iteration are deferred. */
+    const bool defer = packet_num != -1 && c->thread_pool != nullptr && conn->burst;
+
+    if (packet_num != -1 && c->thread_pool != nullptr) {
+        conn->burst = true;
+    }
+
+    if (defer && !conn->has_deferred) {
+        conn->has_deferred = true;
+        conn->deferred_start = packet_num;
+    }
+
     pthread_mutex_unlock(conn->mutex);
 
     if (packet_num == -1) {
         return -1;
     }
 
-    if (!congestion_control && conn->maximum_speed_reached) {
+    /* It will be encrypted together with the other packets queued until the next iteration. */
+    if (defer) {
         return packet_num;
     }
 
-    if (send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, packet_num, data, length) == 0) {
-        Packet_Data *dt1 = nullptr;
+    if (!congestion_control && conn->maximum_speed_reached) {
+        return packet_num;
+    }
 
-        if (get_data_pointer(&conn->send_array, &dt1, packet_num) == 1) {
-            dt1->sent_time = current_time_monotonic(c->mono_time);
-        }
+    if (send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, packet_num, dt->data,
+                                dt->length) == 0) {
+        dt->sent_time = current_time_monotonic(c->mono_time);
     } else {
         conn->maximum_speed_reached = 1;
         LOGGER_DEBUG(c->log, "send_data_packet failed (packet_num = %ld)", (long)packet_num);
@@ -1304,7 +1653,32 @@ static int send_request_packet(Net_Crypto *c, int crypt_connection_id)
                                    len);
 }
 
+/** Announce the optional features we support to the peer.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+non_null()
+static int send_capabilities_packet(Net_Crypto *c, int crypt_connection_id)
+{
+    const Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == nullptr) {
+        return -1;
+    }
+
+    uint8_t data[3];
+    data[0] = PACKET_ID_CAPABILITIES;
+    data[1] = CRYPTO_CAPABILITIES;
+    data[2] = conn->peer_capabilities_received ? 1 : 0;
+
+    return send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, conn->send_array.buffer_end, data,
+                                   sizeof(data));
+}
+
 /** Send up to max num previously requested data packets.
+ *
+ * With the thread pool, they are encrypted together in batches.
  *
  * return -1 on failure.
  * return number of packets sent on success.
@@ -1316,7 +1690,7 @@ static int send_requested_packets(Net_Crypto *c, int crypt_connection_id, uint32
         return -1;
     }
 
-    const Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
 
     if (conn == nullptr) {
         return -1;
@@ -1325,6 +1699,7 @@ static int send_requested_packets(Net_Crypto *c, int crypt_connection_id, uint32
     const uint64_t temp_time = current_time_monotonic(c->mono_time);
     const uint32_t array_size = num_packets_array(&conn->send_array);
     uint32_t num_sent = 0;
+    uint32_t num_queued = 0;
 
     for (uint32_t i = 0; i < array_size; ++i) {
         Packet_Data *dt;
@@ -1343,6 +1718,24 @@ static int send_requested_packets(Net_Crypto *c, int crypt_connection_id, uint32
             continue;
         }
 
+        if (c->thread_pool != nullptr) {
+            if (add_encrypt_job(c->encrypt_batch, crypt_connection_id, conn, packet_num, dt)) {
+                num_sent += send_encrypt_batch(c);
+
+                if (conn->maximum_speed_reached) {
+                    return num_sent;
+                }
+            }
+
+            ++num_queued;
+
+            if (num_queued >= max_num) {
+                break;
+            }
+
+            continue;
+        }
+
         if (send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, packet_num, dt->data,
                                     dt->length) == 0) {
             dt->sent_time = temp_time;
@@ -1354,9 +1747,55 @@ static int send_requested_packets(Net_Crypto *c, int crypt_connection_id, uint32
         }
     }
 
+    if (c->thread_pool != nullptr) {
+        /* Only count what actually went out, the caller adjusts the send rate by it. */
+        num_sent += send_encrypt_batch(c);
+    }
+
     return num_sent;
 }
 
+/** Add the packets deferred by send_lossless_packet() while the thread pool
+ * is enabled to the batch, which is sent whenever it is full.
+ */
+non_null()
+static void queue_deferred_packets(Net_Crypto *c, int crypt_connection_id)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == nullptr) {
+        return;
+    }
+
+    pthread_mutex_lock(conn->mutex);
+    const bool has_deferred = conn->has_deferred;
+    const uint32_t deferred_start = conn->deferred_start;
+    conn->has_deferred = false;
+    conn->burst = false;
+    pthread_mutex_unlock(conn->mutex);
+
+    if (!has_deferred || c->thread_pool == nullptr) {
+        return;
+    }
+
+    for (uint32_t packet_num = deferred_start; packet_num != conn->send_array.buffer_end; ++packet_num) {
+        Packet_Data *dt;
+
+        if (get_data_pointer(&conn->send_array, &dt, packet_num) != 1 || dt->sent_time != 0) {
+            continue;
+        }
+
+        if (add_encrypt_job(c->encrypt_batch, crypt_connection_id, conn, packet_num, dt)) {
+            send_encrypt_batch(c);
+
+            if (conn->maximum_speed_reached) {
+                /* The rest is sent by send_requested_packets(). */
+                return;
+            }
+        }
+    }
+}
+
 
 /** Add a new temp packet to send repeatedly.
  *
@@ -1525,6 +1964,67 @@ static void connection_kill(Net_Crypto *c, int crypt_connection_id, void *userda
     pthread_mutex_unlock(&c->connections_mutex);
 }
 
+/** Pass a received lossless packet to the data callback, splitting coalesced
+ * packets into the packets they contain.
+ *
+ * return -1 if the connection was killed in the callback.
+ * return 0 on success.
+ */
+non_null(1, 3) nullable(5)
+static int deliver_lossless_packet(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length,
+                                   void *userdata)
+{
+    const Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == nullptr) {
+        return -1;
+    }
+
+    if (data[0] != PACKET_ID_COALESCED) {
+        if (conn->connection_data_callback) {
+            conn->connection_data_callback(conn->connection_data_callback_object, conn->connection_data_callback_id, data,
+                                           length, userdata);
+        }
+
+        /* conn might get killed in callback. */
+        return get_crypto_connection(c, crypt_connection_id) == nullptr ? -1 : 0;
+    }
+
+    uint16_t pos = 1;
+
+    while (pos + sizeof(uint16_t) < length) {
+        uint16_t entry_length;
+        net_unpack_u16(data + pos, &entry_length);
+        pos += sizeof(uint16_t);
+
+        if (entry_length == 0 || entry_length > length - pos) {
+            LOGGER_DEBUG(c->log, "invalid entry length %d in coalesced packet", entry_length);
+            break;
+        }
+
+        const uint8_t *entry = data + pos;
+        pos += entry_length;
+
+        if (entry[0] < PACKET_ID_RANGE_LOSSLESS_START || entry[0] > PACKET_ID_RANGE_LOSSLESS_END) {
+            continue;
+        }
+
+        if (conn->connection_data_callback) {
+            conn->connection_data_callback(conn->connection_data_callback_object, conn->connection_data_callback_id, entry,
+                                           entry_length, userdata);
+        }
+
+        /* conn might get killed in callback. */
+        conn = get_crypto_connection(c, crypt_connection_id);
+
+        if (conn == nullptr) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
 /** Handle a received data packet.
  *
  * return -1 on failure.
@@ -1551,6 +2051,8 @@ static int handle_data_packet_core(Net_Crypto *c, int crypt_connection_id, const
         return -1;
     }
 
+    conn->stats_bytes_received += length;
+
     uint32_t buffer_start;
     uint32_t num;
     memcpy(&buffer_start, data, sizeof(uint32_t));
@@ -1610,14 +2112,28 @@ static int handle_data_packet_core(Net_Crypto *c, int crypt_connection_id, const
 
         int requested = handle_request_packet(c->mono_time, &conn->send_array,
                                               real_data, real_length,
-                                              &rtt_calc_time, rtt_time);
+                                              &rtt_calc_time, rtt_time, &conn->stats_packets_resent);
 
         if (requested == -1) {
             return -1;
         }
 
         set_buffer_end(&conn->recv_array, num);
-    } else if (real_data[0] >= PACKET_ID_RANGE_LOSSLESS_START && real_data[0] <= PACKET_ID_RANGE_LOSSLESS_END) {
+    } else if (real_data[0] == PACKET_ID_CAPABILITIES) {
+        if (real_length < 3) {
+            return -1;
+        }
+
+        conn->peer_capabilities = real_data[1];
+        conn->peer_capabilities_received = true;
+
+        if (real_data[2] != 0) {
+            conn->peer_knows_capabilities = true;
+        }
+
+        set_buffer_end(&conn->recv_array, num);
+    } else if ((real_data[0] >= PACKET_ID_RANGE_LOSSLESS_START && real_data[0] <= PACKET_ID_RANGE_LOSSLESS_END)
+               || real_data[0] == PACKET_ID_COALESCED) {
         Packet_Data dt = {0};
         dt.length = real_length;
         memcpy(dt.data, real_data, real_length);
@@ -1635,17 +2151,11 @@ static int handle_data_packet_core(Net_Crypto *c, int crypt_connection_id, const
                 break;
             }
 
-            if (conn->connection_data_callback) {
-                conn->connection_data_callback(conn->connection_data_callback_object, conn->connection_data_callback_id, dt.data,
-                                               dt.length, userdata);
+            if (deliver_lossless_packet(c, crypt_connection_id, dt.data, dt.length, userdata) != 0) {
+                return -1;
             }
 
-            /* conn might get killed in callback. */
             conn = get_crypto_connection(c, crypt_connection_id);
-
-            if (conn == nullptr) {
-                return -1;
-            }
         }
 
         /* Packet counter. */
@@ -1668,6 +2178,12 @@ static int handle_data_packet_core(Net_Crypto *c, int crypt_connection_id, const
         if (rtt_time < conn->rtt_time) {
             conn->rtt_time = rtt_time;
         }
+
+        if (conn->rtt_smoothed == 0) {
+            conn->rtt_smoothed = rtt_time;
+        } else {
+            conn->rtt_smoothed = (conn->rtt_smoothed * 7 + rtt_time) / 8;
+        }
     }
 
     return 0;
@@ -1820,13 +2336,13 @@ static int realloc_cryptoconnection(Net_Crypto *c, uint32_t num)
 }
 
 
-/** Create a new empty crypto connection.
+/** Create a new empty crypto connection to the peer with the given real public key.
  *
  * return -1 on failure.
  * return connection id on success.
  */
 non_null()
-static int create_crypto_connection(Net_Crypto *c)
+static int create_crypto_connection(Net_Crypto *c, const uint8_t *public_key)
 {
     while (1) { /* TODO(irungentoo): is this really the best way to do this? */
         pthread_mutex_lock(&c->connections_mutex);
@@ -1875,6 +2391,14 @@ static int create_crypto_connection(Net_Crypto *c)
             return -1;
         }
 
+        if (!hash_index_add(&c->public_key_index, public_key, id)) {
+            pthread_mutex_destroy(c->crypto_connections[id].mutex);
+            free(c->crypto_connections[id].mutex);
+            pthread_mutex_unlock(&c->connections_mutex);
+            return -1;
+        }
+
+        memcpy(c->crypto_connections[id].public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
         c->crypto_connections[id].status = CRYPTO_CONN_NO_CONNECTION;
     }
 
@@ -1906,6 +2430,11 @@ static int wipe_crypto_connection(Net_Crypto *c, int crypt_connection_id)
 
     uint32_t i;
 
+    const Crypto_Connection *conn = &c->crypto_connections[crypt_connection_id];
+    hash_index_remove(&c->public_key_index, conn->public_key, crypt_connection_id);
+    hash_index_remove(&c->ip_port_index, (const uint8_t *)&conn->ip_portv4, crypt_connection_id);
+    hash_index_remove(&c->ip_port_index, (const uint8_t *)&conn->ip_portv6, crypt_connection_id);
+
     pthread_mutex_destroy(c->crypto_connections[crypt_connection_id].mutex);
     free(c->crypto_connections[crypt_connection_id].mutex);
     crypto_memzero(&c->crypto_connections[crypt_connection_id], sizeof(Crypto_Connection));
@@ -1933,17 +2462,13 @@ static int wipe_crypto_connection(Net_Crypto *c, int crypt_connection_id)
 non_null()
 static int getcryptconnection_id(const Net_Crypto *c, const uint8_t *public_key)
 {
-    for (uint32_t i = 0; i < c->crypto_connections_length; ++i) {
-        if (!crypt_connection_id_is_valid(c, i)) {
-            continue;
-        }
+    const int crypt_connection_id = hash_index_find(&c->public_key_index, public_key);
 
-        if (public_key_cmp(public_key, c->crypto_connections[i].public_key) == 0) {
-            return i;
-        }
+    if (!crypt_connection_id_is_valid(c, crypt_connection_id)) {
+        return -1;
     }
 
-    return -1;
+    return crypt_connection_id;
 }
 
 /** Add a source to the crypto connection.
@@ -2074,7 +2599,7 @@ int accept_crypto_connection(Net_Crypto *c, const New_Connection *n_c)
         return -1;
     }
 
-    const int crypt_connection_id = create_crypto_connection(c);
+    const int crypt_connection_id = create_crypto_connection(c, n_c->public_key);
 
     if (crypt_connection_id == -1) {
         LOGGER_ERROR(c->log, "Could not create new crypto connection");
@@ -2098,7 +2623,6 @@ int accept_crypto_connection(Net_Crypto *c, const New_Connection *n_c)
     }
 
     conn->connection_number_tcp = connection_number_tcp;
-    memcpy(conn->public_key, n_c->public_key, CRYPTO_PUBLIC_KEY_SIZE);
     memcpy(conn->recv_nonce, n_c->recv_nonce, CRYPTO_NONCE_SIZE);
     memcpy(conn->peersessionpublic_key, n_c->peersessionpublic_key, CRYPTO_PUBLIC_KEY_SIZE);
     random_nonce(conn->sent_nonce);
@@ -2137,7 +2661,7 @@ int new_crypto_connection(Net_Crypto *c, const uint8_t *real_public_key, const u
         return crypt_connection_id;
     }
 
-    crypt_connection_id = create_crypto_connection(c);
+    crypt_connection_id = create_crypto_connection(c, real_public_key);
 
     if (crypt_connection_id == -1) {
         return -1;
@@ -2155,7 +2679,6 @@ int new_crypto_connection(Net_Crypto *c, const uint8_t *real_public_key, const u
     }
 
     conn->connection_number_tcp = connection_number_tcp;
-    memcpy(conn->public_key, real_public_key, CRYPTO_PUBLIC_KEY_SIZE);
     random_nonce(conn->sent_nonce);
     crypto_new_keypair(conn->sessionpublic_key, conn->sessionsecret_key);
     conn->status = CRYPTO_CONN_COOKIE_REQUESTING;
@@ -2308,7 +2831,8 @@ int add_tcp_relay(Net_Crypto *c, const IP_Port *ip_port, const uint8_t *public_k
     return ret;
 }
 
-/** Return a random TCP connection number for use in send_tcp_onion_request.
+/** Return the TCP connection number of the fastest onion relay for use in
+ * send_tcp_onion_request.
  *
  * TODO(irungentoo): This number is just the index of an array that the elements can
  * change without warning.
@@ -2316,10 +2840,10 @@ int add_tcp_relay(Net_Crypto *c, const IP_Port *ip_port, const uint8_t *public_k
  * return TCP connection number on success.
  * return -1 on failure.
  */
-int get_random_tcp_con_number(Net_Crypto *c)
+int get_fastest_tcp_con_number(Net_Crypto *c)
 {
     pthread_mutex_lock(&c->tcp_mutex);
-    int ret = get_random_tcp_onion_conn_number(c->tcp_c);
+    int ret = get_fastest_tcp_onion_conn_number(c->tcp_c);
     pthread_mutex_unlock(&c->tcp_mutex);
 
     return ret;
@@ -2493,7 +3017,7 @@ int nc_dht_pk_callback(const Net_Crypto *c, int crypt_connection_id, dht_pk_cb *
 non_null()
 static int crypto_id_ip_port(const Net_Crypto *c, const IP_Port *ip_port)
 {
-    return bs_list_find(&c->ip_port_list, (const uint8_t *)ip_port);
+    return hash_index_find(&c->ip_port_index, (const uint8_t *)ip_port);
 }
 
 #define CRYPTO_MIN_PACKET_SIZE (1 + sizeof(uint16_t) + CRYPTO_MAC_SIZE)
@@ -2595,6 +3119,16 @@ static void send_crypto_packets(Net_Crypto *c)
             }
         }
 
+        if (conn->status == CRYPTO_CONN_ESTABLISHED
+                && !(conn->peer_capabilities_received && conn->peer_knows_capabilities)
+                && conn->capabilities_num_sent < CRYPTO_MAX_CAPABILITIES_SENT
+                && (CRYPTO_CAPABILITIES_INTERVAL + conn->capabilities_sent_time) < temp_time) {
+            if (send_capabilities_packet(c, i) == 0) {
+                conn->capabilities_sent_time = temp_time;
+                ++conn->capabilities_num_sent;
+            }
+        }
+
         if (conn->status == CRYPTO_CONN_ESTABLISHED) {
             if (conn->packet_recv_rate > CRYPTO_PACKET_MIN_RATE) {
                 double request_packet_interval = REQUEST_PACKETS_COMPARE_CONSTANT / ((num_packets_array(
@@ -2847,14 +3381,31 @@ uint32_t crypto_num_free_sendqueue_slots(const Net_Crypto *c, int crypt_connecti
 int64_t write_cryptpacket(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length,
                           uint8_t congestion_control)
 {
-    if (length == 0) {
+    const Crypto_Packet_Fragment fragment = {data, length};
+    return write_cryptpacket_v(c, crypt_connection_id, &fragment, 1, congestion_control);
+}
+
+int64_t write_cryptpacket_v(Net_Crypto *c, int crypt_connection_id, const Crypto_Packet_Fragment *fragments,
+                            uint16_t num_fragments, uint8_t congestion_control)
+{
+    if (num_fragments == 0 || fragments[0].length == 0) {
         return -1;
     }
 
-    if (data[0] < PACKET_ID_RANGE_LOSSLESS_START || data[0] > PACKET_ID_RANGE_LOSSLESS_END) {
+    if (fragments[0].data[0] < PACKET_ID_RANGE_LOSSLESS_START || fragments[0].data[0] > PACKET_ID_RANGE_LOSSLESS_END) {
         return -1;
     }
 
+    uint32_t length = 0;
+
+    for (uint16_t i = 0; i < num_fragments; ++i) {
+        length += fragments[i].length;
+
+        if (length > MAX_CRYPTO_DATA_SIZE) {
+            return -1;
+        }
+    }
+
     Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
 
     if (conn == nullptr) {
@@ -2869,13 +3420,15 @@ int64_t write_cryptpacket(Net_Crypto *c, int crypt_connection_id, const uint8_t
         return -1;
     }
 
-    int64_t ret = send_lossless_packet(c, crypt_connection_id, data, length, congestion_control);
+    const uint32_t buffer_end = conn->send_array.buffer_end;
+    int64_t ret = send_lossless_packet(c, crypt_connection_id, fragments, num_fragments, length, congestion_control);
 
     if (ret == -1) {
         return -1;
     }
 
-    if (congestion_control) {
+    /* Data appended to an already queued coalesced packet doesn't use a new slot. */
+    if (congestion_control && conn->send_array.buffer_end != buffer_end) {
         --conn->packets_left;
         --conn->packets_left_requested;
         ++conn->packets_sent;
@@ -2884,6 +3437,48 @@ int64_t write_cryptpacket(Net_Crypto *c, int crypt_connection_id, const uint8_t
     return ret;
 }
 
+void nc_set_lossless_coalescing(Net_Crypto *c, bool enabled)
+{
+    c->lossless_coalescing = enabled;
+}
+
+bool nc_set_crypto_threads(Net_Crypto *c, uint32_t num_threads)
+{
+    thread_pool_kill(c->thread_pool);
+    c->thread_pool = nullptr;
+    free(c->encrypt_batch);
+    c->encrypt_batch = nullptr;
+
+    /* Encrypting on the pool was measured to be slower than inline when its
+     * threads share cores with the caller, so leave one core to the caller. */
+    const uint32_t num_cpus = thread_pool_num_cpus();
+
+    if (num_cpus != 0) {
+        num_threads = min_u32(num_threads, num_cpus - 1);
+    }
+
+    if (num_threads == 0) {
+        return true;
+    }
+
+    Encrypt_Batch *batch = (Encrypt_Batch *)calloc(1, sizeof(Encrypt_Batch));
+
+    if (batch == nullptr) {
+        return false;
+    }
+
+    Thread_Pool *pool = thread_pool_new(num_threads);
+
+    if (pool == nullptr) {
+        free(batch);
+        return false;
+    }
+
+    c->encrypt_batch = batch;
+    c->thread_pool = pool;
+    return true;
+}
+
 /** Check if packet_number was received by the other side.
  *
  * packet_number must be a valid packet number of a packet sent on this connection.
@@ -2942,6 +3537,13 @@ int send_lossy_cryptpacket(Net_Crypto *c, int crypt_connection_id, const uint8_t
     int ret = -1;
 
     if (conn) {
+        /* Lossless packets deferred for the thread pool go first, so that
+         * packets leave in the order they were sent in. */
+        if (c->thread_pool != nullptr && conn->has_deferred) {
+            queue_deferred_packets(c, crypt_connection_id);
+            send_encrypt_batch(c);
+        }
+
         pthread_mutex_lock(conn->mutex);
         uint32_t buffer_start = conn->recv_array.buffer_start;
         uint32_t buffer_end = conn->send_array.buffer_end;
@@ -2976,8 +3578,6 @@ int crypto_kill(Net_Crypto *c, int crypt_connection_id)
         kill_tcp_connection_to(c->tcp_c, conn->connection_number_tcp);
         pthread_mutex_unlock(&c->tcp_mutex);
 
-        bs_list_remove(&c->ip_port_list, (uint8_t *)&conn->ip_portv4, crypt_connection_id);
-        bs_list_remove(&c->ip_port_list, (uint8_t *)&conn->ip_portv6, crypt_connection_id);
         clear_temp_packet(c, crypt_connection_id);
         clear_buffer(&conn->send_array);
         clear_buffer(&conn->recv_array);
@@ -3015,6 +3615,32 @@ bool crypto_connection_status(const Net_Crypto *c, int crypt_connection_id, bool
     return true;
 }
 
+bool crypto_connection_stats(const Net_Crypto *c, int crypt_connection_id, Crypto_Conn_Stats *stats)
+{
+    const Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == nullptr) {
+        return false;
+    }
+
+    bool direct_connected = false;
+    crypto_connection_status(c, crypt_connection_id, &direct_connected, nullptr);
+
+    stats->established = conn->status == CRYPTO_CONN_ESTABLISHED;
+    stats->direct_connected = direct_connected;
+    stats->rtt = conn->rtt_smoothed != 0 ? conn->rtt_smoothed : conn->rtt_time;
+    stats->min_rtt = conn->rtt_time;
+    stats->send_rate = conn->packet_send_rate;
+    stats->recv_rate = conn->packet_recv_rate;
+    stats->packets_in_flight = num_packets_array(&conn->send_array);
+    stats->packets_sent = conn->stats_packets_sent;
+    stats->packets_resent = conn->stats_packets_resent;
+    stats->bytes_sent = conn->stats_bytes_sent;
+    stats->bytes_received = conn->stats_bytes_received;
+
+    return true;
+}
+
 void new_keys(Net_Crypto *c)
 {
     crypto_new_keypair(c->self_public_key, c->self_secret_key);
@@ -3087,7 +3713,8 @@ Net_Crypto *new_net_crypto(const Logger *log, Mono_Time *mono_time, DHT *dht, co
     networking_registerhandler(dht_get_net(dht), NET_PACKET_CRYPTO_HS, &udp_handle_packet, temp);
     networking_registerhandler(dht_get_net(dht), NET_PACKET_CRYPTO_DATA, &udp_handle_packet, temp);
 
-    bs_list_init(&temp->ip_port_list, sizeof(IP_Port), 8);
+    hash_index_init(&temp->public_key_index, CRYPTO_PUBLIC_KEY_SIZE);
+    hash_index_init(&temp->ip_port_index, sizeof(IP_Port));
 
     return temp;
 }
@@ -3129,11 +3756,26 @@ uint32_t crypto_run_interval(const Net_Crypto *c)
     return c->current_sleep_time;
 }
 
+/** Send the coalesced and deferred packets that were queued since the last iteration. */
+non_null()
+static void flush_queued_packets(Net_Crypto *c)
+{
+    for (uint32_t i = 0; i < c->crypto_connections_length; ++i) {
+        flush_coalesced_packet(c, i);
+        queue_deferred_packets(c, i);
+    }
+
+    if (c->thread_pool != nullptr) {
+        send_encrypt_batch(c);
+    }
+}
+
 /** Main loop. */
 void do_net_crypto(Net_Crypto *c, void *userdata)
 {
     kill_timedout(c, userdata);
     do_tcp(c, userdata);
+    flush_queued_packets(c);
     send_crypto_packets(c);
 }
 
@@ -3147,7 +3789,10 @@ void kill_net_crypto(Net_Crypto *c)
     pthread_mutex_destroy(&c->connections_mutex);
 
     kill_tcp_connections(c->tcp_c);
-    bs_list_free(&c->ip_port_list);
+    thread_pool_kill(c->thread_pool);
+    free(c->encrypt_batch);
+    hash_index_free(&c->ip_port_index);
+    hash_index_free(&c->public_key_index);
     networking_registerhandler(dht_get_net(c->dht), NET_PACKET_COOKIE_REQUEST, nullptr, nullptr);
     networking_registerhandler(dht_get_net(c->dht), NET_PACKET_COOKIE_RESPONSE, nullptr, nullptr);
     networking_registerhandler(dht_get_net(c->dht), NET_PACKET_CRYPTO_HS, nullptr, nullptr);
@@ -46,6 +46,8 @@
 #define PACKET_ID_PADDING 0 // Denotes padding
 #define PACKET_ID_REQUEST 1 // Used to request unreceived packets
 #define PACKET_ID_KILL    2 // Used to kill connection
+#define PACKET_ID_CAPABILITIES 3 // Used to announce optional net_crypto features
+#define PACKET_ID_COALESCED 4 // Several small lossless packets in one
 
 #define PACKET_ID_ONLINE 24
 #define PACKET_ID_OFFLINE 25
@@ -99,6 +101,9 @@
 /** All packets will be padded a number of bytes based on this number. */
 #define CRYPTO_MAX_PADDING 8
 
+/** Lossless packets up to this size may be coalesced with others into one data packet. */
+#define CRYPTO_MAX_COALESCED_LENGTH 256
+
 /** Base current transfer speed on last CONGESTION_QUEUE_ARRAY_SIZE number of points taken
  * at the dT defined in net_crypto.c */
 #define CONGESTION_QUEUE_ARRAY_SIZE 12
@@ -232,6 +237,28 @@ uint32_t crypto_num_free_sendqueue_slots(const Net_Crypto *c, int crypt_connecti
 non_null()
 bool max_speed_reached(Net_Crypto *c, int crypt_connection_id);
 
+/** Enable or disable coalescing of small lossless packets.
+ *
+ * When enabled, lossless packets no bigger than CRYPTO_MAX_COALESCED_LENGTH sent
+ * to a peer that announced support for it are queued and sent together in a
+ * single data packet on the next call to do_net_crypto. Packets coalesced this
+ * way share the same packet number.
+ */
+non_null()
+void nc_set_lossless_coalescing(Net_Crypto *c, bool enabled);
+
+/** Set the number of worker threads used to encrypt data packets, 0 to disable.
+ *
+ * When enabled, the first lossless packet of a connection since the last call
+ * to do_net_crypto is sent at once. The ones after it, and resent packets, are
+ * encrypted on the next call in batches across all connections, in parallel
+ * if a batch is big enough.
+ *
+ * return false on failure, in which case encryption is done on the calling thread.
+ */
+non_null()
+bool nc_set_crypto_threads(Net_Crypto *c, uint32_t num_threads);
+
 /** Sends a lossless cryptopacket.
  *
  * return -1 if data could not be put in packet queue.
@@ -245,6 +272,25 @@ non_null()
 int64_t write_cryptpacket(Net_Crypto *c, int crypt_connection_id,
                           const uint8_t *data, uint16_t length, uint8_t congestion_control);
 
+/** A piece of a packet passed to write_cryptpacket_v. */
+typedef struct Crypto_Packet_Fragment {
+    const uint8_t *data;
+    uint16_t length;
+} Crypto_Packet_Fragment;
+
+/** Sends a lossless cryptopacket made of several fragments.
+ *
+ * Same as write_cryptpacket, but the packet is the concatenation of the
+ * fragments. They are copied straight into the send queue, so callers don't
+ * need to assemble the packet in a buffer of their own first.
+ *
+ * The first fragment must not be empty and its first byte must be in the
+ * PACKET_ID_RANGE_LOSSLESS.
+ */
+non_null()
+int64_t write_cryptpacket_v(Net_Crypto *c, int crypt_connection_id,
+                            const Crypto_Packet_Fragment *fragments, uint16_t num_fragments, uint8_t congestion_control);
+
 /** Check if packet_number was received by the other side.
  *
  * packet_number must be a valid packet number of a packet sent on this connection.
@@ -289,7 +335,8 @@ int add_tcp_relay_peer(Net_Crypto *c, int crypt_connection_id, const IP_Port *ip
 non_null()
 int add_tcp_relay(Net_Crypto *c, const IP_Port *ip_port, const uint8_t *public_key);
 
-/** Return a random TCP connection number for use in send_tcp_onion_request.
+/** Return the TCP connection number of the fastest onion relay for use in
+ * send_tcp_onion_request.
  *
  * TODO(irungentoo): This number is just the index of an array that the elements can
  * change without warning.
@@ -298,7 +345,7 @@ int add_tcp_relay(Net_Crypto *c, const IP_Port *ip_port, const uint8_t *public_k
  * return -1 on failure.
  */
 non_null()
-int get_random_tcp_con_number(Net_Crypto *c);
+int get_fastest_tcp_con_number(Net_Crypto *c);
 
 /** Send an onion packet via the TCP relay corresponding to tcp_connections_number.
  *
@@ -335,6 +382,27 @@ non_null(1, 3) nullable(4)
 bool crypto_connection_status(
     const Net_Crypto *c, int crypt_connection_id, bool *direct_connected, unsigned int *online_tcp_relays);
 
+typedef struct Crypto_Conn_Stats {
+    bool established;
+    bool direct_connected;       /* Whether data goes over UDP rather than a TCP relay. */
+    uint64_t rtt;                /* Smoothed round trip time in ms. */
+    uint64_t min_rtt;            /* Lowest round trip time seen in ms. */
+    double send_rate;            /* Packets per second congestion control lets us send. */
+    double recv_rate;            /* Lossless packets per second received. */
+    uint32_t packets_in_flight;  /* Lossless packets sent or queued but not acknowledged. */
+    uint64_t packets_sent;       /* Lossless packets queued since the connection was created. */
+    uint64_t packets_resent;     /* Lossless packets the peer requested to be sent again. */
+    uint64_t bytes_sent;         /* Total size of the data packets sent. */
+    uint64_t bytes_received;     /* Total size of the data packets received. */
+} Crypto_Conn_Stats;
+
+/** Fill stats with the transport statistics of the connection.
+ *
+ * return true if connection is valid, false otherwise.
+ */
+non_null()
+bool crypto_connection_stats(const Net_Crypto *c, int crypt_connection_id, Crypto_Conn_Stats *stats);
+
 /** Generate our public and private keys.
  *  Only call this function the first time the program starts.
  */
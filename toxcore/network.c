@@ -16,6 +16,11 @@
 #define __EXTENSIONS__ 1
 #endif
 
+// For sendmmsg on Linux.
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 // For Linux (and some BSDs).
 #ifndef _XOPEN_SOURCE
 #define _XOPEN_SOURCE 700
@@ -554,14 +559,21 @@ uint16_t net_port(const Networking_Core *net)
 /* Basic network functions:
  */
 
-int send_packet(const Networking_Core *net, const IP_Port *ip_port, Packet packet)
+/** Convert ip_port into a socket address that can be sent to from the socket of net.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+non_null()
+static int net_sockaddr(const Networking_Core *net, const Logger *log, const IP_Port *ip_port, uint16_t length,
+                        struct sockaddr_storage *addr, size_t *addrsize)
 {
     IP_Port ipp_copy = *ip_port;
 
     if (net_family_is_unspec(net->family)) { /* Socket not initialized */
         // TODO(iphydf): Make this an error. Currently, the onion client calls
         // this via DHT getnodes.
-        LOGGER_WARNING(net->log, "attempted to send message of length %u on uninitialised socket", packet.length);
+        LOGGER_WARNING(net->log, "attempted to send message of length %u on uninitialised socket", length);
         return -1;
     }
 
@@ -589,21 +601,17 @@ int send_packet(const Networking_Core *net, const IP_Port *ip_port, Packet packe
         ipp_copy.ip.ip.v6 = ip6;
     }
 
-    struct sockaddr_storage addr;
-
-    size_t addrsize;
-
     if (net_family_is_ipv4(ipp_copy.ip.family)) {
-        struct sockaddr_in *const addr4 = (struct sockaddr_in *)&addr;
+        struct sockaddr_in *const addr4 = (struct sockaddr_in *)addr;
 
-        addrsize = sizeof(struct sockaddr_in);
+        *addrsize = sizeof(struct sockaddr_in);
         addr4->sin_family = AF_INET;
         addr4->sin_port = ipp_copy.port;
         fill_addr4(&ipp_copy.ip.ip.v4, &addr4->sin_addr);
     } else if (net_family_is_ipv6(ipp_copy.ip.family)) {
-        struct sockaddr_in6 *const addr6 = (struct sockaddr_in6 *)&addr;
+        struct sockaddr_in6 *const addr6 = (struct sockaddr_in6 *)addr;
 
-        addrsize = sizeof(struct sockaddr_in6);
+        *addrsize = sizeof(struct sockaddr_in6);
         addr6->sin6_family = AF_INET6;
         addr6->sin6_port = ipp_copy.port;
         fill_addr6(&ipp_copy.ip.ip.v6, &addr6->sin6_addr);
@@ -613,7 +621,21 @@ int send_packet(const Networking_Core *net, const IP_Port *ip_port, Packet packe
     } else {
         // TODO(iphydf): Make this an error. Currently this fails sometimes when
         // called from DHT.c:do_ping_and_sendnode_requests.
-        LOGGER_WARNING(net->log, "unknown address type: %d", ipp_copy.ip.family.value);
+        LOGGER_WARNING(log, "unknown address type: %d", ipp_copy.ip.family.value);
+        return -1;
+    }
+
+    return 0;
+}
+
+/** Send a packet and log it to log. */
+non_null()
+static int send_packet_log(const Networking_Core *net, const Logger *log, const IP_Port *ip_port, Packet packet)
+{
+    struct sockaddr_storage addr;
+    size_t addrsize;
+
+    if (net_sockaddr(net, log, ip_port, packet.length, &addr, &addrsize) == -1) {
         return -1;
     }
 
@@ -625,12 +647,97 @@ int send_packet(const Networking_Core *net, const IP_Port *ip_port, Packet packe
                             (struct sockaddr *)&addr, addrsize);
 #endif
 
-    loglogdata(net->log, "O=>", packet.data, packet.length, &ipp_copy, res);
+    loglogdata(log, "O=>", packet.data, packet.length, ip_port, res);
 
     assert(res <= INT_MAX);
     return (int)res;
 }
 
+int send_packet(const Networking_Core *net, const IP_Port *ip_port, Packet packet)
+{
+    return send_packet_log(net, net->log, ip_port, packet);
+}
+
+#if defined(__linux__) && !defined(FUZZING_BUILD_MODE_UNSAFE_FOR_PRODUCTION)
+#define NET_SEND_BATCH 64
+
+uint32_t send_packets(const Networking_Core *net, const Logger *log, const IP_Port *ip_ports, const Packet *packets,
+                      uint32_t num)
+{
+    struct sockaddr_storage addrs[NET_SEND_BATCH];
+    struct iovec iovs[NET_SEND_BATCH];
+    struct mmsghdr msgs[NET_SEND_BATCH];
+    uint32_t sent = 0;
+    uint32_t i = 0;
+
+    while (i < num) {
+        /* Packets that can't be sent are skipped, batch[k] is the index of the k-th message. */
+        uint32_t batch[NET_SEND_BATCH];
+        uint32_t count = 0;
+
+        while (i < num && count < NET_SEND_BATCH) {
+            size_t addrsize;
+
+            if (net_sockaddr(net, log, &ip_ports[i], packets[i].length, &addrs[count], &addrsize) == 0) {
+                iovs[count].iov_base = (void *)packets[i].data;
+                iovs[count].iov_len = packets[i].length;
+                memset(&msgs[count], 0, sizeof(msgs[count]));
+                msgs[count].msg_hdr.msg_name = &addrs[count];
+                msgs[count].msg_hdr.msg_namelen = addrsize;
+                msgs[count].msg_hdr.msg_iov = &iovs[count];
+                msgs[count].msg_hdr.msg_iovlen = 1;
+                batch[count] = i;
+                ++count;
+            }
+
+            ++i;
+        }
+
+        uint32_t done = 0;
+
+        while (done < count) {
+            const int res = sendmmsg(net->sock.socket, msgs + done, count - done, 0);
+
+            if (res <= 0) {
+                /* Skip the packet the kernel refused, like a failed sendto() would. */
+                loglogdata(log, "O=>", packets[batch[done]].data, packets[batch[done]].length,
+                           &ip_ports[batch[done]], -1);
+                ++done;
+                continue;
+            }
+
+            for (int k = 0; k < res; ++k) {
+                const uint32_t index = batch[done + k];
+                loglogdata(log, "O=>", packets[index].data, packets[index].length, &ip_ports[index],
+                           msgs[done + k].msg_len);
+            }
+
+            sent += res;
+            done += res;
+        }
+    }
+
+    return sent;
+}
+
+#else
+
+uint32_t send_packets(const Networking_Core *net, const Logger *log, const IP_Port *ip_ports, const Packet *packets,
+                      uint32_t num)
+{
+    uint32_t sent = 0;
+
+    for (uint32_t i = 0; i < num; ++i) {
+        if (send_packet_log(net, log, &ip_ports[i], packets[i]) == packets[i].length) {
+            ++sent;
+        }
+    }
+
+    return sent;
+}
+
+#endif
+
 /**
  * Function to send packet(data) of length length to ip_port.
  *
@@ -1610,6 +1717,45 @@ int net_send(const Logger *log, Socket sock, const uint8_t *buf, size_t len, con
     return res;
 }
 
+int net_send_split(const Logger *log, Socket sock, const uint8_t *buf1, size_t len1, const uint8_t *buf2, size_t len2,
+                   const IP_Port *ip_port)
+{
+#if defined(FUZZING_BUILD_MODE_UNSAFE_FOR_PRODUCTION)
+    int res = fuzz_send(sock.socket, (const char *)buf1, len1, MSG_NOSIGNAL);
+
+    if (res == (int)len1 && len2 > 0) {
+        const int res2 = fuzz_send(sock.socket, (const char *)buf2, len2, MSG_NOSIGNAL);
+
+        if (res2 > 0) {
+            res += res2;
+        }
+    }
+
+#elif defined(OS_WIN32)
+    WSABUF bufs[2];
+    bufs[0].buf = (char *)buf1;
+    bufs[0].len = (ULONG)len1;
+    bufs[1].buf = (char *)buf2;
+    bufs[1].len = (ULONG)len2;
+    DWORD sent = 0;
+    int res = WSASend(sock.socket, bufs, 2, &sent, 0, nullptr, nullptr) == 0 ? (int)sent : -1;
+#else
+    struct iovec iov[2];
+    iov[0].iov_base = (void *)buf1;
+    iov[0].iov_len = len1;
+    iov[1].iov_base = (void *)buf2;
+    iov[1].iov_len = len2;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    int res = sendmsg(sock.socket, &msg, MSG_NOSIGNAL);
+#endif
+    loglogdata(log, "T=>", buf1, len1, ip_port, res);
+    return res;
+}
+
 int net_recv(const Logger *log, Socket sock, uint8_t *buf, size_t len, const IP_Port *ip_port)
 {
 #ifdef FUZZING_BUILD_MODE_UNSAFE_FOR_PRODUCTION
@@ -166,6 +166,13 @@ extern const Socket net_invalid_socket;
  */
 non_null()
 int net_send(const Logger *log, Socket sock, const uint8_t *buf, size_t len, const IP_Port *ip_port);
+/**
+ * Sends buf1 followed by buf2 with a single system call: sendmsg(sockfd, msg,
+ * MSG_NOSIGNAL), or WSASend on Windows.
+ */
+non_null()
+int net_send_split(const Logger *log, Socket sock, const uint8_t *buf1, size_t len1, const uint8_t *buf2, size_t len2,
+                   const IP_Port *ip_port);
 /**
  * Calls recv(sockfd, buf, len, MSG_NOSIGNAL).
  */
@@ -410,6 +417,19 @@ typedef struct Packet {
 non_null()
 int send_packet(const Networking_Core *net, const IP_Port *ip_port, Packet packet);
 
+/**
+ * Send num packets, packets[i] to ip_ports[i], with as few system calls as the
+ * platform allows.
+ *
+ * The packets and errors are logged to log rather than the logger of net, so
+ * that callers on other threads can keep them away from the log callback.
+ *
+ * return the number of packets sent.
+ */
+non_null()
+uint32_t send_packets(const Networking_Core *net, const Logger *log, const IP_Port *ip_ports, const Packet *packets,
+                      uint32_t num);
+
 /**
  * Function to send packet(data) of length length to ip_port.
  *
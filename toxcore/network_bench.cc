@@ -0,0 +1,96 @@
+#include <benchmark/benchmark.h>
+
+#include <array>
+#include <vector>
+
+#include "logger.h"
+#include "network.h"
+
+namespace {
+
+/** Two sockets on loopback. Nothing reads from the receiving one, so the
+ * kernel drops what does not fit its buffer, as it does for a peer that
+ * lags behind.
+ */
+class Loopback {
+ public:
+  Loopback() {
+    IP ip;
+    ip_init(&ip, false);
+    logger_ = logger_new();
+    sender_ = new_networking_ex(logger_, &ip, TOX_PORTRANGE_FROM, TOX_PORTRANGE_TO, nullptr);
+    receiver_ = new_networking_ex(logger_, &ip, TOX_PORTRANGE_FROM, TOX_PORTRANGE_TO, nullptr);
+
+    if (receiver_ != nullptr) {
+      dest_.ip.family = net_family_ipv4;
+      dest_.ip.ip.v4.uint32 = net_htonl(0x7F000001);
+      dest_.port = net_port(receiver_);
+    }
+  }
+
+  ~Loopback() {
+    if (sender_ != nullptr) {
+      kill_networking(sender_);
+    }
+
+    if (receiver_ != nullptr) {
+      kill_networking(receiver_);
+    }
+
+    logger_kill(logger_);
+  }
+
+  bool ok() const { return sender_ != nullptr && receiver_ != nullptr; }
+
+  Logger *logger_;
+  Networking_Core *sender_;
+  Networking_Core *receiver_;
+  IP_Port dest_{};
+};
+
+/** An onion data packet to each of range(0) nodes, one system call each. */
+void BM_SendPacketEach(benchmark::State &state) {
+  Loopback loopback;
+
+  if (!loopback.ok()) {
+    state.SkipWithError("could not bind the sockets");
+    return;
+  }
+
+  const uint32_t num = state.range(0);
+  std::array<uint8_t, 600> data{};
+  const Packet packet = {data.data(), static_cast<uint16_t>(data.size())};
+
+  for (auto _ : state) {
+    for (uint32_t i = 0; i < num; ++i) {
+      send_packet(loopback.sender_, &loopback.dest_, packet);
+    }
+  }
+
+  state.SetItemsProcessed(state.iterations() * num);
+}
+BENCHMARK(BM_SendPacketEach)->Arg(1)->Arg(8)->Arg(64);
+
+/** The same packets passed to send_packets() at once. */
+void BM_SendPackets(benchmark::State &state) {
+  Loopback loopback;
+
+  if (!loopback.ok()) {
+    state.SkipWithError("could not bind the sockets");
+    return;
+  }
+
+  const uint32_t num = state.range(0);
+  std::array<uint8_t, 600> data{};
+  const std::vector<IP_Port> ip_ports(num, loopback.dest_);
+  const std::vector<Packet> packets(num, Packet{data.data(), static_cast<uint16_t>(data.size())});
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(send_packets(loopback.sender_, loopback.logger_, ip_ports.data(), packets.data(), num));
+  }
+
+  state.SetItemsProcessed(state.iterations() * num);
+}
+BENCHMARK(BM_SendPackets)->Arg(1)->Arg(8)->Arg(64);
+
+}  // namespace
@@ -8,6 +8,7 @@
  */
 #include "onion.h"
 
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -23,15 +24,71 @@
 #define SEND_2 ONION_SEND_2
 #define SEND_1 ONION_SEND_1
 
+/** Bytes an onion packet can grow by at the end when it is relayed: the return path it gets. */
+#define RELAY_TAILROOM (CRYPTO_NONCE_SIZE + CRYPTO_MAC_SIZE + SIZE_IPPORT)
+#define RELAY_BUFFER_SIZE (ONION_MAX_PACKET_SIZE + RELAY_TAILROOM)
+
+#define ONION_RELAY_QUEUE_SIZE 512
+#define ONION_RELAY_BATCH 64
+
+/** Forward one kind of onion packet, in place: packet of length length is in a
+ * buffer that has RELAY_TAILROOM bytes after it.
+ *
+ * return length of the packet to send to send_to, which starts at data, on success.
+ * return -1 on failure.
+ */
+typedef int relay_cb(Onion *onion, const IP_Port *source, uint8_t *packet, uint16_t length, IP_Port *send_to,
+                     uint8_t **data);
+
+typedef struct Relay_Slot {
+    relay_cb *function;
+    IP_Port source;
+    uint16_t length;
+    uint8_t data[RELAY_BUFFER_SIZE];
+} Relay_Slot;
+
+struct Onion_Relay {
+    pthread_t thread;
+
+    /* Logger of the relay thread. It has no callback, as the log callback of
+     * the onion is only ever called on the thread running the onion. */
+    Logger *log;
+
+    /* Protects `secret_symmetric_key` and `timestamp` of the onion. */
+    pthread_mutex_t key_lock;
+
+    pthread_mutex_t queue_lock;
+    pthread_cond_t queue_cond; /* Signalled when the queue stops being empty or the thread is stopping. */
+    /* Ring of ONION_RELAY_QUEUE_SIZE packets, `count` of them queued from `first` on. */
+    Relay_Slot *slots;
+    uint32_t first;
+    uint32_t count;
+    bool stopping;
+};
+
 #define KEY_REFRESH_INTERVAL (2 * 60 * 60)
-/** Change symmetric keys every 2 hours to make paths expire eventually. */
+/** Change symmetric keys every 2 hours to make paths expire eventually, and
+ * copy the current one to key.
+ */
 non_null()
-static void change_symmetric_key(Onion *onion)
+static void get_symmetric_key(Onion *onion, uint8_t *key)
 {
+    Onion_Relay *const relay = onion->relay;
+
+    if (relay != nullptr) {
+        pthread_mutex_lock(&relay->key_lock);
+    }
+
     if (mono_time_is_timeout(onion->mono_time, onion->timestamp, KEY_REFRESH_INTERVAL)) {
         new_symmetric_key(onion->secret_symmetric_key);
         onion->timestamp = mono_time_get(onion->mono_time);
     }
+
+    memcpy(key, onion->secret_symmetric_key, CRYPTO_SYMMETRIC_KEY_SIZE);
+
+    if (relay != nullptr) {
+        pthread_mutex_unlock(&relay->key_lock);
+    }
 }
 
 /** packing and unpacking functions */
@@ -159,6 +216,35 @@ int onion_path_to_nodes(Node_format *nodes, unsigned int num_nodes, const Onion_
     return 0;
 }
 
+/** Put the layer of an onion packet that the second node of path decrypts at
+ * layer, with the data for dest in it encrypted for the third node.
+ *
+ * The layers are built in place from the inside out. layer must have room
+ * for SIZE_IPPORT + SEND_BASE + length bytes, and CRYPTO_ENCRYPT_PLAIN_HEADROOM
+ * bytes in front of it that are overwritten.
+ *
+ * return -1 on failure.
+ * return the length of the unencrypted layer on success.
+ */
+non_null()
+static int create_onion_inner_layers(uint8_t *layer, const Onion_Path *path, const uint8_t *nonce, const IP_Port *dest,
+                                     const uint8_t *data, uint16_t length)
+{
+    uint8_t *const inner_layer = layer + SEND_BASE;
+    ipport_pack(inner_layer, dest);
+    memcpy(inner_layer + SIZE_IPPORT, data, length);
+
+    const int len = encrypt_data_symmetric_in_place(path->shared_key3, nonce, inner_layer, SIZE_IPPORT + length);
+
+    if (len != SIZE_IPPORT + length + CRYPTO_MAC_SIZE) {
+        return -1;
+    }
+
+    ipport_pack(layer, &path->ip_port3);
+    memcpy(layer + SIZE_IPPORT, path->public_key3, CRYPTO_PUBLIC_KEY_SIZE);
+    return SIZE_IPPORT + SEND_BASE + length;
+}
+
 /** Create a onion packet.
  *
  * Use Onion_Path path to create packet for data of length to dest.
@@ -175,46 +261,36 @@ int create_onion_packet(uint8_t *packet, uint16_t max_packet_length, const Onion
         return -1;
     }
 
-    VLA(uint8_t, step1, SIZE_IPPORT + length);
-
-    ipport_pack(step1, dest);
-    memcpy(step1 + SIZE_IPPORT, data, length);
-
     uint8_t nonce[CRYPTO_NONCE_SIZE];
     random_nonce(nonce);
 
-    VLA(uint8_t, step2, SIZE_IPPORT + SEND_BASE + length);
-    ipport_pack(step2, &path->ip_port3);
-    memcpy(step2 + SIZE_IPPORT, path->public_key3, CRYPTO_PUBLIC_KEY_SIZE);
+    uint8_t *const layer1 = packet + 1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_MAC_SIZE;
+    uint8_t *const layer2 = layer1 + SEND_BASE;
 
-    int len = encrypt_data_symmetric(path->shared_key3, nonce, step1, SIZEOF_VLA(step1),
-                                     step2 + SIZE_IPPORT + CRYPTO_PUBLIC_KEY_SIZE);
+    const int len2 = create_onion_inner_layers(layer2, path, nonce, dest, data, length);
 
-    if (len != SIZE_IPPORT + length + CRYPTO_MAC_SIZE) {
+    if (len2 == -1) {
         return -1;
     }
 
-    VLA(uint8_t, step3, SIZE_IPPORT + SEND_BASE * 2 + length);
-    ipport_pack(step3, &path->ip_port2);
-    memcpy(step3 + SIZE_IPPORT, path->public_key2, CRYPTO_PUBLIC_KEY_SIZE);
-    len = encrypt_data_symmetric(path->shared_key2, nonce, step2, SIZEOF_VLA(step2),
-                                 step3 + SIZE_IPPORT + CRYPTO_PUBLIC_KEY_SIZE);
-
-    if (len != SIZE_IPPORT + SEND_BASE + length + CRYPTO_MAC_SIZE) {
+    if (encrypt_data_symmetric_in_place(path->shared_key2, nonce, layer2, len2) != len2 + CRYPTO_MAC_SIZE) {
         return -1;
     }
 
-    packet[0] = NET_PACKET_ONION_SEND_INITIAL;
-    memcpy(packet + 1, nonce, CRYPTO_NONCE_SIZE);
-    memcpy(packet + 1 + CRYPTO_NONCE_SIZE, path->public_key1, CRYPTO_PUBLIC_KEY_SIZE);
+    ipport_pack(layer1, &path->ip_port2);
+    memcpy(layer1 + SIZE_IPPORT, path->public_key2, CRYPTO_PUBLIC_KEY_SIZE);
 
-    len = encrypt_data_symmetric(path->shared_key1, nonce, step3, SIZEOF_VLA(step3),
-                                 packet + 1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE);
+    const int len = encrypt_data_symmetric_in_place(path->shared_key1, nonce, layer1,
+                    SIZE_IPPORT + SEND_BASE * 2 + length);
 
     if (len != SIZE_IPPORT + SEND_BASE * 2 + length + CRYPTO_MAC_SIZE) {
         return -1;
     }
 
+    packet[0] = NET_PACKET_ONION_SEND_INITIAL;
+    memcpy(packet + 1, nonce, CRYPTO_NONCE_SIZE);
+    memcpy(packet + 1 + CRYPTO_NONCE_SIZE, path->public_key1, CRYPTO_PUBLIC_KEY_SIZE);
+
     return 1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE + len;
 }
 
@@ -234,35 +310,26 @@ int create_onion_packet_tcp(uint8_t *packet, uint16_t max_packet_length, const O
         return -1;
     }
 
-    VLA(uint8_t, step1, SIZE_IPPORT + length);
-
-    ipport_pack(step1, dest);
-    memcpy(step1 + SIZE_IPPORT, data, length);
-
     uint8_t nonce[CRYPTO_NONCE_SIZE];
     random_nonce(nonce);
 
-    VLA(uint8_t, step2, SIZE_IPPORT + SEND_BASE + length);
-    ipport_pack(step2, &path->ip_port3);
-    memcpy(step2 + SIZE_IPPORT, path->public_key3, CRYPTO_PUBLIC_KEY_SIZE);
+    uint8_t *const layer2 = packet + CRYPTO_NONCE_SIZE + SEND_BASE;
 
-    int len = encrypt_data_symmetric(path->shared_key3, nonce, step1, SIZEOF_VLA(step1),
-                                     step2 + SIZE_IPPORT + CRYPTO_PUBLIC_KEY_SIZE);
+    const int len2 = create_onion_inner_layers(layer2, path, nonce, dest, data, length);
 
-    if (len != SIZE_IPPORT + length + CRYPTO_MAC_SIZE) {
+    if (len2 == -1) {
         return -1;
     }
 
-    ipport_pack(packet + CRYPTO_NONCE_SIZE, &path->ip_port2);
-    memcpy(packet + CRYPTO_NONCE_SIZE + SIZE_IPPORT, path->public_key2, CRYPTO_PUBLIC_KEY_SIZE);
-    len = encrypt_data_symmetric(path->shared_key2, nonce, step2, SIZEOF_VLA(step2),
-                                 packet + CRYPTO_NONCE_SIZE + SIZE_IPPORT + CRYPTO_PUBLIC_KEY_SIZE);
+    const int len = encrypt_data_symmetric_in_place(path->shared_key2, nonce, layer2, len2);
 
-    if (len != SIZE_IPPORT + SEND_BASE + length + CRYPTO_MAC_SIZE) {
+    if (len != len2 + CRYPTO_MAC_SIZE) {
         return -1;
     }
 
     memcpy(packet, nonce, CRYPTO_NONCE_SIZE);
+    ipport_pack(packet + CRYPTO_NONCE_SIZE, &path->ip_port2);
+    memcpy(packet + CRYPTO_NONCE_SIZE + SIZE_IPPORT, path->public_key2, CRYPTO_PUBLIC_KEY_SIZE);
 
     return CRYPTO_NONCE_SIZE + SIZE_IPPORT + CRYPTO_PUBLIC_KEY_SIZE + len;
 }
@@ -317,245 +384,318 @@ int send_onion_response(const Networking_Core *net, const IP_Port *dest, const u
     return 0;
 }
 
+/** Append the return path to source to an onion packet: a fresh nonce and the
+ * encrypted source and ret_length bytes of the return path so far, which start
+ * at end. RELAY_TAILROOM bytes past those are overwritten.
+ *
+ * return length of the new return path on success.
+ * return -1 on failure.
+ */
 non_null()
-static int handle_send_initial(void *object, const IP_Port *source, const uint8_t *packet, uint16_t length,
-                               void *userdata)
+static int append_return(const uint8_t *key, uint8_t *end, const IP_Port *source, uint16_t ret_length)
 {
-    Onion *onion = (Onion *)object;
-
-    if (length > ONION_MAX_PACKET_SIZE) {
-        return 1;
-    }
+    uint8_t nonce[CRYPTO_NONCE_SIZE];
+    random_nonce(nonce);
 
-    if (length <= 1 + SEND_1) {
-        return 1;
-    }
+    uint8_t *const plain = end + CRYPTO_NONCE_SIZE + CRYPTO_MAC_SIZE;
+    memmove(plain + SIZE_IPPORT, end, ret_length);
+    ipport_pack(plain, source);
 
-    change_symmetric_key(onion);
+    const int len = encrypt_data_symmetric_in_place(key, nonce, plain, SIZE_IPPORT + ret_length);
 
-    uint8_t plain[ONION_MAX_PACKET_SIZE];
-    uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
-    get_shared_key(onion->mono_time, &onion->shared_keys_1, shared_key, dht_get_self_secret_key(onion->dht),
-                   packet + 1 + CRYPTO_NONCE_SIZE);
-    int len = decrypt_data_symmetric(shared_key, packet + 1, packet + 1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE,
-                                     length - (1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE), plain);
-
-    if (len != length - (1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_MAC_SIZE)) {
-        return 1;
+    if (len != SIZE_IPPORT + ret_length + CRYPTO_MAC_SIZE) {
+        return -1;
     }
 
-    return onion_send_1(onion, plain, len, source, packet + 1);
+    /* Written last, the encryption overwrote the space in front of plain. */
+    memcpy(end, nonce, CRYPTO_NONCE_SIZE);
+    return CRYPTO_NONCE_SIZE + len;
 }
 
-int onion_send_1(const Onion *onion, const uint8_t *plain, uint16_t len, const IP_Port *source, const uint8_t *nonce)
+/** Turn the decrypted layer plain of length len of an onion packet into a
+ * NET_PACKET_ONION_SEND_1 packet with the return path to source. The packet is
+ * built in place: the 1 + CRYPTO_NONCE_SIZE - SIZE_IPPORT bytes before plain
+ * and RELAY_TAILROOM bytes after it are overwritten.
+ *
+ * return length of the packet put in data, to be sent to send_to, on success.
+ * return -1 on failure.
+ */
+non_null()
+static int relay_send_1(Onion *onion, uint8_t *plain, uint16_t len, const IP_Port *source, const uint8_t *nonce,
+                        IP_Port *send_to, uint8_t **data)
 {
     if (len > ONION_MAX_PACKET_SIZE + SIZE_IPPORT - (1 + CRYPTO_NONCE_SIZE + ONION_RETURN_1)) {
-        return 1;
+        return -1;
     }
 
     if (len <= SIZE_IPPORT + SEND_BASE * 2) {
-        return 1;
+        return -1;
     }
 
-    IP_Port send_to;
-
-    if (ipport_unpack(&send_to, plain, len, 0) == -1) {
-        return 1;
+    if (ipport_unpack(send_to, plain, len, 0) == -1) {
+        return -1;
     }
 
-    uint8_t ip_port[SIZE_IPPORT];
-    ipport_pack(ip_port, source);
+    uint8_t key[CRYPTO_SYMMETRIC_KEY_SIZE];
+    get_symmetric_key(onion, key);
 
-    uint8_t data[ONION_MAX_PACKET_SIZE] = {0};
-    data[0] = NET_PACKET_ONION_SEND_1;
-    memcpy(data + 1, nonce, CRYPTO_NONCE_SIZE);
-    memcpy(data + 1 + CRYPTO_NONCE_SIZE, plain + SIZE_IPPORT, len - SIZE_IPPORT);
-    uint16_t data_len = 1 + CRYPTO_NONCE_SIZE + (len - SIZE_IPPORT);
-    uint8_t *ret_part = data + data_len;
-    random_nonce(ret_part);
-    len = encrypt_data_symmetric(onion->secret_symmetric_key, ret_part, ip_port, SIZE_IPPORT,
-                                 ret_part + CRYPTO_NONCE_SIZE);
+    uint8_t *const end = plain + len;
+    const int ret_length = append_return(key, end, source, 0);
 
-    if (len != SIZE_IPPORT + CRYPTO_MAC_SIZE) {
-        return 1;
+    if (ret_length == -1) {
+        return -1;
     }
 
-    data_len += CRYPTO_NONCE_SIZE + len;
-
-    if ((uint32_t)sendpacket(onion->net, &send_to, data, data_len) != data_len) {
-        return 1;
-    }
+    uint8_t *const packet = plain + SIZE_IPPORT - (1 + CRYPTO_NONCE_SIZE);
+    packet[0] = NET_PACKET_ONION_SEND_1;
+    memmove(packet + 1, nonce, CRYPTO_NONCE_SIZE);
 
-    return 0;
+    *data = packet;
+    return (end + ret_length) - packet;
 }
 
 non_null()
-static int handle_send_1(void *object, const IP_Port *source, const uint8_t *packet, uint16_t length, void *userdata)
+static int relay_send_initial(Onion *onion, const IP_Port *source, uint8_t *packet, uint16_t length,
+                              IP_Port *send_to, uint8_t **data)
 {
-    Onion *onion = (Onion *)object;
+    if (length <= 1 + SEND_1) {
+        return -1;
+    }
 
-    if (length > ONION_MAX_PACKET_SIZE) {
-        return 1;
+    uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
+    get_shared_key(onion->mono_time, &onion->shared_keys_1, shared_key, dht_get_self_secret_key(onion->dht),
+                   packet + 1 + CRYPTO_NONCE_SIZE);
+
+    /* Decrypting in place overwrites the end of the public key, which is no longer needed. */
+    uint8_t *const encrypted = packet + 1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE;
+    const int len = decrypt_data_symmetric_in_place(shared_key, packet + 1, encrypted,
+                    length - (1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE));
+
+    if (len != length - (1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_MAC_SIZE)) {
+        return -1;
     }
 
+    return relay_send_1(onion, encrypted + CRYPTO_MAC_SIZE, len, source, packet + 1, send_to, data);
+}
+
+non_null()
+static int relay_onion_send_1(Onion *onion, const IP_Port *source, uint8_t *packet, uint16_t length,
+                              IP_Port *send_to, uint8_t **data)
+{
     if (length <= 1 + SEND_2) {
-        return 1;
+        return -1;
     }
 
-    change_symmetric_key(onion);
-
-    uint8_t plain[ONION_MAX_PACKET_SIZE];
     uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
     get_shared_key(onion->mono_time, &onion->shared_keys_2, shared_key, dht_get_self_secret_key(onion->dht),
                    packet + 1 + CRYPTO_NONCE_SIZE);
-    int len = decrypt_data_symmetric(shared_key, packet + 1, packet + 1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE,
-                                     length - (1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE + RETURN_1), plain);
+
+    uint8_t *const encrypted = packet + 1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE;
+    const int len = decrypt_data_symmetric_in_place(shared_key, packet + 1, encrypted,
+                    length - (1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE + RETURN_1));
 
     if (len != length - (1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE + RETURN_1 + CRYPTO_MAC_SIZE)) {
-        return 1;
+        return -1;
     }
 
-    IP_Port send_to;
+    uint8_t *const plain = encrypted + CRYPTO_MAC_SIZE;
 
-    if (ipport_unpack(&send_to, plain, len, 0) == -1) {
-        return 1;
+    if (ipport_unpack(send_to, plain, len, 0) == -1) {
+        return -1;
     }
 
-    uint8_t data[ONION_MAX_PACKET_SIZE] = {0};
-    data[0] = NET_PACKET_ONION_SEND_2;
-    memcpy(data + 1, packet + 1, CRYPTO_NONCE_SIZE);
-    memcpy(data + 1 + CRYPTO_NONCE_SIZE, plain + SIZE_IPPORT, len - SIZE_IPPORT);
-    uint16_t data_len = 1 + CRYPTO_NONCE_SIZE + (len - SIZE_IPPORT);
-    uint8_t *ret_part = data + data_len;
-    random_nonce(ret_part);
-    uint8_t ret_data[RETURN_1 + SIZE_IPPORT];
-    ipport_pack(ret_data, source);
-    memcpy(ret_data + SIZE_IPPORT, packet + (length - RETURN_1), RETURN_1);
-    len = encrypt_data_symmetric(onion->secret_symmetric_key, ret_part, ret_data, sizeof(ret_data),
-                                 ret_part + CRYPTO_NONCE_SIZE);
-
-    if (len != RETURN_2 - CRYPTO_NONCE_SIZE) {
-        return 1;
-    }
+    uint8_t key[CRYPTO_SYMMETRIC_KEY_SIZE];
+    get_symmetric_key(onion, key);
 
-    data_len += CRYPTO_NONCE_SIZE + len;
+    /* The return path so far follows the decrypted layer. */
+    uint8_t *const end = plain + len;
+    const int ret_length = append_return(key, end, source, RETURN_1);
 
-    if ((uint32_t)sendpacket(onion->net, &send_to, data, data_len) != data_len) {
-        return 1;
+    if (ret_length != RETURN_2) {
+        return -1;
     }
 
-    return 0;
+    uint8_t *const out = plain + SIZE_IPPORT - (1 + CRYPTO_NONCE_SIZE);
+    out[0] = NET_PACKET_ONION_SEND_2;
+    memmove(out + 1, packet + 1, CRYPTO_NONCE_SIZE);
+
+    *data = out;
+    return (end + ret_length) - out;
 }
 
 non_null()
-static int handle_send_2(void *object, const IP_Port *source, const uint8_t *packet, uint16_t length, void *userdata)
+static int relay_onion_send_2(Onion *onion, const IP_Port *source, uint8_t *packet, uint16_t length,
+                              IP_Port *send_to, uint8_t **data)
 {
-    Onion *onion = (Onion *)object;
-
-    if (length > ONION_MAX_PACKET_SIZE) {
-        return 1;
-    }
-
     if (length <= 1 + SEND_3) {
-        return 1;
+        return -1;
     }
 
-    change_symmetric_key(onion);
-
-    uint8_t plain[ONION_MAX_PACKET_SIZE];
     uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
     get_shared_key(onion->mono_time, &onion->shared_keys_3, shared_key, dht_get_self_secret_key(onion->dht),
                    packet + 1 + CRYPTO_NONCE_SIZE);
-    int len = decrypt_data_symmetric(shared_key, packet + 1, packet + 1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE,
-                                     length - (1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE + RETURN_2), plain);
+
+    uint8_t *const encrypted = packet + 1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE;
+    const int len = decrypt_data_symmetric_in_place(shared_key, packet + 1, encrypted,
+                    length - (1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE + RETURN_2));
 
     if (len != length - (1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE + RETURN_2 + CRYPTO_MAC_SIZE)) {
-        return 1;
+        return -1;
     }
 
     if (len <= SIZE_IPPORT) {
-        return 1;
+        return -1;
     }
 
+    uint8_t *const plain = encrypted + CRYPTO_MAC_SIZE;
     const uint8_t packet_id = plain[SIZE_IPPORT];
 
     if (packet_id != NET_PACKET_ANNOUNCE_REQUEST && packet_id != NET_PACKET_ONION_DATA_REQUEST) {
-        return 1;
+        return -1;
     }
 
-    IP_Port send_to;
+    if (ipport_unpack(send_to, plain, len, 0) == -1) {
+        return -1;
+    }
 
-    if (ipport_unpack(&send_to, plain, len, 0) == -1) {
-        return 1;
+    uint8_t key[CRYPTO_SYMMETRIC_KEY_SIZE];
+    get_symmetric_key(onion, key);
+
+    uint8_t *const end = plain + len;
+    const int ret_length = append_return(key, end, source, RETURN_2);
+
+    if (ret_length != RETURN_3) {
+        return -1;
     }
 
-    uint8_t data[ONION_MAX_PACKET_SIZE] = {0};
-    memcpy(data, plain + SIZE_IPPORT, len - SIZE_IPPORT);
-    uint16_t data_len = len - SIZE_IPPORT;
-    uint8_t *ret_part = data + (len - SIZE_IPPORT);
-    random_nonce(ret_part);
-    uint8_t ret_data[RETURN_2 + SIZE_IPPORT];
-    ipport_pack(ret_data, source);
-    memcpy(ret_data + SIZE_IPPORT, packet + (length - RETURN_2), RETURN_2);
-    len = encrypt_data_symmetric(onion->secret_symmetric_key, ret_part, ret_data, sizeof(ret_data),
-                                 ret_part + CRYPTO_NONCE_SIZE);
+    *data = plain + SIZE_IPPORT;
+    return (end + ret_length) - *data;
+}
 
-    if (len != RETURN_3 - CRYPTO_NONCE_SIZE) {
-        return 1;
+/** Decrypt the return path of a response in place, and write packet_id in
+ * front of the return path it held, which is followed by the response.
+ *
+ * return length of the packet to send to send_to, which starts at data, on success.
+ * return -1 on failure.
+ */
+non_null()
+static int relay_recv(Onion *onion, uint8_t *packet, uint16_t length, uint16_t ret_length, uint8_t packet_id,
+                      IP_Port *send_to, uint8_t **data)
+{
+    const uint16_t inner_ret_length = ret_length - (CRYPTO_NONCE_SIZE + SIZE_IPPORT + CRYPTO_MAC_SIZE);
+
+    if (length <= 1 + ret_length) {
+        return -1;
     }
 
-    data_len += RETURN_3;
+    const uint8_t response_id = packet[1 + ret_length];
 
-    if ((uint32_t)sendpacket(onion->net, &send_to, data, data_len) != data_len) {
-        return 1;
+    if (response_id != NET_PACKET_ANNOUNCE_RESPONSE && response_id != NET_PACKET_ONION_DATA_RESPONSE) {
+        return -1;
     }
 
-    return 0;
+    uint8_t key[CRYPTO_SYMMETRIC_KEY_SIZE];
+    get_symmetric_key(onion, key);
+
+    /* Decrypting in place overwrites the nonce. */
+    uint8_t nonce[CRYPTO_NONCE_SIZE];
+    memcpy(nonce, packet + 1, CRYPTO_NONCE_SIZE);
+
+    uint8_t *const encrypted = packet + 1 + CRYPTO_NONCE_SIZE;
+    const int len = decrypt_data_symmetric_in_place(key, nonce, encrypted,
+                    SIZE_IPPORT + inner_ret_length + CRYPTO_MAC_SIZE);
+
+    if (len != SIZE_IPPORT + inner_ret_length) {
+        return -1;
+    }
+
+    uint8_t *const plain = encrypted + CRYPTO_MAC_SIZE;
+
+    if (ipport_unpack(send_to, plain, len, 0) == -1) {
+        return -1;
+    }
+
+    uint8_t *const out = plain + SIZE_IPPORT - 1;
+    out[0] = packet_id;
+
+    *data = out;
+    return length - (out - packet);
 }
 
+non_null()
+static int relay_recv_3(Onion *onion, const IP_Port *source, uint8_t *packet, uint16_t length, IP_Port *send_to,
+                        uint8_t **data)
+{
+    return relay_recv(onion, packet, length, RETURN_3, NET_PACKET_ONION_RECV_2, send_to, data);
+}
 
 non_null()
-static int handle_recv_3(void *object, const IP_Port *source, const uint8_t *packet, uint16_t length, void *userdata)
+static int relay_recv_2(Onion *onion, const IP_Port *source, uint8_t *packet, uint16_t length, IP_Port *send_to,
+                        uint8_t **data)
 {
-    Onion *onion = (Onion *)object;
+    return relay_recv(onion, packet, length, RETURN_2, NET_PACKET_ONION_RECV_1, send_to, data);
+}
 
-    if (length > ONION_MAX_PACKET_SIZE) {
-        return 1;
-    }
+/** Queue a packet for the relay thread.
+ *
+ * return false if the queue is full.
+ */
+non_null()
+static bool relay_queue_push(Onion_Relay *relay, relay_cb *function, const IP_Port *source, const uint8_t *packet,
+                             uint16_t length)
+{
+    pthread_mutex_lock(&relay->queue_lock);
 
-    if (length <= 1 + RETURN_3) {
-        return 1;
+    if (relay->count == ONION_RELAY_QUEUE_SIZE) {
+        pthread_mutex_unlock(&relay->queue_lock);
+        return false;
     }
 
-    const uint8_t packet_id = packet[1 + RETURN_3];
+    Relay_Slot *const slot = &relay->slots[(relay->first + relay->count) % ONION_RELAY_QUEUE_SIZE];
+    slot->function = function;
+    slot->source = *source;
+    slot->length = length;
+    memcpy(slot->data, packet, length);
 
-    if (packet_id != NET_PACKET_ANNOUNCE_RESPONSE && packet_id != NET_PACKET_ONION_DATA_RESPONSE) {
-        return 1;
-    }
+    ++relay->count;
 
-    change_symmetric_key(onion);
+    if (relay->count == 1) {
+        pthread_cond_signal(&relay->queue_cond);
+    }
 
-    uint8_t plain[SIZE_IPPORT + RETURN_2];
-    int len = decrypt_data_symmetric(onion->secret_symmetric_key, packet + 1, packet + 1 + CRYPTO_NONCE_SIZE,
-                                     SIZE_IPPORT + RETURN_2 + CRYPTO_MAC_SIZE, plain);
+    pthread_mutex_unlock(&relay->queue_lock);
+    return true;
+}
 
-    if ((uint32_t)len != sizeof(plain)) {
+/** Relay a packet now, or hand it to the relay thread if there is one.
+ *
+ * return 0 on success.
+ * return 1 on failure.
+ */
+non_null()
+static int relay_packet(Onion *onion, relay_cb *function, const IP_Port *source, const uint8_t *packet,
+                        uint16_t length)
+{
+    if (length > ONION_MAX_PACKET_SIZE) {
         return 1;
     }
 
+    if (onion->relay != nullptr) {
+        return relay_queue_push(onion->relay, function, source, packet, length) ? 0 : 1;
+    }
+
+    uint8_t buffer[RELAY_BUFFER_SIZE];
+    memcpy(buffer, packet, length);
+
     IP_Port send_to;
+    uint8_t *data;
+    const int len = function(onion, source, buffer, length, &send_to, &data);
 
-    if (ipport_unpack(&send_to, plain, len, 0) == -1) {
+    if (len == -1) {
         return 1;
     }
 
-    uint8_t data[ONION_MAX_PACKET_SIZE] = {0};
-    data[0] = NET_PACKET_ONION_RECV_2;
-    memcpy(data + 1, plain + SIZE_IPPORT, RETURN_2);
-    memcpy(data + 1 + RETURN_2, packet + 1 + RETURN_3, length - (1 + RETURN_3));
-    uint16_t data_len = 1 + RETURN_2 + (length - (1 + RETURN_3));
-
-    if ((uint32_t)sendpacket(onion->net, &send_to, data, data_len) != data_len) {
+    if (sendpacket(onion->net, &send_to, data, len) != len) {
         return 1;
     }
 
@@ -563,53 +703,115 @@ static int handle_recv_3(void *object, const IP_Port *source, const uint8_t *pac
 }
 
 non_null()
-static int handle_recv_2(void *object, const IP_Port *source, const uint8_t *packet, uint16_t length, void *userdata)
+static void *relay_thread(void *arg)
 {
-    Onion *onion = (Onion *)object;
+    Onion *onion = (Onion *)arg;
+    Onion_Relay *relay = onion->relay;
 
-    if (length > ONION_MAX_PACKET_SIZE) {
-        return 1;
-    }
+    IP_Port send_to[ONION_RELAY_BATCH];
+    Packet packets[ONION_RELAY_BATCH];
 
-    if (length <= 1 + RETURN_2) {
-        return 1;
-    }
+    pthread_mutex_lock(&relay->queue_lock);
 
-    const uint8_t packet_id = packet[1 + RETURN_2];
+    while (true) {
+        while (relay->count == 0 && !relay->stopping) {
+            pthread_cond_wait(&relay->queue_cond, &relay->queue_lock);
+        }
 
-    if (packet_id != NET_PACKET_ANNOUNCE_RESPONSE && packet_id != NET_PACKET_ONION_DATA_RESPONSE) {
-        return 1;
-    }
+        if (relay->stopping) {
+            break;
+        }
 
-    change_symmetric_key(onion);
+        /* The slots taken stay ours until they are given back, so they can be
+         * worked on without the lock. */
+        const uint32_t first = relay->first;
+        uint32_t num = min_u32(relay->count, ONION_RELAY_QUEUE_SIZE - first);
+        num = min_u32(num, ONION_RELAY_BATCH);
+        pthread_mutex_unlock(&relay->queue_lock);
 
-    uint8_t plain[SIZE_IPPORT + RETURN_1];
-    int len = decrypt_data_symmetric(onion->secret_symmetric_key, packet + 1, packet + 1 + CRYPTO_NONCE_SIZE,
-                                     SIZE_IPPORT + RETURN_1 + CRYPTO_MAC_SIZE, plain);
+        uint32_t num_packets = 0;
 
-    if ((uint32_t)len != sizeof(plain)) {
+        for (uint32_t i = 0; i < num; ++i) {
+            Relay_Slot *const slot = &relay->slots[first + i];
+            uint8_t *data;
+            const int len = slot->function(onion, &slot->source, slot->data, slot->length, &send_to[num_packets],
+                                           &data);
+
+            if (len != -1) {
+                packets[num_packets].data = data;
+                packets[num_packets].length = len;
+                ++num_packets;
+            }
+        }
+
+        send_packets(onion->net, relay->log, send_to, packets, num_packets);
+
+        pthread_mutex_lock(&relay->queue_lock);
+        relay->first = (first + num) % ONION_RELAY_QUEUE_SIZE;
+        relay->count -= num;
+    }
+
+    pthread_mutex_unlock(&relay->queue_lock);
+    return nullptr;
+}
+
+int onion_send_1(Onion *onion, const uint8_t *plain, uint16_t len, const IP_Port *source, const uint8_t *nonce)
+{
+    if (len > ONION_MAX_PACKET_SIZE + SIZE_IPPORT - (1 + CRYPTO_NONCE_SIZE + ONION_RETURN_1)) {
         return 1;
     }
 
+    /* Leave room for the packet id and nonce that replace the ip_port. */
+    uint8_t buffer[RELAY_BUFFER_SIZE];
+    uint8_t *const copy = buffer + 1 + CRYPTO_NONCE_SIZE - SIZE_IPPORT;
+    memcpy(copy, plain, len);
+
     IP_Port send_to;
+    uint8_t *data;
+    const int data_len = relay_send_1(onion, copy, len, source, nonce, &send_to, &data);
 
-    if (ipport_unpack(&send_to, plain, len, 0) == -1) {
+    if (data_len == -1) {
         return 1;
     }
 
-    uint8_t data[ONION_MAX_PACKET_SIZE] = {0};
-    data[0] = NET_PACKET_ONION_RECV_1;
-    memcpy(data + 1, plain + SIZE_IPPORT, RETURN_1);
-    memcpy(data + 1 + RETURN_1, packet + 1 + RETURN_2, length - (1 + RETURN_2));
-    uint16_t data_len = 1 + RETURN_1 + (length - (1 + RETURN_2));
-
-    if ((uint32_t)sendpacket(onion->net, &send_to, data, data_len) != data_len) {
+    if (sendpacket(onion->net, &send_to, data, data_len) != data_len) {
         return 1;
     }
 
     return 0;
 }
 
+non_null()
+static int handle_send_initial(void *object, const IP_Port *source, const uint8_t *packet, uint16_t length,
+                               void *userdata)
+{
+    return relay_packet((Onion *)object, &relay_send_initial, source, packet, length);
+}
+
+non_null()
+static int handle_send_1(void *object, const IP_Port *source, const uint8_t *packet, uint16_t length, void *userdata)
+{
+    return relay_packet((Onion *)object, &relay_onion_send_1, source, packet, length);
+}
+
+non_null()
+static int handle_send_2(void *object, const IP_Port *source, const uint8_t *packet, uint16_t length, void *userdata)
+{
+    return relay_packet((Onion *)object, &relay_onion_send_2, source, packet, length);
+}
+
+non_null()
+static int handle_recv_3(void *object, const IP_Port *source, const uint8_t *packet, uint16_t length, void *userdata)
+{
+    return relay_packet((Onion *)object, &relay_recv_3, source, packet, length);
+}
+
+non_null()
+static int handle_recv_2(void *object, const IP_Port *source, const uint8_t *packet, uint16_t length, void *userdata)
+{
+    return relay_packet((Onion *)object, &relay_recv_2, source, packet, length);
+}
+
 non_null()
 static int handle_recv_1(void *object, const IP_Port *source, const uint8_t *packet, uint16_t length, void *userdata)
 {
@@ -629,10 +831,11 @@ static int handle_recv_1(void *object, const IP_Port *source, const uint8_t *pac
         return 1;
     }
 
-    change_symmetric_key(onion);
+    uint8_t key[CRYPTO_SYMMETRIC_KEY_SIZE];
+    get_symmetric_key(onion, key);
 
     uint8_t plain[SIZE_IPPORT];
-    int len = decrypt_data_symmetric(onion->secret_symmetric_key, packet + 1, packet + 1 + CRYPTO_NONCE_SIZE,
+    int len = decrypt_data_symmetric(key, packet + 1, packet + 1 + CRYPTO_NONCE_SIZE,
                                      SIZE_IPPORT + CRYPTO_MAC_SIZE, plain);
 
     if ((uint32_t)len != SIZE_IPPORT) {
@@ -666,6 +869,80 @@ void set_callback_handle_recv_1(Onion *onion, onion_recv_1_cb *function, void *o
     onion->callback_object = object;
 }
 
+non_null()
+static void kill_relay(Onion_Relay *relay)
+{
+    pthread_cond_destroy(&relay->queue_cond);
+    pthread_mutex_destroy(&relay->queue_lock);
+    pthread_mutex_destroy(&relay->key_lock);
+    logger_kill(relay->log);
+    free(relay->slots);
+    free(relay);
+}
+
+bool onion_start_relay_thread(Onion *onion)
+{
+    if (onion->relay != nullptr) {
+        return false;
+    }
+
+    Onion_Relay *relay = (Onion_Relay *)calloc(1, sizeof(Onion_Relay));
+
+    if (relay == nullptr) {
+        return false;
+    }
+
+    relay->slots = (Relay_Slot *)calloc(ONION_RELAY_QUEUE_SIZE, sizeof(Relay_Slot));
+
+    if (relay->slots == nullptr) {
+        free(relay);
+        return false;
+    }
+
+    relay->log = logger_new();
+
+    if (relay->log == nullptr) {
+        free(relay->slots);
+        free(relay);
+        return false;
+    }
+
+    if (pthread_mutex_init(&relay->key_lock, nullptr) != 0) {
+        logger_kill(relay->log);
+        free(relay->slots);
+        free(relay);
+        return false;
+    }
+
+    if (pthread_mutex_init(&relay->queue_lock, nullptr) != 0) {
+        pthread_mutex_destroy(&relay->key_lock);
+        logger_kill(relay->log);
+        free(relay->slots);
+        free(relay);
+        return false;
+    }
+
+    if (pthread_cond_init(&relay->queue_cond, nullptr) != 0) {
+        pthread_mutex_destroy(&relay->queue_lock);
+        pthread_mutex_destroy(&relay->key_lock);
+        logger_kill(relay->log);
+        free(relay->slots);
+        free(relay);
+        return false;
+    }
+
+    onion->relay = relay;
+
+    if (pthread_create(&relay->thread, nullptr, &relay_thread, onion) != 0) {
+        onion->relay = nullptr;
+        kill_relay(relay);
+        return false;
+    }
+
+    LOGGER_DEBUG(onion->log, "relaying onion packets on their own thread");
+    return true;
+}
+
 Onion *new_onion(const Logger *log, Mono_Time *mono_time, DHT *dht)
 {
     if (dht == nullptr) {
@@ -710,6 +987,19 @@ void kill_onion(Onion *onion)
     networking_registerhandler(onion->net, NET_PACKET_ONION_RECV_2, nullptr, nullptr);
     networking_registerhandler(onion->net, NET_PACKET_ONION_RECV_1, nullptr, nullptr);
 
+    if (onion->relay != nullptr) {
+        Onion_Relay *relay = onion->relay;
+
+        pthread_mutex_lock(&relay->queue_lock);
+        relay->stopping = true;
+        pthread_cond_signal(&relay->queue_cond);
+        pthread_mutex_unlock(&relay->queue_lock);
+
+        pthread_join(relay->thread, nullptr);
+        onion->relay = nullptr;
+        kill_relay(relay);
+    }
+
     crypto_memzero(onion->secret_symmetric_key, sizeof(onion->secret_symmetric_key));
 
     free(onion);
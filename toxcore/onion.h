@@ -13,8 +13,14 @@
 #include "logger.h"
 #include "mono_time.h"
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 typedef int onion_recv_1_cb(void *object, const IP_Port *dest, const uint8_t *data, uint16_t length);
 
+typedef struct Onion_Relay Onion_Relay;
+
 typedef struct Onion {
     const Logger *log;
     Mono_Time *mono_time;
@@ -29,6 +35,8 @@ typedef struct Onion {
 
     onion_recv_1_cb *recv_1_function;
     void *callback_object;
+
+    Onion_Relay *relay;
 } Onion;
 
 #define ONION_MAX_PACKET_SIZE 1400
@@ -148,18 +156,34 @@ int send_onion_response(const Networking_Core *net, const IP_Port *dest, const u
  * when the response is received.
  */
 non_null()
-int onion_send_1(const Onion *onion, const uint8_t *plain, uint16_t len, const IP_Port *source, const uint8_t *nonce);
+int onion_send_1(Onion *onion, const uint8_t *plain, uint16_t len, const IP_Port *source, const uint8_t *nonce);
 
 /** Set the callback to be called when the dest ip_port doesn't have TOX_AF_INET6 or TOX_AF_INET as the family.
  */
 non_null(1) nullable(2, 3)
 void set_callback_handle_recv_1(Onion *onion, onion_recv_1_cb *function, void *object);
 
+/** Forward the onion packets received over UDP on a thread of their own, in
+ * batches, instead of one by one in networking_poll(). Responses for TCP clients
+ * and packets passed to onion_send_1() are still relayed by the caller.
+ *
+ * The relay thread logs nothing, so the log callback is still only called on
+ * the thread that runs the onion.
+ *
+ * return true on success.
+ * return false on failure.
+ */
+non_null()
+bool onion_start_relay_thread(Onion *onion);
+
 non_null()
 Onion *new_onion(const Logger *log, Mono_Time *mono_time, DHT *dht);
 
 non_null()
 void kill_onion(Onion *onion);
 
+#ifdef __cplusplus
+}  // extern "C"
+#endif
 
 #endif
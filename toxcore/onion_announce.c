@@ -12,6 +12,7 @@
 #include <string.h>
 
 #include "LAN_discovery.h"
+#include "hash_index.h"
 #include "mono_time.h"
 #include "util.h"
 
@@ -25,24 +26,68 @@
 static_assert(ONION_PING_ID_SIZE == CRYPTO_PUBLIC_KEY_SIZE,
               "announce response packets assume that ONION_PING_ID_SIZE is equal to CRYPTO_PUBLIC_KEY_SIZE");
 
+/** Marks the end of the lists of entries. */
+#define ENTRY_NONE UINT32_MAX
+
 typedef struct Onion_Announce_Entry {
     uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
     IP_Port ret_ip_port;
     uint8_t ret[ONION_RETURN_3];
     uint8_t data_public_key[CRYPTO_PUBLIC_KEY_SIZE];
     uint64_t time;
+
+    uint32_t heap_pos; /* Position in distance_heap. */
+    /* Neighbours in the list of entries from oldest to newest. Free entries
+     * are linked through next. */
+    uint32_t prev;
+    uint32_t next;
 } Onion_Announce_Entry;
 
+/** Most requesters whose ping ids are kept. The cache has room for as many
+ * requesters as there are announce entries, rounded up to a power of 2.
+ */
+#define PING_ID_CACHE_MAX_SIZE (1 << 16)
+
+/** The ping ids last generated for a requester. */
+typedef struct Ping_Id_Cache_Entry {
+    uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    IP_Port ret_ip_port;
+    uint64_t window; /* The time divided by PING_ID_TIMEOUT ping_id1 is for, ping_id2 is for the next one. */
+    uint8_t ping_id1[ONION_PING_ID_SIZE];
+    uint8_t ping_id2[ONION_PING_ID_SIZE];
+    bool stored;
+} Ping_Id_Cache_Entry;
+
 struct Onion_Announce {
     const Logger *log;
     Mono_Time *mono_time;
     DHT     *dht;
     Networking_Core *net;
-    Onion_Announce_Entry entries[ONION_ANNOUNCE_MAX_ENTRIES];
+
+    /* Entries are stored at stable indices, grown up to max_entries. */
+    Onion_Announce_Entry *entries;
+    uint32_t entries_size;
+    uint32_t num_entries;
+    uint32_t max_entries;
+    uint32_t first_free;
+
+    Hash_Index key_index; /* Public key to index in entries. */
+    uint32_t *distance_heap; /* Max-heap of entries, the farthest from our DHT key first. */
+    uint32_t oldest;
+    uint32_t newest;
+
     /* This is CRYPTO_SYMMETRIC_KEY_SIZE long just so we can use new_symmetric_key() to fill it */
     uint8_t secret_bytes[CRYPTO_SYMMETRIC_KEY_SIZE];
 
     Shared_Keys shared_keys_recv;
+
+    /* Requesters announce again well within PING_ID_TIMEOUT, so most requests
+     * are answered without hashing. Requesters are placed by a keyed hash of
+     * their public key, so they can't pick a slot to push others out of.
+     * Allocated on the first request. */
+    Ping_Id_Cache_Entry *ping_id_cache;
+    uint32_t ping_id_cache_size;
+    uint8_t ping_id_cache_key[CRYPTO_SIPHASH_KEY_SIZE];
 };
 
 non_null()
@@ -51,15 +96,6 @@ static bool onion_ping_id_eq(const uint8_t *a, const uint8_t *b)
     return public_key_cmp(a, b) == 0;
 }
 
-uint8_t *onion_announce_entry_public_key(Onion_Announce *onion_a, uint32_t entry)
-{
-    return onion_a->entries[entry].public_key;
-}
-
-void onion_announce_entry_set_time(Onion_Announce *onion_a, uint32_t entry, uint64_t time)
-{
-    onion_a->entries[entry].time = time;
-}
 
 /** Create an onion announce request packet in packet of max_packet_length (recommended size ONION_ANNOUNCE_REQUEST_SIZE).
  *
@@ -109,6 +145,7 @@ int create_announce_request(uint8_t *packet, uint16_t max_packet_length, const u
  *
  * public_key is the real public key of the node which we want to send the data of length length to.
  * encrypt_public_key is the public key used to encrypt the data packet.
+ * ephemeral_public_key and ephemeral_secret_key is a new keypair that must not be used for anything else.
  *
  * nonce is the nonce to encrypt this packet with
  *
@@ -116,7 +153,8 @@ int create_announce_request(uint8_t *packet, uint16_t max_packet_length, const u
  * return 0 on success.
  */
 int create_data_request(uint8_t *packet, uint16_t max_packet_length, const uint8_t *public_key,
-                        const uint8_t *encrypt_public_key, const uint8_t *nonce, const uint8_t *data, uint16_t length)
+                        const uint8_t *encrypt_public_key, const uint8_t *ephemeral_public_key,
+                        const uint8_t *ephemeral_secret_key, const uint8_t *nonce, const uint8_t *data, uint16_t length)
 {
     if (DATA_REQUEST_MIN_SIZE + length > max_packet_length) {
         return -1;
@@ -130,13 +168,9 @@ int create_data_request(uint8_t *packet, uint16_t max_packet_length, const uint8
     memcpy(packet + 1, public_key, CRYPTO_PUBLIC_KEY_SIZE);
     memcpy(packet + 1 + CRYPTO_PUBLIC_KEY_SIZE, nonce, CRYPTO_NONCE_SIZE);
 
-    uint8_t random_public_key[CRYPTO_PUBLIC_KEY_SIZE];
-    uint8_t random_secret_key[CRYPTO_SECRET_KEY_SIZE];
-    crypto_new_keypair(random_public_key, random_secret_key);
-
-    memcpy(packet + 1 + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_NONCE_SIZE, random_public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    memcpy(packet + 1 + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_NONCE_SIZE, ephemeral_public_key, CRYPTO_PUBLIC_KEY_SIZE);
 
-    int len = encrypt_data(encrypt_public_key, random_secret_key, packet + 1 + CRYPTO_PUBLIC_KEY_SIZE, data, length,
+    int len = encrypt_data(encrypt_public_key, ephemeral_secret_key, packet + 1 + CRYPTO_PUBLIC_KEY_SIZE, data, length,
                            packet + 1 + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE);
 
     if (1 + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE + len != DATA_REQUEST_MIN_SIZE +
@@ -208,8 +242,14 @@ int send_data_request(const Networking_Core *net, const Onion_Path *path, const
                       const uint8_t *public_key,
                       const uint8_t *encrypt_public_key, const uint8_t *nonce, const uint8_t *data, uint16_t length)
 {
+    uint8_t ephemeral_public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t ephemeral_secret_key[CRYPTO_SECRET_KEY_SIZE];
+    crypto_new_keypair(ephemeral_public_key, ephemeral_secret_key);
+
     uint8_t request[ONION_MAX_DATA_SIZE];
-    int len = create_data_request(request, sizeof(request), public_key, encrypt_public_key, nonce, data, length);
+    int len = create_data_request(request, sizeof(request), public_key, encrypt_public_key, ephemeral_public_key,
+                                  ephemeral_secret_key, nonce, data, length);
+    crypto_memzero(ephemeral_secret_key, sizeof(ephemeral_secret_key));
 
     if (len == -1) {
         return -1;
@@ -243,95 +283,259 @@ static void generate_ping_id(const Onion_Announce *onion_a, uint64_t time, const
     crypto_sha256(ping_id, data, sizeof(data));
 }
 
-/** check if public key is in entries list
- *
- * return -1 if no
- * return position in list if yes
+non_null()
+static void free_ping_id_cache(Onion_Announce *onion_a)
+{
+    if (onion_a->ping_id_cache != nullptr) {
+        crypto_memzero(onion_a->ping_id_cache, onion_a->ping_id_cache_size * sizeof(Ping_Id_Cache_Entry));
+    }
+
+    free(onion_a->ping_id_cache);
+    onion_a->ping_id_cache = nullptr;
+    onion_a->ping_id_cache_size = 0;
+}
+
+/** Put the ping ids for the current and the next time window of a requester
+ * in ping_id1 and ping_id2, reusing the ones generated for its last request.
  */
 non_null()
-static int in_entries(const Onion_Announce *onion_a, const uint8_t *public_key)
+static void get_ping_ids(Onion_Announce *onion_a, const uint8_t *public_key, const IP_Port *ret_ip_port,
+                         uint8_t *ping_id1, uint8_t *ping_id2)
 {
-    for (unsigned int i = 0; i < ONION_ANNOUNCE_MAX_ENTRIES; ++i) {
-        if (!mono_time_is_timeout(onion_a->mono_time, onion_a->entries[i].time, ONION_ANNOUNCE_TIMEOUT)
-                && public_key_cmp(onion_a->entries[i].public_key, public_key) == 0) {
-            return i;
+    const uint64_t time = mono_time_get(onion_a->mono_time);
+    const uint64_t window = time / PING_ID_TIMEOUT;
+
+    if (onion_a->ping_id_cache == nullptr) {
+        uint32_t size = 1;
+
+        while (size < onion_a->max_entries && size < PING_ID_CACHE_MAX_SIZE) {
+            size *= 2;
         }
+
+        onion_a->ping_id_cache = (Ping_Id_Cache_Entry *)calloc(size, sizeof(Ping_Id_Cache_Entry));
+
+        if (onion_a->ping_id_cache == nullptr) {
+            generate_ping_id(onion_a, time, public_key, ret_ip_port, ping_id1);
+            generate_ping_id(onion_a, time + PING_ID_TIMEOUT, public_key, ret_ip_port, ping_id2);
+            return;
+        }
+
+        onion_a->ping_id_cache_size = size;
     }
 
-    return -1;
+    const uint64_t hash = crypto_siphash(onion_a->ping_id_cache_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    Ping_Id_Cache_Entry *const entry = &onion_a->ping_id_cache[hash & (onion_a->ping_id_cache_size - 1)];
+
+    if (!entry->stored || public_key_cmp(entry->public_key, public_key) != 0 || !ipport_equal(&entry->ret_ip_port, ret_ip_port)
+            || entry->window + 1 < window || entry->window > window) {
+        generate_ping_id(onion_a, time, public_key, ret_ip_port, entry->ping_id1);
+        generate_ping_id(onion_a, time + PING_ID_TIMEOUT, public_key, ret_ip_port, entry->ping_id2);
+    } else if (entry->window + 1 == window) {
+        memcpy(entry->ping_id1, entry->ping_id2, ONION_PING_ID_SIZE);
+        generate_ping_id(onion_a, time + PING_ID_TIMEOUT, public_key, ret_ip_port, entry->ping_id2);
+    }
+
+    memcpy(entry->public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    entry->ret_ip_port = *ret_ip_port;
+    entry->window = window;
+    entry->stored = true;
+
+    memcpy(ping_id1, entry->ping_id1, ONION_PING_ID_SIZE);
+    memcpy(ping_id2, entry->ping_id2, ONION_PING_ID_SIZE);
 }
 
-typedef struct Cmp_Data {
-    const Mono_Time *mono_time;
-    const uint8_t *base_public_key;
-    Onion_Announce_Entry entry;
-} Cmp_Data;
+/** Return true if the entry at index a is farther from our DHT key than the one at b. */
+non_null()
+static bool entry_farther(const Onion_Announce *onion_a, uint32_t a, uint32_t b)
+{
+    return id_closest(dht_get_self_public_key(onion_a->dht), onion_a->entries[a].public_key,
+                      onion_a->entries[b].public_key) == 2;
+}
 
 non_null()
-static int cmp_entry(const void *a, const void *b)
+static void heap_set(Onion_Announce *onion_a, uint32_t pos, uint32_t index)
 {
-    const Cmp_Data *cmp1 = (const Cmp_Data *)a;
-    const Cmp_Data *cmp2 = (const Cmp_Data *)b;
-    const Onion_Announce_Entry entry1 = cmp1->entry;
-    const Onion_Announce_Entry entry2 = cmp2->entry;
-    const uint8_t *cmp_public_key = cmp1->base_public_key;
+    onion_a->distance_heap[pos] = index;
+    onion_a->entries[index].heap_pos = pos;
+}
 
-    const int t1 = mono_time_is_timeout(cmp1->mono_time, entry1.time, ONION_ANNOUNCE_TIMEOUT);
-    const int t2 = mono_time_is_timeout(cmp1->mono_time, entry2.time, ONION_ANNOUNCE_TIMEOUT);
+non_null()
+static void heap_sift_up(Onion_Announce *onion_a, uint32_t pos)
+{
+    const uint32_t index = onion_a->distance_heap[pos];
 
-    if (t1 && t2) {
-        return 0;
-    }
+    while (pos > 0) {
+        const uint32_t parent = (pos - 1) / 2;
 
-    if (t1) {
-        return -1;
+        if (!entry_farther(onion_a, index, onion_a->distance_heap[parent])) {
+            break;
+        }
+
+        heap_set(onion_a, pos, onion_a->distance_heap[parent]);
+        pos = parent;
     }
 
-    if (t2) {
-        return 1;
+    heap_set(onion_a, pos, index);
+}
+
+non_null()
+static void heap_sift_down(Onion_Announce *onion_a, uint32_t pos)
+{
+    const uint32_t index = onion_a->distance_heap[pos];
+
+    while (true) {
+        const uint32_t left = 2 * pos + 1;
+
+        if (left >= onion_a->num_entries) {
+            break;
+        }
+
+        uint32_t child = left;
+
+        if (left + 1 < onion_a->num_entries
+                && entry_farther(onion_a, onion_a->distance_heap[left + 1], onion_a->distance_heap[left])) {
+            child = left + 1;
+        }
+
+        if (!entry_farther(onion_a, onion_a->distance_heap[child], index)) {
+            break;
+        }
+
+        heap_set(onion_a, pos, onion_a->distance_heap[child]);
+        pos = child;
     }
 
-    const int close = id_closest(cmp_public_key, entry1.public_key, entry2.public_key);
+    heap_set(onion_a, pos, index);
+}
+
+/** Remove the entry at index and put it on the free list. */
+non_null()
+static void remove_entry(Onion_Announce *onion_a, uint32_t index)
+{
+    Onion_Announce_Entry *entry = &onion_a->entries[index];
 
-    if (close == 1) {
-        return 1;
+    hash_index_remove(&onion_a->key_index, entry->public_key, index);
+
+    const uint32_t pos = entry->heap_pos;
+    --onion_a->num_entries;
+
+    if (pos != onion_a->num_entries) {
+        const uint32_t moved = onion_a->distance_heap[onion_a->num_entries];
+        heap_set(onion_a, pos, moved);
+        heap_sift_up(onion_a, pos);
+        heap_sift_down(onion_a, onion_a->entries[moved].heap_pos);
     }
 
-    if (close == 2) {
-        return -1;
+    if (entry->prev != ENTRY_NONE) {
+        onion_a->entries[entry->prev].next = entry->next;
+    } else {
+        onion_a->oldest = entry->next;
     }
 
-    return 0;
+    if (entry->next != ENTRY_NONE) {
+        onion_a->entries[entry->next].prev = entry->prev;
+    } else {
+        onion_a->newest = entry->prev;
+    }
+
+    crypto_memzero(entry, sizeof(Onion_Announce_Entry));
+    entry->next = onion_a->first_free;
+    onion_a->first_free = index;
 }
 
+/** Make the entry at index the newest one. */
 non_null()
-static void sort_onion_announce_list(Onion_Announce_Entry *list, unsigned int length, const Mono_Time *mono_time,
-                                     const uint8_t *comp_public_key)
+static void append_entry(Onion_Announce *onion_a, uint32_t index)
 {
-    // Pass comp_public_key to qsort with each Client_data entry, so the
-    // comparison function can use it as the base of comparison.
-    Cmp_Data *cmp_list = (Cmp_Data *)calloc(length, sizeof(Cmp_Data));
+    Onion_Announce_Entry *entry = &onion_a->entries[index];
+    entry->prev = onion_a->newest;
+    entry->next = ENTRY_NONE;
 
-    if (cmp_list == nullptr) {
-        return;
+    if (onion_a->newest != ENTRY_NONE) {
+        onion_a->entries[onion_a->newest].next = index;
+    } else {
+        onion_a->oldest = index;
     }
 
-    for (uint32_t i = 0; i < length; ++i) {
-        cmp_list[i].mono_time = mono_time;
-        cmp_list[i].base_public_key = comp_public_key;
-        cmp_list[i].entry = list[i];
+    onion_a->newest = index;
+}
+
+/** Remove the entries that have timed out, which are the oldest ones. */
+non_null()
+static void remove_timed_out_entries(Onion_Announce *onion_a)
+{
+    while (onion_a->oldest != ENTRY_NONE
+            && mono_time_is_timeout(onion_a->mono_time, onion_a->entries[onion_a->oldest].time, ONION_ANNOUNCE_TIMEOUT)) {
+        remove_entry(onion_a, onion_a->oldest);
     }
+}
+
+/** Take an unused entry, growing the entries up to max_entries.
+ *
+ * return -1 on failure.
+ * return index of the entry on success.
+ */
+non_null()
+static int new_entry(Onion_Announce *onion_a)
+{
+    if (onion_a->first_free == ENTRY_NONE) {
+        const uint32_t old_size = onion_a->entries_size;
+
+        if (old_size >= onion_a->max_entries) {
+            return -1;
+        }
+
+        const uint32_t new_size = min_u32(onion_a->max_entries, max_u32(16, old_size * 2));
+        Onion_Announce_Entry *entries = (Onion_Announce_Entry *)realloc(onion_a->entries,
+                                        new_size * sizeof(Onion_Announce_Entry));
 
-    qsort(cmp_list, length, sizeof(Cmp_Data), cmp_entry);
+        if (entries == nullptr) {
+            return -1;
+        }
+
+        onion_a->entries = entries;
+        uint32_t *distance_heap = (uint32_t *)realloc(onion_a->distance_heap, new_size * sizeof(uint32_t));
+
+        if (distance_heap == nullptr) {
+            return -1;
+        }
+
+        onion_a->distance_heap = distance_heap;
+        onion_a->entries_size = new_size;
 
-    for (uint32_t i = 0; i < length; ++i) {
-        list[i] = cmp_list[i].entry;
+        for (uint32_t i = new_size; i > old_size; --i) {
+            memset(&entries[i - 1], 0, sizeof(Onion_Announce_Entry));
+            entries[i - 1].next = onion_a->first_free;
+            onion_a->first_free = i - 1;
+        }
     }
 
-    free(cmp_list);
+    const uint32_t index = onion_a->first_free;
+    onion_a->first_free = onion_a->entries[index].next;
+    return (int)index;
+}
+
+/** check if public key is in entries list
+ *
+ * return -1 if no
+ * return position in list if yes
+ */
+non_null()
+static int in_entries(const Onion_Announce *onion_a, const uint8_t *public_key)
+{
+    const int index = hash_index_find(&onion_a->key_index, public_key);
+
+    if (index == -1 || mono_time_is_timeout(onion_a->mono_time, onion_a->entries[index].time, ONION_ANNOUNCE_TIMEOUT)) {
+        return -1;
+    }
+
+    return index;
 }
 
 /** add entry to entries list
+ *
+ * If the list is full, the entry replaces the one farthest from our DHT key
+ * if it is closer.
  *
  * return -1 if failure
  * return position if added
@@ -340,36 +544,103 @@ non_null()
 static int add_to_entries(Onion_Announce *onion_a, const IP_Port *ret_ip_port, const uint8_t *public_key,
                           const uint8_t *data_public_key, const uint8_t *ret)
 {
+    remove_timed_out_entries(onion_a);
 
     int pos = in_entries(onion_a, public_key);
 
-    if (pos == -1) {
-        for (unsigned i = 0; i < ONION_ANNOUNCE_MAX_ENTRIES; ++i) {
-            if (mono_time_is_timeout(onion_a->mono_time, onion_a->entries[i].time, ONION_ANNOUNCE_TIMEOUT)) {
-                pos = i;
+    if (pos != -1) {
+        Onion_Announce_Entry *entry = &onion_a->entries[pos];
+        entry->ret_ip_port = *ret_ip_port;
+        memcpy(entry->ret, ret, ONION_RETURN_3);
+        memcpy(entry->data_public_key, data_public_key, CRYPTO_PUBLIC_KEY_SIZE);
+        entry->time = mono_time_get(onion_a->mono_time);
+
+        if (onion_a->newest != (uint32_t)pos) {
+            const uint32_t prev = entry->prev;
+            const uint32_t next = entry->next;
+
+            if (prev != ENTRY_NONE) {
+                onion_a->entries[prev].next = next;
+            } else {
+                onion_a->oldest = next;
             }
+
+            onion_a->entries[next].prev = prev;
+            append_entry(onion_a, pos);
         }
+
+        return pos;
     }
 
-    if (pos == -1) {
-        if (id_closest(dht_get_self_public_key(onion_a->dht), public_key, onion_a->entries[0].public_key) == 1) {
-            pos = 0;
+    if (onion_a->num_entries >= onion_a->max_entries) {
+        const uint32_t farthest = onion_a->distance_heap[0];
+
+        if (id_closest(dht_get_self_public_key(onion_a->dht), public_key, onion_a->entries[farthest].public_key) != 1) {
+            return -1;
         }
+
+        remove_entry(onion_a, farthest);
     }
 
-    if (pos == -1) {
+    const int index = new_entry(onion_a);
+
+    if (index == -1) {
         return -1;
     }
 
-    memcpy(onion_a->entries[pos].public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
-    onion_a->entries[pos].ret_ip_port = *ret_ip_port;
-    memcpy(onion_a->entries[pos].ret, ret, ONION_RETURN_3);
-    memcpy(onion_a->entries[pos].data_public_key, data_public_key, CRYPTO_PUBLIC_KEY_SIZE);
-    onion_a->entries[pos].time = mono_time_get(onion_a->mono_time);
+    if (!hash_index_add(&onion_a->key_index, public_key, index)) {
+        Onion_Announce_Entry *entry = &onion_a->entries[index];
+        entry->next = onion_a->first_free;
+        onion_a->first_free = index;
+        return -1;
+    }
+
+    Onion_Announce_Entry *entry = &onion_a->entries[index];
+    memcpy(entry->public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    entry->ret_ip_port = *ret_ip_port;
+    memcpy(entry->ret, ret, ONION_RETURN_3);
+    memcpy(entry->data_public_key, data_public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    entry->time = mono_time_get(onion_a->mono_time);
+
+    ++onion_a->num_entries;
+    heap_set(onion_a, onion_a->num_entries - 1, index);
+    heap_sift_up(onion_a, onion_a->num_entries - 1);
+    append_entry(onion_a, index);
 
-    sort_onion_announce_list(onion_a->entries, ONION_ANNOUNCE_MAX_ENTRIES, onion_a->mono_time,
-                             dht_get_self_public_key(onion_a->dht));
-    return in_entries(onion_a, public_key);
+    return index;
+}
+
+bool onion_announce_add_entry(Onion_Announce *onion_a, const uint8_t *public_key, const IP_Port *ret_ip_port,
+                              const uint8_t *data_public_key, const uint8_t *ret)
+{
+    return add_to_entries(onion_a, ret_ip_port, public_key, data_public_key, ret) != -1;
+}
+
+bool onion_announce_has_entry(const Onion_Announce *onion_a, const uint8_t *public_key)
+{
+    return in_entries(onion_a, public_key) != -1;
+}
+
+uint32_t onion_announce_num_entries(const Onion_Announce *onion_a)
+{
+    return onion_a->num_entries;
+}
+
+bool onion_announce_set_max_entries(Onion_Announce *onion_a, uint32_t max_entries)
+{
+    if (max_entries == 0 || max_entries > ONION_ANNOUNCE_MAX_ENTRIES_LIMIT) {
+        return false;
+    }
+
+    while (onion_a->num_entries > max_entries) {
+        remove_entry(onion_a, onion_a->distance_heap[0]);
+    }
+
+    onion_a->max_entries = max_entries;
+
+    /* Sized again from max_entries on the next request. */
+    free_ping_id_cache(onion_a);
+    return true;
 }
 
 non_null()
@@ -398,10 +669,8 @@ static int handle_announce_request(void *object, const IP_Port *source, const ui
     }
 
     uint8_t ping_id1[ONION_PING_ID_SIZE];
-    generate_ping_id(onion_a, mono_time_get(onion_a->mono_time), packet_public_key, source, ping_id1);
-
     uint8_t ping_id2[ONION_PING_ID_SIZE];
-    generate_ping_id(onion_a, mono_time_get(onion_a->mono_time) + PING_ID_TIMEOUT, packet_public_key, source, ping_id2);
+    get_ping_ids(onion_a, packet_public_key, source, ping_id1, ping_id2);
 
     int index;
 
@@ -523,6 +792,13 @@ Onion_Announce *new_onion_announce(const Logger *log, Mono_Time *mono_time, DHT
     onion_a->dht = dht;
     onion_a->net = dht_get_net(dht);
     new_symmetric_key(onion_a->secret_bytes);
+    random_bytes(onion_a->ping_id_cache_key, sizeof(onion_a->ping_id_cache_key));
+
+    onion_a->max_entries = ONION_ANNOUNCE_MAX_ENTRIES;
+    onion_a->first_free = ENTRY_NONE;
+    onion_a->oldest = ENTRY_NONE;
+    onion_a->newest = ENTRY_NONE;
+    hash_index_init(&onion_a->key_index, CRYPTO_PUBLIC_KEY_SIZE);
 
     networking_registerhandler(onion_a->net, NET_PACKET_ANNOUNCE_REQUEST, &handle_announce_request, onion_a);
     networking_registerhandler(onion_a->net, NET_PACKET_ONION_DATA_REQUEST, &handle_data_request, onion_a);
@@ -538,5 +814,14 @@ void kill_onion_announce(Onion_Announce *onion_a)
 
     networking_registerhandler(onion_a->net, NET_PACKET_ANNOUNCE_REQUEST, nullptr, nullptr);
     networking_registerhandler(onion_a->net, NET_PACKET_ONION_DATA_REQUEST, nullptr, nullptr);
+
+    if (onion_a->entries != nullptr) {
+        crypto_memzero(onion_a->entries, onion_a->entries_size * sizeof(Onion_Announce_Entry));
+    }
+
+    free(onion_a->entries);
+    free(onion_a->distance_heap);
+    free_ping_id_cache(onion_a);
+    hash_index_free(&onion_a->key_index);
     free(onion_a);
 }
@@ -12,7 +12,14 @@
 #include "logger.h"
 #include "onion.h"
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Default number of announcements a node stores. */
 #define ONION_ANNOUNCE_MAX_ENTRIES 160
+/** Largest value onion_announce_set_max_entries() accepts. */
+#define ONION_ANNOUNCE_MAX_ENTRIES_LIMIT (1 << 24)
 #define ONION_ANNOUNCE_TIMEOUT 300
 #define ONION_PING_ID_SIZE CRYPTO_SHA256_SIZE
 
@@ -30,11 +37,36 @@
 
 typedef struct Onion_Announce Onion_Announce;
 
-/** These two are not public; they are for tests only! */
+/** Set how many announcements are stored, the ones closest to our DHT key
+ * being kept. Memory for them is only taken as announcements come in. Default
+ * is ONION_ANNOUNCE_MAX_ENTRIES. tox-bootstrapd sets it from its config file.
+ *
+ * return true on success.
+ * return false if max_entries is 0 or larger than ONION_ANNOUNCE_MAX_ENTRIES_LIMIT.
+ */
 non_null()
-uint8_t *onion_announce_entry_public_key(Onion_Announce *onion_a, uint32_t entry);
+bool onion_announce_set_max_entries(Onion_Announce *onion_a, uint32_t max_entries);
+
+/** These three are not public; they are for tests only! */
+/** Store an announcement as if it came in an announce request with a valid
+ * ping id. If the store is full, it replaces the announcement farthest from
+ * our DHT key, if that one is farther than public_key.
+ *
+ * return true if the announcement was stored.
+ */
 non_null()
-void onion_announce_entry_set_time(Onion_Announce *onion_a, uint32_t entry, uint64_t time);
+bool onion_announce_add_entry(Onion_Announce *onion_a, const uint8_t *public_key, const IP_Port *ret_ip_port,
+                              const uint8_t *data_public_key, const uint8_t *ret);
+
+/** return true if public_key has an announcement that has not timed out. */
+non_null()
+bool onion_announce_has_entry(const Onion_Announce *onion_a, const uint8_t *public_key);
+
+/** return the number of stored announcements, including ones that timed out
+ * but were not removed yet.
+ */
+non_null()
+uint32_t onion_announce_num_entries(const Onion_Announce *onion_a);
 
 /** Create an onion announce request packet in packet of max_packet_length (recommended size ONION_ANNOUNCE_REQUEST_SIZE).
  *
@@ -58,6 +90,7 @@ int create_announce_request(uint8_t *packet, uint16_t max_packet_length, const u
  *
  * public_key is the real public key of the node which we want to send the data of length length to.
  * encrypt_public_key is the public key used to encrypt the data packet.
+ * ephemeral_public_key and ephemeral_secret_key is a new keypair that must not be used for anything else.
  *
  * nonce is the nonce to encrypt this packet with
  *
@@ -66,7 +99,8 @@ int create_announce_request(uint8_t *packet, uint16_t max_packet_length, const u
  */
 non_null()
 int create_data_request(uint8_t *packet, uint16_t max_packet_length, const uint8_t *public_key,
-                        const uint8_t *encrypt_public_key, const uint8_t *nonce, const uint8_t *data, uint16_t length);
+                        const uint8_t *encrypt_public_key, const uint8_t *ephemeral_public_key,
+                        const uint8_t *ephemeral_secret_key, const uint8_t *nonce, const uint8_t *data, uint16_t length);
 
 /** Create and send an onion announce request packet.
  *
@@ -116,5 +150,8 @@ Onion_Announce *new_onion_announce(const Logger *log, Mono_Time *mono_time, DHT
 non_null()
 void kill_onion_announce(Onion_Announce *onion_a);
 
+#ifdef __cplusplus
+}  // extern "C"
+#endif
 
 #endif
@@ -0,0 +1,133 @@
+#include <benchmark/benchmark.h>
+
+#include <array>
+#include <vector>
+
+#include "DHT.h"
+#include "logger.h"
+#include "mono_time.h"
+#include "network.h"
+#include "onion_announce.h"
+
+namespace {
+
+using Public_Key = std::array<uint8_t, CRYPTO_PUBLIC_KEY_SIZE>;
+
+/** A bootstrap node's announce store, filled up to its capacity. */
+class AnnounceStore {
+ public:
+  explicit AnnounceStore(uint32_t max_entries) {
+    IP ip;
+    ip_init(&ip, false);
+    logger_ = logger_new();
+    mono_time_ = mono_time_new();
+    net_ = new_networking_ex(logger_, &ip, TOX_PORTRANGE_FROM, TOX_PORTRANGE_TO, nullptr);
+    dht_ = net_ == nullptr ? nullptr : new_dht(logger_, mono_time_, net_, false);
+    onion_a_ = dht_ == nullptr ? nullptr : new_onion_announce(logger_, mono_time_, dht_);
+
+    if (onion_a_ == nullptr || !onion_announce_set_max_entries(onion_a_, max_entries)) {
+      return;
+    }
+
+    ip_port_.ip = ip;
+    ip_port_.port = net_htons(33445);
+    random_bytes(ret_.data(), ret_.size());
+
+    while (onion_announce_num_entries(onion_a_) < max_entries) {
+      const Public_Key key = random_key();
+
+      if (add(key)) {
+        keys_.push_back(key);
+      }
+    }
+  }
+
+  ~AnnounceStore() {
+    if (onion_a_ != nullptr) {
+      kill_onion_announce(onion_a_);
+    }
+
+    if (dht_ != nullptr) {
+      kill_dht(dht_);
+    }
+
+    if (net_ != nullptr) {
+      kill_networking(net_);
+    }
+    mono_time_free(mono_time_);
+    logger_kill(logger_);
+  }
+
+  bool ok() const { return onion_a_ != nullptr; }
+
+  static Public_Key random_key() {
+    Public_Key key;
+    random_bytes(key.data(), key.size());
+    return key;
+  }
+
+  bool add(const Public_Key &key) {
+    return onion_announce_add_entry(onion_a_, key.data(), &ip_port_, key.data(), ret_.data());
+  }
+
+  /** Keys that were stored when the store filled up. */
+  const std::vector<Public_Key> &keys() const { return keys_; }
+
+ private:
+  Logger *logger_;
+  Mono_Time *mono_time_;
+  Networking_Core *net_ = nullptr;
+  DHT *dht_ = nullptr;
+  Onion_Announce *onion_a_ = nullptr;
+  IP_Port ip_port_{};
+  std::array<uint8_t, ONION_RETURN_3> ret_;
+  std::vector<Public_Key> keys_;
+};
+
+/** Store sizes: the default, and ones a bootstrap node might configure. */
+void StoreSizes(benchmark::internal::Benchmark *b) { b->Arg(ONION_ANNOUNCE_MAX_ENTRIES)->Arg(1600)->Arg(16000); }
+
+/** Announced nodes announce themselves again every few seconds. */
+void BM_OnionAnnounceRefresh(benchmark::State &state) {
+  AnnounceStore store(state.range(0));
+
+  if (!store.ok()) {
+    state.SkipWithError("could not create the announce store");
+    return;
+  }
+
+  const std::vector<Public_Key> &keys = store.keys();
+  uint32_t i = 0;
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(store.add(keys[i]));
+    i = (i + 1) % keys.size();
+  }
+}
+BENCHMARK(BM_OnionAnnounceRefresh)->Apply(StoreSizes);
+
+/** Nodes the store has no room for, which are mostly turned away. */
+void BM_OnionAnnounceNewKey(benchmark::State &state) {
+  AnnounceStore store(state.range(0));
+
+  if (!store.ok()) {
+    state.SkipWithError("could not create the announce store");
+    return;
+  }
+
+  std::vector<Public_Key> keys;
+
+  for (uint32_t i = 0; i < 4096; ++i) {
+    keys.push_back(AnnounceStore::random_key());
+  }
+
+  uint32_t i = 0;
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(store.add(keys[i]));
+    i = (i + 1) % keys.size();
+  }
+}
+BENCHMARK(BM_OnionAnnounceNewKey)->Apply(StoreSizes);
+
+}  // namespace
@@ -0,0 +1,220 @@
+#include <benchmark/benchmark.h>
+
+#include <array>
+#include <chrono>
+#include <cstring>
+#include <vector>
+
+
+#include "DHT.h"
+#include "logger.h"
+#include "mono_time.h"
+#include "network.h"
+#include "onion.h"
+#include "onion_announce.h"
+
+namespace {
+
+IP_Port loopback(uint16_t port) {
+  IP_Port ip_port{};
+  ip_port.ip.family = net_family_ipv4;
+  ip_port.ip.ip.v4.uint32 = net_htonl(0x7F000001);
+  ip_port.port = port;
+  return ip_port;
+}
+
+/** A DHT node on a loopback UDP port. */
+class Node {
+ public:
+  Node() {
+    IP ip;
+    ip_init(&ip, false);
+    logger_ = logger_new();
+    mono_time_ = mono_time_new();
+    net_ = new_networking_ex(logger_, &ip, TOX_PORTRANGE_FROM, TOX_PORTRANGE_TO, nullptr);
+    dht_ = net_ == nullptr ? nullptr : new_dht(logger_, mono_time_, net_, false);
+  }
+
+  ~Node() {
+    if (dht_ != nullptr) {
+      kill_dht(dht_);
+    }
+
+    if (net_ != nullptr) {
+      kill_networking(net_);
+    }
+
+    mono_time_free(mono_time_);
+    logger_kill(logger_);
+  }
+
+  bool ok() const { return dht_ != nullptr; }
+
+  Node_format node_format() const {
+    Node_format node{};
+    memcpy(node.public_key, dht_get_self_public_key(dht_), CRYPTO_PUBLIC_KEY_SIZE);
+    node.ip_port = loopback(net_port(net_));
+    return node;
+  }
+
+  Logger *logger_;
+  Mono_Time *mono_time_;
+  Networking_Core *net_ = nullptr;
+  DHT *dht_ = nullptr;
+};
+
+Node_format random_node(uint16_t port) {
+  Node_format node{};
+  random_bytes(node.public_key, sizeof(node.public_key));
+  node.ip_port = loopback(net_htons(port));
+  return node;
+}
+
+/** Building a path: three key exchanges, which a spare path has done ahead
+ * of time when a path times out.
+ */
+void BM_CreateOnionPath(benchmark::State &state) {
+  Node sender;
+
+  if (!sender.ok()) {
+    state.SkipWithError("could not create the DHT");
+    return;
+  }
+
+  const Node_format nodes[3] = {random_node(33445), random_node(33446), random_node(33447)};
+  Onion_Path path;
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(create_onion_path(sender.dht_, &path, nodes));
+  }
+
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_CreateOnionPath);
+
+/** Wrapping range(0) bytes of data in three onion layers, as the onion client
+ * does for every announce and data request.
+ */
+void BM_CreateOnionPacket(benchmark::State &state) {
+  Node sender;
+
+  if (!sender.ok()) {
+    state.SkipWithError("could not create the DHT");
+    return;
+  }
+
+  const Node_format nodes[3] = {random_node(33445), random_node(33446), random_node(33447)};
+  Onion_Path path;
+  create_onion_path(sender.dht_, &path, nodes);
+  const IP_Port dest = loopback(net_htons(33448));
+  const std::vector<uint8_t> data(state.range(0), 1);
+  std::array<uint8_t, ONION_MAX_PACKET_SIZE> packet;
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(create_onion_packet(packet.data(), packet.size(), &path, &dest, data.data(), data.size()));
+  }
+
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_CreateOnionPacket)->Arg(200)->Arg(1000);
+
+/** A data request with a keypair from the onion client's pool, or with one
+ * made for the request if range(0) is 1.
+ */
+void BM_CreateDataRequest(benchmark::State &state) {
+  const bool new_keypair = state.range(0) != 0;
+  uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
+  uint8_t encrypt_public_key[CRYPTO_PUBLIC_KEY_SIZE];
+  uint8_t ephemeral_public_key[CRYPTO_PUBLIC_KEY_SIZE];
+  uint8_t ephemeral_secret_key[CRYPTO_SECRET_KEY_SIZE];
+  uint8_t nonce[CRYPTO_NONCE_SIZE];
+  random_bytes(public_key, sizeof(public_key));
+  random_bytes(encrypt_public_key, sizeof(encrypt_public_key));
+  crypto_new_keypair(ephemeral_public_key, ephemeral_secret_key);
+  random_nonce(nonce);
+  const std::vector<uint8_t> data(200, 1);
+  std::array<uint8_t, ONION_MAX_PACKET_SIZE> packet;
+
+  for (auto _ : state) {
+    if (new_keypair) {
+      crypto_new_keypair(ephemeral_public_key, ephemeral_secret_key);
+    }
+
+    benchmark::DoNotOptimize(create_data_request(packet.data(), packet.size(), public_key, encrypt_public_key,
+                                                 ephemeral_public_key, ephemeral_secret_key, nonce, data.data(),
+                                                 data.size()));
+  }
+
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_CreateDataRequest)->Arg(0)->Arg(1);
+
+int count_packet(void *object, const IP_Port *source, const uint8_t *packet, uint16_t length, void *userdata) {
+  ++*static_cast<uint32_t *>(object);
+  return 0;
+}
+
+/** A bootstrap node relaying the first hop of announce requests, inline in
+ * networking_poll() or on its relay thread if range(0) is 1. Each iteration
+ * sends a burst of 64 packets and waits until the next hop got all of them.
+ */
+void BM_OnionRelayFirstHop(benchmark::State &state) {
+  constexpr uint32_t kBurst = 64;
+  Node sender;
+  Node relay;
+  Node next_hop;
+
+  if (!sender.ok() || !relay.ok() || !next_hop.ok()) {
+    state.SkipWithError("could not create the DHTs");
+    return;
+  }
+
+  Onion *onion = new_onion(relay.logger_, relay.mono_time_, relay.dht_);
+
+  if (onion == nullptr || (state.range(0) != 0 && !onion_start_relay_thread(onion))) {
+    state.SkipWithError("could not start the onion relay");
+
+    if (onion != nullptr) {
+      kill_onion(onion);
+    }
+
+    return;
+  }
+
+  uint32_t received = 0;
+  networking_registerhandler(next_hop.net_, NET_PACKET_ONION_SEND_1, &count_packet, &received);
+
+  const Node_format nodes[3] = {relay.node_format(), next_hop.node_format(), random_node(33447)};
+  Onion_Path path;
+  create_onion_path(sender.dht_, &path, nodes);
+  const IP_Port dest = loopback(net_htons(33448));
+  const std::vector<uint8_t> data(ONION_ANNOUNCE_REQUEST_SIZE, 1);
+  std::array<uint8_t, ONION_MAX_PACKET_SIZE> packet;
+  const int length = create_onion_packet(packet.data(), packet.size(), &path, &dest, data.data(), data.size());
+
+  for (auto _ : state) {
+    const uint32_t expected = received + kBurst;
+
+    for (uint32_t i = 0; i < kBurst; ++i) {
+      sendpacket(sender.net_, &path.ip_port1, packet.data(), length);
+    }
+
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+
+    while (received < expected && std::chrono::steady_clock::now() < deadline) {
+      networking_poll(relay.net_, nullptr);
+      networking_poll(next_hop.net_, nullptr);
+    }
+
+    if (received < expected) {
+      state.SkipWithError("packets were lost");
+      break;
+    }
+  }
+
+  state.SetItemsProcessed(state.iterations() * kBurst);
+  kill_onion(onion);
+}
+BENCHMARK(BM_OnionRelayFirstHop)->Arg(0)->Arg(1)->UseRealTime();
+
+}  // namespace
@@ -15,6 +15,7 @@
 
 #include "LAN_discovery.h"
 #include "mono_time.h"
+#include "run_queue.h"
 #include "util.h"
 
 /** defines for the array size and
@@ -47,6 +48,15 @@ typedef struct Onion_Client_Paths {
     uint64_t path_creation_time[NUMBER_ONION_PATHS];
     /* number of times used without success. */
     unsigned int last_path_used_times[NUMBER_ONION_PATHS];
+    /* Announce requests sent over the path and responses to them since it was created. */
+    uint32_t path_sent[NUMBER_ONION_PATHS];
+    uint32_t path_received[NUMBER_ONION_PATHS];
+    /* Smoothed round trip time of announce requests in milliseconds, 0 before the first response. */
+    uint32_t path_rtt[NUMBER_ONION_PATHS];
+
+    Onion_Path spare_paths[NUMBER_ONION_SPARE_PATHS];
+    uint64_t spare_path_creation_time[NUMBER_ONION_SPARE_PATHS];
+    uint16_t num_spare_paths;
 } Onion_Client_Paths;
 
 typedef struct Last_Pinged {
@@ -72,6 +82,9 @@ typedef struct Onion_Friend {
     uint64_t last_noreplay;
 
     uint64_t last_seen;
+    /* When the friend was last online. Friends due at the same time run most
+     * recently active first. */
+    uint64_t last_active;
 
     Last_Pinged last_pinged[MAX_STORED_PINGED_NODES];
     uint8_t last_pinged_index;
@@ -87,11 +100,20 @@ typedef struct Onion_Friend {
     uint32_t run_count;
 } Onion_Friend;
 
+/** Number of keypairs for onion data requests generated ahead of time. */
+#define ONION_EPHEMERAL_KEYS 16
+
 typedef struct Onion_Data_Handler {
     oniondata_handler_cb *function;
     void *object;
 } Onion_Data_Handler;
 
+typedef struct Self_Address {
+    IP ip; /* Our address in one family, unset until a DHT node reports one. */
+    IP candidate; /* Another address DHT nodes reported, not yet held for long enough. */
+    uint64_t candidate_since;
+} Self_Address;
+
 struct Onion_Client {
     Mono_Time *mono_time;
     const Logger *logger;
@@ -102,6 +124,21 @@ struct Onion_Client {
     Onion_Friend    *friends_list;
     uint16_t       num_friends;
 
+    Run_Queue run_queue; /* Friends by when do_friend() next has something to do for them. */
+
+    uint32_t search_rate; /* Friend announce requests per second, 0 for no limit. */
+    uint32_t search_budget; /* Friend announce requests left this second. */
+    uint32_t dhtpk_rate; /* Friends to send our DHT public key to per second, 0 for no limit. */
+    uint32_t dhtpk_budget; /* Friends left to send our DHT public key to this second. */
+
+    /* Steps of ONION_STABILITY_STEP seconds the network has been stable for. */
+    uint8_t stability;
+    uint64_t last_stability_change;
+    /* Our IPv4 and IPv6 addresses as DHT nodes see them, to notice when they change. */
+    Self_Address self_addresses[2];
+
+    uint64_t announce_requests_sent;
+
     Onion_Node clients_announce_list[MAX_ONION_CLIENTS_ANNOUNCE];
     uint64_t last_announce;
 
@@ -115,6 +152,11 @@ struct Onion_Client {
     uint8_t temp_public_key[CRYPTO_PUBLIC_KEY_SIZE];
     uint8_t temp_secret_key[CRYPTO_SECRET_KEY_SIZE];
 
+    /* Keypairs for onion data requests, each used once. */
+    uint8_t ephemeral_public_keys[ONION_EPHEMERAL_KEYS][CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t ephemeral_secret_keys[ONION_EPHEMERAL_KEYS][CRYPTO_SECRET_KEY_SIZE];
+    uint16_t num_ephemeral_keys;
+
     Last_Pinged last_pinged[MAX_STORED_PINGED_NODES];
 
     Node_format path_nodes[MAX_PATH_NODES];
@@ -267,9 +309,9 @@ static uint16_t random_nodes_path_onion(const Onion_Client *onion_c, Node_format
             nodes[i] = onion_c->path_nodes[rand_idx];
         }
     } else {
-        int random_tcp = get_random_tcp_con_number(onion_c->c);
+        const int fastest_tcp = get_fastest_tcp_con_number(onion_c->c);
 
-        if (random_tcp == -1) {
+        if (fastest_tcp == -1) {
             return 0;
         }
 
@@ -278,7 +320,7 @@ static uint16_t random_nodes_path_onion(const Onion_Client *onion_c, Node_format
                 0
             };
             nodes[0].ip_port.ip.family = net_family_tcp_family;
-            nodes[0].ip_port.ip.ip.v4.uint32 = random_tcp;
+            nodes[0].ip_port.ip.ip.v4.uint32 = fastest_tcp;
 
             for (unsigned int i = 1; i < max_num; ++i) {
                 const uint32_t rand_idx = random_range_u32(num_nodes);
@@ -295,7 +337,7 @@ static uint16_t random_nodes_path_onion(const Onion_Client *onion_c, Node_format
                 0
             };
             nodes[0].ip_port.ip.family = net_family_tcp_family;
-            nodes[0].ip_port.ip.ip.v4.uint32 = random_tcp;
+            nodes[0].ip_port.ip.ip.v4.uint32 = fastest_tcp;
 
             for (unsigned int i = 1; i < max_num; ++i) {
                 const uint32_t rand_idx = random_range_u32(num_nodes_bs);
@@ -355,8 +397,193 @@ static bool onion_node_timed_out(const Onion_Node *node, const Mono_Time *mono_t
                 && mono_time_is_timeout(mono_time, node->last_pinged, ONION_NODE_TIMEOUT)));
 }
 
+/** Friends due at the same time run most recently active first. */
+non_null()
+static void set_last_active(Onion_Client *onion_c, uint16_t friendnum, uint64_t last_active)
+{
+    onion_c->friends_list[friendnum].last_active = last_active;
+    run_queue_set_priority(&onion_c->run_queue, friendnum, last_active);
+}
+
+/** Run do_friend() for the friend on the next do_onion_client() call, because
+ * something it looks at changed.
+ */
+non_null()
+static void wake_friend(Onion_Client *onion_c, uint16_t friendnum)
+{
+    if (onion_c->friends_list[friendnum].status == 0) {
+        return;
+    }
+
+    run_queue_wake(&onion_c->run_queue, friendnum, mono_time_get(onion_c->mono_time));
+}
+
+/** Whether a spare path still fits the way we currently build paths. */
+non_null()
+static bool spare_path_usable(const Onion_Client *onion_c, const Onion_Client_Paths *onion_paths, uint16_t index)
+{
+    if (mono_time_is_timeout(onion_c->mono_time, onion_paths->spare_path_creation_time[index],
+                             ONION_SPARE_PATH_MAX_AGE)) {
+        return false;
+    }
+
+    // Paths start at a TCP relay exactly when we are not connected to the DHT.
+    return net_family_is_tcp_family(onion_paths->spare_paths[index].ip_port1.ip.family)
+           != dht_isconnected(onion_c->dht);
+}
+
+non_null()
+static void remove_spare_path(Onion_Client_Paths *onion_paths, uint16_t index)
+{
+    --onion_paths->num_spare_paths;
+    onion_paths->spare_paths[index] = onion_paths->spare_paths[onion_paths->num_spare_paths];
+    onion_paths->spare_path_creation_time[index] = onion_paths->spare_path_creation_time[onion_paths->num_spare_paths];
+    crypto_memzero(&onion_paths->spare_paths[onion_paths->num_spare_paths], sizeof(Onion_Path));
+}
+
+/** Build spare paths, including their shared keys, so that a path that times
+ * out can be replaced without waiting for them.
+ */
+non_null()
+static void build_spare_paths(const Onion_Client *onion_c, Onion_Client_Paths *onion_paths)
+{
+    for (uint16_t i = onion_paths->num_spare_paths; i != 0; --i) {
+        if (!spare_path_usable(onion_c, onion_paths, i - 1)) {
+            remove_spare_path(onion_paths, i - 1);
+        }
+    }
+
+    while (onion_paths->num_spare_paths < NUMBER_ONION_SPARE_PATHS) {
+        Node_format nodes[ONION_PATH_LENGTH];
+
+        if (random_nodes_path_onion(onion_c, nodes, ONION_PATH_LENGTH) != ONION_PATH_LENGTH) {
+            return;
+        }
+
+        const uint16_t index = onion_paths->num_spare_paths;
+
+        if (create_onion_path(onion_c->dht, &onion_paths->spare_paths[index], nodes) == -1) {
+            return;
+        }
+
+        onion_paths->spare_path_creation_time[index] = mono_time_get(onion_c->mono_time);
+        ++onion_paths->num_spare_paths;
+    }
+}
+
+/** Take a spare path out of onion_paths that does not overlap with a path in use.
+ *
+ * return true on success.
+ */
+non_null()
+static bool take_spare_path(const Onion_Client *onion_c, Onion_Client_Paths *onion_paths, Onion_Path *path)
+{
+    while (onion_paths->num_spare_paths != 0) {
+        const uint16_t index = onion_paths->num_spare_paths - 1;
+        Node_format nodes[ONION_PATH_LENGTH];
+
+        if (spare_path_usable(onion_c, onion_paths, index)
+                && onion_path_to_nodes(nodes, ONION_PATH_LENGTH, &onion_paths->spare_paths[index]) == 0
+                && is_path_used(onion_c->mono_time, onion_paths, nodes) == -1) {
+            *path = onion_paths->spare_paths[index];
+            remove_spare_path(onion_paths, index);
+            return true;
+        }
+
+        remove_spare_path(onion_paths, index);
+    }
+
+    return false;
+}
+
+/** Whether path a is a better choice than path b: fewer requests without a
+ * response since the last one, then more responses per request, then faster.
+ */
+non_null()
+static bool path_better(const Mono_Time *mono_time, const Onion_Client_Paths *onion_paths, uint32_t a, uint32_t b)
+{
+    const bool a_timed_out = path_timed_out(mono_time, onion_paths, a);
+    const bool b_timed_out = path_timed_out(mono_time, onion_paths, b);
+
+    if (a_timed_out != b_timed_out) {
+        return b_timed_out;
+    }
+
+    if (onion_paths->last_path_used_times[a] != onion_paths->last_path_used_times[b]) {
+        return onion_paths->last_path_used_times[a] < onion_paths->last_path_used_times[b];
+    }
+
+    const uint64_t a_rate = (uint64_t)(onion_paths->path_received[a] + 1) * (onion_paths->path_sent[b] + 2);
+    const uint64_t b_rate = (uint64_t)(onion_paths->path_received[b] + 1) * (onion_paths->path_sent[a] + 2);
+
+    if (a_rate != b_rate) {
+        return a_rate > b_rate;
+    }
+
+    return onion_paths->path_rtt[a] != 0
+           && (onion_paths->path_rtt[b] == 0 || onion_paths->path_rtt[a] < onion_paths->path_rtt[b]);
+}
+
+/** Pick the better of two random paths, which sends most packets over the
+ * best paths while still spreading them over all of them.
+ */
+non_null()
+static uint32_t choose_path(const Mono_Time *mono_time, const Onion_Client_Paths *onion_paths)
+{
+    const uint32_t a = random_range_u32(NUMBER_ONION_PATHS);
+    const uint32_t b = (a + 1 + random_range_u32(NUMBER_ONION_PATHS - 1)) % NUMBER_ONION_PATHS;
+    return path_better(mono_time, onion_paths, b, a) ? b : a;
+}
+
+/** Replace the timed out path pathnum with a spare path or a new one.
+ *
+ * return -1 on failure.
+ * return the number of the path to use, which is that of a similar path if one exists.
+ */
+non_null()
+static int replace_path(const Onion_Client *onion_c, Onion_Client_Paths *onion_paths, uint32_t pathnum)
+{
+    Onion_Path new_path;
+
+    if (!take_spare_path(onion_c, onion_paths, &new_path)) {
+        Node_format nodes[ONION_PATH_LENGTH];
+
+        if (random_nodes_path_onion(onion_c, nodes, ONION_PATH_LENGTH) != ONION_PATH_LENGTH) {
+            return -1;
+        }
+
+        const int n = is_path_used(onion_c->mono_time, onion_paths, nodes);
+
+        if (n != -1) {
+            return n;
+        }
+
+        if (create_onion_path(onion_c->dht, &new_path, nodes) == -1) {
+            return -1;
+        }
+    }
+
+    onion_paths->paths[pathnum] = new_path;
+    crypto_memzero(&new_path, sizeof(new_path));
+
+    onion_paths->path_creation_time[pathnum] = mono_time_get(onion_c->mono_time);
+    onion_paths->last_path_success[pathnum] = onion_paths->path_creation_time[pathnum];
+    onion_paths->last_path_used_times[pathnum] = ONION_PATH_MAX_NO_RESPONSE_USES / 2;
+    onion_paths->path_sent[pathnum] = 0;
+    onion_paths->path_received[pathnum] = 0;
+    onion_paths->path_rtt[pathnum] = 0;
+
+    uint32_t path_num = random_u32();
+    path_num /= NUMBER_ONION_PATHS;
+    path_num *= NUMBER_ONION_PATHS;
+    path_num += pathnum;
+
+    onion_paths->paths[pathnum].path_num = path_num;
+    return pathnum;
+}
+
 /** Create a new path or use an old suitable one (if pathnum is valid)
- * or a random one from onion_paths.
+ * or the better of two random ones from onion_paths.
  *
  * return -1 on failure
  * return 0 on success
@@ -368,38 +595,19 @@ non_null()
 static int random_path(const Onion_Client *onion_c, Onion_Client_Paths *onion_paths, uint32_t pathnum, Onion_Path *path)
 {
     if (pathnum == UINT32_MAX) {
-        pathnum = random_range_u32(NUMBER_ONION_PATHS);
+        pathnum = choose_path(onion_c->mono_time, onion_paths);
     } else {
         pathnum = pathnum % NUMBER_ONION_PATHS;
     }
 
     if (path_timed_out(onion_c->mono_time, onion_paths, pathnum)) {
-        Node_format nodes[ONION_PATH_LENGTH];
+        const int n = replace_path(onion_c, onion_paths, pathnum);
 
-        if (random_nodes_path_onion(onion_c, nodes, ONION_PATH_LENGTH) != ONION_PATH_LENGTH) {
+        if (n == -1) {
             return -1;
         }
 
-        int n = is_path_used(onion_c->mono_time, onion_paths, nodes);
-
-        if (n == -1) {
-            if (create_onion_path(onion_c->dht, &onion_paths->paths[pathnum], nodes) == -1) {
-                return -1;
-            }
-
-            onion_paths->path_creation_time[pathnum] = mono_time_get(onion_c->mono_time);
-            onion_paths->last_path_success[pathnum] = onion_paths->path_creation_time[pathnum];
-            onion_paths->last_path_used_times[pathnum] = ONION_PATH_MAX_NO_RESPONSE_USES / 2;
-
-            uint32_t path_num = random_u32();
-            path_num /= NUMBER_ONION_PATHS;
-            path_num *= NUMBER_ONION_PATHS;
-            path_num += pathnum;
-
-            onion_paths->paths[pathnum].path_num = path_num;
-        } else {
-            pathnum = n;
-        }
+        pathnum = n;
     }
 
     if (onion_paths->last_path_used_times[pathnum] < ONION_PATH_MAX_NO_RESPONSE_USES) {
@@ -422,11 +630,12 @@ static bool path_exists(const Mono_Time *mono_time, const Onion_Client_Paths *on
     return onion_paths->paths[path_num % NUMBER_ONION_PATHS].path_num == path_num;
 }
 
-/** Set path timeouts, return the path number.
+/** Set path timeouts and record a response sent over the path at sent_time
+ * (in milliseconds), return the path number.
  *
  */
 non_null()
-static uint32_t set_path_timeouts(Onion_Client *onion_c, uint32_t num, uint32_t path_num)
+static uint32_t set_path_timeouts(Onion_Client *onion_c, uint32_t num, uint32_t path_num, uint64_t sent_time)
 {
     if (num > onion_c->num_friends) {
         return -1;
@@ -441,12 +650,23 @@ static uint32_t set_path_timeouts(Onion_Client *onion_c, uint32_t num, uint32_t
     }
 
     if (onion_paths->paths[path_num % NUMBER_ONION_PATHS].path_num == path_num) {
-        onion_paths->last_path_success[path_num % NUMBER_ONION_PATHS] = mono_time_get(onion_c->mono_time);
-        onion_paths->last_path_used_times[path_num % NUMBER_ONION_PATHS] = 0;
+        const uint32_t pathnum = path_num % NUMBER_ONION_PATHS;
+        onion_paths->last_path_success[pathnum] = mono_time_get(onion_c->mono_time);
+        onion_paths->last_path_used_times[pathnum] = 0;
+        ++onion_paths->path_received[pathnum];
+
+        const uint64_t now = mono_time_get_ms(onion_c->mono_time);
+        const uint32_t rtt = (uint32_t)min_u64(now - min_u64(sent_time, now), UINT32_MAX - 1) + 1;
+
+        if (onion_paths->path_rtt[pathnum] == 0) {
+            onion_paths->path_rtt[pathnum] = rtt;
+        } else {
+            onion_paths->path_rtt[pathnum] = (uint32_t)(((uint64_t)onion_paths->path_rtt[pathnum] * 7 + rtt) / 8);
+        }
 
         Node_format nodes[ONION_PATH_LENGTH];
 
-        if (onion_path_to_nodes(nodes, ONION_PATH_LENGTH, &onion_paths->paths[path_num % NUMBER_ONION_PATHS]) == 0) {
+        if (onion_path_to_nodes(nodes, ONION_PATH_LENGTH, &onion_paths->paths[pathnum]) == 0) {
             for (unsigned int i = 0; i < ONION_PATH_LENGTH; ++i) {
                 onion_add_path_node(onion_c, &nodes[i].ip_port, nodes[i].public_key);
             }
@@ -496,6 +716,10 @@ static int send_onion_packet_tcp_udp(const Onion_Client *onion_c, const Onion_Pa
     return -1;
 }
 
+#define SENDBACK_DATA_SIZE (sizeof(uint32_t) + CRYPTO_PUBLIC_KEY_SIZE + sizeof(IP_Port) + sizeof(uint32_t) + sizeof(uint64_t))
+
+static_assert(SENDBACK_DATA_SIZE <= PING_ARRAY_MAX_DATA_SIZE, "sendback data does not fit in a ping array entry");
+
 /** Creates a sendback for use in an announce request.
  *
  * num is 0 if we used our secret public key for the announce
@@ -515,11 +739,14 @@ non_null()
 static int new_sendback(Onion_Client *onion_c, uint32_t num, const uint8_t *public_key, const IP_Port *ip_port,
                         uint32_t path_num, uint64_t *sendback)
 {
-    uint8_t data[sizeof(uint32_t) + CRYPTO_PUBLIC_KEY_SIZE + sizeof(IP_Port) + sizeof(uint32_t)];
+    const uint64_t sent_time = mono_time_get_ms(onion_c->mono_time);
+    uint8_t data[SENDBACK_DATA_SIZE];
     memcpy(data, &num, sizeof(uint32_t));
     memcpy(data + sizeof(uint32_t), public_key, CRYPTO_PUBLIC_KEY_SIZE);
     memcpy(data + sizeof(uint32_t) + CRYPTO_PUBLIC_KEY_SIZE, ip_port, sizeof(IP_Port));
     memcpy(data + sizeof(uint32_t) + CRYPTO_PUBLIC_KEY_SIZE + sizeof(IP_Port), &path_num, sizeof(uint32_t));
+    memcpy(data + sizeof(uint32_t) + CRYPTO_PUBLIC_KEY_SIZE + sizeof(IP_Port) + sizeof(uint32_t), &sent_time,
+           sizeof(uint64_t));
     *sendback = ping_array_add(onion_c->announce_ping_array, onion_c->mono_time, data, sizeof(data));
 
     if (*sendback == 0) {
@@ -535,17 +762,18 @@ static int new_sendback(Onion_Client *onion_c, uint32_t num, const uint8_t *publ
  * sendback is the sendback ONION_ANNOUNCE_SENDBACK_DATA_LENGTH big
  * ret_pubkey must be at least CRYPTO_PUBLIC_KEY_SIZE big
  * ret_ip_port must be at least 1 big
+ * sent_time is set to the time in milliseconds at which the request was sent
  *
  * return -1 on failure
  * return num (see new_sendback(...)) on success
  */
 non_null()
 static uint32_t check_sendback(Onion_Client *onion_c, const uint8_t *sendback, uint8_t *ret_pubkey,
-                               IP_Port *ret_ip_port, uint32_t *path_num)
+                               IP_Port *ret_ip_port, uint32_t *path_num, uint64_t *sent_time)
 {
     uint64_t sback;
     memcpy(&sback, sendback, sizeof(uint64_t));
-    uint8_t data[sizeof(uint32_t) + CRYPTO_PUBLIC_KEY_SIZE + sizeof(IP_Port) + sizeof(uint32_t)];
+    uint8_t data[SENDBACK_DATA_SIZE];
 
     if (ping_array_check(onion_c->announce_ping_array, onion_c->mono_time, data, sizeof(data), sback) != sizeof(data)) {
         return -1;
@@ -554,6 +782,8 @@ static uint32_t check_sendback(Onion_Client *onion_c, const uint8_t *sendback, u
     memcpy(ret_pubkey, data + sizeof(uint32_t), CRYPTO_PUBLIC_KEY_SIZE);
     memcpy(ret_ip_port, data + sizeof(uint32_t) + CRYPTO_PUBLIC_KEY_SIZE, sizeof(IP_Port));
     memcpy(path_num, data + sizeof(uint32_t) + CRYPTO_PUBLIC_KEY_SIZE + sizeof(IP_Port), sizeof(uint32_t));
+    memcpy(sent_time, data + sizeof(uint32_t) + CRYPTO_PUBLIC_KEY_SIZE + sizeof(IP_Port) + sizeof(uint32_t),
+           sizeof(uint64_t));
 
     uint32_t num;
     memcpy(&num, data, sizeof(uint32_t));
@@ -570,15 +800,10 @@ static int client_send_announce_request(Onion_Client *onion_c, uint32_t num, con
 
     uint64_t sendback;
     Onion_Path path;
+    Onion_Client_Paths *onion_paths = num == 0 ? &onion_c->onion_paths_self : &onion_c->onion_paths_friends;
 
-    if (num == 0) {
-        if (random_path(onion_c, &onion_c->onion_paths_self, pathnum, &path) == -1) {
-            return -1;
-        }
-    } else {
-        if (random_path(onion_c, &onion_c->onion_paths_friends, pathnum, &path) == -1) {
-            return -1;
-        }
+    if (random_path(onion_c, onion_paths, pathnum, &path) == -1) {
+        return -1;
     }
 
     if (new_sendback(onion_c, num, dest_pubkey, dest, path.path_num, &sendback) == -1) {
@@ -608,7 +833,13 @@ static int client_send_announce_request(Onion_Client *onion_c, uint32_t num, con
         return -1;
     }
 
-    return send_onion_packet_tcp_udp(onion_c, &path, dest, request, len);
+    if (send_onion_packet_tcp_udp(onion_c, &path, dest, request, len) != 0) {
+        return -1;
+    }
+
+    ++onion_paths->path_sent[path.path_num % NUMBER_ONION_PATHS];
+    ++onion_c->announce_requests_sent;
+    return 0;
 }
 
 typedef struct Onion_Client_Cmp_Data {
@@ -759,6 +990,11 @@ static int client_add_to_list(Onion_Client *onion_c, uint32_t num, const uint8_t
     }
 
     list_nodes[index].path_used = path_used;
+
+    if (num != 0) {
+        wake_friend(onion_c, num - 1);
+    }
+
     return 0;
 }
 
@@ -859,7 +1095,8 @@ static int handle_announce_response(void *object, const IP_Port *source, const u
     uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
     IP_Port ip_port;
     uint32_t path_num;
-    uint32_t num = check_sendback(onion_c, packet + 1, public_key, &ip_port, &path_num);
+    uint64_t sent_time;
+    uint32_t num = check_sendback(onion_c, packet + 1, public_key, &ip_port, &path_num, &sent_time);
 
     if (num > onion_c->num_friends) {
         return 1;
@@ -888,7 +1125,7 @@ static int handle_announce_response(void *object, const IP_Port *source, const u
         return 1;
     }
 
-    uint32_t path_used = set_path_timeouts(onion_c, num, path_num);
+    uint32_t path_used = set_path_timeouts(onion_c, num, path_num, sent_time);
 
     if (client_add_to_list(onion_c, num, public_key, &ip_port, plain[0], plain + 1, path_used) == -1) {
         return 1;
@@ -1043,6 +1280,32 @@ static int handle_tcp_onion(void *object, const uint8_t *data, uint16_t length,
     return 1;
 }
 
+/** Generate the keypairs used up from the ephemeral key pool. */
+non_null()
+static void refill_ephemeral_keys(Onion_Client *onion_c)
+{
+    while (onion_c->num_ephemeral_keys < ONION_EPHEMERAL_KEYS) {
+        crypto_new_keypair(onion_c->ephemeral_public_keys[onion_c->num_ephemeral_keys],
+                           onion_c->ephemeral_secret_keys[onion_c->num_ephemeral_keys]);
+        ++onion_c->num_ephemeral_keys;
+    }
+}
+
+/** Take a keypair out of the ephemeral key pool, or generate one if it is empty. */
+non_null()
+static void take_ephemeral_keypair(Onion_Client *onion_c, uint8_t *public_key, uint8_t *secret_key)
+{
+    if (onion_c->num_ephemeral_keys == 0) {
+        crypto_new_keypair(public_key, secret_key);
+        return;
+    }
+
+    --onion_c->num_ephemeral_keys;
+    memcpy(public_key, onion_c->ephemeral_public_keys[onion_c->num_ephemeral_keys], CRYPTO_PUBLIC_KEY_SIZE);
+    memcpy(secret_key, onion_c->ephemeral_secret_keys[onion_c->num_ephemeral_keys], CRYPTO_SECRET_KEY_SIZE);
+    crypto_memzero(onion_c->ephemeral_secret_keys[onion_c->num_ephemeral_keys], CRYPTO_SECRET_KEY_SIZE);
+}
+
 /** Send data of length length to friendnum.
  * Maximum length of data is ONION_CLIENT_MAX_DATA_SIZE.
  * This data will be received by the friend using the Onion_Data_Handlers callbacks.
@@ -1103,6 +1366,12 @@ int send_onion_data(Onion_Client *onion_c, int friend_num, const uint8_t *data,
 
     unsigned int good = 0;
 
+    /* The packets going out over UDP are sent together at the end. */
+    uint8_t udp_packets[MAX_ONION_CLIENTS][ONION_MAX_PACKET_SIZE];
+    Packet udp_batch[MAX_ONION_CLIENTS];
+    IP_Port udp_ip_ports[MAX_ONION_CLIENTS];
+    uint32_t num_udp = 0;
+
     for (unsigned int i = 0; i < num_good; ++i) {
         Onion_Path path;
 
@@ -1110,19 +1379,44 @@ int send_onion_data(Onion_Client *onion_c, int friend_num, const uint8_t *data,
             continue;
         }
 
+        uint8_t ephemeral_public_key[CRYPTO_PUBLIC_KEY_SIZE];
+        uint8_t ephemeral_secret_key[CRYPTO_SECRET_KEY_SIZE];
+        take_ephemeral_keypair(onion_c, ephemeral_public_key, ephemeral_secret_key);
+
         uint8_t o_packet[ONION_MAX_PACKET_SIZE];
         len = create_data_request(o_packet, sizeof(o_packet), onion_c->friends_list[friend_num].real_public_key,
-                                  list_nodes[good_nodes[i]].data_public_key, nonce, packet, SIZEOF_VLA(packet));
+                                  list_nodes[good_nodes[i]].data_public_key, ephemeral_public_key,
+                                  ephemeral_secret_key, nonce, packet, SIZEOF_VLA(packet));
+        crypto_memzero(ephemeral_secret_key, sizeof(ephemeral_secret_key));
 
         if (len == -1) {
             continue;
         }
 
+        if (net_family_is_ipv4(path.ip_port1.ip.family) || net_family_is_ipv6(path.ip_port1.ip.family)) {
+            const int udp_len = create_onion_packet(udp_packets[num_udp], ONION_MAX_PACKET_SIZE, &path,
+                                                    &list_nodes[good_nodes[i]].ip_port, o_packet, len);
+
+            if (udp_len == -1) {
+                continue;
+            }
+
+            udp_batch[num_udp].data = udp_packets[num_udp];
+            udp_batch[num_udp].length = udp_len;
+            udp_ip_ports[num_udp] = path.ip_port1;
+            ++num_udp;
+            continue;
+        }
+
         if (send_onion_packet_tcp_udp(onion_c, &path, &list_nodes[good_nodes[i]].ip_port, o_packet, len) == 0) {
             ++good;
         }
     }
 
+    if (num_udp != 0) {
+        good += send_packets(onion_c->net, onion_c->logger, udp_ip_ports, udp_batch, num_udp);
+    }
+
     return good;
 }
 
@@ -1293,6 +1587,10 @@ static int realloc_onion_friends(Onion_Client *onion_c, uint32_t num)
         return 0;
     }
 
+    if (!run_queue_reserve(&onion_c->run_queue, num)) {
+        return -1;
+    }
+
     Onion_Friend *newonion_friends = (Onion_Friend *)realloc(onion_c->friends_list, num * sizeof(Onion_Friend));
 
     if (newonion_friends == nullptr) {
@@ -1338,6 +1636,8 @@ int onion_addfriend(Onion_Client *onion_c, const uint8_t *public_key)
     onion_c->friends_list[index].status = 1;
     memcpy(onion_c->friends_list[index].real_public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
     crypto_new_keypair(onion_c->friends_list[index].temp_public_key, onion_c->friends_list[index].temp_secret_key);
+    set_last_active(onion_c, index, 0);
+    wake_friend(onion_c, index);
     return index;
 }
 
@@ -1360,6 +1660,7 @@ int onion_delfriend(Onion_Client *onion_c, int friend_num)
 
 #endif
 
+    run_queue_unschedule(&onion_c->run_queue, friend_num);
     crypto_memzero(&onion_c->friends_list[friend_num], sizeof(Onion_Friend));
     unsigned int i;
 
@@ -1441,8 +1742,10 @@ int onion_set_friend_DHT_pubkey(Onion_Client *onion_c, int friend_num, const uin
     }
 
     onion_c->friends_list[friend_num].last_seen = mono_time_get(onion_c->mono_time);
+    set_last_active(onion_c, friend_num, mono_time_get(onion_c->mono_time));
     onion_c->friends_list[friend_num].know_dht_public_key = 1;
     memcpy(onion_c->friends_list[friend_num].dht_public_key, dht_key, CRYPTO_PUBLIC_KEY_SIZE);
+    wake_friend(onion_c, friend_num);
 
     return 0;
 }
@@ -1508,14 +1811,30 @@ int onion_set_friend_online(Onion_Client *onion_c, int friend_num, uint8_t is_on
         onion_c->friends_list[friend_num].last_seen = mono_time_get(onion_c->mono_time);
     }
 
+    if (is_online != 0 || onion_c->friends_list[friend_num].is_online == 1) {
+        set_last_active(onion_c, friend_num, mono_time_get(onion_c->mono_time));
+    }
+
     onion_c->friends_list[friend_num].is_online = is_online;
 
     /* This should prevent some clock related issues */
     if (!is_online) {
         onion_c->friends_list[friend_num].last_noreplay = 0;
         onion_c->friends_list[friend_num].run_count = 0;
+        wake_friend(onion_c, friend_num);
+    }
+
+    return 0;
+}
+
+int onion_set_friend_last_online(Onion_Client *onion_c, int friend_num, uint64_t seconds_ago)
+{
+    if ((uint32_t)friend_num >= onion_c->num_friends) {
+        return -1;
     }
 
+    const uint64_t now = mono_time_get(onion_c->mono_time);
+    set_last_active(onion_c, friend_num, now > seconds_ago ? now - seconds_ago : 0);
     return 0;
 }
 
@@ -1543,6 +1862,29 @@ static void populate_path_nodes_tcp(Onion_Client *onion_c)
     }
 }
 
+/** The network counts as one step more stable for every ONION_STABILITY_STEP
+ * seconds in which none of the nodes we are announced to lost a request, up to
+ * ONION_MAX_STABILITY steps. Each step lengthens the announce and friend search
+ * intervals by half. A lost request halves the steps, a new address of ours or
+ * losing the onion connection resets them.
+ */
+#define ONION_STABILITY_STEP (ONION_NODE_PING_INTERVAL * 20)
+#define ONION_MAX_STABILITY 4
+
+/** Scale interval up with the stability of the network, to at most max_interval. */
+non_null()
+static uint64_t adaptive_interval(const Onion_Client *onion_c, uint64_t interval, uint64_t max_interval)
+{
+    return min_u64(interval + interval * onion_c->stability / 2, max_interval);
+}
+
+non_null()
+static void set_stability(Onion_Client *onion_c, uint8_t stability)
+{
+    onion_c->stability = stability;
+    onion_c->last_stability_change = mono_time_get(onion_c->mono_time);
+}
+
 #define ANNOUNCE_FRIEND (ONION_NODE_PING_INTERVAL * 6)
 #define ANNOUNCE_FRIEND_BEGINNING 3
 
@@ -1551,29 +1893,74 @@ static void populate_path_nodes_tcp(Onion_Client *onion_c)
 #define ONION_FRIEND_BACKOFF_FACTOR 4
 #define ONION_FRIEND_MAX_PING_INTERVAL (5*60*MAX_ONION_CLIENTS)
 
+/** Retry sending our DHT public key to an offline friend this often while it
+ * fails, unless something that lets it succeed wakes the friend earlier.
+ */
+#define DHTPK_RETRY_INTERVAL ANNOUNCE_FRIEND
+
+/** Friends to send our DHT public key to through the onion per second, so
+ * that coming online with many friends does not send them all at once.
+ */
+#define DHTPK_RATE_DEFAULT 32
+
+/** Send an announce request searching for a friend, unless that would go over
+ * the search rate limit for this second.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+non_null()
+static int send_friend_announce_request(Onion_Client *onion_c, uint16_t friendnum, const IP_Port *dest,
+                                        const uint8_t *dest_pubkey)
+{
+    if (onion_c->search_rate != 0 && onion_c->search_budget == 0) {
+        return -1;
+    }
+
+    if (client_send_announce_request(onion_c, friendnum + 1, dest, dest_pubkey, nullptr, -1) != 0) {
+        return -1;
+    }
+
+    if (onion_c->search_rate != 0) {
+        --onion_c->search_budget;
+    }
+
+    return 0;
+}
+
+/** Send the announce requests and DHT public key packets that are due for a
+ * friend.
+ *
+ * return the time at which something is due next.
+ * return 0 if nothing is until the friend is woken.
+ */
 non_null()
-static void do_friend(Onion_Client *onion_c, uint16_t friendnum)
+static uint64_t do_friend(Onion_Client *onion_c, uint16_t friendnum)
 {
     if (friendnum >= onion_c->num_friends) {
-        return;
+        return 0;
     }
 
-    if (onion_c->friends_list[friendnum].status == 0) {
-        return;
+    Onion_Friend *onion_friend = &onion_c->friends_list[friendnum];
+
+    if (onion_friend->status == 0 || onion_friend->is_online) {
+        return 0;
     }
 
-    unsigned int interval = ANNOUNCE_FRIEND;
+    const uint64_t now = mono_time_get(onion_c->mono_time);
+    uint64_t next_run = UINT64_MAX;
+    unsigned int interval = adaptive_interval(onion_c, ANNOUNCE_FRIEND, ONION_FRIEND_MAX_PING_INTERVAL);
 
-    if (onion_c->friends_list[friendnum].run_count < RUN_COUNT_FRIEND_ANNOUNCE_BEGINNING) {
+    if (onion_friend->run_count < RUN_COUNT_FRIEND_ANNOUNCE_BEGINNING) {
         interval = ANNOUNCE_FRIEND_BEGINNING;
+        // run_count counts the runs, so keep running every second until it is done.
+        next_run = now + 1;
     } else {
-        if (onion_c->friends_list[friendnum].last_seen == 0) {
-            onion_c->friends_list[friendnum].last_seen = mono_time_get(onion_c->mono_time);
+        if (onion_friend->last_seen == 0) {
+            onion_friend->last_seen = now;
         }
 
-        uint64_t backoff_interval = (mono_time_get(onion_c->mono_time) -
-                                     onion_c->friends_list[friendnum].last_seen)
-                                    / ONION_FRIEND_BACKOFF_FACTOR;
+        uint64_t backoff_interval = (now - onion_friend->last_seen) / ONION_FRIEND_BACKOFF_FACTOR;
 
         if (backoff_interval > ONION_FRIEND_MAX_PING_INTERVAL) {
             backoff_interval = ONION_FRIEND_MAX_PING_INTERVAL;
@@ -1584,88 +1971,135 @@ static void do_friend(Onion_Client *onion_c, uint16_t friendnum)
         }
     }
 
-    if (!onion_c->friends_list[friendnum].is_online) {
-        unsigned int count = 0;
-        Onion_Node *list_nodes = onion_c->friends_list[friendnum].clients_list;
+    unsigned int count = 0;
+    Onion_Node *list_nodes = onion_friend->clients_list;
 
-        // ensure we get a response from some node roughly once per
-        // (interval / MAX_ONION_CLIENTS)
-        bool ping_random = true;
+    // ensure we get a response from some node roughly once per
+    // (interval / MAX_ONION_CLIENTS)
+    bool ping_random = true;
 
-        for (unsigned i = 0; i < MAX_ONION_CLIENTS; ++i) {
-            if (!(mono_time_is_timeout(onion_c->mono_time, list_nodes[i].timestamp, interval / MAX_ONION_CLIENTS)
-                    && mono_time_is_timeout(onion_c->mono_time, list_nodes[i].last_pinged, ONION_NODE_PING_INTERVAL))) {
-                ping_random = false;
-                break;
-            }
+    for (unsigned i = 0; i < MAX_ONION_CLIENTS; ++i) {
+        if (!(mono_time_is_timeout(onion_c->mono_time, list_nodes[i].timestamp, interval / MAX_ONION_CLIENTS)
+                && mono_time_is_timeout(onion_c->mono_time, list_nodes[i].last_pinged, ONION_NODE_PING_INTERVAL))) {
+            ping_random = false;
+            break;
         }
+    }
 
-        for (unsigned i = 0; i < MAX_ONION_CLIENTS; ++i) {
-            if (onion_node_timed_out(&list_nodes[i], onion_c->mono_time)) {
-                continue;
-            }
+    uint64_t random_ping_time = 0;
 
-            ++count;
+    for (unsigned i = 0; i < MAX_ONION_CLIENTS; ++i) {
+        if (onion_node_timed_out(&list_nodes[i], onion_c->mono_time)) {
+            continue;
+        }
 
+        ++count;
 
-            if (list_nodes[i].last_pinged == 0) {
-                list_nodes[i].last_pinged = mono_time_get(onion_c->mono_time);
-                continue;
-            }
 
-            if (list_nodes[i].unsuccessful_pings >= ONION_NODE_MAX_PINGS) {
-                continue;
+        if (list_nodes[i].last_pinged == 0) {
+            list_nodes[i].last_pinged = now;
+        } else if (list_nodes[i].unsuccessful_pings < ONION_NODE_MAX_PINGS
+                   && (mono_time_is_timeout(onion_c->mono_time, list_nodes[i].last_pinged, interval)
+                       || (ping_random && random_range_u32(MAX_ONION_CLIENTS - i) == 0))) {
+            if (send_friend_announce_request(onion_c, friendnum, &list_nodes[i].ip_port,
+                                             list_nodes[i].public_key) == 0) {
+                list_nodes[i].last_pinged = now;
+                ++list_nodes[i].unsuccessful_pings;
+                ping_random = false;
             }
+        }
 
-            if (mono_time_is_timeout(onion_c->mono_time, list_nodes[i].last_pinged, interval)
-                    || (ping_random && random_range_u32(MAX_ONION_CLIENTS - i) == 0)) {
-                if (client_send_announce_request(onion_c, friendnum + 1, &list_nodes[i].ip_port,
-                                                 list_nodes[i].public_key, nullptr, -1) == 0) {
-                    list_nodes[i].last_pinged = mono_time_get(onion_c->mono_time);
-                    ++list_nodes[i].unsuccessful_pings;
-                    ping_random = false;
-                }
-            }
+        if (list_nodes[i].unsuccessful_pings >= ONION_NODE_MAX_PINGS) {
+            run_queue_at_timeout(&next_run, list_nodes[i].last_pinged, ONION_NODE_TIMEOUT);
+        } else {
+            run_queue_at_timeout(&next_run, list_nodes[i].last_pinged, interval);
         }
 
-        if (count != MAX_ONION_CLIENTS) {
-            const uint16_t num_nodes = min_u16(onion_c->path_nodes_index, MAX_PATH_NODES);
-            uint16_t n = num_nodes;
+        random_ping_time = max_u64(random_ping_time,
+                                   max_u64(list_nodes[i].timestamp + interval / MAX_ONION_CLIENTS,
+                                           list_nodes[i].last_pinged + ONION_NODE_PING_INTERVAL));
+    }
 
-            if (num_nodes > (MAX_ONION_CLIENTS / 2)) {
-                n = (MAX_ONION_CLIENTS / 2);
-            }
+    if (count != MAX_ONION_CLIENTS) {
+        const uint16_t num_nodes = min_u16(onion_c->path_nodes_index, MAX_PATH_NODES);
+        uint16_t n = num_nodes;
 
-            if (count <= random_range_u32(MAX_ONION_CLIENTS)) {
-                if (num_nodes != 0) {
-                    for (unsigned int j = 0; j < n; ++j) {
-                        const uint32_t num = random_range_u32(num_nodes);
-                        client_send_announce_request(onion_c, friendnum + 1, &onion_c->path_nodes[num].ip_port,
-                                                     onion_c->path_nodes[num].public_key, nullptr, -1);
-                    }
+        if (num_nodes > (MAX_ONION_CLIENTS / 2)) {
+            n = (MAX_ONION_CLIENTS / 2);
+        }
 
-                    ++onion_c->friends_list[friendnum].run_count;
+        if (count <= random_range_u32(MAX_ONION_CLIENTS)) {
+            if (num_nodes != 0) {
+                for (unsigned int j = 0; j < n; ++j) {
+                    const uint32_t num = random_range_u32(num_nodes);
+                    send_friend_announce_request(onion_c, friendnum, &onion_c->path_nodes[num].ip_port,
+                                                 onion_c->path_nodes[num].public_key);
                 }
+
+                ++onion_friend->run_count;
             }
-        } else {
-            ++onion_c->friends_list[friendnum].run_count;
         }
 
-        /* send packets to friend telling them our DHT public key. */
-        if (mono_time_is_timeout(onion_c->mono_time, onion_c->friends_list[friendnum].last_dht_pk_onion_sent,
-                                 ONION_DHTPK_SEND_INTERVAL)) {
-            if (send_dhtpk_announce(onion_c, friendnum, 0) >= 1) {
-                onion_c->friends_list[friendnum].last_dht_pk_onion_sent = mono_time_get(onion_c->mono_time);
+        // Search for more nodes every second until the list is full.
+        next_run = now + 1;
+    } else {
+        ++onion_friend->run_count;
+        next_run = min_u64(next_run, random_ping_time);
+    }
+
+    /* send packets to friend telling them our DHT public key. */
+    if (mono_time_is_timeout(onion_c->mono_time, onion_friend->last_dht_pk_onion_sent, ONION_DHTPK_SEND_INTERVAL)) {
+        if (onion_c->dhtpk_rate != 0 && onion_c->dhtpk_budget == 0) {
+            // Over the limit for this second, friends that were active more recently went first.
+            run_queue_at_timeout(&next_run, now, 1);
+        } else if (send_dhtpk_announce(onion_c, friendnum, 0) >= 1) {
+            onion_friend->last_dht_pk_onion_sent = now;
+
+            if (onion_c->dhtpk_rate != 0) {
+                --onion_c->dhtpk_budget;
             }
+        } else {
+            // Finding a node the friend announced itself to wakes the friend sooner.
+            run_queue_at_timeout(&next_run, now, DHTPK_RETRY_INTERVAL);
         }
+    }
 
-        if (mono_time_is_timeout(onion_c->mono_time, onion_c->friends_list[friendnum].last_dht_pk_dht_sent,
-                                 DHT_DHTPK_SEND_INTERVAL)) {
-            if (send_dhtpk_announce(onion_c, friendnum, 1) >= 1) {
-                onion_c->friends_list[friendnum].last_dht_pk_dht_sent = mono_time_get(onion_c->mono_time);
-            }
+    if (mono_time_is_timeout(onion_c->mono_time, onion_friend->last_dht_pk_dht_sent, DHT_DHTPK_SEND_INTERVAL)) {
+        if (send_dhtpk_announce(onion_c, friendnum, 1) >= 1) {
+            onion_friend->last_dht_pk_dht_sent = now;
+        } else if (onion_friend->know_dht_public_key) {
+            // A new DHT public key of the friend wakes the friend sooner.
+            run_queue_at_timeout(&next_run, now, DHTPK_RETRY_INTERVAL);
         }
     }
+
+    if (!mono_time_is_timeout(onion_c->mono_time, onion_friend->last_dht_pk_onion_sent, ONION_DHTPK_SEND_INTERVAL)) {
+        run_queue_at_timeout(&next_run, onion_friend->last_dht_pk_onion_sent, ONION_DHTPK_SEND_INTERVAL);
+    }
+
+    if (!mono_time_is_timeout(onion_c->mono_time, onion_friend->last_dht_pk_dht_sent, DHT_DHTPK_SEND_INTERVAL)) {
+        run_queue_at_timeout(&next_run, onion_friend->last_dht_pk_dht_sent, DHT_DHTPK_SEND_INTERVAL);
+    }
+
+    return max_u64(next_run, now + 1);
+}
+
+/** Set how many announce requests per second may be sent to search for and
+ * keep track of offline friends. Friends that are due when the limit is hit
+ * go first in the next second.
+ *
+ * A rate of 0 removes the limit, which is the default.
+ */
+void onion_set_friend_search_rate(Onion_Client *onion_c, uint32_t packets_per_second)
+{
+    onion_c->search_rate = packets_per_second;
+    onion_c->search_budget = packets_per_second;
+}
+
+void onion_set_dhtpk_rate(Onion_Client *onion_c, uint32_t friends_per_second)
+{
+    onion_c->dhtpk_rate = friends_per_second;
+    onion_c->dhtpk_budget = friends_per_second;
 }
 
 
@@ -1681,6 +2115,8 @@ void oniondata_registerhandler(Onion_Client *onion_c, uint8_t byte, oniondata_ha
 
 #define TIME_TO_STABLE (ONION_NODE_PING_INTERVAL * 6)
 #define ANNOUNCE_INTERVAL_STABLE (ONION_NODE_PING_INTERVAL * 8)
+/** Nodes forget announcements ONION_ANNOUNCE_TIMEOUT after they were last refreshed. */
+#define ANNOUNCE_INTERVAL_MAX_STABLE (ONION_ANNOUNCE_TIMEOUT * 3 / 4)
 
 non_null()
 static void do_announce(Onion_Client *onion_c)
@@ -1723,13 +2159,20 @@ static void do_announce(Onion_Client *onion_c)
                     && mono_time_is_timeout(onion_c->mono_time, onion_c->onion_paths_self.path_creation_time[pathnum], TIME_TO_STABLE)
                     && !(onion_c->onion_paths_self.last_path_used_times[pathnum] > 0
                          && mono_time_is_timeout(onion_c->mono_time, onion_c->onion_paths_self.last_path_used[pathnum], ONION_PATH_TIMEOUT))) {
-                interval = ANNOUNCE_INTERVAL_STABLE;
+                interval = adaptive_interval(onion_c, ANNOUNCE_INTERVAL_STABLE, ANNOUNCE_INTERVAL_MAX_STABLE);
             }
         }
 
         if (mono_time_is_timeout(onion_c->mono_time, list_nodes[i].last_pinged, interval)
-                || (mono_time_is_timeout(onion_c->mono_time, onion_c->last_announce, ONION_NODE_PING_INTERVAL)
+                || (mono_time_is_timeout(onion_c->mono_time, onion_c->last_announce,
+                                         adaptive_interval(onion_c, ONION_NODE_PING_INTERVAL, ANNOUNCE_INTERVAL_STABLE))
                     && random_range_u32(MAX_ONION_CLIENTS_ANNOUNCE - i) == 0)) {
+            if (list_nodes[i].is_stored && list_nodes[i].unsuccessful_pings > 0
+                    && mono_time_is_timeout(onion_c->mono_time, list_nodes[i].last_pinged, ANNOUNCE_TIMEOUT)) {
+                // The last request to a node we are announced to went unanswered.
+                set_stability(onion_c, onion_c->stability / 2);
+            }
+
             uint32_t path_to_use = list_nodes[i].path_used;
 
             if (list_nodes[i].unsuccessful_pings == ONION_NODE_MAX_PINGS - 1
@@ -1814,6 +2257,126 @@ static int onion_isconnected(const Onion_Client *onion_c)
     return 0;
 }
 
+/** Re-announce ourselves and search for friends like after startup, because
+ * the return paths that lead to us changed.
+ */
+non_null()
+static void onion_network_changed(Onion_Client *onion_c)
+{
+    set_stability(onion_c, 0);
+
+    for (unsigned int i = 0; i < MAX_ONION_CLIENTS_ANNOUNCE; ++i) {
+        Onion_Node *node = &onion_c->clients_announce_list[i];
+
+        if (node->last_pinged != 0) {
+            node->last_pinged = 1;
+        }
+    }
+
+    for (uint16_t i = 0; i < onion_c->num_friends; ++i) {
+        onion_c->friends_list[i].run_count = 0;
+        wake_friend(onion_c, i);
+    }
+}
+
+/** A new address of ours only counts once DHT nodes have reported it for this
+ * many seconds in a row, so that close nodes disagreeing about it for a moment
+ * don't make us announce again.
+ */
+#define SELF_ADDRESS_HOLD_TIME 10
+
+/** Copy our IPv4 and IPv6 addresses reported by the closest DHT nodes, leaving
+ * out LAN addresses. Families nobody reported are reset.
+ */
+non_null()
+static void self_addresses_seen(const DHT *dht, IP *ip4, IP *ip6)
+{
+    ip_reset(ip4);
+    ip_reset(ip6);
+
+    for (uint32_t i = 0; i < LCLIENT_LIST && !(ip_isset(ip4) && ip_isset(ip6)); ++i) {
+        const Client_data *client = dht_get_close_client(dht, i);
+        const IPPTsPng *const assocs[] = {&client->assoc4, &client->assoc6};
+        IP *const ips[] = {ip4, ip6};
+
+        for (int family = 0; family < 2; ++family) {
+            const IPPTsPng *const assoc = assocs[family];
+
+            if (!ip_isset(ips[family]) && assoc->ret_ip_self && ipport_isset(&assoc->ret_ip_port)
+                    && !ip_is_lan(&assoc->ret_ip_port.ip)) {
+                *ips[family] = assoc->ret_ip_port.ip;
+            }
+        }
+    }
+}
+
+/** Take in the address of ours that DHT nodes reported in one family.
+ *
+ * return true if it replaced a different address that we had before.
+ */
+non_null()
+static bool self_address_changed(Self_Address *self, const IP *seen, uint64_t now)
+{
+    if (!ip_isset(seen)) {
+        return false;
+    }
+
+    if (!ip_isset(&self->ip)) {
+        self->ip = *seen;
+        return false;
+    }
+
+    if (ip_equal(seen, &self->ip)) {
+        ip_reset(&self->candidate);
+        return false;
+    }
+
+    if (!ip_equal(seen, &self->candidate)) {
+        self->candidate = *seen;
+        self->candidate_since = now;
+        return false;
+    }
+
+    if (now < self->candidate_since + SELF_ADDRESS_HOLD_TIME) {
+        return false;
+    }
+
+    self->ip = *seen;
+    ip_reset(&self->candidate);
+    return true;
+}
+
+non_null()
+static void update_stability(Onion_Client *onion_c)
+{
+    const uint64_t now = mono_time_get(onion_c->mono_time);
+    IP seen[2];
+    self_addresses_seen(onion_c->dht, &seen[0], &seen[1]);
+
+    const bool changed4 = self_address_changed(&onion_c->self_addresses[0], &seen[0], now);
+    const bool changed6 = self_address_changed(&onion_c->self_addresses[1], &seen[1], now);
+
+    if (changed4 || changed6) {
+        LOGGER_DEBUG(onion_c->logger, "our address changed, announcing again");
+        onion_network_changed(onion_c);
+    }
+
+    if (!onion_isconnected(onion_c)) {
+        set_stability(onion_c, 0);
+        return;
+    }
+
+    if (onion_c->stability < ONION_MAX_STABILITY
+            && mono_time_is_timeout(onion_c->mono_time, onion_c->last_stability_change, ONION_STABILITY_STEP)) {
+        set_stability(onion_c, onion_c->stability + 1);
+    }
+}
+
+uint64_t onion_announce_requests_sent(const Onion_Client *onion_c)
+{
+    return onion_c->announce_requests_sent;
+}
+
 #define ONION_CONNECTION_SECONDS 3
 
 /**  return 0 if we are not connected to the network.
@@ -1858,13 +2421,40 @@ void do_onion_client(Onion_Client *onion_c)
 
     onion_c->udp_connected = dht_non_lan_connected(onion_c->dht);
 
+    update_stability(onion_c);
+
+    build_spare_paths(onion_c, &onion_c->onion_paths_self);
+
+    if (onion_c->num_friends != 0) {
+        build_spare_paths(onion_c, &onion_c->onion_paths_friends);
+        refill_ephemeral_keys(onion_c);
+    }
+
     if (mono_time_is_timeout(onion_c->mono_time, onion_c->first_run, ONION_CONNECTION_SECONDS * 2)) {
         set_tcp_onion_status(nc_get_tcp_c(onion_c->c), !onion_c->udp_connected);
     }
 
+    onion_c->search_budget = onion_c->search_rate;
+    onion_c->dhtpk_budget = onion_c->dhtpk_rate;
+
     if (onion_connection_status(onion_c)) {
-        for (unsigned i = 0; i < onion_c->num_friends; ++i) {
-            do_friend(onion_c, i);
+        const uint64_t now = mono_time_get(onion_c->mono_time);
+
+        uint32_t friendnum;
+        uint64_t next_run;
+
+        while (run_queue_peek(&onion_c->run_queue, &friendnum, &next_run) && next_run <= now) {
+            if (onion_c->search_rate != 0 && onion_c->search_budget == 0) {
+                break;
+            }
+
+            next_run = do_friend(onion_c, friendnum);
+
+            if (next_run == 0) {
+                run_queue_unschedule(&onion_c->run_queue, friendnum);
+            } else {
+                run_queue_schedule(&onion_c->run_queue, friendnum, next_run);
+            }
         }
     }
 
@@ -1887,6 +2477,7 @@ Onion_Client *new_onion_client(const Logger *logger, Mono_Time *mono_time, Net_C
         return nullptr;
     }
 
+    run_queue_init(&onion_c->run_queue);
     onion_c->announce_ping_array = ping_array_new(ANNOUNCE_ARRAY_SIZE, ANNOUNCE_TIMEOUT);
 
     if (onion_c->announce_ping_array == nullptr) {
@@ -1895,6 +2486,8 @@ Onion_Client *new_onion_client(const Logger *logger, Mono_Time *mono_time, Net_C
     }
 
     onion_c->mono_time = mono_time;
+    onion_c->dhtpk_rate = DHTPK_RATE_DEFAULT;
+    onion_c->dhtpk_budget = DHTPK_RATE_DEFAULT;
     onion_c->logger = logger;
     onion_c->dht = nc_get_dht(c);
     onion_c->net = dht_get_net(onion_c->dht);
@@ -1918,6 +2511,7 @@ void kill_onion_client(Onion_Client *onion_c)
 
     ping_array_kill(onion_c->announce_ping_array);
     realloc_onion_friends(onion_c, 0);
+    run_queue_free(&onion_c->run_queue);
     networking_registerhandler(onion_c->net, NET_PACKET_ANNOUNCE_RESPONSE, nullptr, nullptr);
     networking_registerhandler(onion_c->net, NET_PACKET_ONION_DATA_RESPONSE, nullptr, nullptr);
     oniondata_registerhandler(onion_c, ONION_DATA_DHTPK, nullptr, nullptr);
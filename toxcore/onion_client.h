@@ -25,6 +25,11 @@
 
 #define NUMBER_ONION_PATHS 6
 
+/** Number of paths built ahead of time to replace the ones that time out. */
+#define NUMBER_ONION_SPARE_PATHS 2
+/** Spare paths older than this are rebuilt, as their nodes may be gone. */
+#define ONION_SPARE_PATH_MAX_AGE (ONION_PATH_TIMEOUT * 6)
+
 /** The timeout the first time the path is added and
  * then for all the next consecutive times */
 #define ONION_PATH_FIRST_TIMEOUT 4
@@ -108,6 +113,16 @@ int onion_delfriend(Onion_Client *onion_c, int friend_num);
 non_null()
 int onion_set_friend_online(Onion_Client *onion_c, int friend_num, uint8_t is_online);
 
+/** Set how many seconds ago the friend was last online, for example from a
+ * saved last seen time. Friends that were online more recently get our DHT
+ * public key first.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+non_null()
+int onion_set_friend_last_online(Onion_Client *onion_c, int friend_num, uint64_t seconds_ago);
+
 /** Get the ip of friend friendnum and put it in ip_port
  *
  *  return -1, -- if public_key does NOT refer to a friend
@@ -184,6 +199,30 @@ typedef int oniondata_handler_cb(void *object, const uint8_t *source_pubkey, con
 non_null(1) nullable(3, 4)
 void oniondata_registerhandler(Onion_Client *onion_c, uint8_t byte, oniondata_handler_cb *cb, void *object);
 
+/** Set how many announce requests per second may be sent to search for and
+ * keep track of offline friends. Friends that are due when the limit is hit
+ * go first in the next second.
+ *
+ * A rate of 0 removes the limit, which is the default.
+ */
+non_null()
+void onion_set_friend_search_rate(Onion_Client *onion_c, uint32_t packets_per_second);
+
+/** Set to how many offline friends per second our DHT public key may be sent
+ * through the onion. Friends that were online more recently go first. The
+ * default is 32.
+ *
+ * A rate of 0 removes the limit.
+ */
+non_null()
+void onion_set_dhtpk_rate(Onion_Client *onion_c, uint32_t friends_per_second);
+
+/** Number of announce requests sent to announce ourselves and to search for
+ * friends, to measure the background traffic of the onion.
+ */
+non_null()
+uint64_t onion_announce_requests_sent(const Onion_Client *onion_c);
+
 non_null()
 void do_onion_client(Onion_Client *onion_c);
 
@@ -16,7 +16,7 @@
 #include "util.h"
 
 typedef struct Ping_Array_Entry {
-    uint8_t *data;
+    uint8_t data[PING_ARRAY_MAX_DATA_SIZE];
     uint32_t length;
     uint64_t time;
     uint64_t ping_id;
@@ -65,9 +65,10 @@ Ping_Array *ping_array_new(uint32_t size, uint32_t timeout)
 non_null()
 static void clear_entry(Ping_Array *array, uint32_t index)
 {
-    const Ping_Array_Entry empty = {nullptr};
-    free(array->entries[index].data);
-    array->entries[index] = empty;
+    Ping_Array_Entry *const entry = &array->entries[index];
+    entry->length = 0;
+    entry->time = 0;
+    entry->ping_id = 0;
 }
 
 void ping_array_kill(Ping_Array *array)
@@ -106,20 +107,18 @@ static void ping_array_clear_timedout(Ping_Array *array, const Mono_Time *mono_t
 uint64_t ping_array_add(Ping_Array *array, const Mono_Time *mono_time, const uint8_t *data,
                         uint32_t length)
 {
+    if (length > PING_ARRAY_MAX_DATA_SIZE) {
+        return 0;
+    }
+
     ping_array_clear_timedout(array, mono_time);
     const uint32_t index = array->last_added % array->total_size;
 
-    if (array->entries[index].data != nullptr) {
+    if (array->entries[index].ping_id != 0) {
         array->last_deleted = array->last_added - array->total_size;
         clear_entry(array, index);
     }
 
-    array->entries[index].data = (uint8_t *)malloc(length);
-
-    if (array->entries[index].data == nullptr) {
-        return 0;
-    }
-
     memcpy(array->entries[index].data, data, length);
     array->entries[index].length = length;
     array->entries[index].time = mono_time_get(mono_time);
@@ -158,11 +157,6 @@ int32_t ping_array_check(Ping_Array *array, const Mono_Time *mono_time, uint8_t
         return -1;
     }
 
-    // TODO(iphydf): This can't happen? If it indeed can't, turn it into an assert.
-    if (array->entries[index].data == nullptr) {
-        return -1;
-    }
-
     memcpy(data, array->entries[index].data, array->entries[index].length);
     const uint32_t len = array->entries[index].length;
     clear_entry(array, index);
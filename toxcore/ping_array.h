@@ -18,6 +18,10 @@
 extern "C" {
 #endif
 
+/** Largest data a @ref Ping_Array entry holds. Entries store it inline, so
+ * adding one does not allocate. */
+#define PING_ARRAY_MAX_DATA_SIZE 96
+
 typedef struct Ping_Array Ping_Array;
 
 /**
@@ -39,7 +43,8 @@ void ping_array_kill(struct Ping_Array *array);
 /**
  * @brief Add a data with length to the @ref Ping_Array list and return a ping_id.
  *
- * @return ping_id on success, 0 on failure.
+ * @return ping_id on success, 0 on failure or if length is larger than
+ *   PING_ARRAY_MAX_DATA_SIZE.
  */
 non_null()
 uint64_t ping_array_add(struct Ping_Array *array, const struct Mono_Time *mono_time, const uint8_t *data,
@@ -84,6 +84,23 @@ TEST(PingArray, ZeroLengthDataCanBeAdded) {
   EXPECT_EQ(ping_array_check(arr.get(), mono_time.get(), &c, sizeof(c), ping_id), 1);
 }
 
+TEST(PingArray, DataUpToMaxSizeCanBeAdded) {
+  Ping_Array_Ptr const arr(ping_array_new(2, 1));
+  Mono_Time_Ptr const mono_time(mono_time_new());
+
+  std::vector<uint8_t> data(PING_ARRAY_MAX_DATA_SIZE + 1, 7);
+  EXPECT_EQ(ping_array_add(arr.get(), mono_time.get(), data.data(), data.size()), 0);
+
+  data.pop_back();
+  uint64_t const ping_id = ping_array_add(arr.get(), mono_time.get(), data.data(), data.size());
+  EXPECT_NE(ping_id, 0);
+
+  std::vector<uint8_t> out(PING_ARRAY_MAX_DATA_SIZE);
+  EXPECT_EQ(ping_array_check(arr.get(), mono_time.get(), out.data(), out.size(), ping_id),
+            PING_ARRAY_MAX_DATA_SIZE);
+  EXPECT_EQ(out, data);
+}
+
 TEST(PingArray, PingId0IsInvalid) {
   Ping_Array_Ptr const arr(ping_array_new(2, 1));
   Mono_Time_Ptr const mono_time(mono_time_new());
@@ -0,0 +1,235 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later
+ * Copyright © 2022 The TokTok team.
+ */
+
+/** @file
+ * @brief Queue of ids ordered by the time at which there is work to do for
+ *   them, kept as a binary min-heap with the position of every id so that any
+ *   id can be moved or removed in logarithmic time.
+ */
+#include "run_queue.h"
+
+#include <stdlib.h>
+
+#include "ccompat.h"
+
+#define NOT_SCHEDULED UINT32_MAX
+
+void run_queue_init(Run_Queue *queue)
+{
+    queue->size = 0;
+    queue->capacity = 0;
+    queue->heap = nullptr;
+    queue->times = nullptr;
+    queue->priorities = nullptr;
+    queue->positions = nullptr;
+    queue->due = nullptr;
+}
+
+void run_queue_free(Run_Queue *queue)
+{
+    free(queue->due);
+    free(queue->positions);
+    free(queue->priorities);
+    free(queue->times);
+    free(queue->heap);
+    run_queue_init(queue);
+}
+
+non_null()
+static bool grow_array(uint32_t **array, uint32_t capacity)
+{
+    uint32_t *const grown = (uint32_t *)realloc(*array, capacity * sizeof(uint32_t));
+
+    if (grown == nullptr) {
+        return false;
+    }
+
+    *array = grown;
+    return true;
+}
+
+non_null()
+static bool grow_array_u64(uint64_t **array, uint32_t capacity)
+{
+    uint64_t *const grown = (uint64_t *)realloc(*array, capacity * sizeof(uint64_t));
+
+    if (grown == nullptr) {
+        return false;
+    }
+
+    *array = grown;
+    return true;
+}
+
+bool run_queue_reserve(Run_Queue *queue, uint32_t capacity)
+{
+    if (capacity <= queue->capacity) {
+        return true;
+    }
+
+    if (!grow_array_u64(&queue->times, capacity) || !grow_array_u64(&queue->priorities, capacity)
+            || !grow_array(&queue->heap, capacity) || !grow_array(&queue->positions, capacity)
+            || !grow_array(&queue->due, capacity)) {
+        return false;
+    }
+
+    for (uint32_t id = queue->capacity; id < capacity; ++id) {
+        queue->priorities[id] = 0;
+        queue->positions[id] = NOT_SCHEDULED;
+    }
+
+    queue->capacity = capacity;
+    return true;
+}
+
+non_null()
+static void heap_set(Run_Queue *queue, uint32_t pos, uint32_t id)
+{
+    queue->heap[pos] = id;
+    queue->positions[id] = pos;
+}
+
+/** Return true if id a comes out before id b. */
+non_null()
+static bool runs_before(const Run_Queue *queue, uint32_t a, uint32_t b)
+{
+    if (queue->times[a] != queue->times[b]) {
+        return queue->times[a] < queue->times[b];
+    }
+
+    return queue->priorities[a] > queue->priorities[b];
+}
+
+non_null()
+static void sift_up(Run_Queue *queue, uint32_t pos)
+{
+    const uint32_t id = queue->heap[pos];
+
+    while (pos > 0) {
+        const uint32_t parent = (pos - 1) / 2;
+
+        if (!runs_before(queue, id, queue->heap[parent])) {
+            break;
+        }
+
+        heap_set(queue, pos, queue->heap[parent]);
+        pos = parent;
+    }
+
+    heap_set(queue, pos, id);
+}
+
+non_null()
+static void sift_down(Run_Queue *queue, uint32_t pos)
+{
+    const uint32_t id = queue->heap[pos];
+
+    while (true) {
+        const uint32_t left = 2 * pos + 1;
+
+        if (left >= queue->size) {
+            break;
+        }
+
+        uint32_t child = left;
+
+        if (left + 1 < queue->size && runs_before(queue, queue->heap[left + 1], queue->heap[left])) {
+            child = left + 1;
+        }
+
+        if (!runs_before(queue, queue->heap[child], id)) {
+            break;
+        }
+
+        heap_set(queue, pos, queue->heap[child]);
+        pos = child;
+    }
+
+    heap_set(queue, pos, id);
+}
+
+void run_queue_schedule(Run_Queue *queue, uint32_t id, uint64_t time)
+{
+    queue->times[id] = time;
+
+    if (queue->positions[id] == NOT_SCHEDULED) {
+        ++queue->size;
+        heap_set(queue, queue->size - 1, id);
+    }
+
+    sift_up(queue, queue->positions[id]);
+    sift_down(queue, queue->positions[id]);
+}
+
+void run_queue_wake(Run_Queue *queue, uint32_t id, uint64_t time)
+{
+    if (queue->positions[id] == NOT_SCHEDULED || queue->times[id] > time) {
+        run_queue_schedule(queue, id, time);
+    }
+}
+
+void run_queue_unschedule(Run_Queue *queue, uint32_t id)
+{
+    if (id >= queue->capacity) {
+        return;
+    }
+
+    const uint32_t pos = queue->positions[id];
+
+    if (pos == NOT_SCHEDULED) {
+        return;
+    }
+
+    queue->positions[id] = NOT_SCHEDULED;
+    --queue->size;
+
+    if (pos != queue->size) {
+        const uint32_t moved = queue->heap[queue->size];
+        heap_set(queue, pos, moved);
+        sift_up(queue, pos);
+        sift_down(queue, queue->positions[moved]);
+    }
+}
+
+void run_queue_set_priority(Run_Queue *queue, uint32_t id, uint64_t priority)
+{
+    queue->priorities[id] = priority;
+
+    if (queue->positions[id] != NOT_SCHEDULED) {
+        sift_up(queue, queue->positions[id]);
+        sift_down(queue, queue->positions[id]);
+    }
+}
+
+bool run_queue_peek(const Run_Queue *queue, uint32_t *id, uint64_t *time)
+{
+    if (queue->size == 0) {
+        return false;
+    }
+
+    *id = queue->heap[0];
+    *time = queue->times[*id];
+    return true;
+}
+
+uint32_t run_queue_take_due(Run_Queue *queue, uint64_t now)
+{
+    uint32_t num_due = 0;
+
+    while (queue->size != 0 && queue->times[queue->heap[0]] <= now) {
+        const uint32_t id = queue->heap[0];
+        run_queue_unschedule(queue, id);
+        queue->due[num_due] = id;
+        ++num_due;
+    }
+
+    return num_due;
+}
+
+void run_queue_at_timeout(uint64_t *next_run, uint64_t timestamp, uint64_t timeout)
+{
+    if (timestamp + timeout < *next_run) {
+        *next_run = timestamp + timeout;
+    }
+}
@@ -0,0 +1,97 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later
+ * Copyright © 2022 The TokTok team.
+ */
+
+/** @file
+ * @brief Queue of ids ordered by the time at which there is work to do for
+ *   them, for loops that should only look at the ids that are due.
+ *
+ * An id is scheduled at most once. Scheduling it again moves it to the new
+ * time. An id scheduled at the current time is due on the next call to
+ * run_queue_take_due(), which makes the queue double as a set of ids with
+ * pending work. Ids due at the same time come out highest priority first.
+ */
+#ifndef C_TOXCORE_TOXCORE_RUN_QUEUE_H
+#define C_TOXCORE_TOXCORE_RUN_QUEUE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "attributes.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct Run_Queue {
+    uint32_t size; // number of scheduled ids
+    uint32_t capacity; // ids must be below this
+    uint32_t *heap; // min-heap of the scheduled ids by time
+    uint64_t *times; // time of each id
+    uint64_t *priorities; // priority of each id among the ids due at the same time
+    uint32_t *positions; // position of each id in heap, UINT32_MAX if it is not scheduled
+    uint32_t *due; // ids returned by run_queue_take_due()
+} Run_Queue;
+
+/** @brief Initialize an empty queue. */
+non_null()
+void run_queue_init(Run_Queue *queue);
+
+/** @brief Free the memory used by the queue. */
+non_null()
+void run_queue_free(Run_Queue *queue);
+
+/** @brief Make room for ids below capacity.
+ *
+ * @retval false if memory allocation failed.
+ */
+non_null()
+bool run_queue_reserve(Run_Queue *queue, uint32_t capacity);
+
+/** @brief Schedule id at time, or move it there if it is already scheduled. */
+non_null()
+void run_queue_schedule(Run_Queue *queue, uint32_t id, uint64_t time);
+
+/** @brief Schedule id at time, unless it is already scheduled earlier. */
+non_null()
+void run_queue_wake(Run_Queue *queue, uint32_t id, uint64_t time);
+
+/** @brief Remove id from the queue if it is scheduled. */
+non_null()
+void run_queue_unschedule(Run_Queue *queue, uint32_t id);
+
+/** @brief Set the priority of id, 0 by default. Of the ids due at the same
+ * time, the ones with a higher priority come out first.
+ */
+non_null()
+void run_queue_set_priority(Run_Queue *queue, uint32_t id, uint64_t priority);
+
+/** @brief Get the id that is due first, and the time at which it is due,
+ * without removing it.
+ *
+ * @retval false if no id is scheduled.
+ */
+non_null()
+bool run_queue_peek(const Run_Queue *queue, uint32_t *id, uint64_t *time);
+
+/** @brief Remove the ids scheduled at or before now, earliest first, and put
+ * them in queue->due.
+ *
+ * Ids scheduled while going through them are not due until the next call.
+ *
+ * @return the number of ids in queue->due.
+ */
+non_null()
+uint32_t run_queue_take_due(Run_Queue *queue, uint64_t now);
+
+/** @brief Lower next_run to the time at which mono_time_is_timeout() becomes
+ * true for timestamp and timeout.
+ */
+non_null()
+void run_queue_at_timeout(uint64_t *next_run, uint64_t timestamp, uint64_t timeout);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif // C_TOXCORE_TOXCORE_RUN_QUEUE_H
@@ -0,0 +1,152 @@
+#include "run_queue.h"
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+namespace {
+
+class RunQueue : public ::testing::Test {
+ protected:
+  void SetUp() override { run_queue_init(&queue_); }
+  void TearDown() override { run_queue_free(&queue_); }
+
+  std::vector<uint32_t> take_due(uint64_t now) {
+    const uint32_t num_due = run_queue_take_due(&queue_, now);
+    return std::vector<uint32_t>(queue_.due, queue_.due + num_due);
+  }
+
+  Run_Queue queue_;
+};
+
+TEST_F(RunQueue, EmptyQueueHasNothingDue) {
+  EXPECT_TRUE(take_due(UINT64_MAX).empty());
+  ASSERT_TRUE(run_queue_reserve(&queue_, 10));
+  EXPECT_TRUE(take_due(UINT64_MAX).empty());
+}
+
+TEST_F(RunQueue, TakesDueIdsEarliestFirst) {
+  ASSERT_TRUE(run_queue_reserve(&queue_, 4));
+  run_queue_schedule(&queue_, 0, 30);
+  run_queue_schedule(&queue_, 1, 10);
+  run_queue_schedule(&queue_, 2, 20);
+  run_queue_schedule(&queue_, 3, 40);
+
+  EXPECT_TRUE(take_due(9).empty());
+  EXPECT_EQ(take_due(30), std::vector<uint32_t>({1, 2, 0}));
+  EXPECT_TRUE(take_due(39).empty());
+  EXPECT_EQ(take_due(40), std::vector<uint32_t>({3}));
+  EXPECT_TRUE(take_due(UINT64_MAX).empty());
+}
+
+TEST_F(RunQueue, SchedulingAgainMovesTheId) {
+  ASSERT_TRUE(run_queue_reserve(&queue_, 2));
+  run_queue_schedule(&queue_, 0, 10);
+  run_queue_schedule(&queue_, 1, 20);
+  run_queue_schedule(&queue_, 0, 30);
+  EXPECT_EQ(queue_.size, 2);
+
+  EXPECT_EQ(take_due(20), std::vector<uint32_t>({1}));
+  EXPECT_EQ(take_due(30), std::vector<uint32_t>({0}));
+}
+
+TEST_F(RunQueue, WakeOnlyMovesTheIdEarlier) {
+  ASSERT_TRUE(run_queue_reserve(&queue_, 2));
+  run_queue_schedule(&queue_, 0, 10);
+  run_queue_wake(&queue_, 0, 20);
+  run_queue_wake(&queue_, 1, 20);
+  run_queue_wake(&queue_, 1, 5);
+
+  EXPECT_EQ(take_due(10), std::vector<uint32_t>({1, 0}));
+}
+
+TEST_F(RunQueue, HigherPriorityComesFirstAtTheSameTime) {
+  ASSERT_TRUE(run_queue_reserve(&queue_, 3));
+  run_queue_schedule(&queue_, 0, 10);
+  run_queue_schedule(&queue_, 1, 10);
+  run_queue_schedule(&queue_, 2, 5);
+  run_queue_set_priority(&queue_, 1, 7);
+  run_queue_set_priority(&queue_, 2, 1);
+
+  EXPECT_EQ(take_due(10), std::vector<uint32_t>({2, 1, 0}));
+}
+
+TEST_F(RunQueue, PeekShowsTheFirstIdWithoutTakingIt) {
+  uint32_t id;
+  uint64_t time;
+  EXPECT_FALSE(run_queue_peek(&queue_, &id, &time));
+
+  ASSERT_TRUE(run_queue_reserve(&queue_, 2));
+  run_queue_schedule(&queue_, 0, 20);
+  run_queue_schedule(&queue_, 1, 10);
+  ASSERT_TRUE(run_queue_peek(&queue_, &id, &time));
+  EXPECT_EQ(id, 1);
+  EXPECT_EQ(time, 10);
+  EXPECT_EQ(queue_.size, 2);
+}
+
+TEST_F(RunQueue, IdsScheduledNowAreDueOnTheNextCall) {
+  ASSERT_TRUE(run_queue_reserve(&queue_, 1));
+  run_queue_schedule(&queue_, 0, 5);
+
+  for (int i = 0; i < 3; ++i) {
+    const std::vector<uint32_t> due = take_due(5);
+    ASSERT_EQ(due, std::vector<uint32_t>({0}));
+    run_queue_schedule(&queue_, due[0], 5);
+  }
+}
+
+TEST_F(RunQueue, UnscheduledIdsAreNotDue) {
+  ASSERT_TRUE(run_queue_reserve(&queue_, 3));
+  run_queue_schedule(&queue_, 0, 1);
+  run_queue_schedule(&queue_, 1, 2);
+  run_queue_schedule(&queue_, 2, 3);
+  run_queue_unschedule(&queue_, 0);
+  run_queue_unschedule(&queue_, 0);
+  run_queue_unschedule(&queue_, 100);
+
+  EXPECT_EQ(take_due(3), std::vector<uint32_t>({1, 2}));
+}
+
+TEST_F(RunQueue, GrowingKeepsScheduledIds) {
+  ASSERT_TRUE(run_queue_reserve(&queue_, 1));
+  run_queue_schedule(&queue_, 0, 2);
+  ASSERT_TRUE(run_queue_reserve(&queue_, 1000));
+  run_queue_schedule(&queue_, 999, 1);
+
+  EXPECT_EQ(take_due(2), std::vector<uint32_t>({999, 0}));
+}
+
+TEST_F(RunQueue, MatchesSortingAfterManyChanges) {
+  constexpr uint32_t kNumIds = 500;
+  ASSERT_TRUE(run_queue_reserve(&queue_, kNumIds));
+
+  std::mt19937 rng(42);
+  std::vector<uint64_t> times(kNumIds, UINT64_MAX);
+
+  for (int i = 0; i < 5000; ++i) {
+    const uint32_t id = rng() % kNumIds;
+
+    if (rng() % 4 == 0) {
+      run_queue_unschedule(&queue_, id);
+      times[id] = UINT64_MAX;
+    } else {
+      times[id] = rng() % 1000;
+      run_queue_schedule(&queue_, id, times[id]);
+    }
+  }
+
+  const std::vector<uint32_t> due = take_due(1000);
+
+  for (uint32_t id = 0; id < kNumIds; ++id) {
+    EXPECT_EQ(std::count(due.begin(), due.end(), id), times[id] == UINT64_MAX ? 0 : 1);
+  }
+
+  for (size_t i = 1; i < due.size(); ++i) {
+    EXPECT_LE(times[due[i - 1]], times[due[i]]);
+  }
+}
+
+}  // namespace
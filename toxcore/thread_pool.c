@@ -0,0 +1,217 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later
+ * Copyright © 2022 The TokTok team.
+ */
+
+/** @file
+ * @brief A fixed set of worker threads that run a function over a range of
+ *   items in parallel.
+ */
+#include "thread_pool.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "ccompat.h"
+
+struct Thread_Pool {
+    pthread_t *threads;
+    uint32_t num_threads;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t work_cond; /* Signalled when there is a new job or the pool is stopping. */
+    pthread_cond_t done_cond; /* Signalled when the last chunk of a job is done. */
+
+    /* The current job, split into num_chunks contiguous ranges of items, at
+     * most one for each thread. Chunks `[next_chunk, num_chunks)` are not
+     * claimed yet. */
+    thread_pool_cb *function;
+    void *object;
+    uint32_t num_items;
+    uint32_t num_chunks;
+    uint32_t next_chunk;
+    uint32_t chunks_done;
+
+    bool stopping;
+};
+
+/** Claim and run chunks of the current job until none are left.
+ *
+ * The mutex is only taken once to claim a chunk and once to report it done,
+ * not for every item.
+ *
+ * Must be called with the mutex held, returns with the mutex held.
+ */
+non_null()
+static void run_chunks(Thread_Pool *pool)
+{
+    while (pool->next_chunk < pool->num_chunks) {
+        const uint32_t chunk = pool->next_chunk;
+        ++pool->next_chunk;
+
+        thread_pool_cb *const function = pool->function;
+        void *const object = pool->object;
+        const uint64_t num_items = pool->num_items;
+        const uint32_t begin = num_items * chunk / pool->num_chunks;
+        const uint32_t end = num_items * (chunk + 1) / pool->num_chunks;
+        pthread_mutex_unlock(&pool->mutex);
+
+        for (uint32_t index = begin; index < end; ++index) {
+            function(object, index);
+        }
+
+        pthread_mutex_lock(&pool->mutex);
+        ++pool->chunks_done;
+
+        if (pool->chunks_done == pool->num_chunks) {
+            pthread_cond_signal(&pool->done_cond);
+        }
+    }
+}
+
+non_null()
+static void *worker_thread(void *arg)
+{
+    Thread_Pool *pool = (Thread_Pool *)arg;
+
+    pthread_mutex_lock(&pool->mutex);
+
+    while (!pool->stopping) {
+        if (pool->next_chunk < pool->num_chunks) {
+            run_chunks(pool);
+        } else {
+            pthread_cond_wait(&pool->work_cond, &pool->mutex);
+        }
+    }
+
+    pthread_mutex_unlock(&pool->mutex);
+    return nullptr;
+}
+
+Thread_Pool *thread_pool_new(uint32_t num_threads)
+{
+    if (num_threads == 0) {
+        return nullptr;
+    }
+
+    Thread_Pool *pool = (Thread_Pool *)calloc(1, sizeof(Thread_Pool));
+
+    if (pool == nullptr) {
+        return nullptr;
+    }
+
+    pool->threads = (pthread_t *)calloc(num_threads, sizeof(pthread_t));
+
+    if (pool->threads == nullptr) {
+        free(pool);
+        return nullptr;
+    }
+
+    if (pthread_mutex_init(&pool->mutex, nullptr) != 0) {
+        free(pool->threads);
+        free(pool);
+        return nullptr;
+    }
+
+    if (pthread_cond_init(&pool->work_cond, nullptr) != 0) {
+        pthread_mutex_destroy(&pool->mutex);
+        free(pool->threads);
+        free(pool);
+        return nullptr;
+    }
+
+    if (pthread_cond_init(&pool->done_cond, nullptr) != 0) {
+        pthread_cond_destroy(&pool->work_cond);
+        pthread_mutex_destroy(&pool->mutex);
+        free(pool->threads);
+        free(pool);
+        return nullptr;
+    }
+
+    for (uint32_t i = 0; i < num_threads; ++i) {
+        if (pthread_create(&pool->threads[i], nullptr, &worker_thread, pool) != 0) {
+            thread_pool_kill(pool);
+            return nullptr;
+        }
+
+        ++pool->num_threads;
+    }
+
+    return pool;
+}
+
+void thread_pool_kill(Thread_Pool *pool)
+{
+    if (pool == nullptr) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (uint32_t i = 0; i < pool->num_threads; ++i) {
+        pthread_join(pool->threads[i], nullptr);
+    }
+
+    pthread_cond_destroy(&pool->done_cond);
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool->threads);
+    free(pool);
+}
+
+uint32_t thread_pool_size(const Thread_Pool *pool)
+{
+    return pool->num_threads;
+}
+
+uint32_t thread_pool_num_cpus(void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+    const long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (num_cpus > 0) {
+        return (uint32_t)num_cpus;
+    }
+
+#endif
+    return 0;
+}
+
+void thread_pool_run(Thread_Pool *pool, thread_pool_cb *function, void *object, uint32_t num_items)
+{
+    if (num_items == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->function = function;
+    pool->object = object;
+    pool->num_items = num_items;
+    pool->num_chunks = num_items < pool->num_threads + 1 ? num_items : pool->num_threads + 1;
+    pool->next_chunk = 0;
+    pool->chunks_done = 0;
+
+    if (pool->num_chunks > 1) {
+        pthread_cond_broadcast(&pool->work_cond);
+    }
+
+    run_chunks(pool);
+
+    while (pool->chunks_done < pool->num_chunks) {
+        pthread_cond_wait(&pool->done_cond, &pool->mutex);
+    }
+
+    pool->function = nullptr;
+    pool->object = nullptr;
+    pool->num_items = 0;
+    pool->num_chunks = 0;
+    pool->next_chunk = 0;
+    pthread_mutex_unlock(&pool->mutex);
+}
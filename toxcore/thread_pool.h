@@ -0,0 +1,77 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later
+ * Copyright © 2022 The TokTok team.
+ */
+
+/** @file
+ * @brief A fixed set of worker threads that run a function over a range of
+ *   items in parallel.
+ *
+ * The thread calling thread_pool_run() works on the items too, and the call
+ * returns only when all items are done, so the function may freely use data
+ * owned by the caller.
+ */
+#ifndef C_TOXCORE_TOXCORE_THREAD_POOL_H
+#define C_TOXCORE_TOXCORE_THREAD_POOL_H
+
+#include <stdint.h>
+
+#include "attributes.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct Thread_Pool Thread_Pool;
+
+/**
+ * @brief Function run by thread_pool_run() for each item.
+ *
+ * It is called concurrently from several threads, each time with a different
+ * index.
+ */
+typedef void thread_pool_cb(void *object, uint32_t index);
+
+/**
+ * @brief Start a thread pool with the given number of worker threads.
+ *
+ * @return nullptr on failure or if num_threads is 0.
+ */
+Thread_Pool *thread_pool_new(uint32_t num_threads);
+
+/**
+ * @brief Number of CPU cores online, or 0 if it is not known.
+ *
+ * A pool only speeds things up with a core for each of its threads next to
+ * the caller's.
+ */
+uint32_t thread_pool_num_cpus(void);
+
+/**
+ * @brief Stop the worker threads and free the pool.
+ */
+nullable(1)
+void thread_pool_kill(Thread_Pool *pool);
+
+/**
+ * @brief Number of worker threads in the pool, not counting the caller.
+ */
+non_null()
+uint32_t thread_pool_size(const Thread_Pool *pool);
+
+/**
+ * @brief Call function(object, i) for every i in [0, num_items) and wait until
+ *   all calls have returned.
+ *
+ * The items are split into one contiguous range for each thread, the caller
+ * included, so a job should have enough items to be worth waking them up for.
+ *
+ * Must not be called from several threads at the same time.
+ */
+non_null(1, 2) nullable(3)
+void thread_pool_run(Thread_Pool *pool, thread_pool_cb *function, void *object, uint32_t num_items);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif // C_TOXCORE_TOXCORE_THREAD_POOL_H
@@ -0,0 +1,59 @@
+#include "thread_pool.h"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+namespace {
+
+struct Thread_Pool_Deleter {
+  void operator()(Thread_Pool *pool) { thread_pool_kill(pool); }
+};
+
+using Thread_Pool_Ptr = std::unique_ptr<Thread_Pool, Thread_Pool_Deleter>;
+
+void mark_item(void *object, uint32_t index) {
+  auto *items = static_cast<std::vector<std::atomic<int>> *>(object);
+  ++(*items)[index];
+}
+
+TEST(ThreadPool, NeedsAtLeastOneThread) {
+  EXPECT_EQ(thread_pool_new(0), nullptr);
+
+  Thread_Pool_Ptr pool(thread_pool_new(1));
+  ASSERT_NE(pool, nullptr);
+  EXPECT_EQ(thread_pool_size(pool.get()), 1);
+}
+
+TEST(ThreadPool, RunsEveryItemExactlyOnce) {
+  Thread_Pool_Ptr pool(thread_pool_new(4));
+  ASSERT_NE(pool, nullptr);
+
+  for (uint32_t num_items : {0, 1, 2, 3, 100, 1000}) {
+    std::vector<std::atomic<int>> items(num_items);
+    thread_pool_run(pool.get(), &mark_item, &items, num_items);
+
+    for (const auto &item : items) {
+      EXPECT_EQ(item, 1);
+    }
+  }
+}
+
+TEST(ThreadPool, CanBeReusedManyTimes) {
+  Thread_Pool_Ptr pool(thread_pool_new(3));
+  ASSERT_NE(pool, nullptr);
+
+  std::vector<std::atomic<int>> items(8);
+
+  for (int i = 0; i < 1000; ++i) {
+    thread_pool_run(pool.get(), &mark_item, &items, items.size());
+  }
+
+  for (const auto &item : items) {
+    EXPECT_EQ(item, 1000);
+  }
+}
+
+}  // namespace
@@ -498,6 +498,8 @@ Tox *tox_new(const struct Tox_Options *options, Tox_Err_New *error)
     m_options.tcp_server_port = tox_options_get_tcp_port(opts);
     m_options.hole_punching_enabled = tox_options_get_hole_punching_enabled(opts);
     m_options.local_discovery_enabled = tox_options_get_local_discovery_enabled(opts);
+    m_options.lossless_coalescing = tox_options_get_experimental_lossless_coalescing(opts);
+    m_options.crypto_threads = tox_options_get_experimental_crypto_threads(opts);
 
     // TODO(iphydf): Don't cast function pointers.
     //!TOKSTYLE-
@@ -1361,6 +1363,136 @@ void tox_callback_friend_connection_status(Tox *tox, tox_friend_connection_statu
     tox->friend_connection_status_callback = callback;
 }
 
+/** Get the transport statistics of the connection to a friend, or all zeros
+ * if the friend is offline.
+ *
+ * return true on success.
+ */
+non_null(1, 3) nullable(4)
+static bool get_transport_stats(const Tox *tox, uint32_t friend_number, Crypto_Conn_Stats *stats,
+                                Tox_Err_Friend_Query *error)
+{
+    lock(tox);
+    const int ret = m_get_friend_transport_stats(tox->m, friend_number, stats);
+    unlock(tox);
+
+    if (ret == -1) {
+        SET_ERROR_PARAMETER(error, TOX_ERR_FRIEND_QUERY_FRIEND_NOT_FOUND);
+        return false;
+    }
+
+    if (ret != 0) {
+        const Crypto_Conn_Stats empty_stats = {false};
+        *stats = empty_stats;
+    }
+
+    SET_ERROR_PARAMETER(error, TOX_ERR_FRIEND_QUERY_OK);
+    return true;
+}
+
+uint32_t tox_friend_get_transport_stats_rtt(const Tox *tox, uint32_t friend_number, Tox_Err_Friend_Query *error)
+{
+    assert(tox != nullptr);
+    Crypto_Conn_Stats stats;
+
+    if (!get_transport_stats(tox, friend_number, &stats, error)) {
+        return 0;
+    }
+
+    return (uint32_t)stats.rtt;
+}
+
+uint32_t tox_friend_get_transport_stats_send_rate(const Tox *tox, uint32_t friend_number,
+        Tox_Err_Friend_Query *error)
+{
+    assert(tox != nullptr);
+    Crypto_Conn_Stats stats;
+
+    if (!get_transport_stats(tox, friend_number, &stats, error)) {
+        return 0;
+    }
+
+    return (uint32_t)stats.send_rate;
+}
+
+uint32_t tox_friend_get_transport_stats_recv_rate(const Tox *tox, uint32_t friend_number,
+        Tox_Err_Friend_Query *error)
+{
+    assert(tox != nullptr);
+    Crypto_Conn_Stats stats;
+
+    if (!get_transport_stats(tox, friend_number, &stats, error)) {
+        return 0;
+    }
+
+    return (uint32_t)stats.recv_rate;
+}
+
+uint32_t tox_friend_get_transport_stats_packets_in_flight(const Tox *tox, uint32_t friend_number,
+        Tox_Err_Friend_Query *error)
+{
+    assert(tox != nullptr);
+    Crypto_Conn_Stats stats;
+
+    if (!get_transport_stats(tox, friend_number, &stats, error)) {
+        return 0;
+    }
+
+    return stats.packets_in_flight;
+}
+
+uint64_t tox_friend_get_transport_stats_packets_sent(const Tox *tox, uint32_t friend_number,
+        Tox_Err_Friend_Query *error)
+{
+    assert(tox != nullptr);
+    Crypto_Conn_Stats stats;
+
+    if (!get_transport_stats(tox, friend_number, &stats, error)) {
+        return 0;
+    }
+
+    return stats.packets_sent;
+}
+
+uint64_t tox_friend_get_transport_stats_packets_resent(const Tox *tox, uint32_t friend_number,
+        Tox_Err_Friend_Query *error)
+{
+    assert(tox != nullptr);
+    Crypto_Conn_Stats stats;
+
+    if (!get_transport_stats(tox, friend_number, &stats, error)) {
+        return 0;
+    }
+
+    return stats.packets_resent;
+}
+
+uint64_t tox_friend_get_transport_stats_bytes_sent(const Tox *tox, uint32_t friend_number,
+        Tox_Err_Friend_Query *error)
+{
+    assert(tox != nullptr);
+    Crypto_Conn_Stats stats;
+
+    if (!get_transport_stats(tox, friend_number, &stats, error)) {
+        return 0;
+    }
+
+    return stats.bytes_sent;
+}
+
+uint64_t tox_friend_get_transport_stats_bytes_received(const Tox *tox, uint32_t friend_number,
+        Tox_Err_Friend_Query *error)
+{
+    assert(tox != nullptr);
+    Crypto_Conn_Stats stats;
+
+    if (!get_transport_stats(tox, friend_number, &stats, error)) {
+        return 0;
+    }
+
+    return stats.bytes_received;
+}
+
 bool tox_friend_get_typing(const Tox *tox, uint32_t friend_number, Tox_Err_Friend_Query *error)
 {
     assert(tox != nullptr);
@@ -663,6 +663,29 @@ struct Tox_Options {
      */
     bool experimental_thread_safety;
 
+    /**
+     * Send several small lossless packets to a friend in a single encrypted
+     * packet where the friend supports it. This reduces the number of packets
+     * sent on chatty connections at the cost of up to one tox_iterate interval
+     * of extra latency for those packets.
+     *
+     * Default: false.
+     */
+    bool experimental_lossless_coalescing;
+
+    /**
+     * Number of extra threads used to encrypt data packets sent to friends.
+     * With more than 0, packets sent in one tox_iterate interval are encrypted
+     * in parallel, which helps on fast connections where encryption is the
+     * bottleneck. The first packet to a friend in an interval is sent at once;
+     * the ones after it get up to one tox_iterate interval of extra latency.
+     * At most one thread per CPU core besides the calling thread is used, so
+     * on a single core packets are always encrypted on the calling thread.
+     *
+     * Default: 0.
+     */
+    uint32_t experimental_crypto_threads;
+
 };
 
 
@@ -730,6 +753,14 @@ bool tox_options_get_experimental_thread_safety(const struct Tox_Options *option
 
 void tox_options_set_experimental_thread_safety(struct Tox_Options *options, bool thread_safety);
 
+bool tox_options_get_experimental_lossless_coalescing(const struct Tox_Options *options);
+
+void tox_options_set_experimental_lossless_coalescing(struct Tox_Options *options, bool lossless_coalescing);
+
+uint32_t tox_options_get_experimental_crypto_threads(const struct Tox_Options *options);
+
+void tox_options_set_experimental_crypto_threads(struct Tox_Options *options, uint32_t crypto_threads);
+
 /**
  * @brief Initialises a Tox_Options object with the default options.
  *
@@ -1635,6 +1666,68 @@ typedef void tox_friend_connection_status_cb(Tox *tox, uint32_t friend_number, T
  */
 void tox_callback_friend_connection_status(Tox *tox, tox_friend_connection_status_cb *callback);
 
+/**
+ * @brief Get the smoothed round trip time to a friend in milliseconds.
+ *
+ * The `tox_friend_get_transport_stats_*` functions describe the current
+ * connection to a friend. The totals count from the moment the connection was
+ * established, and start over when the friend reconnects. All of them return
+ * 0 while the friend is offline. They are cheap enough to be called every
+ * second for every friend.
+ *
+ * @param friend_number The friend number for which to query the statistics.
+ */
+uint32_t tox_friend_get_transport_stats_rtt(const Tox *tox, uint32_t friend_number, Tox_Err_Friend_Query *error);
+
+/**
+ * @brief Get the packets per second the congestion control currently allows
+ *   sending to a friend.
+ */
+uint32_t tox_friend_get_transport_stats_send_rate(const Tox *tox, uint32_t friend_number,
+        Tox_Err_Friend_Query *error);
+
+/**
+ * @brief Get the lossless packets per second received from a friend.
+ */
+uint32_t tox_friend_get_transport_stats_recv_rate(const Tox *tox, uint32_t friend_number,
+        Tox_Err_Friend_Query *error);
+
+/**
+ * @brief Get the lossless packets sent or queued to a friend that the friend
+ *   hasn't acknowledged yet.
+ */
+uint32_t tox_friend_get_transport_stats_packets_in_flight(const Tox *tox, uint32_t friend_number,
+        Tox_Err_Friend_Query *error);
+
+/**
+ * @brief Get the lossless packets sent to a friend.
+ *
+ * The retransmit ratio is packets_resent divided by packets_sent.
+ */
+uint64_t tox_friend_get_transport_stats_packets_sent(const Tox *tox, uint32_t friend_number,
+        Tox_Err_Friend_Query *error);
+
+/**
+ * @brief Get the lossless packets that had to be sent to a friend again
+ *   because the friend didn't receive them.
+ */
+uint64_t tox_friend_get_transport_stats_packets_resent(const Tox *tox, uint32_t friend_number,
+        Tox_Err_Friend_Query *error);
+
+/**
+ * @brief Get the bytes sent to a friend on the wire, including encryption
+ *   overhead.
+ */
+uint64_t tox_friend_get_transport_stats_bytes_sent(const Tox *tox, uint32_t friend_number,
+        Tox_Err_Friend_Query *error);
+
+/**
+ * @brief Get the bytes received from a friend on the wire, including
+ *   encryption overhead.
+ */
+uint64_t tox_friend_get_transport_stats_bytes_received(const Tox *tox, uint32_t friend_number,
+        Tox_Err_Friend_Query *error);
+
 /**
  * @brief Check whether a friend is currently typing a message.
  *
@@ -71,6 +71,8 @@ ACCESSORS(tox_log_cb *, log_, callback)
 ACCESSORS(void *, log_, user_data)
 ACCESSORS(bool,, local_discovery_enabled)
 ACCESSORS(bool,, experimental_thread_safety)
+ACCESSORS(bool,, experimental_lossless_coalescing)
+ACCESSORS(uint32_t,, experimental_crypto_threads)
 
 //!TOKSTYLE+
 
@@ -96,6 +98,8 @@ void tox_options_default(struct Tox_Options *options)
         tox_options_set_hole_punching_enabled(options, true);
         tox_options_set_local_discovery_enabled(options, true);
         tox_options_set_experimental_thread_safety(options, false);
+        tox_options_set_experimental_lossless_coalescing(options, false);
+        tox_options_set_experimental_crypto_threads(options, 0);
     }
 }
 
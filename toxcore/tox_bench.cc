@@ -0,0 +1,99 @@
+#include <benchmark/benchmark.h>
+
+#include <array>
+#include <random>
+#include <vector>
+
+#include "tox.h"
+
+namespace {
+
+using Public_Key = std::array<uint8_t, TOX_PUBLIC_KEY_SIZE>;
+
+/** A Tox instance that is not connected to anything, with range(0) friends
+ * who are all offline.
+ */
+class Friends {
+ public:
+  explicit Friends(uint32_t num_friends) {
+    Tox_Options *options = tox_options_new(nullptr);
+    tox_options_set_ipv6_enabled(options, false);
+    tox_options_set_udp_enabled(options, false);
+    tox_options_set_local_discovery_enabled(options, false);
+    tox_ = tox_new(options, nullptr);
+    tox_options_free(options);
+
+    if (tox_ == nullptr) {
+      return;
+    }
+
+    // Random keys of friends that never come online.
+    std::mt19937 rng(num_friends);
+
+    for (uint32_t i = 0; i < num_friends; ++i) {
+      Public_Key key;
+
+      for (uint8_t &b : key) {
+        b = static_cast<uint8_t>(rng());
+      }
+
+      // public_key_valid() rejects keys with the top bit set.
+      key.back() &= 0x7f;
+
+      if (tox_friend_add_norequest(tox_, key.data(), nullptr) == UINT32_MAX) {
+        tox_kill(tox_);
+        tox_ = nullptr;
+        return;
+      }
+
+      keys_.push_back(key);
+    }
+  }
+
+  ~Friends() {
+    if (tox_ != nullptr) {
+      tox_kill(tox_);
+    }
+  }
+
+  Tox *tox_ = nullptr;
+  std::vector<Public_Key> keys_;
+};
+
+void FriendCounts(benchmark::internal::Benchmark *b) { b->Arg(1000)->Arg(10000)->Arg(50000); }
+
+void BM_ToxIterate(benchmark::State &state) {
+  Friends friends(state.range(0));
+
+  if (friends.tox_ == nullptr) {
+    state.SkipWithError("could not create the Tox instance");
+    return;
+  }
+
+  for (auto _ : state) {
+    tox_iterate(friends.tox_, nullptr);
+  }
+}
+BENCHMARK(BM_ToxIterate)->Apply(FriendCounts);
+
+/** The lookup done for every incoming friend request and new connection. */
+void BM_ToxFriendByPublicKey(benchmark::State &state) {
+  Friends friends(state.range(0));
+
+  if (friends.tox_ == nullptr) {
+    state.SkipWithError("could not create the Tox instance");
+    return;
+  }
+
+  // Step through the keys with a large prime so that short runs still look up
+  // friends from the whole list, not only the first ones added.
+  uint32_t i = 0;
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(tox_friend_by_public_key(friends.tox_, friends.keys_[i].data(), nullptr));
+    i = (i + 7919) % friends.keys_.size();
+  }
+}
+BENCHMARK(BM_ToxFriendByPublicKey)->Apply(FriendCounts);
+
+}  // namespace